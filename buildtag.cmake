@@ -0,0 +1 @@
+set(HAKA_VERSION_BUILD "+2948872")
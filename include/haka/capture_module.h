@@ -118,6 +118,12 @@ struct capture_module {
 	 * Get the packet timestamp.
 	 */
 	const struct time *(*get_timestamp)(struct packet *pkt);
+
+	/**
+	 * Get the checksum status of a received packet. This callback is
+	 * optional, the checksums are considered unknown if it is NULL.
+	 */
+	enum packet_checksum (*get_checksum)(struct packet *pkt);
 };
 
 #endif /* HAKA_CAPTURE_MODULE_H */
@@ -9,6 +9,9 @@
 
 #define PACKED __attribute__((packed))
 
+#define CACHE_LINE_SIZE 64
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+
 #define FORMAT_PRINTF(fmt, args) __attribute__((format(printf, fmt, args)))
 
 #define INIT __attribute__((constructor(32767)))
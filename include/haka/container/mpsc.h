@@ -0,0 +1,86 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * \file
+ * Lock-free multi-producer single-consumer queue.
+ *
+ * Producers push elements with a compare-and-swap on the queue head. The
+ * consumer takes all the queued elements at once and gets them back in
+ * their insertion order.
+ */
+
+#ifndef HAKA_CONTAINER_MPSC_H
+#define HAKA_CONTAINER_MPSC_H
+
+#include <haka/types.h>
+#include <haka/compiler.h>
+#include <stddef.h>
+
+
+struct mpsc_elem {
+	struct mpsc_elem          *next;
+};
+
+struct mpsc {
+	struct mpsc_elem *volatile head;
+};
+
+#define MPSC_INIT { NULL }
+
+INLINE void mpsc_init(struct mpsc *queue) { queue->head = NULL; }
+
+/**
+ * Check if the queue is empty. This is a single load that can be used
+ * on a fast path.
+ */
+INLINE bool mpsc_empty(struct mpsc *queue) { return queue->head == NULL; }
+
+/**
+ * Push an element to the queue. Can be called concurrently from any thread.
+ *
+ * \return true if the queue was empty.
+ */
+INLINE bool mpsc_push(struct mpsc *queue, struct mpsc_elem *elem)
+{
+	struct mpsc_elem *head;
+
+	do {
+		head = queue->head;
+		elem->next = head;
+	} while (!__sync_bool_compare_and_swap(&queue->head, head, elem));
+
+	return head == NULL;
+}
+
+/**
+ * Take all the elements of the queue. Only the consumer thread can call this
+ * function.
+ *
+ * \return The first queued element, the others are linked through the next field.
+ */
+INLINE struct mpsc_elem *mpsc_popall(struct mpsc *queue)
+{
+	struct mpsc_elem *iter, *next, *ret = NULL;
+
+	if (mpsc_empty(queue)) {
+		return NULL;
+	}
+
+	iter = __sync_lock_test_and_set(&queue->head, NULL);
+
+	/* Restore the insertion order */
+	while (iter) {
+		next = iter->next;
+		iter->next = ret;
+		ret = iter;
+		iter = next;
+	}
+
+	return ret;
+}
+
+#define mpsc_get(elem, type, member) ((type *)((char *)(elem) - offsetof(type, member)))
+
+#endif /* HAKA_CONTAINER_MPSC_H */
@@ -26,6 +26,7 @@ struct packet_stats {
 
 struct engine_thread;
 struct lua_State;
+struct timeval;
 
 bool                           engine_prepare(int thread_count);
 
@@ -38,6 +39,7 @@ int                            engine_thread_id(struct engine_thread *thread);
 enum thread_status             engine_thread_update_status(struct engine_thread *thread, enum thread_status status);
 enum thread_status             engine_thread_status(struct engine_thread *thread);
 volatile struct packet_stats  *engine_thread_statistics(struct engine_thread *thread);
+struct lua_State              *engine_thread_lua_state(struct engine_thread *thread);
 
 bool                           engine_thread_remote_launch(struct engine_thread *thread, void (*callback)(void *), void *data);
 int                            engine_thread_lua_remote_launch(struct engine_thread *thread, struct lua_State *L, int index);
@@ -46,5 +48,8 @@ void                           engine_thread_check_remote_launch(struct engine_t
 void                           engine_thread_interrupt_begin(struct engine_thread *thread);
 void                           engine_thread_interrupt_end(struct engine_thread *thread);
 int                            engine_thread_interrupt_fd();
+void                           engine_thread_set_idle_work(struct engine_thread *thread, bool pending);
+bool                           engine_thread_has_idle_work(struct engine_thread *thread);
+struct timeval                *engine_thread_idle_timeout(struct timeval *timeout);
 
 #endif /* HAKA_ENGINE_H */
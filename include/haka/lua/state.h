@@ -18,6 +18,28 @@ struct lua_state {
 typedef int  (*lua_function)(struct lua_State *L);
 typedef void (*lua_hook)(struct lua_State *L, struct lua_Debug *ar);
 
+struct lua_state_memory_stats {
+	size_t               allocated;  /* Bytes currently allocated */
+	size_t               slab;       /* Bytes of the slab pages of the thread */
+	size_t               peak;       /* Maximum bytes allocated */
+	size_t               limit;      /* Hard limit in bytes (0 if unlimited) */
+	uint64               total;      /* Cumulative allocated bytes */
+	double               rate;       /* Allocation rate in bytes per second */
+	uint64               failures;   /* Allocations refused due to the limit */
+	uint64               evictions;  /* Number of memory_pressure events */
+	uint64               gc_time;    /* Time spent in idle collection (ns) */
+	uint64               gc_steps;   /* Number of idle collection steps */
+	uint64               gc_cycles;  /* Collection cycles finished while idle */
+	int                  gc_pause;   /* Current collector pause */
+	int                  gc_stepmul; /* Current collector step multiplier */
+};
+
+enum lua_state_profiling {
+	LUA_PROFILING_NONE,
+	LUA_PROFILING_WALL,  /* Measure the wall time */
+	LUA_PROFILING_CPU,   /* Measure both the wall and the thread cpu time */
+};
+
 struct lua_state *lua_state_init();
 void lua_state_close(struct lua_state *state);
 bool lua_state_require(struct lua_state *state, const char *module);
@@ -28,6 +50,28 @@ bool lua_state_setdebugger_hook(struct lua_state *state, lua_hook hook);
 bool lua_state_run_file(struct lua_state *L, const char *filename, int argc, char *argv[]);
 void lua_state_trigger_haka_event(struct lua_state *state, const char *event);
 
+void lua_state_set_memory_limit(size_t limit);
+bool lua_state_memory_stats(struct lua_State *L, struct lua_state_memory_stats *stats);
+void lua_state_memory_check(struct lua_state *state);
+bool lua_state_gc_update(struct lua_state *state);
+void lua_state_gc_step(struct lua_state *state);
+
+void lua_state_set_packet_budget(double budget);
+bool lua_state_budget_init_thread(struct lua_state *state);
+void lua_state_budget_begin(struct lua_state *state);
+bool lua_state_budget_end(struct lua_state *state);
+int  lua_state_budget_info(struct lua_State *L);
+
+void lua_state_set_rule_profiling(enum lua_state_profiling mode);
+int  lua_state_rule_profiling(struct lua_State *L);
+int  lua_state_profile_clock(struct lua_State *L);
+
+void lua_state_set_jit_diagnostics(bool enable);
+int  lua_state_jit_diagnostics(struct lua_State *L);
+
+bool  lua_state_profile_start(struct lua_state *state, double period);
+char *lua_state_profile_stop(struct lua_state *state, size_t *size);
+
 int lua_state_error_formater(struct lua_State *L);
 void lua_state_print_error(struct lua_State *L, const char *msg);
 struct lua_state *lua_state_get(struct lua_State *L);
@@ -0,0 +1,157 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * \file
+ * Metrics registry.
+ *
+ * Metrics are declared statically and registered on their first use. Each
+ * thread updates its own cache line aligned slot without any atomic
+ * operation, the values are only aggregated when they are read.
+ */
+
+#ifndef HAKA_METRICS_H
+#define HAKA_METRICS_H
+
+#include <haka/types.h>
+#include <haka/compiler.h>
+
+
+/**
+ * Metric type.
+ */
+enum metric_type {
+	METRIC_TYPE_COUNTER,   /**< Monotonic counter. */
+	METRIC_TYPE_GAUGE,     /**< Value that can go up and down. */
+	METRIC_TYPE_HISTOGRAM  /**< Distribution of observed values. */
+};
+
+/**
+ * Metric definition.
+ */
+struct metric {
+	const char          *name;
+	const char          *help;
+	enum metric_type     type;
+	const uint64        *bounds;       /**< Histogram bucket upper bounds. */
+	int                  bucket_count;
+	volatile int         offset;       /**< Offset in the thread slots, -1 if not registered. */
+	struct metric       *next;
+};
+
+/** Static initializer for a counter. */
+#define METRIC_COUNTER(name, help)     { name, help, METRIC_TYPE_COUNTER, NULL, 0, -1, NULL }
+
+/** Static initializer for a gauge. */
+#define METRIC_GAUGE(name, help)       { name, help, METRIC_TYPE_GAUGE, NULL, 0, -1, NULL }
+
+/**
+ * Static initializer for an histogram. The `bounds` parameter must be a static array
+ * of increasing upper bounds. An implicit last bucket holds all the greater values.
+ */
+#define METRIC_HISTOGRAM(name, help, bounds) \
+	{ name, help, METRIC_TYPE_HISTOGRAM, bounds, sizeof(bounds)/sizeof(bounds[0]), -1, NULL }
+
+/** Thread value used to read the metrics of all threads. */
+#define METRICS_ALL_THREADS    -1
+
+/** Thread value of the slots used by threads that are not packet threads. */
+#define METRICS_OTHER_THREADS  -2
+
+/** Maximum number of values (one per counter or gauge) per thread. */
+#define METRICS_MAX_VALUES     1024
+
+/**
+ * Register a metric. This is done automatically when a metric is updated
+ * for the first time.
+ *
+ * \returns True on success. Use clear_error() to get details about the error.
+ */
+bool           metric_register(struct metric *metric);
+
+/**
+ * Get the values of the slot of the current thread.
+ */
+uint64        *metrics_thread_values();
+
+/**
+ * Get the number of values used by a metric (buckets, sum and count for
+ * the histograms).
+ */
+int            metric_size(const struct metric *metric);
+
+/**
+ * Read a metric summed over the slots of a thread, or of all threads if
+ * `thread` is METRICS_ALL_THREADS. The `values` array must hold metric_size()
+ * elements.
+ */
+void           metric_read(const struct metric *metric, int thread, uint64 *values);
+
+/**
+ * Call `callback` for each registered metric.
+ */
+void           metrics_foreach(void (*callback)(struct metric *metric, void *data), void *data);
+
+/**
+ * Call `callback` for each thread that owns a slot.
+ */
+void           metrics_foreach_thread(void (*callback)(int thread, void *data), void *data);
+
+INLINE uint64 *_metric_values(struct metric *metric)
+{
+	uint64 *values;
+
+	if (metric->offset < 0 && !metric_register(metric)) return NULL;
+
+	values = metrics_thread_values();
+	if (!values) return NULL;
+
+	return values + metric->offset;
+}
+
+/**
+ * Add a value to a counter or a gauge.
+ */
+INLINE void metric_add(struct metric *metric, uint64 value)
+{
+	uint64 *values = _metric_values(metric);
+	if (values) *values += value;
+}
+
+/**
+ * Increment a counter or a gauge.
+ */
+INLINE void metric_inc(struct metric *metric)
+{
+	metric_add(metric, 1);
+}
+
+/**
+ * Decrement a gauge.
+ */
+INLINE void metric_dec(struct metric *metric)
+{
+	metric_add(metric, (uint64)-1);
+}
+
+/**
+ * Observe a value in an histogram.
+ */
+INLINE void metric_observe(struct metric *metric, uint64 value)
+{
+	uint64 *values = _metric_values(metric);
+	int i;
+
+	if (!values) return;
+
+	for (i=0; i<metric->bucket_count; ++i) {
+		if (value <= metric->bounds[i]) break;
+	}
+
+	++values[i];
+	values[metric->bucket_count+1] += value;
+	++values[metric->bucket_count+2];
+}
+
+#endif /* HAKA_METRICS_H */
@@ -27,6 +27,7 @@ struct packet {
 	struct vbuffer           payload;    /**< \private */
 	struct lua_ref           userdata;
 	struct lua_ref           next_dissector;
+	uint64                   trace_start; /**< \private */
 };
 
 /** \cond */
@@ -43,6 +44,16 @@ enum packet_status {
 	STATUS_SENT,   /**< Packet already sent on the network. */
 };
 
+/**
+ * Checksum status of a captured packet, as reported by the capture.
+ */
+enum packet_checksum {
+	CHECKSUM_UNKNOWN,  /**< Checksums have not been verified. */
+	CHECKSUM_VERIFIED, /**< Checksums already verified by the capture. */
+	CHECKSUM_PARTIAL,  /**< Transport checksum offloaded and not computed yet, the
+	                        network header checksum is valid. */
+};
+
 /**
  * Initialize packet internals for a given thread.
  */
@@ -104,6 +115,14 @@ bool               packet_send(struct packet *pkt);
  */
 int                packet_receive(struct engine_thread *engine, struct packet **pkt);
 
+/**
+ * Get the file descriptor to poll with the capture descriptors in order to
+ * wake up when a network timer expires.
+ *
+ * \returns -1 if the network time is not realtime.
+ */
+int                packet_timer_fd();
+
 /**
  * Get the packet mtu.
  */
@@ -114,6 +133,12 @@ size_t             packet_mtu(struct packet *pkt);
  */
 enum packet_status packet_state(struct packet *pkt);
 
+/**
+ * Get the checksum status of the packet. This status only describes the
+ * packet as it was captured.
+ */
+enum packet_checksum packet_checksum_status(struct packet *pkt);
+
 /**
  * Packet capture mode.
  */
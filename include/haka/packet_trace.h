@@ -0,0 +1,89 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * \file
+ * Per-stage packet latency tracing.
+ *
+ * One packet out of a configurable sampling rate is traced. While it is
+ * processed, the time spent in each stage (receive, dissectors, rules,
+ * verdict) is accumulated using the cpu timestamp counter, and recorded
+ * in per-stage histograms when the processing ends.
+ */
+
+#ifndef HAKA_PACKET_TRACE_H
+#define HAKA_PACKET_TRACE_H
+
+#include <haka/types.h>
+#include <haka/compiler.h>
+
+
+struct packet;
+struct metric;
+
+/** Maximum number of traced stages. */
+#define PACKET_TRACE_MAX_STAGES   32
+
+/**
+ * Enable the tracing of one packet out of `sampling`. A value of 0
+ * disables the tracing.
+ */
+void        packet_trace_set_sampling(int sampling);
+
+/**
+ * Check if the latency tracing is enabled.
+ */
+bool        packet_trace_enabled();
+
+/**
+ * Called when a packet is received, decide if it is traced.
+ */
+void        packet_trace_begin(struct packet *pkt);
+
+/**
+ * Called when the processing of the current packet ends, record the
+ * stage durations.
+ */
+void        packet_trace_end();
+
+/**
+ * Enter a stage. The returned depth must be given to packet_trace_pop().
+ *
+ * \returns The depth of the stage or 0 if the current packet is not traced.
+ */
+int         packet_trace_push(const char *stage);
+
+/**
+ * Leave a stage and all the stages pushed after it.
+ */
+void        packet_trace_pop(int depth);
+
+/**
+ * Leave all the stages entered during the processing of the current
+ * packet. Used when the processing has been aborted and the stages could
+ * not be popped.
+ */
+void        packet_trace_unwind();
+
+/**
+ * Record the total latency of a traced packet when its verdict is given.
+ */
+void        packet_trace_verdict(struct packet *pkt);
+
+/**
+ * Call `callback` for each stage with its histogram. The histograms
+ * are in nanoseconds.
+ */
+void        packet_trace_foreach(void (*callback)(const char *stage, struct metric *metric, void *data), void *data);
+
+/**
+ * Get the current value of the trace clock.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+INLINE uint64 packet_trace_clock() { return __builtin_ia32_rdtsc(); }
+#else
+uint64      packet_trace_clock();
+#endif
+
+#endif /* HAKA_PACKET_TRACE_H */
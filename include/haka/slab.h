@@ -0,0 +1,96 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * \file
+ * Per-thread slab allocator for small fixed size objects.
+ *
+ * Each thread allocates the objects from its own pages without any lock.
+ * An object freed by another thread is queued back to the thread that owns
+ * it, which reuses it on its next allocation. Each thread keeps a few free
+ * pages, the others are given back to the system.
+ */
+
+#ifndef HAKA_SLAB_H
+#define HAKA_SLAB_H
+
+#include <haka/types.h>
+#include <haka/compiler.h>
+#include <haka/thread.h>
+#include <haka/metrics.h>
+
+
+struct slab;
+
+/**
+ * Object cache. Caches are declared statically and must be initialized
+ * with slab_cache_init() before their first use.
+ */
+struct slab_cache {
+	const char       *name;
+	size_t            size;
+	struct metric     allocs;        /**< Number of allocated objects. */
+	struct metric     pages;         /**< Number of pages allocated from the system. */
+	struct metric     remote_frees;  /**< Number of objects freed by another thread. */
+	struct metric     released;      /**< Number of pages given back to the system. */
+	local_storage_t   key;           /**< \private */
+	mutex_t           lock;          /**< \private */
+	struct slab      *slabs;         /**< \private */
+	struct slab      *orphans;       /**< \private */
+	struct slab_cache *next;         /**< \private */
+};
+
+/**
+ * Static initializer for a cache of objects of the given type. The metrics
+ * `slab_<name>_allocs_total`, `slab_<name>_pages_total`,
+ * `slab_<name>_remote_frees_total` and `slab_<name>_pages_released_total`
+ * are associated to the cache.
+ */
+#define SLAB_CACHE(name, type) { name, sizeof(type), \
+	METRIC_COUNTER("slab_" name "_allocs_total", "Number of objects allocated from the " name " cache"), \
+	METRIC_COUNTER("slab_" name "_pages_total", "Number of pages allocated for the " name " cache"), \
+	METRIC_COUNTER("slab_" name "_remote_frees_total", "Number of " name " objects freed by another thread"), \
+	METRIC_COUNTER("slab_" name "_pages_released_total", "Number of pages released by the " name " cache"), \
+	0, MUTEX_INIT, NULL, NULL, NULL }
+
+/**
+ * Destructor priority of the caches. They are destroyed after the other
+ * destructors (FINI and the FINI_P with a higher priority) which can still
+ * release some objects.
+ */
+#define SLAB_FINI FINI_P(1000)
+
+/**
+ * Initialize a cache.
+ *
+ * \returns True on success. Use clear_error() to get details about the error.
+ */
+bool   slab_cache_init(struct slab_cache *cache);
+
+/**
+ * Destroy a cache and release all its memory. No object of the cache must be
+ * used after this call.
+ */
+void   slab_cache_destroy(struct slab_cache *cache);
+
+/**
+ * Allocate an object from the cache.
+ *
+ * \returns The new object or NULL on error. Use clear_error() to get details about the error.
+ */
+void  *slab_alloc(struct slab_cache *cache);
+
+/**
+ * Free an object allocated with slab_alloc(). This function can be called from
+ * any thread.
+ */
+void   slab_free(void *ptr);
+
+/**
+ * Get the number of bytes of the pages owned by the current thread in all
+ * the caches.
+ */
+size_t slab_thread_memory();
+
+#endif /* HAKA_SLAB_H */
@@ -329,6 +329,13 @@ INLINE uint64 atomic64_inc(atomic64_t *v) { return __sync_add_and_fetch(v, 1); }
  */
 INLINE uint64 atomic64_dec(atomic64_t *v) { return __sync_sub_and_fetch(v, 1); }
 
+/**
+ * Add a signed value to a 64 bit atomic counter.
+ *
+ * \return The new value after the addition.
+ */
+INLINE uint64 atomic64_add(atomic64_t *v, int64 x) { return __sync_add_and_fetch(v, x); }
+
 /**
  * Get the value of a 64 bit atomic counter.
  */
@@ -345,6 +352,7 @@ void atomic64_init(atomic64_t *v, uint64 x);
 void atomic64_destroy(atomic64_t *v);
 uint64 atomic64_inc(atomic64_t *v);
 uint64 atomic64_dec(atomic64_t *v);
+uint64 atomic64_add(atomic64_t *v, int64 x);
 INLINE uint64 atomic64_get(atomic64_t *v) { return v->value; }
 void atomic64_set(atomic64_t *v, uint64 x);
 
@@ -69,10 +69,12 @@ struct timer *time_realm_timer(struct time_realm *realm, timer_callback callback
 bool time_realm_check(struct time_realm *realm);
 
 /**
- * Initialize the current thread for timer support.
- * \return false if an error occurred.
+ * Get the file descriptor of the current thread that becomes readable when
+ * some timers of a realtime realm expire. It should be polled alongside the
+ * capture descriptors and time_realm_check() called when it is readable.
+ * \return -1 for a static realm or if an error occurred.
  */
-bool timer_init_thread();
+int time_realm_fd(struct time_realm *realm);
 
 /**
  * Destroy a timer.
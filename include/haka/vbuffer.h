@@ -140,6 +140,27 @@ bool          vbuffer_create_new(struct vbuffer *buf, size_t size, bool zero);
  */
 bool          vbuffer_create_from(struct vbuffer *buf, const char *str, size_t len);
 
+/**
+ * Create a new vbuffer referencing an external memory block without copying it.
+ * The memory is only copied when the buffer is modified. The `release` callback,
+ * if any, is called once the memory is not used anymore.
+ *
+ * If `handle` is not NULL, it receives a reference on the memory for its owner,
+ * which must give it back with vbuffer_external_reclaim().
+ */
+bool          vbuffer_create_external(struct vbuffer *buf, const uint8 *ptr, size_t len,
+		void (*release)(void *owner, const uint8 *ptr), void *owner, struct vbuffer_data **handle);
+
+/**
+ * Get back an external memory block referenced by `handle`. The buffers that
+ * still use it get a private copy of the data. On success, the memory can be
+ * reused and `handle` is not valid anymore.
+ *
+ * \returns False if the copy failed, the memory is then still in use. Use
+ * clear_error() to get details about the error.
+ */
+bool          vbuffer_external_reclaim(struct vbuffer_data *handle);
+
 /**
  * Clean all data in the vbuffer.
  */
@@ -152,6 +173,8 @@ void          vbuffer_release(struct vbuffer *buf);
 
 /**
  * Get an iterator at the given offset.
+ * \note On buffers made of many memory blocks, an offset index is used to find
+ * the block in logarithmic time.
  */
 void          vbuffer_position(const struct vbuffer *buf, struct vbuffer_iterator *position, size_t offset);
 
@@ -200,8 +223,7 @@ void          vbuffer_clearmodified(struct vbuffer *buf);
 bool          vbuffer_append(struct vbuffer *buf, struct vbuffer *buffer);
 
 /**
- * Compute the size of the buffer.
- * \note This function needs to process all memory block.
+ * Get the size of the buffer.
  */
 size_t        vbuffer_size(struct vbuffer *buf);
 
@@ -454,6 +476,41 @@ bool          vbuffer_sub_clone(struct vbuffer_sub *data, struct vbuffer *buffer
  */
 uint8        *vbuffer_mmap(struct vbuffer_sub *data, size_t *len, bool write, struct vbuffer_sub_mmap *mmap_iter, struct vbuffer_iterator *iter);
 
+/**
+ * Find the first occurrence of a byte in the sub buffer. If `iter` is not NULL, it is
+ * set at the position of the byte.
+ *
+ * \returns The offset of the byte from the beginning of the sub buffer or -1 if it
+ * is not found.
+ */
+size_t        vbuffer_sub_find_byte(struct vbuffer_sub *data, uint8 byte, struct vbuffer_iterator *iter);
+
+/**
+ * Find the first byte of the sub buffer that is one of the `setlen` bytes of `set`.
+ * \see vbuffer_sub_find_byte()
+ */
+size_t        vbuffer_sub_find_set(struct vbuffer_sub *data, const uint8 *set, size_t setlen, struct vbuffer_iterator *iter);
+
+/**
+ * Find the first occurrence of a literal string in the sub buffer. The literal can
+ * span several memory blocks, the data are never flattened.
+ * \see vbuffer_sub_find_byte()
+ */
+size_t        vbuffer_sub_find_literal(struct vbuffer_sub *data, const uint8 *literal, size_t len, struct vbuffer_iterator *iter);
+
+/**
+ * Force the implementation used by vbuffer_sub_find_set(): `scalar`, `sse4.2`
+ * or `avx2`. By default, the fastest one supported by the cpu is selected.
+ *
+ * \returns false if the kernel is unknown or not supported by the cpu.
+ */
+bool          vbuffer_find_set_kernel(const char *name);
+
+/**
+ * Get the name of the implementation used by vbuffer_sub_find_set().
+ */
+const char   *vbuffer_find_get_kernel();
+
 /**
  * Set each byte of the buffer to zero.
  */
@@ -28,6 +28,9 @@ struct vbuffer_stream {
 	struct list2                 read_chunks; /**< \private */
 	struct lua_ref               comanager;   /**< \private */
 	void                       (*userdata_cleanup)(void *); /**< \private */
+	size_t                       max_size;    /**< Maximum number of bytes held by the stream, 0 for no limit. */
+	size_t                       memory;      /**< \private */
+	bool                         overflow;    /**< True if the last push was refused because of a memory limit. */
 };
 
 /**
@@ -43,6 +46,10 @@ void            vbuffer_stream_clear(struct vbuffer_stream *stream);
 /**
  * Push some data in the stream. Fill the iterator `current` with the position right
  * before the data just added.
+ *
+ * The push is refused if the stream, or all the streams together, would then hold
+ * more than their memory limit. In this case, `overflow` is set and `buffer` is left
+ * untouched.
  */
 bool            vbuffer_stream_push(struct vbuffer_stream *stream, struct vbuffer *buffer, void *userdata, struct vbuffer_iterator *current);
 
@@ -69,4 +76,20 @@ bool            vbuffer_stream_pop(struct vbuffer_stream *stream, struct vbuffer
  */
 struct vbuffer *vbuffer_stream_data(struct vbuffer_stream *stream);
 
+/**
+ * Get the number of data bytes held by the stream, including the data kept
+ * for the readers after a pop.
+ */
+size_t          vbuffer_stream_memory(struct vbuffer_stream *stream);
+
+/**
+ * Set the maximum number of bytes held by all the streams, 0 for no limit.
+ */
+void            vbuffer_stream_set_global_limit(size_t size);
+
+/**
+ * Get the number of data bytes held by all the streams.
+ */
+size_t          vbuffer_stream_global_memory();
+
 #endif /* HAKA_VBUFFER_STREAM_H */
@@ -15,12 +15,14 @@
 #include <haka/alert_module.h>
 #include <haka/container/list.h>
 #include <haka/colors.h>
+#include <haka/metrics.h>
 
 
 static struct alerter *alerters = NULL;
 static local_storage_t alert_string_key;
 static atomic64_t alert_id;
 static rwlock_t alert_module_lock = RWLOCK_INIT;
+static struct metric alert_metric = METRIC_COUNTER("alerts_total", "Number of raised alerts");
 
 #define BUFFER_SIZE    3072
 
@@ -146,6 +148,8 @@ uint64 alert(const struct alert *alert)
 	bool remove_pass = false;
 	struct time time;
 
+	metric_inc(&alert_metric);
+
 	time_gettimestamp(&time);
 
 	rwlock_readlock(&alert_module_lock);
@@ -6,7 +6,7 @@
 #include <haka/thread.h>
 #include <haka/error.h>
 #include <haka/log.h>
-#include <haka/container/list2.h>
+#include <haka/container/mpsc.h>
 #include <haka/lua/state.h>
 #include <haka/lua/luautils.h>
 #include <haka/lua/marshal.h>
@@ -15,12 +15,13 @@
 #include <string.h>
 #include <assert.h>
 #include <signal.h>
-#include <fcntl.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
 
 
 struct remote_launch {
-	struct list2_elem   list;
+	struct mpsc_elem    list;
 	void              (*callback)(void *);
 	void               *data;
 	int                 state;
@@ -29,16 +30,19 @@ struct remote_launch {
 	semaphore_t         sync;
 };
 
+/* The statistics are on their own cache line as they are written for
+ * every packet */
 struct engine_thread {
-	volatile enum thread_status    status;
-	volatile struct packet_stats   packet_stats;
-	mutex_t                        remote_launch_lock;
+	volatile struct packet_stats   packet_stats CACHE_ALIGNED;
+	volatile enum thread_status    status CACHE_ALIGNED;
 	thread_t                       thread;
 	int                            id;
 	atomic_t                       interrupt_count;
-	int                            interrupt_fd[2];
+	int                            interrupt_fd;
 	struct lua_State              *lua_state;
-	struct list2                   remote_launches;
+	struct mpsc                    remote_launches;
+	struct mpsc_elem              *remote_pending;
+	bool                           idle_work;
 };
 
 static local_storage_t engine_thread_localstorage;
@@ -72,26 +76,27 @@ bool engine_prepare(int thread_count)
 
 struct engine_thread *engine_thread_init(struct lua_State *state, int id)
 {
-	int err;
+	struct engine_thread *new;
 
-	struct engine_thread *new = malloc(sizeof(struct engine_thread));
-	if (!new) {
+	if (posix_memalign((void **)&new, CACHE_LINE_SIZE, sizeof(struct engine_thread))) {
 		error("memory error");
 		return NULL;
 	}
 
 	memset(new, 0, sizeof(*new));
 	new->status = THREAD_RUNNING;
-	mutex_init(&new->remote_launch_lock, true);
 	new->thread = thread_current();
 	new->lua_state = state;
 	new->id = id;
 	atomic_set(&new->interrupt_count, 0);
-	list2_init(&new->remote_launches);
+	mpsc_init(&new->remote_launches);
+	new->remote_pending = NULL;
 	thread_setid(id);
 
-	err = pipe2(new->interrupt_fd, O_NONBLOCK);
-	if (err) {
+	/* The semaphore mode keeps the descriptor readable as long as
+	 * an interrupt is pending */
+	new->interrupt_fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (new->interrupt_fd < 0) {
 		error("%s", errno_error(errno));
 		free(new);
 		return NULL;
@@ -119,28 +124,29 @@ static void remote_launch_release(struct engine_thread *thread, struct remote_la
 	semaphore_post(&current->sync);
 }
 
-void engine_thread_cleanup(struct engine_thread *thread)
+static void remote_launch_abort(struct engine_thread *thread, struct mpsc_elem *iter)
 {
-	list2_iter end, iter;
-
-	assert(thread);
-
-	mutex_lock(&thread->remote_launch_lock);
-
-	end = list2_end(&thread->remote_launches);
-	for (iter = list2_begin(&thread->remote_launches); iter != end; ) {
-		struct remote_launch *current = list2_get(iter, struct remote_launch, list);
+	while (iter) {
+		struct remote_launch *current = mpsc_get(iter, struct remote_launch, list);
+		iter = iter->next;
 
 		current->state = -1;
 		current->error = "aborted";
 		current->own_error = false;
 
-		iter = list2_erase(iter);
 		remote_launch_release(thread, current);
 	}
+}
+
+void engine_thread_cleanup(struct engine_thread *thread)
+{
+	assert(thread);
+
+	remote_launch_abort(thread, thread->remote_pending);
+	thread->remote_pending = NULL;
+	remote_launch_abort(thread, mpsc_popall(&thread->remote_launches));
 
-	mutex_unlock(&thread->remote_launch_lock);
-	mutex_destroy(&thread->remote_launch_lock);
+	close(thread->interrupt_fd);
 
 	engine_threads[thread->id] = NULL;
 	local_storage_set(&engine_thread_localstorage, NULL);
@@ -172,12 +178,18 @@ volatile struct packet_stats *engine_thread_statistics(struct engine_thread *thr
 	else return NULL;
 }
 
+struct lua_State *engine_thread_lua_state(struct engine_thread *thread)
+{
+	assert(thread);
+	return thread->lua_state;
+}
+
 bool engine_thread_remote_launch(struct engine_thread *thread, void (*callback)(void *), void *data)
 {
 	struct remote_launch new;
 	assert(thread);
 
-	list2_elem_init(&new.list);
+	new.list.next = NULL;
 	new.callback = callback;
 	new.data = data;
 	new.state = -1;
@@ -185,10 +197,8 @@ bool engine_thread_remote_launch(struct engine_thread *thread, void (*callback)(
 	new.own_error = false;
 	semaphore_init(&new.sync, 0);
 
-	mutex_lock(&thread->remote_launch_lock);
 	engine_thread_interrupt_begin(thread);
-	list2_insert(list2_end(&thread->remote_launches), &new.list);
-	mutex_unlock(&thread->remote_launch_lock);
+	mpsc_push(&thread->remote_launches, &new.list);
 
 	semaphore_wait(&new.sync);
 
@@ -301,16 +311,12 @@ char* engine_thread_raw_lua_remote_launch(struct engine_thread *thread, const ch
 	}
 }
 
-static void _engine_thread_check_remote_launch(void *_thread)
+static void _engine_thread_check_remote_launch(struct engine_thread *thread)
 {
-	struct engine_thread *thread = (struct engine_thread *)_thread;
-
-	mutex_lock(&thread->remote_launch_lock);
-
-	const list2_iter end = list2_end(&thread->remote_launches);
-	list2_iter iter;
-	for (iter = list2_begin(&thread->remote_launches); iter != end; ) {
-		struct remote_launch *current = list2_get(iter, struct remote_launch, list);
+	/* The pending list, including the launch being run, is kept in the
+	 * thread to be able to abort them if the thread gets cancelled */
+	while (thread->remote_pending) {
+		struct remote_launch *current = mpsc_get(thread->remote_pending, struct remote_launch, list);
 
 		LOG_DEBUG(core, "execute lua remote launch on thread %d",
 		         engine_thread_id(thread));
@@ -331,38 +337,28 @@ static void _engine_thread_check_remote_launch(void *_thread)
 		/* This end match the begin done in the function engine_thread_remote_launch() */
 		engine_thread_interrupt_end(thread);
 
-		iter = list2_erase(iter);
+		/* The launch is only popped once done, the caller owns it and
+		 * could return as soon as it is released */
+		thread->remote_pending = current->list.next;
 		remote_launch_release(thread, current);
 	}
 }
 
-static void _engine_thread_check_remote_cleanup(void *_thread)
-{
-	struct engine_thread *thread = (struct engine_thread *)_thread;
-	mutex_unlock(&thread->remote_launch_lock);
-}
-
 void engine_thread_check_remote_launch(struct engine_thread *thread)
 {
-	if (!list2_empty(&thread->remote_launches)) {
-		thread_protect(_engine_thread_check_remote_launch, thread,
-				_engine_thread_check_remote_cleanup, thread);
+	/* Fast path, a single load when no launch is queued */
+	if (!mpsc_empty(&thread->remote_launches)) {
+		thread->remote_pending = mpsc_popall(&thread->remote_launches);
+		_engine_thread_check_remote_launch(thread);
 	}
 }
 
-static const char interrupt_magic = 0xaa;
-
 void engine_thread_interrupt_begin(struct engine_thread *thread)
 {
 	if (atomic_inc(&thread->interrupt_count) == 1) {
-		const int err = write(thread->interrupt_fd[1], &interrupt_magic, 1);
-		if (err != 1) {
-			if (err == -1) {
-				LOG_ERROR(core, "engine interrupt error: %s", errno_error(errno));
-			}
-			else {
-				LOG_ERROR(core, "engine interrupt error");
-			}
+		const int err = eventfd_write(thread->interrupt_fd, 1);
+		if (err) {
+			LOG_ERROR(core, "engine interrupt error: %s", errno_error(errno));
 		}
 	}
 }
@@ -370,15 +366,10 @@ void engine_thread_interrupt_begin(struct engine_thread *thread)
 void engine_thread_interrupt_end(struct engine_thread *thread)
 {
 	if (atomic_dec(&thread->interrupt_count) == 0) {
-		char byte;
-		const int err = read(thread->interrupt_fd[0], &byte, 1);
-		if (err != 1 || byte != interrupt_magic) {
-			if (err == -1) {
-				LOG_ERROR(core, "engine interrupt error: %s", errno_error(errno));
-			}
-			else {
-				LOG_ERROR(core, "engine interrupt error");
-			}
+		eventfd_t value;
+		const int err = eventfd_read(thread->interrupt_fd, &value);
+		if (err) {
+			LOG_ERROR(core, "engine interrupt error: %s", errno_error(errno));
 		}
 	}
 }
@@ -386,5 +377,31 @@ void engine_thread_interrupt_end(struct engine_thread *thread)
 int engine_thread_interrupt_fd()
 {
 	struct engine_thread *thread = engine_thread_current();
-	return thread->interrupt_fd[0];
+	return thread->interrupt_fd;
+}
+
+void engine_thread_set_idle_work(struct engine_thread *thread, bool pending)
+{
+	thread->idle_work = pending;
+}
+
+bool engine_thread_has_idle_work(struct engine_thread *thread)
+{
+	return thread->idle_work;
+}
+
+struct timeval *engine_thread_idle_timeout(struct timeval *timeout)
+{
+	struct engine_thread *thread = engine_thread_current();
+
+	/* Only poll the capture if some work can be done while idle,
+	 * otherwise block until a packet is received. */
+	if (thread && thread->idle_work) {
+		timeout->tv_sec = 0;
+		timeout->tv_usec = 0;
+		return timeout;
+	}
+	else {
+		return NULL;
+	}
 }
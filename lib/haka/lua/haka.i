@@ -16,7 +16,10 @@
 #include <haka/config.h>
 #include <haka/colors.h>
 #include <haka/engine.h>
+#include <haka/metrics.h>
+#include <haka/packet_trace.h>
 #include <haka/system.h>
+#include <haka/lua/state.h>
 
 %}
 
@@ -126,6 +129,216 @@ STRUCT_UNKNOWN_KEY_ERROR(time);
 	}
 %}
 
+%native(_memory_info) int memory_info(lua_State *L);
+
+%{
+	int memory_info(struct lua_State *L)
+	{
+		int i;
+
+		lua_newtable(L);
+
+		for (i=0;; ++i) {
+			struct lua_state_memory_stats stats;
+			struct engine_thread *engine = engine_thread_byid(i);
+			if (!engine) break;
+
+			if (!lua_state_memory_stats(engine_thread_lua_state(engine), &stats)) {
+				clear_error();
+				continue;
+			}
+
+			lua_pushnumber(L, i+1);
+
+			lua_newtable(L);
+
+			lua_pushnumber(L, i);
+			lua_setfield(L, -2, "id");
+
+			lua_pushnumber(L, (double)stats.allocated);
+			lua_setfield(L, -2, "allocated");
+			lua_pushnumber(L, (double)stats.peak);
+			lua_setfield(L, -2, "peak");
+			lua_pushnumber(L, (double)stats.slab);
+			lua_setfield(L, -2, "slab");
+			if (stats.limit) {
+				lua_pushnumber(L, (double)stats.limit);
+				lua_setfield(L, -2, "limit");
+			}
+			lua_pushnumber(L, stats.rate);
+			lua_setfield(L, -2, "rate");
+			lua_pushnumber(L, (double)stats.failures);
+			lua_setfield(L, -2, "failures");
+			lua_pushnumber(L, (double)stats.evictions);
+			lua_setfield(L, -2, "evictions");
+			lua_pushnumber(L, stats.gc_time / 1000000000.);
+			lua_setfield(L, -2, "gc_time");
+			lua_pushnumber(L, (double)stats.gc_cycles);
+			lua_setfield(L, -2, "gc_cycles");
+			if (stats.gc_pause) {
+				lua_pushnumber(L, stats.gc_pause);
+				lua_setfield(L, -2, "gc_pause");
+				lua_pushnumber(L, stats.gc_stepmul);
+				lua_setfield(L, -2, "gc_stepmul");
+			}
+
+			lua_settable(L, -3);
+		}
+
+		return 1;
+	}
+%}
+
+%native(_metrics_info) int metrics_info(lua_State *L);
+
+%{
+	struct metrics_info_data {
+		struct lua_State *L;
+		int               index;
+	};
+
+	static void metrics_info_push(struct metric *metric, void *_data)
+	{
+		struct metrics_info_data *data = (struct metrics_info_data *)_data;
+		struct lua_State *L = data->L;
+		uint64 values[METRICS_MAX_VALUES];
+		const int size = metric_size(metric);
+
+		metric_read(metric, METRICS_ALL_THREADS, values);
+
+		lua_pushnumber(L, ++data->index);
+
+		lua_newtable(L);
+
+		lua_pushstring(L, metric->name);
+		lua_setfield(L, -2, "name");
+		lua_pushstring(L, metric->help);
+		lua_setfield(L, -2, "help");
+
+		switch (metric->type) {
+		case METRIC_TYPE_COUNTER:
+			lua_pushstring(L, "counter");
+			lua_setfield(L, -2, "type");
+			lua_pushnumber(L, (double)values[0]);
+			lua_setfield(L, -2, "value");
+			break;
+
+		case METRIC_TYPE_GAUGE:
+			lua_pushstring(L, "gauge");
+			lua_setfield(L, -2, "type");
+			lua_pushnumber(L, (double)(int64)values[0]);
+			lua_setfield(L, -2, "value");
+			break;
+
+		case METRIC_TYPE_HISTOGRAM:
+			lua_pushstring(L, "histogram");
+			lua_setfield(L, -2, "type");
+			lua_pushnumber(L, (double)values[size-1]);
+			lua_setfield(L, -2, "value");
+			lua_pushnumber(L, (double)values[size-2]);
+			lua_setfield(L, -2, "sum");
+			break;
+		}
+
+		lua_settable(L, -3);
+	}
+
+	int metrics_info(struct lua_State *L)
+	{
+		struct metrics_info_data data = { L, 0 };
+
+		lua_newtable(L);
+		metrics_foreach(metrics_info_push, &data);
+		return 1;
+	}
+%}
+
+%native(_budget_info) int lua_state_budget_info(lua_State *L);
+
+%native(_jit_diagnostics) int lua_state_jit_diagnostics(lua_State *L);
+
+%native(_trace_push) int trace_push(lua_State *L);
+%native(_trace_pop) int trace_pop(lua_State *L);
+%native(_trace_enabled) int trace_enabled(lua_State *L);
+%native(_latency_info) int latency_info(lua_State *L);
+
+%{
+	int trace_push(struct lua_State *L)
+	{
+		const char *stage = lua_tostring(L, 1);
+		lua_pushnumber(L, stage ? packet_trace_push(stage) : 0);
+		return 1;
+	}
+
+	int trace_pop(struct lua_State *L)
+	{
+		packet_trace_pop(lua_tointeger(L, 1));
+		return 0;
+	}
+
+	int trace_enabled(struct lua_State *L)
+	{
+		lua_pushboolean(L, packet_trace_enabled());
+		return 1;
+	}
+
+	static double latency_quantile(struct metric *metric, const uint64 *values, uint64 count, double q)
+	{
+		uint64 cumul = 0;
+		int i;
+
+		/* Upper bound of the bucket containing the quantile */
+		for (i=0; i<metric->bucket_count; ++i) {
+			cumul += values[i];
+			if (cumul >= q * count) return metric->bounds[i] / 1e9;
+		}
+		return metric->bounds[metric->bucket_count-1] / 1e9;
+	}
+
+	static void latency_info_push(const char *stage, struct metric *metric, void *_data)
+	{
+		struct metrics_info_data *data = (struct metrics_info_data *)_data;
+		struct lua_State *L = data->L;
+		uint64 values[METRICS_MAX_VALUES];
+		const int size = metric_size(metric);
+		uint64 count;
+
+		metric_read(metric, METRICS_ALL_THREADS, values);
+		count = values[size-1];
+		if (count == 0) return;
+
+		lua_pushnumber(L, ++data->index);
+
+		lua_newtable(L);
+
+		lua_pushstring(L, stage);
+		lua_setfield(L, -2, "stage");
+		lua_pushnumber(L, (double)count);
+		lua_setfield(L, -2, "count");
+		lua_pushnumber(L, values[size-2] / 1e9 / count);
+		lua_setfield(L, -2, "mean");
+		lua_pushnumber(L, latency_quantile(metric, values, count, 0.5));
+		lua_setfield(L, -2, "p50");
+		lua_pushnumber(L, latency_quantile(metric, values, count, 0.9));
+		lua_setfield(L, -2, "p90");
+		lua_pushnumber(L, latency_quantile(metric, values, count, 0.99));
+		lua_setfield(L, -2, "p99");
+
+		lua_settable(L, -3);
+	}
+
+	int latency_info(struct lua_State *L)
+	{
+		struct metrics_info_data data = { L, 0 };
+
+		lua_newtable(L);
+		packet_trace_foreach(latency_info_push, &data);
+		return 1;
+	}
+%}
+%native(_rule_profiling) int lua_state_rule_profiling(lua_State *L);
+%native(_profile_clock) int lua_state_profile_clock(lua_State *L);
+
 %luacode {
 	haka = unpack({...})
 }
@@ -139,6 +352,7 @@ STRUCT_UNKNOWN_KEY_ERROR(time);
 
 	haka.events.exiting = haka.event.Event:new("exiting")
 	haka.events.started = haka.event.Event:new("started")
+	haka.events.memory_pressure = haka.event.Event:new("memory_pressure")
 
 	haka.helper = {}
 
@@ -151,10 +365,31 @@ STRUCT_UNKNOWN_KEY_ERROR(time);
 	haka.console.threads = haka._threads_info
 	haka._threads_info = nil
 
+	haka.console.memory = haka._memory_info
+	haka._memory_info = nil
+
+	haka.console.budget = haka._budget_info
+	haka._budget_info = nil
+
+	haka.console.metrics = haka._metrics_info
+	haka._metrics_info = nil
+
+	haka.console.latency = haka._latency_info
+	haka._latency_info = nil
+
+	-- The sampling is set at startup, avoid calling the C functions on
+	-- each packet when the tracing is disabled
+	if not haka._trace_enabled() then
+		haka._trace_push = function () return 0 end
+		haka._trace_pop = function () end
+	end
+	haka._trace_enabled = nil
+
 	require('context')
 	require('policy')
 	require('dissector')
 	require('grammar')
+	require('jit_diagnostics')
 
 	haka.mode = 'normal'
 }
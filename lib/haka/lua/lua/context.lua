@@ -4,6 +4,8 @@
 
 local class = require('class')
 
+local trace_push, trace_pop = haka._trace_push, haka._trace_pop
+
 local Scope = class.class()
 
 function Scope.method:__init()
@@ -25,9 +27,7 @@ function Context.method:__init()
 	self.connections = haka.event.StaticEventConnections:new()
 end
 
-function Context.method:signal(emitter, event, ...)
-	assert(class.classof(event, haka.event.Event), "event expected")
-
+local function signal(self, emitter, event, ...)
 	if not self.connections:signal(emitter, event, ...) then
 		return false
 	end
@@ -43,6 +43,21 @@ function Context.method:signal(emitter, event, ...)
 	return true
 end
 
+function Context.method:signal(emitter, event, ...)
+	assert(class.classof(event, haka.event.Event), "event expected")
+
+	local trace = trace_push('rules')
+	if trace == 0 then
+		return signal(self, emitter, event, ...)
+	end
+
+	-- Leave the stage even if a rule raises an error
+	local success, ret = pcall(signal, self, emitter, event, ...)
+	trace_pop(trace)
+	if not success then error(ret, 0) end
+	return ret
+end
+
 function Context.method:newscope()
 	return Scope:new()
 end
@@ -290,6 +290,7 @@ types.PacketDissector:register_event('send_packet')
 types.PacketDissector:register_event('protocol_error')
 
 local npkt
+local trace_push, trace_pop = haka._trace_push, haka._trace_pop
 
 local function preceive()
 	npkt:receive()
@@ -298,7 +299,10 @@ end
 function types.PacketDissector.method:preceive()
 	-- JIT optim
 	npkt = self
-	return dissector.pcall(npkt, preceive)
+	local trace = trace_push(self.name)
+	local ret = dissector.pcall(npkt, preceive)
+	trace_pop(trace)
+	return ret
 end
 
 function types.PacketDissector.method:receive()
@@ -313,7 +317,16 @@ function types.PacketDissector.method:receive()
 
 	-- Dirty workaround to avoid changing {tcp,udp}_connection right now
 	if self._next_dissector and self._next_dissector.receive then
-		return self._next_dissector:receive(self)
+		local next_dissector = self._next_dissector
+		local trace = trace_push(next_dissector.name)
+		if trace == 0 then
+			return next_dissector:receive(self)
+		end
+
+		local success, ret = pcall(next_dissector.receive, next_dissector, self)
+		trace_pop(trace)
+		if not success then error(ret, 0) end
+		return ret
 	else
 		local next_dissector = self:activate_next_dissector()
 		if next_dissector then
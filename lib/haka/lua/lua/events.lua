@@ -97,3 +97,6 @@ end
 
 
 haka.event = module
+
+-- Used by the profiler to find the signaled events in the stack
+haka._event_signal = module.EventConnections.method.signal
@@ -0,0 +1,126 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+local module = {}
+local log = haka.log_section("lua")
+
+-- Maximum number of distinct abort locations kept
+module.max_entries = 256
+
+local jutil, vmdef
+if jit then
+	jutil = require('jit.util')
+	vmdef = require('jit.vmdef')
+end
+
+local aborts = {}
+local entries = 0
+local overflow = 0
+local starts = {}
+local attached = false
+
+local function location(func, pc)
+	local info = jutil.funcinfo(func, pc)
+	if info.loc then
+		return info.loc
+	elseif info.ffid then
+		return vmdef.ffnames[info.ffid]
+	elseif info.addr then
+		return string.format("C:%x", info.addr)
+	else
+		return "?"
+	end
+end
+
+local function reason(err, info)
+	if type(err) == 'number' then
+		if type(info) == 'function' then info = location(info) end
+		return string.format(vmdef.traceerr[err], info)
+	end
+	return tostring(err)
+end
+
+local function rule(func)
+	local locations = haka._rule_location
+	return locations and locations[func]
+end
+
+local function trace_event(what, tr, func, pc, otr, oex)
+	if what == 'start' then
+		starts[tr] = rule(func) or location(func, pc)
+	elseif what == 'abort' then
+		local loc = location(func, pc)
+		local msg = reason(otr, oex)
+		local key = loc .. '\0' .. msg
+
+		local entry = aborts[key]
+		if not entry then
+			if entries >= module.max_entries then
+				overflow = overflow + 1
+				return
+			end
+
+			entry = { location = loc, reason = msg, start = starts[tr], rule = rule(func), count = 0 }
+			aborts[key] = entry
+			entries = entries + 1
+		end
+
+		entry.count = entry.count + 1
+		starts[tr] = nil
+	elseif what == 'stop' then
+		starts[tr] = nil
+	end
+end
+
+function module.enable(enable)
+	if not jit then
+		error("trace diagnostics require LuaJIT")
+	end
+
+	if enable and not attached then
+		jit.attach(trace_event, 'trace')
+		attached = true
+		log.info("trace abort diagnostics enabled")
+	elseif not enable and attached then
+		jit.attach(trace_event)
+		attached = false
+		starts = {}
+		log.info("trace abort diagnostics disabled")
+	end
+end
+
+function module.reset()
+	aborts = {}
+	entries = 0
+	overflow = 0
+end
+
+function haka.console.jit_diagnostics(enable)
+	module.enable(enable)
+end
+
+function haka.console.jit_aborts()
+	local ret = {}
+	for _, entry in pairs(aborts) do
+		table.insert(ret, {
+			location = entry.location,
+			reason = entry.reason,
+			start = entry.start,
+			rule = entry.rule,
+			count = entry.count
+		})
+	end
+
+	if overflow > 0 then
+		table.insert(ret, { location = '<other>', reason = '<other>', count = overflow })
+	end
+
+	return ret
+end
+
+if haka._jit_diagnostics() then
+	module.enable(true)
+end
+
+return module
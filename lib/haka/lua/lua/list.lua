@@ -216,6 +216,14 @@ function module.formatter.unit(num)
 	return string.format("%.2f%s", num, num_units[#num_units])
 end
 
+function module.formatter.duration(secs)
+	if not secs then return tostring(secs) end
+
+	if secs < 1e-3 then return string.format("%.2fus", secs*1e6)
+	elseif secs < 1 then return string.format("%.2fms", secs*1e3)
+	else return string.format("%.2fs", secs) end
+end
+
 function module.formatter.optional(default)
 	return function (val)
 		if val then return val
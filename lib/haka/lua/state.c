@@ -11,6 +11,10 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 #include <haka/lua/state.h>
 #include <haka/lua/object.h>
@@ -19,13 +23,130 @@
 #include <haka/compiler.h>
 #include <haka/error.h>
 #include <haka/timer.h>
+#include <haka/time.h>
 #include <haka/lua/luautils.h>
 #include <haka/container/vector.h>
+#include <haka/container/hash.h>
 #include <haka/luadebug/debugger.h>
+#include <haka/thread.h>
+#include <haka/engine.h>
+#include <haka/slab.h>
 
 
 #define STATE_TABLE      "__haka_state"
 
+/* Size-class pools used for small Lua objects */
+#define POOL_GRANULARITY     16
+#define POOL_MAXSIZE         512
+#define POOL_CLASSES         (POOL_MAXSIZE / POOL_GRANULARITY)
+#define POOL_SLABSIZE        (64*1024)
+#define POOL_CLASS(size)     (((size)-1) / POOL_GRANULARITY)
+
+/* Above this threshold, the state is considered to be under memory pressure */
+#define MEMORY_WATERMARK(limit) ((limit) - ((limit) >> 3))
+
+/* Incremental collection done while the thread is idle */
+#define GC_IDLE_MINWORK      (64*1024)
+#define GC_UPDATE_MASK       0xff
+#define GC_RATE_PERIOD       0.1
+#define GC_RATE_HIGH         (64.*1024*1024)
+#define GC_STEP_DURATION     0.01
+#define GC_STEP_MIN          8
+#define GC_STEP_MAX          1024
+#define GC_PAUSE_MIN         150
+#define GC_PAUSE_MAX         400
+#define GC_STEPMUL_MIN       200
+#define GC_STEPMUL_MAX       800
+
+/* Per-packet cpu budget */
+#define BUDGET_SIGNAL        SIGVTALRM
+#define BUDGET_TICKS         4
+#define BUDGET_HOOK_COUNT    1000
+#define BUDGET_LOCATIONS     16
+#define BUDGET_LOCATION_SIZE 128
+#define RULE_LOCATION_TABLE  "_rule_location"
+
+/* Sampling profiler */
+#define PROFILE_SIGNAL       SIGPROF
+#define PROFILE_MAX_DEPTH    64
+#define PROFILE_FRAME_SIZE   128
+#define PROFILE_STACK_SIZE   2048
+#define PROFILE_MAX_STACKS   4096
+#define EVENT_SIGNAL_FUNC    "_event_signal"
+
+struct lua_pool_slab {
+	struct lua_pool_slab  *next;
+};
+
+struct lua_pool {
+	void                  *free[POOL_CLASSES];
+	struct lua_pool_slab  *slabs;
+	uint8                 *current;
+	size_t                 remaining;
+};
+
+struct lua_state_memory {
+	size_t                 allocated;
+	size_t                 slab;  /* slab pages of the thread, refreshed periodically */
+	size_t                 peak;
+	size_t                 limit;
+	uint64                 total;
+	uint64                 failures;
+	uint64                 evictions;
+	bool                   pressure;
+	lua_Alloc              allocf;
+	void                  *allocd;
+	struct lua_pool        pool;
+	double                 rate; /* updated by the owning thread */
+	/* Collector tuning and idle collection */
+	uint32                 gc_updates;
+	int                    gc_pause;
+	int                    gc_stepmul;
+	int                    gc_stepsize;
+	double                 gc_rate;
+	struct time            gc_sample_time;
+	uint64                 gc_sample_total;
+	uint64                 gc_cycle_total;
+	uint64                 gc_time;
+	uint64                 gc_steps;
+	uint64                 gc_cycles;
+};
+
+struct lua_budget_location {
+	char                   rule[BUDGET_LOCATION_SIZE];
+	char                   location[BUDGET_LOCATION_SIZE];
+	uint64                 count;
+};
+
+struct lua_state_budget {
+	bool                   has_timer;
+	timer_t                timer;
+	volatile sig_atomic_t  active;
+	volatile sig_atomic_t  expired;
+	volatile uint32        packet;
+	volatile uint32        tick_packet;
+	volatile int           ticks;
+	bool                   recorded;
+	uint64                 exceeded;
+	int                    location_count;
+	struct lua_budget_location locations[BUDGET_LOCATIONS];
+};
+
+struct lua_profile_stack {
+	hash_head_t            hh;
+	uint64                 count;
+	char                   stack[0];
+};
+
+struct lua_state_profiler {
+	bool                   has_timer;
+	timer_t                timer;
+	volatile sig_atomic_t  pending;
+	volatile uint32        outside;
+	uint64                 dropped;
+	int                    stack_count;
+	struct lua_profile_stack *stacks;
+};
 
 struct lua_interrupt_data {
 	lua_function          function;
@@ -35,10 +156,13 @@ struct lua_interrupt_data {
 
 struct lua_state_ext {
 	struct lua_state       state;
-	bool                   hook_installed;
+	volatile sig_atomic_t  hook_installed;   /* also updated by the budget signal handler */
 	lua_hook               debug_hook;
 	struct vector          interrupts;
 	bool                   has_interrupts;
+	struct lua_state_memory memory;
+	struct lua_state_budget budget;
+	struct lua_state_profiler profiler;
 	struct lua_state_ext  *next;
 };
 
@@ -288,6 +412,217 @@ static int str_format(lua_State *L)
 #endif
 
 static struct lua_state_ext *allocated_state = NULL;
+static size_t memory_limit = 0;
+static double packet_budget = 0;
+
+
+/*
+ * Memory allocator
+ *
+ * Each Lua state is owned by a single thread, so the pools and the
+ * counters are not protected. The counters can be read from other
+ * threads for statistics only.
+ */
+
+static void *lua_pool_get(struct lua_pool *pool, size_t size)
+{
+	const int index = POOL_CLASS(size);
+	void *ptr = pool->free[index];
+
+	if (ptr) {
+		pool->free[index] = *(void **)ptr;
+	}
+	else {
+		const size_t block = (index+1) * POOL_GRANULARITY;
+
+		if (pool->remaining < block) {
+			/* The end of the previous slab is lost, it is always
+			 * smaller than POOL_MAXSIZE. */
+			struct lua_pool_slab *slab = malloc(POOL_SLABSIZE);
+			if (!slab) {
+				return NULL;
+			}
+
+			slab->next = pool->slabs;
+			pool->slabs = slab;
+			pool->current = (uint8 *)slab + POOL_GRANULARITY;
+			pool->remaining = POOL_SLABSIZE - POOL_GRANULARITY;
+		}
+
+		ptr = pool->current;
+		pool->current += block;
+		pool->remaining -= block;
+	}
+
+	return ptr;
+}
+
+static void lua_pool_put(struct lua_pool *pool, void *ptr, size_t size)
+{
+	const int index = POOL_CLASS(size);
+	*(void **)ptr = pool->free[index];
+	pool->free[index] = ptr;
+}
+
+static void lua_pool_destroy(struct lua_pool *pool)
+{
+	struct lua_pool_slab *slab = pool->slabs;
+	while (slab) {
+		struct lua_pool_slab *next = slab->next;
+		free(slab);
+		slab = next;
+	}
+
+	memset(pool, 0, sizeof(*pool));
+}
+
+UNUSED static void *lua_pool_realloc(struct lua_pool *pool, void *ptr, size_t osize, size_t nsize)
+{
+	void *ret;
+
+	if (nsize == 0) {
+		if (ptr) {
+			if (osize <= POOL_MAXSIZE) lua_pool_put(pool, ptr, osize);
+			else free(ptr);
+		}
+		return NULL;
+	}
+
+	if (!ptr) {
+		if (nsize <= POOL_MAXSIZE) return lua_pool_get(pool, nsize);
+		else return malloc(nsize);
+	}
+
+	if (osize > POOL_MAXSIZE && nsize > POOL_MAXSIZE) {
+		return realloc(ptr, nsize);
+	}
+
+	if (osize <= POOL_MAXSIZE && nsize <= POOL_MAXSIZE &&
+	    POOL_CLASS(osize) == POOL_CLASS(nsize)) {
+		return ptr;
+	}
+
+	if (nsize <= POOL_MAXSIZE) ret = lua_pool_get(pool, nsize);
+	else ret = malloc(nsize);
+
+	if (!ret) {
+		/* Lua does not expect a shrinking block to fail, the old block
+		 * is large enough to be kept. */
+		if (nsize < osize) return ptr;
+		return NULL;
+	}
+
+	memcpy(ret, ptr, osize < nsize ? osize : nsize);
+
+	if (osize <= POOL_MAXSIZE) lua_pool_put(pool, ptr, osize);
+	else free(ptr);
+
+	return ret;
+}
+
+static void *lua_state_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	struct lua_state_memory *memory = (struct lua_state_memory *)ud;
+	void *ret;
+
+	/* Lua 5.2 gives the object type in osize for new objects */
+	if (!ptr) osize = 0;
+
+	if (nsize > osize && memory->limit &&
+	    memory->allocated + memory->slab + (nsize - osize) > memory->limit) {
+		++memory->failures;
+		memory->pressure = true;
+		return NULL;
+	}
+
+#if HAKA_LUAJIT
+	ret = memory->allocf(memory->allocd, ptr, osize, nsize);
+#else
+	ret = lua_pool_realloc(&memory->pool, ptr, osize, nsize);
+#endif
+
+	if (ret || nsize == 0) {
+		memory->allocated += nsize - osize;
+
+		if (nsize > osize) {
+			memory->total += nsize - osize;
+
+			if (memory->allocated > memory->peak) {
+				memory->peak = memory->allocated;
+			}
+
+			if (memory->limit && memory->allocated + memory->slab > MEMORY_WATERMARK(memory->limit)) {
+				memory->pressure = true;
+			}
+		}
+	}
+
+	return ret;
+}
+
+static lua_State *lua_state_newstate(struct lua_state_memory *memory)
+{
+	lua_State *L;
+
+	memset(memory, 0, sizeof(*memory));
+	memory->gc_stepsize = GC_STEP_MIN;
+
+#if HAKA_LUAJIT
+	/* LuaJIT refuses custom allocators on x86_64 as it needs memory in
+	 * the lower 2GB. Its builtin allocator already uses one arena per
+	 * state, we only wrap it to do the accounting. */
+	L = luaL_newstate();
+	if (!L) {
+		return NULL;
+	}
+
+	memory->allocf = lua_getallocf(L, &memory->allocd);
+	memory->allocated = lua_gc(L, LUA_GCCOUNT, 0)*1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+	memory->peak = memory->allocated;
+	lua_setallocf(L, lua_state_alloc, memory);
+#else
+	L = lua_newstate(lua_state_alloc, memory);
+#endif
+
+	return L;
+}
+
+void lua_state_set_memory_limit(size_t limit)
+{
+	memory_limit = limit;
+}
+
+bool lua_state_memory_stats(struct lua_State *L, struct lua_state_memory_stats *stats)
+{
+	void *ud;
+	struct lua_state_memory *memory;
+
+	/* The fields are only read, they are updated by the thread owning
+	 * the state. This function can then be called from any thread. */
+	if (lua_getallocf(L, &ud) != lua_state_alloc) {
+		error("invalid lua state allocator");
+		return false;
+	}
+
+	memory = (struct lua_state_memory *)ud;
+
+	stats->allocated = memory->allocated;
+	stats->slab = memory->slab;
+	stats->peak = memory->peak;
+	stats->limit = memory->limit;
+	stats->total = memory->total;
+	stats->failures = memory->failures;
+	stats->evictions = memory->evictions;
+	stats->gc_time = memory->gc_time;
+	stats->gc_steps = memory->gc_steps;
+	stats->gc_cycles = memory->gc_cycles;
+	stats->gc_pause = memory->gc_pause;
+	stats->gc_stepmul = memory->gc_stepmul;
+
+	stats->rate = memory->rate;
+
+	return true;
+}
 
 static void lua_interrupt_data_destroy(void *_data)
 {
@@ -342,20 +677,25 @@ static int lua_setfenv_wrapper(lua_State *L)
 struct lua_state *lua_state_init()
 {
 	struct lua_state_ext *ret;
-	lua_State *L = luaL_newstate();
-	if (!L) {
-		return NULL;
-	}
+	lua_State *L;
 
 	ret = malloc(sizeof(struct lua_state_ext));
 	if (!ret) {
 		return NULL;
 	}
 
+	L = lua_state_newstate(&ret->memory);
+	if (!L) {
+		free(ret);
+		return NULL;
+	}
+
 	ret->state.L = L;
 	ret->hook_installed = false;
 	ret->debug_hook = NULL;
 	ret->has_interrupts = false;
+	memset(&ret->budget, 0, sizeof(ret->budget));
+	memset(&ret->profiler, 0, sizeof(ret->profiler));
 	vector_create_reserve(&ret->interrupts, struct lua_interrupt_data, 20, lua_interrupt_data_destroy);
 	ret->next = NULL;
 
@@ -403,6 +743,8 @@ struct lua_state *lua_state_init()
 	ret->next = allocated_state;
 	allocated_state = ret;
 
+	ret->memory.limit = memory_limit;
+
 	return &ret->state;
 }
 
@@ -449,8 +791,22 @@ void lua_state_close(struct lua_state *_state)
 	vector_destroy(&state->interrupts);
 	state->has_interrupts = false;
 
+	if (state->budget.has_timer) {
+		timer_delete(state->budget.timer);
+		state->budget.has_timer = false;
+	}
+
+	free(lua_state_profile_stop(_state, NULL));
+
+#if HAKA_LUAJIT
+	/* LuaJIT only destroys its arena when closed with its own allocator */
+	lua_setallocf(state->state.L, state->memory.allocf, state->memory.allocd);
+#endif
+
 	lua_close(state->state.L);
 	state->state.L = NULL;
+
+	lua_pool_destroy(&state->memory.pool);
 }
 
 FINI_P(2000) static void lua_state_cleanup()
@@ -467,6 +823,145 @@ FINI_P(2000) static void lua_state_cleanup()
 	allocated_state = NULL;
 }
 
+void lua_state_memory_check(struct lua_state *_state)
+{
+	struct lua_state_ext *state = (struct lua_state_ext *)_state;
+	struct lua_state_memory *memory = &state->memory;
+
+	if (!memory->pressure) {
+		return;
+	}
+
+	memory->pressure = false;
+
+	LOG_DEBUG(lua, "memory pressure (%zu bytes allocated), running emergency collection",
+			memory->allocated);
+
+	lua_gc(state->state.L, LUA_GCCOLLECT, 0);
+	memory->slab = slab_thread_memory();
+
+	if (memory->limit && memory->allocated + memory->slab > MEMORY_WATERMARK(memory->limit)) {
+		LOG_WARNING(lua, "memory limit almost reached (%zu bytes allocated, %zu in slabs), evicting connections",
+				memory->allocated, memory->slab);
+
+		++memory->evictions;
+		lua_state_trigger_haka_event(_state, "memory_pressure");
+		lua_gc(state->state.L, LUA_GCCOLLECT, 0);
+		memory->slab = slab_thread_memory();
+	}
+
+	memory->pressure = false;
+}
+
+static void lua_state_gc_tune(struct lua_state_ext *state)
+{
+	struct lua_state_memory *memory = &state->memory;
+	struct time now, diff;
+	double rate, load;
+	int pause, stepmul, stepsize;
+
+	if (!time_gettimestamp(&now)) {
+		clear_error();
+		return;
+	}
+
+	if (!time_isvalid(&memory->gc_sample_time)) {
+		memory->gc_sample_time = now;
+		memory->gc_sample_total = memory->total;
+		return;
+	}
+
+	if (time_diff(&diff, &now, &memory->gc_sample_time) <= 0 ||
+	    time_sec(&diff) < GC_RATE_PERIOD) {
+		return;
+	}
+
+	rate = (memory->total - memory->gc_sample_total) / time_sec(&diff);
+	memory->rate = rate;
+	if (memory->gc_rate > 0) memory->gc_rate = 0.75*memory->gc_rate + 0.25*rate;
+	else memory->gc_rate = rate;
+
+	memory->gc_sample_time = now;
+	memory->gc_sample_total = memory->total;
+
+	/*
+	 * With a low allocation rate, the idle collection keeps up and the
+	 * automatic collection can be deferred to avoid running it while
+	 * processing packets. With a high rate, the collector needs to start
+	 * earlier and to work harder to bound the memory growth.
+	 */
+	load = memory->gc_rate / GC_RATE_HIGH;
+	if (load > 1.) load = 1.;
+
+	pause = GC_PAUSE_MAX - load*(GC_PAUSE_MAX - GC_PAUSE_MIN);
+	stepmul = GC_STEPMUL_MIN + load*(GC_STEPMUL_MAX - GC_STEPMUL_MIN);
+
+	if (pause != memory->gc_pause) {
+		lua_gc(state->state.L, LUA_GCSETPAUSE, pause);
+		memory->gc_pause = pause;
+	}
+
+	if (stepmul != memory->gc_stepmul) {
+		lua_gc(state->state.L, LUA_GCSETSTEPMUL, stepmul);
+		memory->gc_stepmul = stepmul;
+	}
+
+	/* Each idle step handles about GC_STEP_DURATION worth of allocations */
+	stepsize = memory->gc_rate * GC_STEP_DURATION / 1024;
+	if (stepsize < GC_STEP_MIN) stepsize = GC_STEP_MIN;
+	else if (stepsize > GC_STEP_MAX) stepsize = GC_STEP_MAX;
+	memory->gc_stepsize = stepsize;
+}
+
+bool lua_state_gc_update(struct lua_state *_state)
+{
+	struct lua_state_ext *state = (struct lua_state_ext *)_state;
+	struct lua_state_memory *memory = &state->memory;
+	size_t threshold;
+
+	if ((++memory->gc_updates & GC_UPDATE_MASK) == 0) {
+		/* The vbuffer chunk, head and control structures of the thread
+		 * are allocated from the slabs, they count in the memory limit */
+		memory->slab = slab_thread_memory();
+		if (memory->limit && memory->allocated + memory->slab > MEMORY_WATERMARK(memory->limit)) {
+			memory->pressure = true;
+		}
+
+		lua_state_gc_tune(state);
+	}
+
+	threshold = memory->allocated >> 4;
+	if (threshold < GC_IDLE_MINWORK) threshold = GC_IDLE_MINWORK;
+
+	return memory->total - memory->gc_cycle_total > threshold;
+}
+
+void lua_state_gc_step(struct lua_state *_state)
+{
+	struct lua_state_ext *state = (struct lua_state_ext *)_state;
+	struct lua_state_memory *memory = &state->memory;
+	struct time start, end, diff;
+	bool timed;
+
+	timed = time_gettimestamp(&start);
+
+	if (lua_gc(state->state.L, LUA_GCSTEP, memory->gc_stepsize)) {
+		/* The step finished a collection cycle */
+		++memory->gc_cycles;
+		memory->gc_cycle_total = memory->total;
+	}
+
+	++memory->gc_steps;
+
+	if (timed && time_gettimestamp(&end)) {
+		time_diff(&diff, &end, &start);
+		memory->gc_time += diff.secs * 1000000000ULL + diff.nsecs;
+	}
+	else {
+		clear_error();
+	}
+}
+
 bool lua_state_isvalid(struct lua_state *state)
 {
 	return (state->L != NULL);
@@ -531,7 +1026,14 @@ static void lua_interrupt_call(struct lua_state_ext *state)
 
 static void lua_update_hook(struct lua_state_ext *state)
 {
-	if (state->debug_hook || state->has_interrupts) {
+	if (state->budget.expired) {
+		/* The count hook makes sure that the budget is also enforced
+		 * on loops that does not change line */
+		lua_sethook(state->state.L, &lua_dispatcher_hook,
+				LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE | LUA_MASKCOUNT, BUDGET_HOOK_COUNT);
+		state->hook_installed = true;
+	}
+	else if (state->debug_hook || state->has_interrupts || state->profiler.pending) {
 		if (!state->hook_installed) {
 			lua_sethook(state->state.L, &lua_dispatcher_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE, 1);
 			state->hook_installed = true;
@@ -545,11 +1047,201 @@ static void lua_update_hook(struct lua_state_ext *state)
 	}
 }
 
+static void lua_budget_record(struct lua_state_ext *state, lua_State *L)
+{
+	struct lua_state_budget *budget = &state->budget;
+	struct lua_budget_location *entry = NULL;
+	char location[BUDGET_LOCATION_SIZE] = "<unknown>";
+	char rule[BUDGET_LOCATION_SIZE] = "<unknown>";
+	bool has_location = false;
+	lua_Debug ar;
+	int i, level;
+	LUA_STACK_MARK(L);
+
+	++budget->exceeded;
+
+	/* Rule eval functions are mapped to the rule location in
+	 * haka._rule_location */
+	lua_getglobal(L, "haka");
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, RULE_LOCATION_TABLE);
+		lua_remove(L, -2);
+	}
+
+	for (level = 0; lua_getstack(L, level, &ar); ++level) {
+		if (!lua_getinfo(L, "Slf", &ar)) {
+			continue;
+		}
+
+		if (!has_location && ar.currentline > 0) {
+			snprintf(location, BUDGET_LOCATION_SIZE, "%s:%d", ar.short_src, ar.currentline);
+			has_location = true;
+		}
+
+		if (lua_istable(L, -2)) {
+			lua_rawget(L, -2);
+			if (lua_isstring(L, -1)) {
+				snprintf(rule, BUDGET_LOCATION_SIZE, "%s", lua_tostring(L, -1));
+				lua_pop(L, 1);
+				break;
+			}
+		}
+		lua_pop(L, 1);
+	}
+
+	lua_pop(L, 1);
+	LUA_STACK_CHECK(L, 0);
+
+	LOG_WARNING(lua, "packet budget exceeded in rule %s at %s", rule, location);
+
+	for (i=0; i<budget->location_count; ++i) {
+		if (strcmp(budget->locations[i].rule, rule) == 0 &&
+		    strcmp(budget->locations[i].location, location) == 0) {
+			entry = &budget->locations[i];
+			break;
+		}
+	}
+
+	if (!entry) {
+		if (budget->location_count < BUDGET_LOCATIONS) {
+			entry = &budget->locations[budget->location_count++];
+		}
+		else {
+			/* Replace the least frequent location */
+			entry = &budget->locations[0];
+			for (i=1; i<budget->location_count; ++i) {
+				if (budget->locations[i].count < entry->count) {
+					entry = &budget->locations[i];
+				}
+			}
+		}
+
+		strcpy(entry->rule, rule);
+		strcpy(entry->location, location);
+		entry->count = 0;
+	}
+
+	++entry->count;
+}
+
+static void lua_profile_add(struct lua_state_profiler *profiler, const char *stack, uint64 count)
+{
+	struct lua_profile_stack *entry;
+	size_t len;
+
+	HASH_FIND_STR(profiler->stacks, stack, entry);
+	if (entry) {
+		entry->count += count;
+		return;
+	}
+
+	if (profiler->stack_count >= PROFILE_MAX_STACKS) {
+		profiler->dropped += count;
+		return;
+	}
+
+	len = strlen(stack);
+	entry = malloc(sizeof(struct lua_profile_stack) + len + 1);
+	if (!entry) {
+		profiler->dropped += count;
+		return;
+	}
+
+	memcpy(entry->stack, stack, len + 1);
+	entry->count = count;
+	HASH_ADD_KEYPTR(hh, profiler->stacks, entry->stack, len, entry);
+	++profiler->stack_count;
+}
+
+static void lua_profile_frame(lua_State *L, lua_Debug *ar, int signal_func, char *frame)
+{
+	char *iter;
+
+	/* The event signal function is replaced by the name of the event
+	 * which also contains the name of the dissector */
+	if (lua_isfunction(L, signal_func) && lua_rawequal(L, -1, signal_func)) {
+		const char *name;
+
+		if (lua_getlocal(L, ar, 3)) {
+			if (lua_istable(L, -1)) {
+				lua_getfield(L, -1, "name");
+				name = lua_tostring(L, -1);
+				if (name) {
+					snprintf(frame, PROFILE_FRAME_SIZE, "[event %s]", name);
+					lua_pop(L, 2);
+					return;
+				}
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+	}
+
+	if (strcmp(ar->what, "C") == 0) {
+		snprintf(frame, PROFILE_FRAME_SIZE, "[C] %s", ar->name ? ar->name : "?");
+	}
+	else if (strcmp(ar->what, "main") == 0) {
+		snprintf(frame, PROFILE_FRAME_SIZE, "main (%s)", ar->short_src);
+	}
+	else {
+		snprintf(frame, PROFILE_FRAME_SIZE, "%s (%s:%d)", ar->name ? ar->name : "?",
+				ar->short_src, ar->linedefined);
+	}
+
+	/* The ';' is the frame separator in the folded format */
+	for (iter = frame; *iter; ++iter) {
+		if (*iter == ';') *iter = ':';
+	}
+}
+
+static void lua_profile_record(struct lua_state_ext *state, lua_State *L)
+{
+	char frames[PROFILE_MAX_DEPTH][PROFILE_FRAME_SIZE];
+	char stack[PROFILE_STACK_SIZE];
+	int level, depth = 0, signal_func;
+	size_t len = 0;
+	lua_Debug ar;
+	LUA_STACK_MARK(L);
+
+	if (state->profiler.outside > 0) {
+		lua_profile_add(&state->profiler, "[outside rules]", state->profiler.outside);
+		state->profiler.outside = 0;
+	}
+
+	lua_getglobal(L, "haka");
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, EVENT_SIGNAL_FUNC);
+		lua_remove(L, -2);
+	}
+	signal_func = lua_gettop(L);
+
+	for (level = 0; depth < PROFILE_MAX_DEPTH && lua_getstack(L, level, &ar); ++level) {
+		if (!lua_getinfo(L, "Snf", &ar)) {
+			continue;
+		}
+
+		lua_profile_frame(L, &ar, signal_func, frames[depth++]);
+		lua_pop(L, 1);
+	}
+
+	lua_pop(L, 1);
+	LUA_STACK_CHECK(L, 0);
+
+	/* The folded stacks start from the root frame */
+	stack[0] = '\0';
+	while (depth > 0 && len < PROFILE_STACK_SIZE) {
+		len += snprintf(stack + len, PROFILE_STACK_SIZE - len, "%s%s",
+				len > 0 ? ";" : "", frames[--depth]);
+	}
+
+	lua_profile_add(&state->profiler, stack, 1);
+}
+
 static void lua_dispatcher_hook(lua_State *L, lua_Debug *ar)
 {
 	struct lua_state_ext *state = lua_state_getext(L);
 	if (state) {
-		if (state->debug_hook) {
+		if (state->debug_hook && ar->event != LUA_HOOKCOUNT) {
 			state->debug_hook(L, ar);
 		}
 
@@ -558,6 +1250,24 @@ static void lua_dispatcher_hook(lua_State *L, lua_Debug *ar)
 			lua_interrupt_call(state);
 			lua_update_hook(state);
 		}
+
+		if (state->profiler.pending) {
+			state->profiler.pending = false;
+			lua_profile_record(state, L);
+			lua_update_hook(state);
+		}
+
+		if (state->budget.expired && state->budget.active &&
+		    (ar->event == LUA_HOOKLINE || ar->event == LUA_HOOKCOUNT)) {
+			if (!state->budget.recorded) {
+				lua_budget_record(state, L);
+				state->budget.recorded = true;
+			}
+
+			/* The error is raised again on each hook until the packet
+			 * processing is fully aborted */
+			luaL_error(L, "packet budget exceeded");
+		}
 	}
 }
 
@@ -607,6 +1317,333 @@ bool lua_state_runinterrupt(struct lua_state *_state)
 	return true;
 }
 
+void lua_state_set_packet_budget(double budget)
+{
+	packet_budget = budget;
+}
+
+static void lua_budget_handler(int sig, siginfo_t *si, void *uc)
+{
+	struct lua_state_ext *state = (struct lua_state_ext *)si->si_value.sival_ptr;
+	struct lua_state_budget *budget;
+
+	if (!state) return;
+
+	budget = &state->budget;
+	if (!budget->active || budget->expired) return;
+
+	if (budget->tick_packet != budget->packet) {
+		budget->tick_packet = budget->packet;
+		budget->ticks = 0;
+	}
+
+	/* The packet is still processed after BUDGET_TICKS timer periods,
+	 * lua_sethook() is safe to be called from a signal handler. */
+	if (++budget->ticks > BUDGET_TICKS) {
+		budget->expired = true;
+		lua_update_hook(state);
+	}
+}
+
+bool lua_state_budget_init_thread(struct lua_state *_state)
+{
+	struct lua_state_ext *state = (struct lua_state_ext *)_state;
+	struct sigevent sev;
+	struct sigaction sa;
+	struct itimerspec ts;
+	sigset_t mask;
+	double period;
+
+	if (packet_budget <= 0 || state->budget.has_timer) {
+		return true;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sa.sa_sigaction = lua_budget_handler;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(BUDGET_SIGNAL, &sa, NULL) == -1) {
+		error("%s", errno_error(errno));
+		return false;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, BUDGET_SIGNAL);
+	if (!thread_sigmask(SIG_UNBLOCK, &mask, NULL)) {
+		return false;
+	}
+
+	/* The timer counts the cpu time of the thread, it does not trigger
+	 * while the thread is waiting for packets. */
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = BUDGET_SIGNAL;
+	sev.sigev_value.sival_ptr = state;
+	sev._sigev_un._tid = syscall(SYS_gettid);
+
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &state->budget.timer)) {
+		error("timer creation error: %s", errno_error(errno));
+		return false;
+	}
+
+	period = packet_budget / BUDGET_TICKS;
+	ts.it_value.tv_sec = period;
+	ts.it_value.tv_nsec = (period - ts.it_value.tv_sec) * 1000000000.;
+	ts.it_interval = ts.it_value;
+
+	if (timer_settime(state->budget.timer, 0, &ts, NULL)) {
+		error("timer error: %s", errno_error(errno));
+		timer_delete(state->budget.timer);
+		return false;
+	}
+
+	state->budget.has_timer = true;
+	return true;
+}
+
+void lua_state_budget_begin(struct lua_state *_state)
+{
+	struct lua_state_ext *state = (struct lua_state_ext *)_state;
+
+	++state->budget.packet;
+	state->budget.active = true;
+}
+
+bool lua_state_budget_end(struct lua_state *_state)
+{
+	struct lua_state_ext *state = (struct lua_state_ext *)_state;
+
+	state->budget.active = false;
+
+	if (state->budget.expired) {
+		state->budget.expired = false;
+		state->budget.recorded = false;
+
+		/* Remove the budget hook */
+		lua_sethook(state->state.L, &lua_dispatcher_hook, 0, 1);
+		state->hook_installed = false;
+		lua_update_hook(state);
+
+		return true;
+	}
+
+	return false;
+}
+
+int lua_state_budget_info(struct lua_State *L)
+{
+	struct lua_state_ext *state = lua_state_getext(L);
+	struct engine_thread *engine = engine_thread_current();
+	int i;
+
+	lua_newtable(L);
+
+	for (i=0; i<state->budget.location_count; ++i) {
+		const struct lua_budget_location *entry = &state->budget.locations[i];
+
+		lua_pushnumber(L, i+1);
+
+		lua_newtable(L);
+
+		if (engine) {
+			lua_pushnumber(L, engine_thread_id(engine));
+			lua_setfield(L, -2, "thread");
+		}
+		lua_pushstring(L, entry->rule);
+		lua_setfield(L, -2, "rule");
+		lua_pushstring(L, entry->location);
+		lua_setfield(L, -2, "location");
+		lua_pushnumber(L, (double)entry->count);
+		lua_setfield(L, -2, "count");
+
+		lua_settable(L, -3);
+	}
+
+	return 1;
+}
+
+/*
+ * Sampling profiler
+ */
+
+static void lua_profile_handler(int sig, siginfo_t *si, void *uc)
+{
+	struct lua_state_ext *state = (struct lua_state_ext *)si->si_value.sival_ptr;
+
+	if (!state) return;
+
+	/* The budget is active while the rules process a packet, the
+	 * samples taken outside are only counted. */
+	if (state->budget.active) {
+		state->profiler.pending = true;
+		lua_update_hook(state);
+	}
+	else {
+		++state->profiler.outside;
+	}
+}
+
+bool lua_state_profile_start(struct lua_state *_state, double period)
+{
+	struct lua_state_ext *state = (struct lua_state_ext *)_state;
+	struct lua_state_profiler *profiler = &state->profiler;
+	struct sigevent sev;
+	struct sigaction sa;
+	struct itimerspec ts;
+	sigset_t mask;
+
+	if (profiler->has_timer) {
+		error("profiler already running");
+		return false;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sa.sa_sigaction = lua_profile_handler;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(PROFILE_SIGNAL, &sa, NULL) == -1) {
+		error("%s", errno_error(errno));
+		return false;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, PROFILE_SIGNAL);
+	if (!thread_sigmask(SIG_UNBLOCK, &mask, NULL)) {
+		return false;
+	}
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = PROFILE_SIGNAL;
+	sev.sigev_value.sival_ptr = state;
+	sev._sigev_un._tid = syscall(SYS_gettid);
+
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &profiler->timer)) {
+		error("timer creation error: %s", errno_error(errno));
+		return false;
+	}
+
+	ts.it_value.tv_sec = period;
+	ts.it_value.tv_nsec = (period - ts.it_value.tv_sec) * 1000000000.;
+	ts.it_interval = ts.it_value;
+
+	if (timer_settime(profiler->timer, 0, &ts, NULL)) {
+		error("timer error: %s", errno_error(errno));
+		timer_delete(profiler->timer);
+		return false;
+	}
+
+	profiler->has_timer = true;
+	return true;
+}
+
+char *lua_state_profile_stop(struct lua_state *_state, size_t *size)
+{
+	struct lua_state_ext *state = (struct lua_state_ext *)_state;
+	struct lua_state_profiler *profiler = &state->profiler;
+	struct lua_profile_stack *entry, *tmp;
+	char *result = NULL;
+	size_t len = 0;
+	FILE *out = NULL;
+
+	if (profiler->has_timer) {
+		timer_delete(profiler->timer);
+		profiler->has_timer = false;
+	}
+
+	profiler->pending = false;
+	lua_update_hook(state);
+
+	if (profiler->outside > 0) {
+		lua_profile_add(profiler, "[outside rules]", profiler->outside);
+		profiler->outside = 0;
+	}
+
+	if (size) {
+		out = open_memstream(&result, &len);
+		if (!out) {
+			error("memory error");
+		}
+	}
+
+	HASH_ITER(hh, profiler->stacks, entry, tmp) {
+		if (out) fprintf(out, "%s %llu\n", entry->stack, (unsigned long long)entry->count);
+
+		HASH_DEL(profiler->stacks, entry);
+		free(entry);
+	}
+
+	if (out) {
+		if (profiler->dropped) {
+			fprintf(out, "[dropped] %llu\n", (unsigned long long)profiler->dropped);
+		}
+
+		fclose(out);
+		*size = len;
+	}
+
+	profiler->stack_count = 0;
+	profiler->dropped = 0;
+
+	return result;
+}
+
+/*
+ * Rule profiling
+ */
+
+static enum lua_state_profiling rule_profiling = LUA_PROFILING_NONE;
+
+void lua_state_set_rule_profiling(enum lua_state_profiling mode)
+{
+	rule_profiling = mode;
+}
+
+int lua_state_rule_profiling(struct lua_State *L)
+{
+	switch (rule_profiling) {
+	case LUA_PROFILING_WALL: lua_pushstring(L, "wall"); break;
+	case LUA_PROFILING_CPU:  lua_pushstring(L, "cpu"); break;
+	default:                 lua_pushnil(L); break;
+	}
+	return 1;
+}
+
+int lua_state_profile_clock(struct lua_State *L)
+{
+	struct timespec ts;
+
+	/* The monotonic clock is read from the vdso, the thread cpu clock
+	 * needs a system call and is only used if requested */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	lua_pushnumber(L, (double)ts.tv_sec * 1e9 + ts.tv_nsec);
+
+	if (rule_profiling == LUA_PROFILING_CPU) {
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		lua_pushnumber(L, (double)ts.tv_sec * 1e9 + ts.tv_nsec);
+		return 2;
+	}
+
+	return 1;
+}
+
+/*
+ * Trace abort diagnostics
+ */
+
+static bool jit_diagnostics = false;
+
+void lua_state_set_jit_diagnostics(bool enable)
+{
+	jit_diagnostics = enable;
+}
+
+int lua_state_jit_diagnostics(struct lua_State *L)
+{
+	lua_pushboolean(L, jit_diagnostics);
+	return 1;
+}
+
 bool lua_state_run_file(struct lua_state *state, const char *filename, int argc, char *argv[])
 {
 	int i, h;
@@ -0,0 +1,173 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <haka/metrics.h>
+#include <haka/thread.h>
+#include <haka/engine.h>
+#include <haka/error.h>
+#include <haka/log.h>
+
+
+struct metrics_slot {
+	uint64                 values[METRICS_MAX_VALUES];
+	struct metrics_slot   *next;
+	int                    thread;
+} CACHE_ALIGNED;
+
+static mutex_t metrics_lock = MUTEX_INIT;
+static struct metric *volatile metrics = NULL;
+static struct metric *metrics_last = NULL;
+static int metrics_size = 0;
+static struct metrics_slot *volatile metrics_slots = NULL;
+static local_storage_t metrics_localstorage;
+
+INIT static void metrics_init()
+{
+	local_storage_init(&metrics_localstorage, NULL);
+}
+
+/* Run after the other destructors (including SLAB_FINI), they can still
+ * update some metrics while releasing their objects */
+FINI_P(900) static void metrics_fini()
+{
+	struct metrics_slot *slot = metrics_slots, *next;
+	while (slot) {
+		next = slot->next;
+		free(slot);
+		slot = next;
+	}
+	metrics_slots = NULL;
+
+	local_storage_destroy(&metrics_localstorage);
+}
+
+int metric_size(const struct metric *metric)
+{
+	switch (metric->type) {
+	case METRIC_TYPE_HISTOGRAM: return metric->bucket_count + 3;
+	default:                    return 1;
+	}
+}
+
+bool metric_register(struct metric *metric)
+{
+	struct metric *iter;
+	const int size = metric_size(metric);
+
+	mutex_lock(&metrics_lock);
+
+	if (metric->offset >= 0) {
+		mutex_unlock(&metrics_lock);
+		return true;
+	}
+
+	/* The same metric can be declared by several modules */
+	for (iter = metrics; iter; iter = iter->next) {
+		if (strcmp(iter->name, metric->name) == 0) {
+			if (iter->type != metric->type || metric_size(iter) != size) {
+				mutex_unlock(&metrics_lock);
+				error("metric %s already registered with a different type", metric->name);
+				return false;
+			}
+
+			metric->offset = iter->offset;
+			mutex_unlock(&metrics_lock);
+			return true;
+		}
+	}
+
+	if (metrics_size + size > METRICS_MAX_VALUES) {
+		mutex_unlock(&metrics_lock);
+		error("too many metrics");
+		return false;
+	}
+
+	metric->next = NULL;
+	metric->offset = metrics_size;
+	metrics_size += size;
+
+	/* Publish the metric only once it is fully initialized, readers
+	 * walk the list without the lock */
+	__sync_synchronize();
+	if (metrics_last) metrics_last->next = metric;
+	else metrics = metric;
+	metrics_last = metric;
+
+	mutex_unlock(&metrics_lock);
+
+	LOG_DEBUG(core, "registered metric %s", metric->name);
+	return true;
+}
+
+uint64 *metrics_thread_values()
+{
+	struct metrics_slot *slot = local_storage_get(&metrics_localstorage);
+	if (!slot) {
+		struct engine_thread *engine = engine_thread_current();
+
+		if (posix_memalign((void **)&slot, CACHE_LINE_SIZE, sizeof(struct metrics_slot))) {
+			return NULL;
+		}
+
+		memset(slot, 0, sizeof(struct metrics_slot));
+		slot->thread = engine ? engine_thread_id(engine) : METRICS_OTHER_THREADS;
+
+		mutex_lock(&metrics_lock);
+		slot->next = metrics_slots;
+		__sync_synchronize();
+		metrics_slots = slot;
+		mutex_unlock(&metrics_lock);
+
+		local_storage_set(&metrics_localstorage, slot);
+	}
+
+	return slot->values;
+}
+
+void metric_read(const struct metric *metric, int thread, uint64 *values)
+{
+	struct metrics_slot *slot;
+	const int size = metric_size(metric);
+	int i;
+
+	memset(values, 0, size * sizeof(uint64));
+
+	if (metric->offset < 0) {
+		return;
+	}
+
+	/* Slots are only prepended and never freed while running, the
+	 * readers do not need the lock used by the threads to register
+	 * their slot */
+	for (slot = metrics_slots; slot; slot = slot->next) {
+		if (thread == METRICS_ALL_THREADS || slot->thread == thread) {
+			for (i=0; i<size; ++i) {
+				values[i] += slot->values[metric->offset + i];
+			}
+		}
+	}
+}
+
+void metrics_foreach(void (*callback)(struct metric *metric, void *data), void *data)
+{
+	struct metric *iter;
+
+	/* Metrics are only appended, the list can be walked without the lock */
+	for (iter = metrics; iter; iter = iter->next) {
+		callback(iter, data);
+	}
+}
+
+void metrics_foreach_thread(void (*callback)(int thread, void *data), void *data)
+{
+	struct metrics_slot *slot;
+
+	for (slot = metrics_slots; slot; slot = slot->next) {
+		callback(slot->thread, data);
+	}
+}
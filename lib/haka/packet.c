@@ -14,6 +14,7 @@
 #include <haka/timer.h>
 #include <haka/capture_module.h>
 #include <haka/engine.h>
+#include <haka/packet_trace.h>
 
 
 static struct capture_module *capture_module = NULL;
@@ -125,6 +126,7 @@ int packet_receive(struct engine_thread *engine, struct packet **pkt)
 		lua_ref_init(&(*pkt)->next_dissector);
 		atomic_set(&(*pkt)->ref, 1);
 		assert(vbuffer_isvalid(&(*pkt)->payload));
+		packet_trace_begin(*pkt);
 		LOG_DEBUG(packet, "received packet id=%lli",
 				capture_module->get_id(*pkt));
 
@@ -148,14 +150,25 @@ int packet_receive(struct engine_thread *engine, struct packet **pkt)
 	return ret;
 }
 
+int packet_timer_fd()
+{
+	if (!network_time_inited || !is_realtime) return -1;
+	return time_realm_fd(&network_time);
+}
+
 void packet_drop(struct packet *pkt)
 {
+	int trace;
+
 	assert(capture_module);
 	assert(pkt);
 	LOG_DEBUG(packet, "dropping packet id=%lli",
 			capture_module->get_id(pkt));
 
+	trace = packet_trace_push("verdict");
+	packet_trace_verdict(pkt);
 	capture_module->verdict(pkt, FILTER_DROP);
+	packet_trace_pop(trace);
 
 	{
 		volatile struct packet_stats *stats = engine_thread_statistics(engine_thread_current());
@@ -165,6 +178,8 @@ void packet_drop(struct packet *pkt)
 
 void packet_accept(struct packet *pkt)
 {
+	int trace;
+
 	assert(capture_module);
 	assert(pkt);
 
@@ -179,7 +194,10 @@ void packet_accept(struct packet *pkt)
 		}
 	}
 
+	trace = packet_trace_push("verdict");
+	packet_trace_verdict(pkt);
 	capture_module->verdict(pkt, FILTER_ACCEPT);
+	packet_trace_pop(trace);
 }
 
 void packet_addref(struct packet *pkt)
@@ -220,6 +238,7 @@ struct packet *packet_new(size_t size)
 	lua_ref_init(&pkt->userdata);
 	lua_ref_init(&pkt->next_dissector);
 	atomic_set(&pkt->ref, 1);
+	pkt->trace_start = 0;
 	assert(vbuffer_isvalid(&pkt->payload));
 
 	return pkt;
@@ -279,6 +298,15 @@ const struct time *packet_timestamp(struct packet *pkt)
 	return capture_module->get_timestamp(pkt);
 }
 
+enum packet_checksum packet_checksum_status(struct packet *pkt)
+{
+	assert(capture_module);
+	assert(pkt);
+
+	if (!capture_module->get_checksum) return CHECKSUM_UNKNOWN;
+	return capture_module->get_checksum(pkt);
+}
+
 uint64 packet_id(struct packet *pkt)
 {
 	assert(capture_module);
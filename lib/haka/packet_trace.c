@@ -0,0 +1,300 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <haka/packet_trace.h>
+#include <haka/packet.h>
+#include <haka/metrics.h>
+#include <haka/thread.h>
+#include <haka/error.h>
+#include <haka/log.h>
+
+
+#define TRACE_CALIBRATION    10000000 /* ns */
+#define TRACE_MAX_DEPTH      16
+#define STAGE_NAME_SIZE      48
+#define STAGE_RECEIVE        0
+
+struct packet_trace_stage {
+	char                   name[STAGE_NAME_SIZE];
+	char                   metric_name[STAGE_NAME_SIZE+16];
+	struct metric          metric;
+};
+
+struct packet_trace_state {
+	uint32                 counter;
+	bool                   active;
+	uint64                 last;
+	int                    depth;
+	int                    stack[TRACE_MAX_DEPTH];
+	uint32                 used;
+	uint64                 time[PACKET_TRACE_MAX_STAGES];
+};
+
+/* Latency bounds (in ns) */
+static const uint64 trace_bounds[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000, 10000000, 50000000
+};
+
+static struct metric trace_total = METRIC_HISTOGRAM("latency_total_ns",
+	"Time from the packet reception to its verdict in nanoseconds", trace_bounds);
+
+static struct packet_trace_stage stages[PACKET_TRACE_MAX_STAGES];
+static volatile int stage_count = 0;
+static mutex_t stage_lock = MUTEX_INIT;
+static int trace_sampling = 0;
+static double trace_ns_per_tick = 1.;
+static local_storage_t trace_localstorage;
+
+static void packet_trace_state_delete(void *state)
+{
+	free(state);
+}
+
+INIT static void packet_trace_init()
+{
+	local_storage_init(&trace_localstorage, packet_trace_state_delete);
+}
+
+FINI static void packet_trace_fini()
+{
+	local_storage_destroy(&trace_localstorage);
+}
+
+#if !defined(__x86_64__) && !defined(__i386__)
+uint64 packet_trace_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static int packet_trace_stage(const char *name)
+{
+	struct packet_trace_stage *stage;
+	const int count = stage_count;
+	char *iter;
+	int i;
+
+	if (strlen(name) >= STAGE_NAME_SIZE) {
+		name = "other";
+	}
+
+	for (i=0; i<count; ++i) {
+		if (strcmp(stages[i].name, name) == 0) return i;
+	}
+
+	mutex_lock(&stage_lock);
+
+	for (i=count; i<stage_count; ++i) {
+		if (strcmp(stages[i].name, name) == 0) {
+			mutex_unlock(&stage_lock);
+			return i;
+		}
+	}
+
+	if (stage_count >= PACKET_TRACE_MAX_STAGES) {
+		mutex_unlock(&stage_lock);
+		return -1;
+	}
+
+	stage = &stages[stage_count];
+	strcpy(stage->name, name);
+	snprintf(stage->metric_name, sizeof(stage->metric_name), "latency_%s_ns", name);
+
+	/* Keep valid metric names */
+	for (iter = stage->metric_name; *iter; ++iter) {
+		if (!isalnum((unsigned char)*iter) && *iter != '_') *iter = '_';
+	}
+
+	stage->metric = (struct metric)METRIC_HISTOGRAM(stage->metric_name,
+		"Time spent in a packet processing stage in nanoseconds", trace_bounds);
+
+	/* Publish the stage once initialized, the lookup is done without the lock */
+	__sync_synchronize();
+	i = stage_count++;
+
+	mutex_unlock(&stage_lock);
+	return i;
+}
+
+static void packet_trace_calibrate()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec start, end;
+	const struct timespec delay = { 0, TRACE_CALIBRATION };
+	uint64 start_tick, end_tick;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	start_tick = packet_trace_clock();
+
+	nanosleep(&delay, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end_tick = packet_trace_clock();
+
+	elapsed = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	if (end_tick > start_tick) {
+		trace_ns_per_tick = elapsed / (end_tick - start_tick);
+	}
+
+	LOG_DEBUG(core, "trace clock calibrated to %f ns per tick", trace_ns_per_tick);
+#endif
+}
+
+void packet_trace_set_sampling(int sampling)
+{
+	if (sampling > 0 && trace_sampling == 0) {
+		packet_trace_calibrate();
+
+		packet_trace_stage("receive");
+		packet_trace_stage("verdict");
+	}
+
+	trace_sampling = sampling > 0 ? sampling : 0;
+}
+
+bool packet_trace_enabled()
+{
+	return trace_sampling > 0;
+}
+
+static struct packet_trace_state *packet_trace_getstate()
+{
+	struct packet_trace_state *state = local_storage_get(&trace_localstorage);
+	if (!state) {
+		state = malloc(sizeof(struct packet_trace_state));
+		if (!state) {
+			return NULL;
+		}
+
+		memset(state, 0, sizeof(struct packet_trace_state));
+		local_storage_set(&trace_localstorage, state);
+	}
+	return state;
+}
+
+static void packet_trace_charge(struct packet_trace_state *state, uint64 now)
+{
+	const int stage = state->stack[state->depth-1];
+
+	if (!(state->used & (1U << stage))) {
+		state->used |= 1U << stage;
+		state->time[stage] = 0;
+	}
+
+	state->time[stage] += now - state->last;
+	state->last = now;
+}
+
+void packet_trace_begin(struct packet *pkt)
+{
+	struct packet_trace_state *state;
+
+	pkt->trace_start = 0;
+
+	if (!trace_sampling) return;
+
+	state = packet_trace_getstate();
+	if (!state || state->active) return;
+
+	if (++state->counter < trace_sampling) return;
+	state->counter = 0;
+
+	state->active = true;
+	state->last = packet_trace_clock();
+	state->depth = 1;
+	state->stack[0] = STAGE_RECEIVE;
+	state->used = 0;
+
+	pkt->trace_start = state->last;
+}
+
+void packet_trace_end()
+{
+	struct packet_trace_state *state;
+	int i;
+
+	if (!trace_sampling) return;
+
+	state = local_storage_get(&trace_localstorage);
+	if (!state || !state->active) return;
+
+	packet_trace_charge(state, packet_trace_clock());
+
+	for (i=0; i<stage_count; ++i) {
+		if (state->used & (1U << i)) {
+			metric_observe(&stages[i].metric, state->time[i] * trace_ns_per_tick);
+		}
+	}
+
+	state->active = false;
+}
+
+int packet_trace_push(const char *name)
+{
+	struct packet_trace_state *state;
+	int stage;
+
+	if (!trace_sampling) return 0;
+
+	state = local_storage_get(&trace_localstorage);
+	if (!state || !state->active || state->depth >= TRACE_MAX_DEPTH) return 0;
+
+	stage = packet_trace_stage(name);
+	if (stage < 0) return 0;
+
+	packet_trace_charge(state, packet_trace_clock());
+	state->stack[state->depth++] = stage;
+	return state->depth;
+}
+
+void packet_trace_pop(int depth)
+{
+	struct packet_trace_state *state;
+
+	if (depth <= 0) return;
+
+	state = local_storage_get(&trace_localstorage);
+	if (!state || !state->active || depth > state->depth) return;
+
+	/* The stages pushed after this one might not have been popped if an
+	 * error was raised */
+	packet_trace_charge(state, packet_trace_clock());
+	state->depth = depth-1;
+}
+
+void packet_trace_unwind()
+{
+	/* Only keep the receive stage at the bottom of the stack */
+	packet_trace_pop(2);
+}
+
+void packet_trace_verdict(struct packet *pkt)
+{
+	if (pkt->trace_start) {
+		metric_observe(&trace_total, (packet_trace_clock() - pkt->trace_start) * trace_ns_per_tick);
+		pkt->trace_start = 0;
+	}
+}
+
+void packet_trace_foreach(void (*callback)(const char *stage, struct metric *metric, void *data), void *data)
+{
+	const int count = stage_count;
+	int i;
+
+	for (i=0; i<count; ++i) {
+		callback(stages[i].name, &stages[i].metric, data);
+	}
+
+	callback("total", &trace_total, data);
+}
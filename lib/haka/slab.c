@@ -0,0 +1,317 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+
+#include <haka/slab.h>
+#include <haka/container/mpsc.h>
+#include <haka/container/list2.h>
+#include <haka/compiler.h>
+#include <haka/error.h>
+
+
+#define SLAB_PAGE_SIZE      16384
+#define SLAB_RESERVE_PAGES  4      /* Free pages kept by each thread */
+
+struct slab_page {
+	struct list2_elem          list;
+	struct slab               *owner;
+	struct mpsc_elem          *free;
+	size_t                     used;     /* Number of allocated objects */
+	size_t                     size;     /* Bytes allocated from the system */
+};
+
+struct slab_object {
+	struct slab_page          *page;
+	struct mpsc_elem           elem;     /* start of the user data */
+};
+
+struct slab {
+	struct slab_cache         *cache;
+	struct list2               partial;  /* Pages with some free objects, the fully free ones last */
+	struct list2               full;
+	size_t                     empty;    /* Number of fully free pages */
+	size_t                     bytes;
+	struct slab               *next;
+	struct slab               *next_orphan;
+	struct mpsc                remote CACHE_ALIGNED;
+};
+
+static mutex_t slab_caches_lock = MUTEX_INIT;
+static struct slab_cache *slab_caches = NULL;
+
+static size_t slab_stride(const struct slab_cache *cache)
+{
+	size_t size = cache->size;
+	if (size < sizeof(struct mpsc_elem)) size = sizeof(struct mpsc_elem);
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	return offsetof(struct slab_object, elem) + size;
+}
+
+static void slab_release_page(struct slab *slab, struct slab_page *page)
+{
+	list2_erase(&page->list);
+	slab->bytes -= page->size;
+	free(page);
+
+	metric_inc(&slab->cache->released);
+}
+
+/* Give an object back to its page, must be called by the thread owning
+ * the slab */
+static void slab_put(struct slab *slab, struct slab_object *obj, size_t reserve)
+{
+	struct slab_page *page = obj->page;
+
+	if (!page->free) {
+		list2_erase(&page->list);
+		list2_insert(list2_begin(&slab->partial), &page->list);
+	}
+
+	obj->elem.next = page->free;
+	page->free = &obj->elem;
+
+	if (--page->used == 0) {
+		if (slab->empty >= reserve) {
+			slab_release_page(slab, page);
+		}
+		else {
+			/* The fully free pages are used last to give them a
+			 * chance to be released */
+			list2_erase(&page->list);
+			list2_insert(list2_end(&slab->partial), &page->list);
+			++slab->empty;
+		}
+	}
+}
+
+static void slab_put_remote(struct slab *slab, size_t reserve)
+{
+	struct mpsc_elem *elem = mpsc_popall(&slab->remote);
+
+	while (elem) {
+		struct mpsc_elem *next = elem->next;
+		slab_put(slab, mpsc_get(elem, struct slab_object, elem), reserve);
+		elem = next;
+	}
+}
+
+static void slab_orphan(void *_slab)
+{
+	struct slab *slab = _slab;
+	struct slab_cache *cache = slab->cache;
+
+	/* The free pages are not needed anymore, the other objects of the
+	 * thread stay valid and another thread will take over the slab */
+	slab_put_remote(slab, 0);
+	while (slab->empty > 0) {
+		struct slab_page *page = list2_last(&slab->partial, struct slab_page, list);
+		assert(page && page->used == 0);
+
+		slab_release_page(slab, page);
+		--slab->empty;
+	}
+
+	mutex_lock(&cache->lock);
+	slab->next_orphan = cache->orphans;
+	cache->orphans = slab;
+	mutex_unlock(&cache->lock);
+}
+
+bool slab_cache_init(struct slab_cache *cache)
+{
+	cache->slabs = NULL;
+	cache->orphans = NULL;
+	if (!local_storage_init(&cache->key, slab_orphan)) {
+		return false;
+	}
+
+	mutex_lock(&slab_caches_lock);
+	cache->next = slab_caches;
+	slab_caches = cache;
+	mutex_unlock(&slab_caches_lock);
+
+	return true;
+}
+
+static void slab_free_pages(struct list2 *pages)
+{
+	while (!list2_empty(pages)) {
+		struct slab_page *page = list2_first(pages, struct slab_page, list);
+		list2_erase(&page->list);
+		free(page);
+	}
+}
+
+void slab_cache_destroy(struct slab_cache *cache)
+{
+	struct slab *slab = cache->slabs, *next;
+	struct slab_cache **iter;
+
+	mutex_lock(&slab_caches_lock);
+	for (iter = &slab_caches; *iter; iter = &(*iter)->next) {
+		if (*iter == cache) {
+			*iter = cache->next;
+			break;
+		}
+	}
+	mutex_unlock(&slab_caches_lock);
+
+	while (slab) {
+		slab_free_pages(&slab->partial);
+		slab_free_pages(&slab->full);
+
+		next = slab->next;
+		free(slab);
+		slab = next;
+	}
+
+	cache->slabs = NULL;
+	cache->orphans = NULL;
+	local_storage_destroy(&cache->key);
+	mutex_destroy(&cache->lock);
+}
+
+size_t slab_thread_memory()
+{
+	struct slab_cache *cache;
+	size_t bytes = 0;
+
+	mutex_lock(&slab_caches_lock);
+	for (cache = slab_caches; cache; cache = cache->next) {
+		struct slab *slab = local_storage_get(&cache->key);
+		if (slab) bytes += slab->bytes;
+	}
+	mutex_unlock(&slab_caches_lock);
+
+	return bytes;
+}
+
+static struct slab *slab_get(struct slab_cache *cache)
+{
+	struct slab *slab = local_storage_get(&cache->key);
+	if (slab) return slab;
+
+	mutex_lock(&cache->lock);
+
+	if (cache->orphans) {
+		slab = cache->orphans;
+		cache->orphans = slab->next_orphan;
+	}
+	else {
+		if (posix_memalign((void **)&slab, CACHE_LINE_SIZE, sizeof(struct slab))) {
+			mutex_unlock(&cache->lock);
+			error("memory error");
+			return NULL;
+		}
+
+		slab->cache = cache;
+		list2_init(&slab->partial);
+		list2_init(&slab->full);
+		slab->empty = 0;
+		slab->bytes = 0;
+		mpsc_init(&slab->remote);
+
+		slab->next = cache->slabs;
+		cache->slabs = slab;
+	}
+
+	slab->next_orphan = NULL;
+
+	mutex_unlock(&cache->lock);
+
+	local_storage_set(&cache->key, slab);
+	return slab;
+}
+
+static bool slab_grow(struct slab *slab)
+{
+	const size_t stride = slab_stride(slab->cache);
+	size_t count = (SLAB_PAGE_SIZE - sizeof(struct slab_page)) / stride;
+	struct slab_page *page;
+	uint8 *iter;
+
+	if (count == 0) count = 1;
+
+	page = malloc(sizeof(struct slab_page) + count * stride);
+	if (!page) {
+		error("memory error");
+		return false;
+	}
+
+	list2_elem_init(&page->list);
+	page->owner = slab;
+	page->free = NULL;
+	page->used = 0;
+	page->size = sizeof(struct slab_page) + count * stride;
+
+	for (iter = (uint8 *)(page + 1); count > 0; --count, iter += stride) {
+		struct slab_object *obj = (struct slab_object *)iter;
+		obj->page = page;
+		obj->elem.next = page->free;
+		page->free = &obj->elem;
+	}
+
+	list2_insert(list2_begin(&slab->partial), &page->list);
+	++slab->empty;
+	slab->bytes += page->size;
+
+	metric_inc(&slab->cache->pages);
+	return true;
+}
+
+void *slab_alloc(struct slab_cache *cache)
+{
+	struct mpsc_elem *elem;
+	struct slab_page *page;
+	struct slab *slab = slab_get(cache);
+	if (!slab) return NULL;
+
+	if (list2_empty(&slab->partial)) {
+		/* The objects freed by the other threads are about to be
+		 * reused, their pages are all kept */
+		slab_put_remote(slab, (size_t)-1);
+		if (list2_empty(&slab->partial) && !slab_grow(slab)) {
+			return NULL;
+		}
+	}
+
+	page = list2_first(&slab->partial, struct slab_page, list);
+
+	elem = page->free;
+	page->free = elem->next;
+
+	if (page->used++ == 0) {
+		--slab->empty;
+	}
+
+	if (!page->free) {
+		list2_erase(&page->list);
+		list2_insert(list2_end(&slab->full), &page->list);
+	}
+
+	metric_inc(&cache->allocs);
+	return elem;
+}
+
+void slab_free(void *ptr)
+{
+	struct slab_object *obj;
+	struct slab *slab;
+
+	if (!ptr) return;
+
+	obj = mpsc_get(ptr, struct slab_object, elem);
+	slab = obj->page->owner;
+
+	if (local_storage_get(&slab->cache->key) == slab) {
+		slab_put(slab, obj, SLAB_RESERVE_PAGES);
+	}
+	else {
+		mpsc_push(&slab->remote, &obj->elem);
+		metric_inc(&slab->cache->remote_frees);
+	}
+}
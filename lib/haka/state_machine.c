@@ -59,20 +59,16 @@ struct state_machine_instance {
 	struct state_machine         *state_machine;
 	struct state                 *current;
 	struct state_machine_context *context;
-	struct vector                 timers;
-	int                           used_timer;
+	struct timer                 *timer;          /* Shared by all the timeout transitions */
+	struct time                   timer_deadline; /* Armed deadline, invalid if the timer is stopped */
+	struct vector                 deadlines;      /* Deadline of each timeout transition of the state */
+	int                           used_deadline;
 	bool                          in_transition:1;
 	bool                          finished:1;
 	bool                          failed:1;
 	bool                          in_failure:1;
 };
 
-struct timeout_data {
-	struct timer                  *timer;
-	struct state_machine_instance *instance;
-	int                            timer_index;
-};
-
 
 /*
  * State
@@ -300,12 +296,6 @@ bool state_machine_set_initial(struct state_machine *machine, struct state *init
  * State machine instance
  */
 
-void timeout_data_destroy(void *_elem)
-{
-	struct timeout_data *elem = (struct timeout_data *)_elem;
-	timer_destroy(elem->timer);
-}
-
 static bool have_transition(struct state_machine_instance *instance, struct transition *trans)
 {
 	return trans->callback && trans->callback->callback;
@@ -322,12 +312,9 @@ static struct state *state_machine_leave_state(struct state_machine_instance *in
 	struct state *newstate = NULL;
 
 	if (instance->current) {
-		int i;
-		for (i=0; i<instance->used_timer; ++i) {
-			struct timeout_data *t = vector_get(&instance->timers, struct timeout_data, i);
-			assert(t);
-			timer_stop(t->timer);
-		}
+		/* The timer is left armed, it will be ignored or moved when
+		 * it triggers. */
+		instance->used_deadline = 0;
 
 		if (have_transition(instance, &instance->current->leave)) {
 			LOG_DEBUG(MODULE, "%s: leave transition on state '%s'",
@@ -341,28 +328,111 @@ static struct state *state_machine_leave_state(struct state_machine_instance *in
 	return newstate;
 }
 
+static void transition_timeout(int count, void *_data);
+
+/*
+ * Arm the timer for the earliest deadline. The timer is only moved when this
+ * deadline is earlier than the armed one, otherwise it will trigger too early
+ * and be armed again from transition_timeout().
+ */
+static bool state_machine_arm_timer(struct state_machine_instance *instance, const struct time *now)
+{
+	struct time *earliest = NULL;
+	struct time delay;
+	int i;
+
+	for (i=0; i<instance->used_deadline; ++i) {
+		struct time *deadline = vector_get(&instance->deadlines, struct time, i);
+		if (!earliest || time_cmp(deadline, earliest) < 0) {
+			earliest = deadline;
+		}
+	}
+
+	if (!earliest) {
+		return true;
+	}
+
+	if (time_isvalid(&instance->timer_deadline) &&
+	    time_cmp(&instance->timer_deadline, earliest) <= 0) {
+		return true;
+	}
+
+	if (!instance->timer) {
+		instance->timer = time_realm_timer(&network_time, transition_timeout, instance);
+		if (!instance->timer) {
+			return false;
+		}
+	}
+
+	if (time_diff(&delay, earliest, now) <= 0) {
+		/* Already expired, trigger as soon as possible */
+		delay.secs = 0;
+		delay.nsecs = 1;
+	}
+
+	if (!timer_once(instance->timer, &delay)) {
+		return false;
+	}
+
+	instance->timer_deadline = *earliest;
+	return true;
+}
+
 static void transition_timeout(int count, void *_data)
 {
-	struct transition *trans;
-	struct timeout_data *data = (struct timeout_data *)_data;
-	assert(data);
-	assert(data->timer_index < data->instance->used_timer);
+	struct state_machine_instance *instance = (struct state_machine_instance *)_data;
+	struct state *state;
+	const struct time now = *time_realm_current_time(&network_time);
+	int i;
 
-	if (!data->instance->in_transition) {
-		struct state *newstate;
-		assert(data->instance->current);
+	assert(instance);
 
-		trans = vector_get(&data->instance->current->timeouts, struct transition, data->timer_index);
-		assert(trans);
+	instance->timer_deadline = invalid_time;
 
-		LOG_DEBUG(MODULE, "%s: timeout trigger on state '%s'",
-				data->instance->state_machine->name, data->instance->current->name);
+	state = instance->current;
+	if (!state) {
+		return;
+	}
 
-		newstate = do_transition(data->instance, trans);
-		if (newstate) {
-			state_machine_instance_update(data->instance, newstate);
+	if (!instance->in_transition) {
+		for (i=0; i<instance->used_deadline; ++i) {
+			struct time *deadline = vector_get(&instance->deadlines, struct time, i);
+			struct transition *trans;
+			struct state *newstate;
+			struct time offset;
+			uint64 missed;
+
+			if (time_cmp(deadline, &now) > 0) {
+				continue;
+			}
+
+			trans = vector_get(&state->timeouts, struct transition, i);
+			assert(trans);
+
+			/* The timeout transitions repeat as long as the state is active */
+			time_diff(&offset, &now, deadline);
+			missed = time_divide(&offset, &trans->timeout) + 1;
+			time_mult(&offset, &trans->timeout, missed);
+			time_add(deadline, deadline, &offset);
+
+			LOG_DEBUG(MODULE, "%s: timeout trigger on state '%s'",
+					instance->state_machine->name, state->name);
+
+			newstate = do_transition(instance, trans);
+			if (newstate) {
+				state_machine_instance_update(instance, newstate);
+			}
+
+			if (instance->current != state) {
+				/* The timer was armed again by the new state if needed */
+				return;
+			}
 		}
 	}
+
+	if (!state_machine_arm_timer(instance, &now)) {
+		LOG_ERROR(MODULE, "%s", clear_error());
+	}
 }
 
 static void state_machine_enter_state(struct state_machine_instance *instance, struct state *state)
@@ -395,53 +465,36 @@ static void state_machine_enter_state(struct state_machine_instance *instance, s
 				}
 			}
 
-			/* Create missing timers */
-			{
-				const int tcount = vector_count(&instance->timers);
+			/* Store the timeout deadlines, the timer is only moved if needed */
+			if (count > 0) {
+				const struct time now = *time_realm_current_time(&network_time);
 				int i;
 
-				if (count > tcount) {
-					vector_reserve(&instance->timers, count);
-				}
-
-				for (i=tcount; i<count; ++i) {
-					struct timeout_data *timer = vector_push(&instance->timers, struct timeout_data);
-					if (!timer) {
-						LOG_ERROR(MODULE, "%s", clear_error());
-						state_machine_leave_state(instance);
-						return;
-					}
-
-					timer->instance = instance;
-					timer->timer_index = i;
-
-					timer->timer = time_realm_timer(&network_time, transition_timeout, timer);
-					if (!timer->timer) {
-						vector_pop(&instance->timers);
-						assert(check_error());
-						LOG_ERROR(MODULE, "%s", clear_error());
-						state_machine_leave_state(instance);
-						return;
-					}
+				if (!vector_reserve(&instance->deadlines, count) ||
+				    !vector_resize(&instance->deadlines, count)) {
+					LOG_ERROR(MODULE, "%s", clear_error());
+					state_machine_leave_state(instance);
+					return;
 				}
-			}
 
-			instance->used_timer = count;
-
-			/* Start timers */
-			{
-				int i;
 				for (i=0; i<count; ++i) {
-					struct timeout_data *timer = vector_get(&instance->timers, struct timeout_data, i);
+					struct time *deadline = vector_get(&instance->deadlines, struct time, i);
 					struct transition *trans = vector_get(&state->timeouts, struct transition, i);
 
 					assert(trans);
 					assert(trans->type == TRANSITION_TIMEOUT);
 
-					timer_repeat(timer->timer, &trans->timeout);
+					time_add(deadline, &now, &trans->timeout);
 				}
-			}
 
+				instance->used_deadline = count;
+
+				if (!state_machine_arm_timer(instance, &now)) {
+					LOG_ERROR(MODULE, "%s", clear_error());
+					state_machine_leave_state(instance);
+					return;
+				}
+			}
 		}
 	}
 
@@ -460,8 +513,10 @@ struct state_machine_instance *state_machine_instance(struct state_machine *stat
 	instance->state_machine = state_machine;
 	instance->current = NULL;
 	instance->context = context;
-	vector_create(&instance->timers, struct timeout_data, timeout_data_destroy);
-	instance->used_timer = 0;
+	instance->timer = NULL;
+	instance->timer_deadline = invalid_time;
+	vector_create(&instance->deadlines, struct time, NULL);
+	instance->used_deadline = 0;
 	instance->in_transition = false;
 	instance->finished = false;
 	instance->failed = false;
@@ -502,6 +557,11 @@ void state_machine_instance_finish(struct state_machine_instance *instance)
 
 		state_machine_leave_state(instance);
 
+		if (instance->timer) {
+			timer_stop(instance->timer);
+			instance->timer_deadline = invalid_time;
+		}
+
 		LOG_DEBUG(MODULE, "%s: finish from state '%s'",
 				instance->state_machine->name, current->name);
 
@@ -526,7 +586,11 @@ void state_machine_instance_destroy(struct state_machine_instance *instance)
 		instance->context->destroy(instance->context);
 	}
 
-	vector_destroy(&instance->timers);
+	if (instance->timer) {
+		timer_destroy(instance->timer);
+	}
+
+	vector_destroy(&instance->deadlines);
 	free(instance);
 }
 
@@ -0,0 +1,103 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <check.h>
+#include <haka/config.h>
+#include <haka/metrics.h>
+#include <haka/thread.h>
+
+
+static const uint64 bounds[] = { 10, 100, 1000 };
+
+static struct metric counter = METRIC_COUNTER("test_counter", "Test counter");
+static struct metric counter_alias = METRIC_COUNTER("test_counter", "Test counter");
+static struct metric gauge = METRIC_GAUGE("test_gauge", "Test gauge");
+static struct metric histogram = METRIC_HISTOGRAM("test_histogram", "Test histogram", bounds);
+
+static void *thread_count(void *param)
+{
+	int i;
+	for (i=0; i<1000; ++i) {
+		metric_inc(&counter);
+	}
+	return NULL;
+}
+
+START_TEST(test_counter)
+{
+	uint64 value;
+	thread_t thread;
+
+	metric_inc(&counter);
+	metric_add(&counter_alias, 10);
+
+	ck_assert_int_eq(counter.offset, counter_alias.offset);
+
+	metric_read(&counter, METRICS_ALL_THREADS, &value);
+	ck_assert_int_eq(value, 11);
+
+	ck_assert(thread_create(&thread, thread_count, NULL));
+	ck_assert(thread_join(thread, NULL));
+
+	metric_read(&counter, METRICS_ALL_THREADS, &value);
+	ck_assert_int_eq(value, 1011);
+}
+END_TEST
+
+START_TEST(test_gauge)
+{
+	uint64 value;
+
+	metric_inc(&gauge);
+	metric_inc(&gauge);
+	metric_dec(&gauge);
+
+	metric_read(&gauge, METRICS_ALL_THREADS, &value);
+	ck_assert_int_eq((int64)value, 1);
+}
+END_TEST
+
+START_TEST(test_histogram)
+{
+	uint64 values[6];
+
+	ck_assert_int_eq(metric_size(&histogram), 6);
+
+	metric_observe(&histogram, 5);
+	metric_observe(&histogram, 50);
+	metric_observe(&histogram, 500);
+	metric_observe(&histogram, 5000);
+	metric_observe(&histogram, 10);
+
+	metric_read(&histogram, METRICS_ALL_THREADS, values);
+	ck_assert_int_eq(values[0], 2);
+	ck_assert_int_eq(values[1], 1);
+	ck_assert_int_eq(values[2], 1);
+	ck_assert_int_eq(values[3], 1);
+	ck_assert_int_eq(values[4], 5565);
+	ck_assert_int_eq(values[5], 5);
+}
+END_TEST
+
+int main(int argc, char *argv[])
+{
+	int number_failed;
+
+	Suite *suite = suite_create("metrics");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, test_counter);
+	tcase_add_test(tcase, test_gauge);
+	tcase_add_test(tcase, test_histogram);
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+#ifdef HAKA_DEBUG
+	srunner_set_fork_status(runner, CK_NOFORK);
+#endif
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return number_failed;
+}
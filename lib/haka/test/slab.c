@@ -0,0 +1,167 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <string.h>
+#include <check.h>
+#include <haka/config.h>
+#include <haka/slab.h>
+#include <haka/thread.h>
+
+
+struct object {
+	int    value;
+	char   data[20];
+};
+
+static struct slab_cache cache = SLAB_CACHE("test", struct object);
+
+#define COUNT 10000
+
+static struct object *objects[COUNT];
+
+static uint64 read_counter(struct metric *metric)
+{
+	uint64 value;
+	metric_read(metric, METRICS_ALL_THREADS, &value);
+	return value;
+}
+
+START_TEST(test_reuse)
+{
+	struct object *obj, *obj2;
+	uint64 pages;
+
+	obj = slab_alloc(&cache);
+	ck_assert(obj != NULL);
+	obj->value = 42;
+	slab_free(obj);
+
+	pages = read_counter(&cache.pages);
+
+	/* The last freed object is reused first */
+	obj2 = slab_alloc(&cache);
+	ck_assert(obj == obj2);
+	slab_free(obj2);
+
+	ck_assert_int_eq(read_counter(&cache.pages), pages);
+}
+END_TEST
+
+START_TEST(test_many)
+{
+	int i;
+	uint64 allocs = read_counter(&cache.allocs);
+
+	for (i=0; i<COUNT; ++i) {
+		objects[i] = slab_alloc(&cache);
+		ck_assert(objects[i] != NULL);
+		objects[i]->value = i;
+		memset(objects[i]->data, i & 0xff, sizeof(objects[i]->data));
+	}
+
+	for (i=0; i<COUNT; ++i) {
+		ck_assert_int_eq(objects[i]->value, i);
+		ck_assert_int_eq(objects[i]->data[19], (char)(i & 0xff));
+	}
+
+	for (i=0; i<COUNT; ++i) {
+		slab_free(objects[i]);
+	}
+
+	ck_assert_int_eq(read_counter(&cache.allocs) - allocs, COUNT);
+	ck_assert(read_counter(&cache.pages) < COUNT / 10);
+}
+END_TEST
+
+START_TEST(test_release)
+{
+	int i;
+	uint64 released = read_counter(&cache.released);
+	size_t memory;
+
+	for (i=0; i<COUNT; ++i) {
+		objects[i] = slab_alloc(&cache);
+		ck_assert(objects[i] != NULL);
+	}
+
+	memory = slab_thread_memory();
+	ck_assert(memory >= COUNT * sizeof(struct object));
+
+	for (i=0; i<COUNT; ++i) {
+		slab_free(objects[i]);
+	}
+
+	/* Only a few free pages are kept */
+	ck_assert(read_counter(&cache.released) > released);
+	ck_assert(slab_thread_memory() < memory);
+}
+END_TEST
+
+static void *thread_free(void *param)
+{
+	int i;
+	for (i=0; i<COUNT; ++i) {
+		slab_free(objects[i]);
+	}
+	return NULL;
+}
+
+START_TEST(test_remote_free)
+{
+	int i;
+	thread_t thread;
+	uint64 remote = read_counter(&cache.remote_frees);
+	uint64 pages;
+
+	for (i=0; i<COUNT; ++i) {
+		objects[i] = slab_alloc(&cache);
+		ck_assert(objects[i] != NULL);
+	}
+
+	pages = read_counter(&cache.pages);
+
+	ck_assert(thread_create(&thread, thread_free, NULL));
+	ck_assert(thread_join(thread, NULL));
+
+	ck_assert_int_eq(read_counter(&cache.remote_frees) - remote, COUNT);
+
+	/* The objects freed by the other thread are reused */
+	for (i=0; i<COUNT; ++i) {
+		objects[i] = slab_alloc(&cache);
+		ck_assert(objects[i] != NULL);
+	}
+
+	ck_assert_int_eq(read_counter(&cache.pages), pages);
+
+	for (i=0; i<COUNT; ++i) {
+		slab_free(objects[i]);
+	}
+}
+END_TEST
+
+int main(int argc, char *argv[])
+{
+	int number_failed;
+
+	if (!slab_cache_init(&cache)) return 1;
+
+	Suite *suite = suite_create("slab");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, test_reuse);
+	tcase_add_test(tcase, test_many);
+	tcase_add_test(tcase, test_release);
+	tcase_add_test(tcase, test_remote_free);
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+#ifdef HAKA_DEBUG
+	srunner_set_fork_status(runner, CK_NOFORK);
+#endif
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	slab_cache_destroy(&cache);
+	return number_failed;
+}
@@ -0,0 +1,233 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdlib.h>
+#include <check.h>
+#include <haka/capture_module.h>
+#include <haka/packet.h>
+#include <haka/timer.h>
+#include <haka/state_machine.h>
+
+
+extern int set_capture_module(struct module *module);
+
+/*
+ * Capture module giving a static network time
+ */
+
+static bool is_realtime() { return false; }
+
+static struct capture_module test_capture = {
+	module: {
+		type:        MODULE_CAPTURE,
+		name:        "test",
+		api_version: HAKA_API_VERSION,
+	},
+	is_realtime:     is_realtime
+};
+
+/* The tests share the network time, each one starts at a later base */
+static double base = 0.;
+
+static void set_time(double secs)
+{
+	struct time time;
+	time_build(&time, base + secs);
+	time_realm_update_and_check(&network_time, &time);
+}
+
+/*
+ * Timeout transition counting its calls and jumping to a fixed state
+ */
+
+struct test_transition {
+	struct transition_data  data;
+	int                     count;
+	struct state           *jump;
+};
+
+static struct state *test_transition_callback(struct state_machine_instance *instance,
+		struct transition_data *data)
+{
+	struct test_transition *trans = (struct test_transition *)data;
+	++trans->count;
+	return trans->jump;
+}
+
+static void test_transition_destroy(struct transition_data *data)
+{
+	free(data);
+}
+
+static struct test_transition *add_timeout(struct state *state, double secs, struct state *jump)
+{
+	struct test_transition *trans = malloc(sizeof(struct test_transition));
+	struct time timeout;
+
+	ck_assert(trans != NULL);
+	trans->data.callback = test_transition_callback;
+	trans->data.destroy = test_transition_destroy;
+	trans->count = 0;
+	trans->jump = jump;
+
+	time_build(&timeout, secs);
+	ck_assert(state_add_timeout_transition(state, &timeout, &trans->data));
+	return trans;
+}
+
+static struct state_machine_instance *start(struct state_machine *machine, struct state *initial)
+{
+	struct state_machine_instance *instance;
+
+	ck_assert(state_machine_set_initial(machine, initial));
+	ck_assert(state_machine_compile(machine));
+
+	base += 1000.;
+	set_time(0.);
+
+	instance = state_machine_instance(machine, NULL);
+	ck_assert(instance != NULL);
+	state_machine_instance_init(instance);
+	return instance;
+}
+
+START_TEST(test_timeout)
+{
+	struct state_machine *machine = state_machine_create("timeout");
+	struct state *first = state_machine_create_state(machine, "first");
+	struct state *second = state_machine_create_state(machine, "second");
+	struct test_transition *trans = add_timeout(first, 2., second);
+	struct state_machine_instance *instance;
+
+	instance = start(machine, first);
+
+	set_time(1.9);
+	ck_assert_int_eq(trans->count, 0);
+	ck_assert(state_machine_instance_state(instance) == first);
+
+	set_time(2.1);
+	ck_assert_int_eq(trans->count, 1);
+	ck_assert(state_machine_instance_state(instance) == second);
+
+	state_machine_instance_destroy(instance);
+	state_machine_destroy(machine);
+}
+END_TEST
+
+START_TEST(test_timeout_earlier)
+{
+	struct state_machine *machine = state_machine_create("timeout");
+	struct state *first = state_machine_create_state(machine, "first");
+	struct state *second = state_machine_create_state(machine, "second");
+	struct test_transition *trans_first = add_timeout(first, 10., NULL);
+	struct test_transition *trans_second = add_timeout(second, 2., state_machine_finish_state);
+	struct state_machine_instance *instance;
+
+	instance = start(machine, first);
+
+	/* The timer armed for the first state must be moved sooner */
+	set_time(1.);
+	state_machine_instance_update(instance, second);
+
+	set_time(3.1);
+	ck_assert_int_eq(trans_second->count, 1);
+	ck_assert(state_machine_instance_isfinished(instance));
+
+	set_time(11.);
+	ck_assert_int_eq(trans_first->count, 0);
+
+	state_machine_instance_destroy(instance);
+	state_machine_destroy(machine);
+}
+END_TEST
+
+START_TEST(test_timeout_stale)
+{
+	struct state_machine *machine = state_machine_create("timeout");
+	struct state *first = state_machine_create_state(machine, "first");
+	struct state *second = state_machine_create_state(machine, "second");
+	struct test_transition *trans_first = add_timeout(first, 2., NULL);
+	struct test_transition *trans_second = add_timeout(second, 10., NULL);
+	struct state_machine_instance *instance;
+
+	instance = start(machine, first);
+
+	set_time(1.);
+	state_machine_instance_update(instance, second);
+
+	/* The timer armed for the first state triggers, nothing is done
+	 * and it is armed again for the second state */
+	set_time(3.);
+	ck_assert_int_eq(trans_first->count, 0);
+	ck_assert_int_eq(trans_second->count, 0);
+	ck_assert(state_machine_instance_state(instance) == second);
+
+	set_time(10.9);
+	ck_assert_int_eq(trans_second->count, 0);
+	set_time(11.1);
+	ck_assert_int_eq(trans_second->count, 1);
+	ck_assert_int_eq(trans_first->count, 0);
+
+	state_machine_instance_destroy(instance);
+	state_machine_destroy(machine);
+}
+END_TEST
+
+START_TEST(test_timeout_repeat)
+{
+	struct state_machine *machine = state_machine_create("timeout");
+	struct state *state = state_machine_create_state(machine, "state");
+	struct test_transition *trans = add_timeout(state, 1., NULL);
+	struct state_machine_instance *instance;
+
+	instance = start(machine, state);
+
+	set_time(1.);
+	ck_assert_int_eq(trans->count, 1);
+	set_time(2.);
+	ck_assert_int_eq(trans->count, 2);
+
+	/* The missed periods are skipped, the transition is only called
+	 * once and keeps its initial phase */
+	set_time(10.5);
+	ck_assert_int_eq(trans->count, 3);
+	set_time(10.9);
+	ck_assert_int_eq(trans->count, 3);
+	set_time(11.);
+	ck_assert_int_eq(trans->count, 4);
+
+	/* No more trigger once finished */
+	state_machine_instance_finish(instance);
+	set_time(20.);
+	ck_assert_int_eq(trans->count, 4);
+
+	state_machine_instance_destroy(instance);
+	state_machine_destroy(machine);
+}
+END_TEST
+
+int main(int argc, char *argv[])
+{
+	int number_failed;
+
+	set_capture_module(&test_capture.module);
+
+	Suite *suite = suite_create("state_machine");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, test_timeout);
+	tcase_add_test(tcase, test_timeout_earlier);
+	tcase_add_test(tcase, test_timeout_stale);
+	tcase_add_test(tcase, test_timeout_repeat);
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+#ifdef HAKA_DEBUG
+	srunner_set_fork_status(runner, CK_NOFORK);
+#endif
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return number_failed;
+}
@@ -0,0 +1,186 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <check.h>
+#include <haka/config.h>
+#include <haka/timer.h>
+
+
+static struct time_realm realm;
+
+static void set_time(double secs)
+{
+	struct time time;
+	time_build(&time, secs);
+	time_realm_update_and_check(&realm, &time);
+}
+
+static void count_callback(int count, void *data)
+{
+	*(int *)data += count;
+}
+
+static void stop_callback(int count, void *data)
+{
+	timer_stop((struct timer *)data);
+}
+
+START_TEST(test_once)
+{
+	int near = 0, middle = 0, far = 0;
+	struct timer *timer_near, *timer_middle, *timer_far;
+	struct time delay;
+
+	ck_assert(time_realm_initialize(&realm, TIME_REALM_STATIC));
+	set_time(1000.);
+
+	timer_near = time_realm_timer(&realm, count_callback, &near);
+	timer_middle = time_realm_timer(&realm, count_callback, &middle);
+	timer_far = time_realm_timer(&realm, count_callback, &far);
+
+	time_build(&delay, 0.010);
+	ck_assert(timer_once(timer_near, &delay));
+	time_build(&delay, 60.);
+	ck_assert(timer_once(timer_middle, &delay));
+	time_build(&delay, 100*86400.);
+	ck_assert(timer_once(timer_far, &delay));
+
+	set_time(1000.009);
+	ck_assert_int_eq(near, 0);
+	set_time(1000.011);
+	ck_assert_int_eq(near, 1);
+
+	set_time(1059.5);
+	ck_assert_int_eq(middle, 0);
+	set_time(1200.);
+	ck_assert_int_eq(middle, 1);
+
+	set_time(1000. + 99*86400.);
+	ck_assert_int_eq(far, 0);
+	set_time(1000. + 100*86400.);
+	ck_assert_int_eq(far, 1);
+
+	ck_assert_int_eq(near, 1);
+	ck_assert_int_eq(middle, 1);
+
+	timer_destroy(timer_near);
+	timer_destroy(timer_middle);
+	timer_destroy(timer_far);
+	ck_assert(time_realm_destroy(&realm));
+}
+END_TEST
+
+START_TEST(test_repeat)
+{
+	int count = 0;
+	struct timer *timer;
+	struct time delay;
+
+	ck_assert(time_realm_initialize(&realm, TIME_REALM_STATIC));
+	set_time(1000.);
+
+	timer = time_realm_timer(&realm, count_callback, &count);
+	time_build(&delay, 1.);
+	ck_assert(timer_repeat(timer, &delay));
+
+	set_time(1001.);
+	ck_assert_int_eq(count, 1);
+	set_time(1005.5);
+	ck_assert_int_eq(count, 5);
+
+	ck_assert(timer_stop(timer));
+	set_time(1010.);
+	ck_assert_int_eq(count, 5);
+
+	timer_destroy(timer);
+	ck_assert(time_realm_destroy(&realm));
+}
+END_TEST
+
+START_TEST(test_stop)
+{
+	int count = 0;
+	struct timer *timer, *stopper;
+	struct time delay;
+
+	ck_assert(time_realm_initialize(&realm, TIME_REALM_STATIC));
+	set_time(1000.);
+
+	timer = time_realm_timer(&realm, count_callback, &count);
+	stopper = time_realm_timer(&realm, stop_callback, timer);
+
+	/* Both timers expire on the same tick, the first one stops the other */
+	time_build(&delay, 2.);
+	ck_assert(timer_once(stopper, &delay));
+	ck_assert(timer_once(timer, &delay));
+
+	set_time(1003.);
+	ck_assert_int_eq(count, 0);
+
+	timer_destroy(timer);
+	timer_destroy(stopper);
+	ck_assert(time_realm_destroy(&realm));
+}
+END_TEST
+
+START_TEST(test_next_tick)
+{
+	int early = 0, late = 0;
+	struct timer *timer_early, *timer_late;
+	struct time delay;
+
+	ck_assert(time_realm_initialize(&realm, TIME_REALM_STATIC));
+	set_time(1000.);
+
+	timer_early = time_realm_timer(&realm, count_callback, &early);
+	timer_late = time_realm_timer(&realm, count_callback, &late);
+
+	time_build(&delay, 60.);
+	ck_assert(timer_once(timer_late, &delay));
+
+	/* Updates before the next expiry do not scan the wheel, a timer
+	 * started in between must still be triggered on time */
+	set_time(1001.);
+	time_build(&delay, 0.010);
+	ck_assert(timer_once(timer_early, &delay));
+	set_time(1001.011);
+	ck_assert_int_eq(early, 1);
+
+	/* Same after the late timer has been restarted sooner */
+	ck_assert(timer_stop(timer_late));
+	time_build(&delay, 2.);
+	ck_assert(timer_once(timer_late, &delay));
+	set_time(1002.);
+	ck_assert_int_eq(late, 0);
+	set_time(1003.5);
+	ck_assert_int_eq(late, 1);
+
+	timer_destroy(timer_early);
+	timer_destroy(timer_late);
+	ck_assert(time_realm_destroy(&realm));
+}
+END_TEST
+
+int main(int argc, char *argv[])
+{
+	int number_failed;
+
+	Suite *suite = suite_create("timer");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, test_once);
+	tcase_add_test(tcase, test_repeat);
+	tcase_add_test(tcase, test_stop);
+	tcase_add_test(tcase, test_next_tick);
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+#ifdef HAKA_DEBUG
+	srunner_set_fork_status(runner, CK_NOFORK);
+#endif
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return number_failed;
+}
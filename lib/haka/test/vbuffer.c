@@ -304,6 +304,255 @@ START_TEST(test_compact)
 }
 END_TEST
 
+/* Build a buffer made of many small chunks, each byte holds its offset */
+static void vbuffer_test_build_fragmented(struct vbuffer *buffer, size_t count)
+{
+	size_t i, j, offset = 0;
+
+	ck_assert(vbuffer_create_empty(buffer));
+	ck_check_error;
+
+	for (i=0; i<count; ++i) {
+		struct vbuffer chunk = vbuffer_init;
+		char data[8];
+		const size_t len = i % 8;
+
+		for (j=0; j<len; ++j) {
+			data[j] = (offset + j) & 0xff;
+		}
+		offset += len;
+
+		ck_assert(vbuffer_create_from(&chunk, data, len));
+		ck_check_error;
+
+		vbuffer_append(buffer, &chunk);
+		vbuffer_release(&chunk);
+	}
+}
+
+static void vbuffer_test_check_position(struct vbuffer *buffer, size_t first)
+{
+	const size_t size = vbuffer_size(buffer);
+	size_t offset;
+
+	for (offset=0; offset<=size; ++offset) {
+		struct vbuffer_iterator iter, ref;
+
+		vbuffer_position(buffer, &iter, offset);
+		vbuffer_begin(buffer, &ref);
+		vbuffer_iterator_advance(&ref, offset);
+
+		ck_assert(iter.chunk == ref.chunk);
+		ck_assert_int_eq(iter.offset, ref.offset);
+
+		if (offset < size) {
+			ck_assert_int_eq(vbuffer_iterator_getbyte(&iter), (first + offset) & 0xff);
+		}
+	}
+}
+
+START_TEST(test_position)
+{
+	struct vbuffer buffer = vbuffer_init, extract = vbuffer_init, more = vbuffer_init;
+	struct vbuffer_sub sub;
+
+	vbuffer_test_build_fragmented(&buffer, 200);
+	ck_assert_int_eq(vbuffer_size(&buffer), 25*28);
+	vbuffer_test_check_position(&buffer, 0);
+
+	/* Remove some data from the beginning */
+	vbuffer_sub_create(&sub, &buffer, 0, 50);
+	vbuffer_extract(&sub, &extract);
+	ck_check_error;
+	ck_assert_int_eq(vbuffer_size(&extract), 50);
+	ck_assert_int_eq(vbuffer_size(&buffer), 25*28-50);
+	vbuffer_test_check_position(&buffer, 50);
+	vbuffer_test_check_position(&extract, 0);
+
+	/* Append data at the end */
+	vbuffer_test_build_fragmented(&more, 40);
+	vbuffer_append(&buffer, &more);
+	vbuffer_release(&more);
+	ck_assert_int_eq(vbuffer_size(&buffer), 25*28-50+5*28);
+
+	/* Erase in the middle */
+	vbuffer_sub_create(&sub, &buffer, 100, 300);
+	vbuffer_erase(&sub);
+	vbuffer_sub_clear(&sub);
+	ck_check_error;
+	ck_assert_int_eq(vbuffer_size(&buffer), 25*28-50+5*28-300);
+
+	vbuffer_sub_create(&sub, &buffer, 0, 100);
+	vbuffer_extract(&sub, &more);
+	vbuffer_test_check_position(&more, 50);
+	vbuffer_release(&more);
+	ck_check_error;
+
+	vbuffer_release(&extract);
+	vbuffer_release(&buffer);
+	ck_check_error;
+}
+END_TEST
+
+START_TEST(test_find)
+{
+	struct vbuffer buffer = vbuffer_init, flat = vbuffer_init;
+	struct vbuffer_sub sub;
+	struct vbuffer_iterator iter;
+	static const uint8 straddle[] = { 5, 6, 7, 8, 9, 10 };
+	static const uint8 missing[] = { 9, 10, 11, 99 };
+	static const uint8 set[] = { 250, 7 };
+	char data[100];
+
+	vbuffer_test_build_fragmented(&buffer, 200);
+	vbuffer_sub_create(&sub, &buffer, 0, ALL);
+
+	ck_assert_int_eq(vbuffer_sub_find_byte(&sub, 200, &iter), 200);
+	ck_assert_int_eq(vbuffer_iterator_getbyte(&iter), 200);
+	ck_assert_int_eq(vbuffer_sub_find_set(&sub, set, sizeof(set), NULL), 7);
+
+	/* Literal spanning several chunks */
+	ck_assert_int_eq(vbuffer_sub_find_literal(&sub, straddle, sizeof(straddle), &iter), 5);
+	ck_assert_int_eq(vbuffer_iterator_getbyte(&iter), 5);
+	ck_assert_int_eq(vbuffer_sub_find_literal(&sub, missing, sizeof(missing), NULL), (size_t)-1);
+	vbuffer_sub_clear(&sub);
+
+	vbuffer_sub_create(&sub, &buffer, 300, ALL);
+	ck_assert_int_eq(vbuffer_sub_find_byte(&sub, 200, NULL), 456-300);
+	vbuffer_sub_clear(&sub);
+
+	/* Long memory block */
+	memset(data, 'a', sizeof(data));
+	data[70] = 'Z';
+	data[90] = (char)0xe9;
+	ck_assert(vbuffer_create_from(&flat, data, sizeof(data)));
+	vbuffer_sub_create(&sub, &flat, 0, ALL);
+	ck_assert_int_eq(vbuffer_sub_find_set(&sub, (const uint8 *)"XYZ", 3, NULL), 70);
+	ck_assert_int_eq(vbuffer_sub_find_set(&sub, (const uint8 *)"\xe9!", 2, NULL), 90);
+	ck_assert_int_eq(vbuffer_sub_find_set(&sub, (const uint8 *)"bcd", 3, NULL), (size_t)-1);
+	ck_assert_int_eq(vbuffer_sub_find_literal(&sub, (const uint8 *)"aZa", 3, NULL), 69);
+	vbuffer_sub_clear(&sub);
+
+	vbuffer_release(&flat);
+	vbuffer_release(&buffer);
+	ck_check_error;
+}
+END_TEST
+
+START_TEST(test_find_kernels)
+{
+	static const char *kernels[] = { "scalar", "sse4.2", "avx2" };
+	const char *initial = vbuffer_find_get_kernel();
+	struct vbuffer buffer = vbuffer_init, flat = vbuffer_init;
+	struct vbuffer_sub sub;
+	char data[100];
+	int i, pos;
+
+	ck_assert(!vbuffer_find_set_kernel("unknown"));
+	clear_error();
+
+	vbuffer_test_build_fragmented(&buffer, 200);
+	memset(data, 'a', sizeof(data));
+	ck_assert(vbuffer_create_from(&flat, data, sizeof(data)));
+
+	for (i=0; i<sizeof(kernels)/sizeof(kernels[0]); ++i) {
+		if (!vbuffer_find_set_kernel(kernels[i])) {
+			/* Not supported by this cpu */
+			clear_error();
+			continue;
+		}
+
+		ck_assert_str_eq(vbuffer_find_get_kernel(), kernels[i]);
+
+		vbuffer_sub_create(&sub, &buffer, 0, ALL);
+		ck_assert_int_eq(vbuffer_sub_find_set(&sub, (const uint8 *)"\xfa\x07", 2, NULL), 7);
+		ck_assert_int_eq(vbuffer_sub_find_set(&sub, (const uint8 *)"\xc8\xff", 2, NULL), 200);
+		vbuffer_sub_clear(&sub);
+
+		/* Match at every position, in the vector loop and in the tail */
+		vbuffer_sub_create(&sub, &flat, 0, ALL);
+		for (pos=0; pos<sizeof(data); ++pos) {
+			ck_assert(vbuffer_setbyte(&sub, pos, pos & 1 ? 'Z' : (char)0xe9));
+			ck_assert_int_eq(vbuffer_sub_find_set(&sub, (const uint8 *)"Z\xe9", 2, NULL), pos);
+			ck_assert(vbuffer_setbyte(&sub, pos, 'a'));
+		}
+		ck_assert_int_eq(vbuffer_sub_find_set(&sub, (const uint8 *)"bcd", 3, NULL), (size_t)-1);
+		vbuffer_sub_clear(&sub);
+	}
+
+	ck_assert(vbuffer_find_set_kernel(initial));
+
+	vbuffer_release(&flat);
+	vbuffer_release(&buffer);
+	ck_check_error;
+}
+END_TEST
+
+static int external_released;
+
+static void external_release(void *owner, const uint8 *ptr)
+{
+	ck_assert(owner == &external_released);
+	++external_released;
+}
+
+START_TEST(test_external)
+{
+	struct vbuffer buffer = vbuffer_init, clone = vbuffer_init;
+	struct vbuffer_sub sub;
+	struct vbuffer_data *handle;
+	uint8 data[] = "external data";
+	const uint8 *ptr;
+	size_t len;
+
+	external_released = 0;
+
+	/* Reading does not copy the memory */
+	ck_assert(vbuffer_create_external(&buffer, data, sizeof(data), external_release,
+		&external_released, &handle));
+	ptr = vbuffer_flatten(&buffer, &len);
+	ck_assert(ptr == data);
+	ck_assert_int_eq(len, sizeof(data));
+
+	/* Writing copies it */
+	vbuffer_sub_create(&sub, &buffer, 0, ALL);
+	ck_assert(vbuffer_setbyte(&sub, 0, 'E'));
+	vbuffer_sub_clear(&sub);
+	ck_assert_int_eq(data[0], 'e');
+	ptr = vbuffer_flatten(&buffer, &len);
+	ck_assert(ptr != data);
+	ck_assert_int_eq(ptr[0], 'E');
+
+	ck_assert(vbuffer_external_reclaim(handle));
+	ck_assert_int_eq(external_released, 1);
+	vbuffer_release(&buffer);
+	ck_assert_int_eq(external_released, 1);
+
+	/* Data still used when the owner reclaims the memory */
+	ck_assert(vbuffer_create_external(&buffer, data, sizeof(data), external_release,
+		&external_released, &handle));
+	ck_assert(vbuffer_clone(&buffer, &clone, false));
+	vbuffer_release(&buffer);
+
+	ck_assert(vbuffer_external_reclaim(handle));
+	ck_assert_int_eq(external_released, 2);
+	memset(data, 0, sizeof(data));
+
+	ptr = vbuffer_flatten(&clone, &len);
+	ck_assert(ptr != data);
+	ck_assert_int_eq(memcmp(ptr, "external data", sizeof(data)), 0);
+	vbuffer_release(&clone);
+
+	/* Without owner reference, the memory is given back with the last buffer */
+	ck_assert(vbuffer_create_external(&buffer, data, sizeof(data), external_release,
+		&external_released, NULL));
+	ck_assert_int_eq(external_released, 2);
+	vbuffer_release(&buffer);
+	ck_assert_int_eq(external_released, 3);
+	ck_check_error;
+}
+END_TEST
+
 START_TEST(test_number)
 {
 	static const int number = 0xdeadbeef;
@@ -509,6 +758,10 @@ int main(int argc, char *argv[])
 	tcase_add_test(tcase, test_select);
 	tcase_add_test(tcase, test_flatten);
 	tcase_add_test(tcase, test_compact);
+	tcase_add_test(tcase, test_position);
+	tcase_add_test(tcase, test_find);
+	tcase_add_test(tcase, test_find_kernels);
+	tcase_add_test(tcase, test_external);
 	tcase_add_test(tcase, test_number);
 	tcase_add_test(tcase, test_bits);
 	tcase_add_test(tcase, test_bits_endian);
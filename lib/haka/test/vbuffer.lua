@@ -76,4 +76,57 @@ function TestVBuffer:test_append_on_itself()
 	assertEquals(not success and msg, "circular buffer insertion")
 end
 
+function TestVBuffer:test_find()
+	local buf = haka.vbuffer_from("Hello ")
+	buf:append(haka.vbuffer_from("world"))
+
+	local iter, offset = buf:sub():find("o w")
+	assertEquals(offset, 4)
+	assertEquals(iter:sub(3):asstring(), "o w")
+
+	iter, offset = buf:sub(5):find_byte(string.byte("o"))
+	assertEquals(offset, 2)
+
+	iter, offset = buf:sub():find_set("wr")
+	assertEquals(offset, 6)
+
+	iter, offset = buf:sub():find("xyz")
+	assertEquals(iter, nil)
+	assertEquals(offset, -1)
+end
+
+function TestVBuffer:test_find_byte_range()
+	local buf = haka.vbuffer_from("Hello")
+
+	local success, msg = pcall(function () buf:sub():find_byte(256) end)
+	assertEquals(not success and msg, "byte out of range")
+
+	success, msg = pcall(function () buf:sub():find_byte(-1) end)
+	assertEquals(not success and msg, "byte out of range")
+end
+
+function TestVBuffer:test_iterator_find()
+	local buf = haka.vbuffer_from("Hello ")
+	buf:append(haka.vbuffer_from("world"))
+
+	local pos = buf:pos(2)
+	local iter, offset = pos:find("o w")
+	assertEquals(offset, 2)
+	assertEquals(iter:sub(3):asstring(), "o w")
+
+	iter, offset = pos:find_byte(string.byte("o"))
+	assertEquals(offset, 2)
+
+	iter, offset = pos:find_set("wH")
+	assertEquals(offset, 4)
+	assertEquals(pos:available(), 9)
+
+	iter, offset = buf:pos(5):find("Hello")
+	assertEquals(iter, nil)
+	assertEquals(offset, -1)
+
+	local success, msg = pcall(function () pos:find_byte(300) end)
+	assertEquals(not success and msg, "byte out of range")
+end
+
 addTestSuite('TestVBuffer')
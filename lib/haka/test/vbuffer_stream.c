@@ -3,6 +3,7 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include <stdio.h>
+#include <string.h>
 #include <check.h>
 #include <haka/vbuffer_stream.h>
 #include <haka/error.h>
@@ -169,6 +170,184 @@ START_TEST(test_eof)
 }
 END_TEST
 
+START_TEST(test_limit)
+{
+	int i;
+	struct vbuffer_stream stream, other;
+	struct vbuffer buffer;
+	const size_t global = vbuffer_stream_global_memory();
+	ck_assert(vbuffer_stream_init(&stream, NULL));
+	ck_assert(vbuffer_stream_init(&other, NULL));
+
+	stream.max_size = 500;
+
+	for (i=0; i<5; ++i) {
+		vbuffer_create_new(&buffer, 100, true);
+		ck_assert(vbuffer_stream_push(&stream, &buffer, NULL, NULL));
+		ck_assert(!stream.overflow);
+	}
+
+	ck_assert_int_eq(vbuffer_stream_memory(&stream), 500);
+	ck_assert_int_eq(vbuffer_stream_global_memory() - global, 500);
+
+	/* The buffer is kept by the caller on overflow */
+	vbuffer_create_new(&buffer, 1, true);
+	ck_assert(!vbuffer_stream_push(&stream, &buffer, NULL, NULL));
+	ck_assert(check_error());
+	clear_error();
+	ck_assert(stream.overflow);
+	ck_assert_int_eq(vbuffer_size(&buffer), 1);
+	vbuffer_release(&buffer);
+
+	/* Popped data does not count anymore */
+	ck_assert(vbuffer_stream_pop(&stream, &buffer, NULL));
+	vbuffer_clear(&buffer);
+	ck_assert_int_eq(vbuffer_stream_memory(&stream), 400);
+
+	vbuffer_create_new(&buffer, 100, true);
+	ck_assert(vbuffer_stream_push(&stream, &buffer, NULL, NULL));
+	ck_assert(!stream.overflow);
+
+	/* Limit shared by all the streams */
+	vbuffer_stream_set_global_limit(global + 600);
+	vbuffer_create_new(&buffer, 200, true);
+	ck_assert(!vbuffer_stream_push(&other, &buffer, NULL, NULL));
+	clear_error();
+	ck_assert(other.overflow);
+	vbuffer_stream_set_global_limit(0);
+	ck_assert(vbuffer_stream_push(&other, &buffer, NULL, NULL));
+
+	vbuffer_stream_clear(&stream);
+	vbuffer_stream_clear(&other);
+	ck_assert_int_eq(vbuffer_stream_global_memory(), global);
+	ck_check_error;
+}
+END_TEST
+
+static int count_chunks(struct vbuffer *buffer)
+{
+	struct vbuffer_sub sub;
+	struct vbuffer_sub_mmap iter = vbuffer_mmap_init;
+	size_t len;
+	int count = 0;
+
+	vbuffer_sub_create(&sub, buffer, 0, ALL);
+	while (vbuffer_mmap(&sub, &len, false, &iter, NULL)) {
+		++count;
+	}
+	vbuffer_sub_clear(&sub);
+	return count;
+}
+
+START_TEST(test_compact)
+{
+	int i;
+	struct vbuffer_stream stream;
+	struct vbuffer_iterator mark;
+	struct vbuffer_sub sub;
+	ck_assert(vbuffer_stream_init(&stream, NULL));
+
+	for (i=0; i<50; ++i) {
+		struct vbuffer buffer;
+		char data[10];
+		memset(data, i, sizeof(data));
+		vbuffer_create_from(&buffer, data, sizeof(data));
+
+		/* The read only mark keeps the data in the stream after the pop */
+		if (i == 0) {
+			vbuffer_begin(&buffer, &mark);
+			ck_assert(vbuffer_iterator_mark(&mark, true));
+		}
+
+		ck_assert(vbuffer_stream_push(&stream, &buffer, NULL, NULL));
+	}
+
+	for (i=0; i<50; ++i) {
+		struct vbuffer buffer;
+		ck_assert(vbuffer_stream_pop(&stream, &buffer, NULL));
+		ck_assert_int_eq(vbuffer_size(&buffer), 10);
+		vbuffer_clear(&buffer);
+	}
+
+	ck_assert_int_eq(vbuffer_stream_memory(&stream), 500);
+	ck_assert(count_chunks(vbuffer_stream_data(&stream)) < 5);
+
+	vbuffer_sub_create(&sub, vbuffer_stream_data(&stream), 0, ALL);
+	for (i=0; i<500; ++i) {
+		ck_assert_int_eq(vbuffer_getbyte(&sub, i), i/10);
+	}
+	vbuffer_sub_clear(&sub);
+
+	ck_assert(vbuffer_iterator_unmark(&mark));
+	vbuffer_stream_clear(&stream);
+	ck_check_error;
+}
+END_TEST
+
+static void check_positions(struct vbuffer *buffer, size_t first)
+{
+	const size_t size = vbuffer_size(buffer);
+	size_t offset;
+
+	for (offset=0; offset<size; ++offset) {
+		struct vbuffer_iterator iter, ref;
+
+		vbuffer_position(buffer, &iter, offset);
+		vbuffer_begin(buffer, &ref);
+		vbuffer_iterator_advance(&ref, offset);
+
+		ck_assert_int_eq(vbuffer_iterator_getbyte(&iter), (first + offset) & 0xff);
+		ck_assert_int_eq(vbuffer_iterator_getbyte(&ref), (first + offset) & 0xff);
+	}
+}
+
+START_TEST(test_position_interleaved)
+{
+	int i, j;
+	size_t pushed = 0, popped = 0;
+	struct vbuffer_stream stream;
+	ck_assert(vbuffer_stream_init(&stream, NULL));
+
+	/* The stream keeps growing at the end while being consumed at the
+	 * beginning, which is the pattern the offset index follows without
+	 * being rebuilt. Each byte holds its offset in the stream. */
+	for (i=0; i<20; ++i) {
+		for (j=0; j<5; ++j) {
+			struct vbuffer buffer;
+			char data[16];
+			const size_t len = (i + j) % 16 + 1;
+			size_t k;
+
+			for (k=0; k<len; ++k) {
+				data[k] = (pushed + k) & 0xff;
+			}
+			pushed += len;
+
+			ck_assert(vbuffer_create_from(&buffer, data, len));
+			ck_assert(vbuffer_stream_push(&stream, &buffer, NULL, NULL));
+			ck_check_error;
+		}
+
+		ck_assert_int_eq(vbuffer_size(vbuffer_stream_data(&stream)), pushed - popped);
+		check_positions(vbuffer_stream_data(&stream), popped);
+
+		for (j=0; j<3; ++j) {
+			struct vbuffer buffer;
+			ck_assert(vbuffer_stream_pop(&stream, &buffer, NULL));
+			popped += vbuffer_size(&buffer);
+			vbuffer_clear(&buffer);
+			ck_check_error;
+		}
+
+		ck_assert_int_eq(vbuffer_size(vbuffer_stream_data(&stream)), pushed - popped);
+		check_positions(vbuffer_stream_data(&stream), popped);
+	}
+
+	vbuffer_stream_clear(&stream);
+	ck_check_error;
+}
+END_TEST
+
 int main(int argc, char *argv[])
 {
 	int number_failed;
@@ -180,6 +359,9 @@ int main(int argc, char *argv[])
 	tcase_add_test(tcase, test_push_pop_interleaved);
 	tcase_add_test(tcase, test_mark);
 	tcase_add_test(tcase, test_eof);
+	tcase_add_test(tcase, test_limit);
+	tcase_add_test(tcase, test_compact);
+	tcase_add_test(tcase, test_position_interleaved);
 	suite_add_tcase(suite, tcase);
 
 	SRunner *runner = srunner_create(suite);
@@ -70,4 +70,49 @@ function TestVBufferStream:test_stream_blocking_available()
 	assertEquals(loop, 10)
 end
 
+function TestVBufferStream:test_stream_blocking_coalesce()
+	local resume = coroutine.resume
+	local count = 0
+	local ref = { "HakaHakaHakaHakaHaka", "HakaHakaHakaHakaHaka" }
+	local loop = 0
+
+	coroutine.resume = function (...)
+		count = count+1
+		return resume(...)
+	end
+
+	self:gen_stream(function (iter)
+		while true do
+			local sub = iter:sub(20)
+			if not sub then break end
+
+			assertEquals(sub:asstring(), ref[loop+1])
+			loop = loop+1
+		end
+	end)
+
+	coroutine.resume = resume
+
+	assertEquals(loop, 2)
+	-- Only woken up when 20 bytes are available and at the end of stream
+	assertEquals(count, 3)
+end
+
+function TestVBufferStream:test_stream_blocking_reuse()
+	local first, second
+
+	self:gen_stream(function (iter)
+		iter:sub('all')
+		first = coroutine.running()
+	end)
+
+	self:gen_stream(function (iter)
+		iter:sub('all')
+		second = coroutine.running()
+	end)
+
+	assertTrue(first ~= nil)
+	assertEquals(first, second)
+end
+
 addTestSuite('TestVBufferStream')
@@ -212,6 +212,15 @@ uint64 atomic64_dec(atomic64_t *v)
 	return r;
 }
 
+uint64 atomic64_add(atomic64_t *v, int64 x)
+{
+	uint64 r;
+	spinlock_lock(&v->spinlock);
+	r = (v->value += x);
+	spinlock_unlock(&v->spinlock);
+	return r;
+}
+
 void atomic64_set(atomic64_t *v, uint64 x)
 {
 	spinlock_lock(&v->spinlock);
@@ -2,14 +2,13 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
-#include <signal.h>
 #include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/types.h>
-#include <sys/syscall.h>
+#include <sys/timerfd.h>
 
 #include <haka/timer.h>
 #include <haka/error.h>
@@ -19,10 +18,30 @@
 #include <haka/container/list2.h>
 
 
+/*
+ * The timers are stored in a hierarchical timing wheel. Each level has
+ * WHEEL_SIZE slots, the slots of the first level are one tick wide and the
+ * slots of the next levels are WHEEL_SIZE times wider than the ones of the
+ * previous level. A timer is inserted in the level matching its distance to
+ * the current tick, and it moves down to the lower levels (cascade) when the
+ * wheel reaches its slot.
+ */
+#define WHEEL_BITS       8
+#define WHEEL_SIZE       (1 << WHEEL_BITS)
+#define WHEEL_MASK       (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS     4
+#define WHEEL_RANGE      (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+#define WHEEL_TICK_NSEC  1000000ULL  /* 1 ms */
+#define WHEEL_NO_TICK    ((uint64)-1)
+
+#define TIMER_PENDING    -1
+
 struct timer {
 	struct list2_elem       list;
 	bool                    armed:1;
 	bool                    repeat:1;
+	int                     level;         /* Wheel level or TIMER_PENDING if the timer is being triggered */
+	uint64                  expires;       /* Trigger tick */
 	struct time             trigger_time;
 	struct time             delay;
 	timer_callback          callback;
@@ -32,25 +51,29 @@ struct timer {
 
 struct time_realm_state {
 	struct time             time;
-	timer_t                 timer;
-	struct list2            sorted_timer;
+	int                     fd;            /* Timer descriptor of the realtime realms */
+	uint64                  current_tick;  /* Next tick to process */
+	uint64                  next_tick;     /* First tick with some work, the system timer is set for it */
 	bool                    check_timer;
+	bool                    checking;
 	struct time_realm      *realm;
+	size_t                  level_count[WHEEL_LEVELS];
+	struct list2            wheel[WHEEL_LEVELS][WHEEL_SIZE];
 };
 
 static bool _time_realm_check(struct time_realm_state *state);
 
-static void timer_handler(int sig, siginfo_t *si, void *uc)
+static uint64 time_to_tick(const struct time *time, bool round_up)
 {
-	struct time_realm_state *state = (struct time_realm_state *)si->si_value.sival_ptr;
-	if (state) {
-		state->check_timer = true;
-	}
+	uint64 tick = (uint64)time->secs * (1000000000ULL / WHEEL_TICK_NSEC);
+	if (round_up) tick += (time->nsecs + WHEEL_TICK_NSEC - 1) / WHEEL_TICK_NSEC;
+	else tick += time->nsecs / WHEEL_TICK_NSEC;
+	return tick;
 }
 
 static struct time_realm_state *create_time_realm_state(struct time_realm *realm)
 {
-	struct sigevent sev;
+	int level, slot;
 
 	struct time_realm_state *state = malloc(sizeof(struct time_realm_state));
 	if (!state) {
@@ -58,16 +81,19 @@ static struct time_realm_state *create_time_realm_state(struct time_realm *realm
 		return NULL;
 	}
 
-	list2_init(&state->sorted_timer);
+	for (level=0; level<WHEEL_LEVELS; ++level) {
+		state->level_count[level] = 0;
+		for (slot=0; slot<WHEEL_SIZE; ++slot) {
+			list2_init(&state->wheel[level][slot]);
+		}
+	}
 
+	state->fd = -1;
 	if (realm->mode == TIME_REALM_REALTIME) {
-		memset(&sev, 0, sizeof(sev));
-		sev.sigev_notify = SIGEV_THREAD_ID;
-		sev.sigev_signo = SIGALRM;
-		sev.sigev_value.sival_ptr = state;
-		sev._sigev_un._tid = syscall(SYS_gettid);
-
-		if (timer_create(CLOCK_MONOTONIC, &sev, &state->timer)) {
+		/* The timer uses the same clock as the realm time so that it
+		 * expires exactly when the timers are due. */
+		state->fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (state->fd < 0) {
 			free(state);
 			error("timer creation error: %s", errno_error(errno));
 			return NULL;
@@ -75,8 +101,15 @@ static struct time_realm_state *create_time_realm_state(struct time_realm *realm
 	}
 
 	state->check_timer = false;
+	state->checking = false;
 	state->realm = realm;
 	state->time = invalid_time;
+	state->next_tick = WHEEL_NO_TICK;
+
+	if (realm->mode == TIME_REALM_REALTIME) {
+		time_gettimestamp(&state->time);
+	}
+	state->current_tick = time_to_tick(&state->time, false);
 
 	return state;
 }
@@ -95,17 +128,24 @@ static void free_time_realm_state(void *_ptr)
 {
 	struct time_realm_state *state = (struct time_realm_state *)_ptr;
 	if (state) {
-		const list2_iter end = list2_end(&state->sorted_timer);
-		list2_iter iter = list2_begin(&state->sorted_timer);
-		while (iter != end) {
-			struct timer *timer = list2_get(iter, struct timer, list);
-			timer->armed = false;
-
-			iter = list2_erase(iter);
+		int level, slot;
+
+		for (level=0; level<WHEEL_LEVELS; ++level) {
+			for (slot=0; slot<WHEEL_SIZE; ++slot) {
+				struct list2 *list = &state->wheel[level][slot];
+				const list2_iter end = list2_end(list);
+				list2_iter iter = list2_begin(list);
+				while (iter != end) {
+					struct timer *timer = list2_get(iter, struct timer, list);
+					timer->armed = false;
+
+					iter = list2_erase(iter);
+				}
+			}
 		}
 
-		if (state->realm->mode == TIME_REALM_REALTIME) {
-			timer_delete(state->timer);
+		if (state->fd >= 0) {
+			close(state->fd);
 		}
 		free(state);
 	}
@@ -157,6 +197,12 @@ void time_realm_update_and_check(struct time_realm *realm, const struct time *va
 				(time_diff(&difftime, value, &state->time), time_sec(&difftime)));
 
 		state->time = *value;
+
+		/* Skip the wheel scan until the next tick with some work */
+		if (time_to_tick(value, false) < state->next_tick) {
+			return;
+		}
+
 		state->check_timer = true;
 		_time_realm_check(state);
 	}
@@ -184,33 +230,11 @@ const struct time *time_realm_current_time(struct time_realm *realm)
 	return _time_realm_current_time(state);
 }
 
-INIT static void _timer_init()
-{
-	struct sigaction sa;
-
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_flags = SA_SIGINFO;
-	sa.sa_sigaction = timer_handler;
-	sigemptyset(&sa.sa_mask);
-	if (sigaction(SIGALRM, &sa, NULL) == -1) {
-		LOG_FATAL(time, "%s", errno_error(errno));
-		abort();
-	}
-
-	timer_init_thread();
-}
-
-bool timer_init_thread()
+int time_realm_fd(struct time_realm *realm)
 {
-	sigset_t mask;
-
-	sigemptyset(&mask);
-	sigaddset(&mask, SIGALRM);
-	if (!thread_sigmask(SIG_UNBLOCK, &mask, NULL)) {
-		return false;
-	}
-
-	return true;
+	struct time_realm_state *state = get_time_realm_state(realm, true);
+	if (!state) return -1;
+	return state->fd;
 }
 
 struct timer *time_realm_timer(struct time_realm *realm, timer_callback callback, void *user)
@@ -228,6 +252,8 @@ struct timer *time_realm_timer(struct time_realm *realm, timer_callback callback
 	list2_elem_init(&timer->list);
 	timer->armed = false;
 	timer->repeat = false;
+	timer->level = TIMER_PENDING;
+	timer->expires = 0;
 	timer->trigger_time = invalid_time;
 	timer->delay = invalid_time;
 	timer->callback = callback;
@@ -237,83 +263,121 @@ struct timer *time_realm_timer(struct time_realm *realm, timer_callback callback
 	return timer;
 }
 
-static bool time_realm_insert_timer(struct time_realm_state *state,
+static void time_realm_insert_timer(struct time_realm_state *state,
 		struct timer *timer)
 {
-	const list2_iter begin = list2_begin(&state->sorted_timer);
-	const list2_iter end = list2_end(&state->sorted_timer);
-	list2_iter iter;
+	uint64 expires = timer->expires;
+	uint64 delta;
+	int level = 0;
 
-	for (iter = begin; iter != end; iter = list2_next(iter)) {
-		struct timer *cur = list2_get(iter, struct timer, list);
-		if (time_cmp(&timer->trigger_time, &cur->trigger_time) < 0) {
-			break;
-		}
+	if (expires < state->current_tick) {
+		/* Late timer, trigger it on the next tick */
+		expires = state->current_tick;
+	}
+
+	delta = expires - state->current_tick;
+	if (delta >= WHEEL_RANGE) {
+		/* Too far in the future, the timer will be moved again once the
+		 * last level reaches it. */
+		delta = WHEEL_RANGE - 1;
+		expires = state->current_tick + delta;
 	}
 
-	list2_insert(iter, &timer->list);
+	while (delta >= (1ULL << (WHEEL_BITS * (level+1)))) {
+		++level;
+	}
 
-	return iter == begin;
+	list2_insert(list2_end(&state->wheel[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK]),
+			&timer->list);
+	timer->level = level;
+	++state->level_count[level];
 }
 
-static bool time_realm_update_timer_list(struct time_realm_state *state,
-		bool update_timer)
+static void time_realm_remove_timer(struct time_realm_state *state,
+		struct timer *timer)
 {
-	if (!update_timer) {
-		return true;
+	list2_erase(&timer->list);
+	if (timer->level != TIMER_PENDING) {
+		--state->level_count[timer->level];
+		timer->level = TIMER_PENDING;
 	}
+}
 
+/*
+ * Get the first tick at which the wheel has some work to do, either to
+ * trigger some timers or to cascade a slot to the lower levels.
+ */
+static uint64 time_realm_next_tick(struct time_realm_state *state)
+{
+	uint64 next = WHEEL_NO_TICK;
+	int level;
+
+	for (level=0; level<WHEEL_LEVELS; ++level) {
+		const int shift = WHEEL_BITS * level;
+		const uint64 base = state->current_tick >> shift;
+		int i;
+
+		if (state->level_count[level] == 0) continue;
+
+		/* The slot of the current tick is checked last when it has already
+		 * been cascaded, its content is then for the next wheel turn. */
+		for (i=0; i<=WHEEL_SIZE; ++i) {
+			const uint64 tick = (base + i) << shift;
+			if (tick < state->current_tick) continue;
+
+			if (!list2_empty(&state->wheel[level][(base + i) & WHEEL_MASK])) {
+				if (tick < next) next = tick;
+				break;
+			}
+		}
+	}
+
+	return next;
+}
+
+static void time_realm_cascade(struct time_realm_state *state, int level, int slot)
+{
+	struct list2 list;
+	list2_iter iter, end;
+
+	list2_init(&list);
+	list2_swap(&list, &state->wheel[level][slot]);
+
+	iter = list2_begin(&list);
+	end = list2_end(&list);
+	while (iter != end) {
+		struct timer *timer = list2_get(iter, struct timer, list);
+		iter = list2_erase(iter);
+		--state->level_count[level];
+		time_realm_insert_timer(state, timer);
+	}
+}
+
+static bool time_realm_update_timer(struct time_realm_state *state, uint64 tick)
+{
 	if (state->realm->mode == TIME_REALM_REALTIME) {
 		struct itimerspec ts;
 		memset(&ts, 0, sizeof(ts));
 
-		if (list2_empty(&state->sorted_timer)) {
-			/* stop the timer */
-			if (timer_settime(state->timer, 0, &ts, NULL) != 0) {
-				error("%s", errno_error(errno));
-				return false;
-			}
+		/* An absolute time in the past expires immediately, the
+		 * descriptor will then wake up the thread to check the timers. */
+		if (tick != WHEEL_NO_TICK) {
+			ts.it_value.tv_sec = tick / (1000000000ULL / WHEEL_TICK_NSEC);
+			ts.it_value.tv_nsec = (tick % (1000000000ULL / WHEEL_TICK_NSEC)) * WHEEL_TICK_NSEC;
 		}
-		else {
-			struct time diff;
-			struct timer *first = list2_first(&state->sorted_timer, struct timer, list);
-			struct time current = *_time_realm_current_time(state);
-
-			if (time_diff(&diff, &first->trigger_time, &current) <= 0) {
-				state->check_timer = true;
-
-				/* stop the timer, the timer will be restarted if needed by the
-				 * next call to timer_realm_check(). */
-				if (timer_settime(state->timer, 0, &ts, NULL) != 0) {
-					error("%s", errno_error(errno));
-					return false;
-				}
-			}
-			else {
-				ts.it_value.tv_sec = diff.secs;
-				ts.it_value.tv_nsec = diff.nsecs;
 
-				if (timer_settime(state->timer, 0, &ts, NULL) != 0) {
-					error("%s", errno_error(errno));
-					return false;
-				}
-
-				LOG_DEBUG(time, "next timer in %f seconds", time_sec(&diff));
-			}
+		/* Setting the timer also resets its expiration count */
+		if (timerfd_settime(state->fd, TFD_TIMER_ABSTIME, &ts, NULL) != 0) {
+			error("%s", errno_error(errno));
+			return false;
 		}
-	}
-	else {
-		if (!list2_empty(&state->sorted_timer)) {
-			struct time diff;
-			struct timer *first = list2_first(&state->sorted_timer, struct timer, list);
-			struct time current = *_time_realm_current_time(state);
 
-			if (time_diff(&diff, &first->trigger_time, &current) > 0) {
-				LOG_DEBUG(time, "next timer in %f seconds", time_sec(&diff));
-			}
+		if (tick != WHEEL_NO_TICK) {
+			LOG_DEBUG(time, "next timer at tick %llu", (unsigned long long)tick);
 		}
 	}
 
+	state->next_tick = tick;
 	return true;
 }
 
@@ -336,10 +400,23 @@ static bool timer_start(struct timer *timer, struct time *delay, bool repeat)
 
 	timer->delay = *delay;
 	time_add(&timer->trigger_time, time_realm_current_time(state->realm), &timer->delay);
+	timer->expires = time_to_tick(&timer->trigger_time, true);
 	timer->armed = true;
 	timer->repeat = repeat;
 
-	return time_realm_update_timer_list(state, time_realm_insert_timer(state, timer));
+	time_realm_insert_timer(state, timer);
+
+	/* The system timer is only moved forward, it is left as is when the
+	 * timers are stopped and the next check will set it again. */
+	if (!state->checking) {
+		const uint64 tick = timer->expires < state->current_tick ?
+				state->current_tick : timer->expires;
+		if (tick < state->next_tick) {
+			return time_realm_update_timer(state, tick);
+		}
+	}
+
+	return true;
 }
 
 bool timer_once(struct timer *timer, struct time *delay)
@@ -355,87 +432,127 @@ bool timer_repeat(struct timer *timer, struct time *delay)
 bool timer_stop(struct timer *timer)
 {
 	struct time_realm_state *state = get_time_realm_state(timer->realm, true);
-	bool is_first;
 
 	if (!timer->armed) return false;
 
-	is_first = list2_prev(&timer->list) == list2_end(&state->sorted_timer);
-	list2_erase(&timer->list);
+	/* The next tick is kept, it stays a valid lower bound of the next
+	 * work and the next check will compute it again */
+
+	time_realm_remove_timer(state, timer);
 	timer->armed = false;
-	return time_realm_update_timer_list(state, is_first);
+	return true;
 }
 
-static bool _time_realm_check(struct time_realm_state *state)
+static void time_realm_trigger(struct time_realm_state *state, struct list2 *pending,
+		const struct time *current)
 {
-	bool need_update = false;
-	struct list2 repeat_list; /* store repeat timers to reinsert them safely */
-	struct time current = *_time_realm_current_time(state);
-	list2_iter iter = list2_begin(&state->sorted_timer);
-	list2_iter end = list2_end(&state->sorted_timer);
+	while (!list2_empty(pending)) {
+		struct timer *timer = list2_first(pending, struct timer, list);
+		int count;
 
-	state->check_timer = false;
-	if (iter == end) return true;
+		/* The callbacks can stop or destroy any timer, including the
+		 * ones that are still pending. */
+		list2_erase(&timer->list);
 
-	list2_init(&repeat_list);
+		if (timer->repeat) {
+			struct time offset;
 
-	while (iter != end) {
-		struct timer *timer = list2_get(iter, struct timer, list);
-		if (time_cmp(&timer->trigger_time, &current) <= 0) {
-			int count;
-
-			iter = list2_erase(&timer->list);
-			if (timer->repeat) {
-				struct time offset;
-				list2_insert(list2_end(&repeat_list), &timer->list);
-
-				/* Compute the next trigger time as well as the number
-				 * of missed triggers. */
-				if (time_diff(&offset, &timer->trigger_time, &current) <= 0) {
-					count = time_divide(&offset, &timer->delay) + 1;
-					time_mult(&offset, &timer->delay, count);
-					time_add(&timer->trigger_time, &timer->trigger_time, &offset);
-
-					assert(time_cmp(&timer->trigger_time, &current) >= 0);
-				}
-				else {
-					/* The time seams to have gone back in time, this is case
-					 * should not be reached. */
-					time_add(&timer->trigger_time, &current, &timer->delay);
-					count = 1;
-				}
+			/* Compute the next trigger time as well as the number
+			 * of missed triggers. */
+			if (time_diff(&offset, &timer->trigger_time, current) <= 0) {
+				count = time_divide(&offset, &timer->delay) + 1;
+				time_mult(&offset, &timer->delay, count);
+				time_add(&timer->trigger_time, &timer->trigger_time, &offset);
+
+				assert(time_cmp(&timer->trigger_time, current) >= 0);
 			}
 			else {
+				/* The time seams to have gone back in time, this is case
+				 * should not be reached. */
+				time_add(&timer->trigger_time, current, &timer->delay);
 				count = 1;
-				timer->armed = false;
 			}
 
-			(*timer->callback)(count, timer->data);
-
-			need_update = true;
+			timer->expires = time_to_tick(&timer->trigger_time, true);
+			time_realm_insert_timer(state, timer);
 		}
 		else {
-			break;
+			count = 1;
+			timer->armed = false;
 		}
+
+		(*timer->callback)(count, timer->data);
 	}
+}
 
-	if (!list2_empty(&repeat_list)) {
-		iter = list2_begin(&repeat_list);
-		end = list2_end(&repeat_list);
-		while (iter != end) {
-			struct timer *timer = list2_get(iter, struct timer, list);
-			iter = list2_erase(iter);
-			time_realm_insert_timer(state, timer);
+static bool _time_realm_check(struct time_realm_state *state)
+{
+	struct list2 pending;
+	struct time current = *_time_realm_current_time(state);
+	const uint64 now = time_to_tick(&current, false);
+	int level;
+
+	state->check_timer = false;
+	state->checking = true;
+
+	list2_init(&pending);
+
+	while (state->current_tick <= now) {
+		const uint64 tick = time_realm_next_tick(state);
+		if (tick > now) {
+			state->current_tick = now + 1;
+			break;
+		}
+
+		state->current_tick = tick;
+
+		/* Move down the timers of the upper levels that reached their slot */
+		for (level=WHEEL_LEVELS-1; level>0; --level) {
+			const int shift = WHEEL_BITS * level;
+			if ((tick & ((1ULL << shift) - 1)) == 0) {
+				time_realm_cascade(state, level, (tick >> shift) & WHEEL_MASK);
+			}
+		}
+
+		/* Trigger all the timers of the tick at once */
+		{
+			struct list2 *slot = &state->wheel[0][tick & WHEEL_MASK];
+			list2_iter iter = list2_begin(slot);
+			const list2_iter end = list2_end(slot);
+
+			for (; iter != end; iter = list2_next(iter)) {
+				struct timer *timer = list2_get(iter, struct timer, list);
+				timer->level = TIMER_PENDING;
+				--state->level_count[0];
+			}
+
+			list2_swap(&pending, slot);
 		}
+
+		state->current_tick = tick + 1;
+		time_realm_trigger(state, &pending, &current);
 	}
 
-	return time_realm_update_timer_list(state, need_update);
+	state->checking = false;
+
+	return time_realm_update_timer(state, time_realm_next_tick(state));
 }
 
 bool time_realm_check(struct time_realm *realm)
 {
 	struct time_realm_state *state = get_time_realm_state(realm, false);
-	if (state && state->check_timer) {
+	if (!state) return true;
+
+	if (state->check_timer) {
 		return _time_realm_check(state);
 	}
+
+	if (state->next_tick != WHEEL_NO_TICK) {
+		const struct time *current = _time_realm_current_time(state);
+		if (time_to_tick(current, false) >= state->next_tick) {
+			return _time_realm_check(state);
+		}
+	}
+
 	return true;
 }
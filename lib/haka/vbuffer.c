@@ -10,15 +10,244 @@
 #include <haka/error.h>
 #include <haka/log.h>
 #include <haka/thread.h>
+#include <haka/slab.h>
 
 #include "vbuffer.h"
 #include "vbuffer_data.h"
 
 
+static struct slab_cache vbuffer_chunk_cache = SLAB_CACHE("vbuffer_chunk", struct vbuffer_chunk);
+static struct slab_cache vbuffer_head_cache = SLAB_CACHE("vbuffer_head", struct vbuffer_head);
+
+INIT static void vbuffer_init_caches()
+{
+	slab_cache_init(&vbuffer_chunk_cache);
+	slab_cache_init(&vbuffer_head_cache);
+}
+
+SLAB_FINI static void vbuffer_fini_caches()
+{
+	slab_cache_destroy(&vbuffer_chunk_cache);
+	slab_cache_destroy(&vbuffer_head_cache);
+}
+
+/*
+ * Chunk index
+ */
+
+/* Minimum number of chunks before using the offset index */
+#define VBUFFER_INDEX_MIN_CHUNKS   16
+
+static void vbuffer_index_reset(struct vbuffer_head *head)
+{
+	head->index.valid = false;
+}
+
+static bool vbuffer_index_reserve(struct vbuffer_index *index, size_t count)
+{
+	struct vbuffer_index_entry *entries;
+	size_t capacity;
+
+	if (count <= index->capacity) return true;
+
+	capacity = index->capacity ? index->capacity : VBUFFER_INDEX_MIN_CHUNKS;
+	while (capacity < count) capacity *= 2;
+
+	entries = realloc(index->entries, capacity * sizeof(struct vbuffer_index_entry));
+	if (!entries) return false;
+
+	index->entries = entries;
+	index->capacity = capacity;
+	return true;
+}
+
+static void vbuffer_index_push(struct vbuffer_head *head, struct vbuffer_chunk *chunk)
+{
+	struct vbuffer_index *index = &head->index;
+
+	if (index->last == index->capacity) {
+		if (index->first >= index->capacity / 2) {
+			memmove(index->entries, index->entries + index->first,
+					(index->last - index->first) * sizeof(struct vbuffer_index_entry));
+			index->last -= index->first;
+			index->first = 0;
+		}
+		else if (!vbuffer_index_reserve(index, index->capacity + 1)) {
+			vbuffer_index_reset(head);
+			return;
+		}
+	}
+
+	index->entries[index->last].start = index->base + head->size;
+	index->entries[index->last].chunk = chunk;
+	++index->last;
+}
+
+static void vbuffer_index_pop(struct vbuffer_head *head, struct vbuffer_chunk *chunk)
+{
+	struct vbuffer_index *index = &head->index;
+
+	if (index->first == index->last) {
+		vbuffer_index_reset(head);
+	}
+	else if (index->entries[index->first].chunk == chunk) {
+		/* Removed from the beginning, the other entries are still valid */
+		index->base += chunk->size;
+		if (++index->first == index->last) {
+			index->first = index->last = 0;
+		}
+	}
+	else if (index->entries[index->last-1].chunk == chunk) {
+		--index->last;
+	}
+	else {
+		vbuffer_index_reset(head);
+	}
+}
+
+static bool vbuffer_index_build(struct vbuffer_head *head, struct vbuffer_chunk *end)
+{
+	struct vbuffer_index *index = &head->index;
+	struct vbuffer_chunk *iter;
+	size_t start = 0;
+
+	if (!vbuffer_index_reserve(index, head->count)) return false;
+
+	index->first = index->last = 0;
+	index->base = 0;
+
+	iter = list2_get(list2_next(&end->list), struct vbuffer_chunk, list);
+	for (; !iter->flags.end; iter = vbuffer_chunk_next(iter)) {
+		index->entries[index->last].start = start;
+		index->entries[index->last].chunk = iter;
+		++index->last;
+		start += iter->size;
+	}
+
+	assert(index->last == head->count);
+	assert(start == head->size);
+
+	index->valid = true;
+	return true;
+}
+
+/*
+ * Find the chunk containing the byte before offset, which is where
+ * vbuffer_iterator_advance() would stop. The offset must be in ]0, size].
+ */
+static struct vbuffer_chunk *vbuffer_index_find(struct vbuffer_head *head, struct vbuffer_chunk *end,
+		size_t *offset)
+{
+	struct vbuffer_index *index = &head->index;
+	size_t lo, hi, start;
+
+	assert(*offset > 0 && *offset <= head->size);
+
+	if (!index->valid && !vbuffer_index_build(head, end)) {
+		return NULL;
+	}
+
+	assert(index->first < index->last);
+	assert(index->entries[index->first].start == index->base);
+
+	start = index->base + *offset;
+	lo = index->first;
+	hi = index->last;
+	while (hi - lo > 1) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (index->entries[mid].start < start) lo = mid;
+		else hi = mid;
+	}
+
+	*offset = start - index->entries[lo].start;
+	return index->entries[lo].chunk;
+}
+
+
 /*
  * Buffer chunk
  */
 
+static void vbuffer_chunk_attach(struct vbuffer_chunk *chunk, struct vbuffer_head *head, bool tail)
+{
+	assert(head);
+	assert(!chunk->head);
+
+	if (head->index.valid) {
+		if (tail) vbuffer_index_push(head, chunk);
+		else vbuffer_index_reset(head);
+	}
+
+	chunk->head = head;
+	head->size += chunk->size;
+	++head->count;
+}
+
+static void vbuffer_chunk_detach(struct vbuffer_chunk *chunk)
+{
+	struct vbuffer_head *head = chunk->head;
+
+	assert(head);
+	assert(head->count > 0);
+
+	if (head->index.valid) vbuffer_index_pop(head, chunk);
+
+	head->size -= chunk->size;
+	--head->count;
+	chunk->head = NULL;
+}
+
+static void vbuffer_chunk_resize(struct vbuffer_chunk *chunk, size_t size)
+{
+	struct vbuffer_head *head = chunk->head;
+
+	if (head) {
+		struct vbuffer_index *index = &head->index;
+
+		/* Only the last chunk can change without moving the others */
+		if (index->valid && (index->first == index->last ||
+		    index->entries[index->last-1].chunk != chunk)) {
+			vbuffer_index_reset(head);
+		}
+
+		head->size = head->size - chunk->size + size;
+	}
+
+	chunk->size = size;
+}
+
+void vbuffer_chunk_link(struct vbuffer_chunk *insert, struct vbuffer_chunk *chunk)
+{
+	assert(insert->head);
+
+	list2_insert(&insert->list, &chunk->list);
+	vbuffer_chunk_attach(chunk, insert->head, insert->flags.end);
+}
+
+void vbuffer_chunk_move(struct vbuffer_chunk *insert, struct vbuffer_chunk *begin, struct vbuffer_chunk *end)
+{
+	struct vbuffer_head *head = insert->head;
+
+	assert(head);
+
+	if (begin == end) return;
+
+	if (begin->head == head) {
+		vbuffer_index_reset(head);
+	}
+	else {
+		struct vbuffer_chunk *iter = begin;
+		while (iter != end) {
+			struct vbuffer_chunk *next = list2_get(list2_next(&iter->list), struct vbuffer_chunk, list);
+			vbuffer_chunk_detach(iter);
+			vbuffer_chunk_attach(iter, head, insert->flags.end);
+			iter = next;
+		}
+	}
+
+	list2_insert_list(&insert->list, &begin->list, &end->list);
+}
+
 static void vbuffer_chunk_addref(struct vbuffer_chunk *chunk)
 {
 	atomic_inc(&chunk->ref);
@@ -29,7 +258,7 @@ static void vbuffer_chunk_release(struct vbuffer_chunk *chunk)
 	if (atomic_dec(&chunk->ref) == 0) {
 		assert(!chunk->data);
 		assert(!list2_elem_check(&chunk->list));
-		free(chunk);
+		slab_free(chunk);
 	}
 }
 
@@ -37,6 +266,7 @@ void vbuffer_chunk_clear(struct vbuffer_chunk *chunk)
 {
 	if (chunk->list.next) {
 		assert(chunk->list.prev);
+		if (!chunk->flags.end) vbuffer_chunk_detach(chunk);
 		list2_erase(&chunk->list);
 	}
 
@@ -48,16 +278,25 @@ void vbuffer_chunk_clear(struct vbuffer_chunk *chunk)
 
 static struct vbuffer_chunk *vbuffer_chunk_create_end(bool writable)
 {
-	struct vbuffer_chunk *chunk = malloc(sizeof(struct vbuffer_chunk));
+	struct vbuffer_chunk *chunk;
+	struct vbuffer_head *head = slab_alloc(&vbuffer_head_cache);
+	if (!head) {
+		return NULL;
+	}
+
+	chunk = slab_alloc(&vbuffer_chunk_cache);
 	if (!chunk) {
-		error("memory error");
+		slab_free(head);
 		return NULL;
 	}
 
+	memset(head, 0, sizeof(struct vbuffer_head));
+
 	atomic_set(&chunk->ref, 0);
 	chunk->size = 0;
 	chunk->offset = 0;
 	chunk->data = NULL;
+	chunk->head = head;
 	chunk->flags.modified = false;
 	chunk->flags.writable = writable;
 	chunk->flags.ctl = true;
@@ -83,13 +322,56 @@ struct vbuffer_chunk *vbuffer_chunk_clone(struct vbuffer_chunk *chunk, bool copy
 	return clone;
 }
 
+bool vbuffer_chunk_merge(struct vbuffer_chunk *first, struct vbuffer_chunk *last)
+{
+	struct vbuffer_chunk *iter;
+	struct vbuffer_data_basic *data;
+	size_t size = 0;
+	uint8 *dst;
+
+	assert(!first->flags.ctl);
+
+	for (iter = first; iter != last; iter = vbuffer_chunk_next(iter)) {
+		size += iter->size;
+	}
+
+	data = vbuffer_data_basic(size, false);
+	if (!data) {
+		return false;
+	}
+
+	dst = data->buffer;
+	for (iter = first; iter != last; iter = vbuffer_chunk_next(iter)) {
+		if (iter->flags.ctl) continue;
+
+		memcpy(dst, iter->data->ops->get(iter->data, false) + iter->offset, iter->size);
+		dst += iter->size;
+		first->flags.modified |= iter->flags.modified;
+	}
+
+	/* The first chunk is kept, its iterators stay at the same offset */
+	vbuffer_data_release(first->data);
+	first->data = &data->super;
+	data->super.ops->addref(&data->super);
+	first->offset = 0;
+
+	iter = vbuffer_chunk_next(first);
+	while (iter != last) {
+		struct vbuffer_chunk *next = vbuffer_chunk_next(iter);
+		if (!iter->flags.ctl) vbuffer_chunk_clear(iter);
+		iter = next;
+	}
+
+	vbuffer_chunk_resize(first, size);
+	return true;
+}
+
 struct vbuffer_chunk *vbuffer_chunk_create(struct vbuffer_data *data, size_t offset,
 		size_t length)
 {
-	struct vbuffer_chunk *chunk = malloc(sizeof(struct vbuffer_chunk));
+	struct vbuffer_chunk *chunk = slab_alloc(&vbuffer_chunk_cache);
 	if (!chunk) {
 		if (data) data->ops->free(data);
-		error("memory error");
 		return NULL;
 	}
 
@@ -97,6 +379,7 @@ struct vbuffer_chunk *vbuffer_chunk_create(struct vbuffer_data *data, size_t off
 	chunk->size = length;
 	chunk->offset = offset;
 	chunk->data = data;
+	chunk->head = NULL;
 	chunk->flags.modified = false;
 	chunk->flags.writable = true;
 	chunk->flags.ctl = false;
@@ -116,10 +399,9 @@ struct vbuffer_chunk *vbuffer_chunk_insert_ctl(struct vbuffer_chunk *insert, str
 	assert(data);
 	assert(insert);
 
-	chunk = malloc(sizeof(struct vbuffer_chunk));
+	chunk = slab_alloc(&vbuffer_chunk_cache);
 	if (!chunk) {
 		if (data) data->ops->free(data);
-		error("memory error");
 		return NULL;
 	}
 
@@ -127,6 +409,7 @@ struct vbuffer_chunk *vbuffer_chunk_insert_ctl(struct vbuffer_chunk *insert, str
 	chunk->size = 0;
 	chunk->offset = 0;
 	chunk->data = data;
+	chunk->head = NULL;
 	chunk->flags.modified = false;
 	chunk->flags.writable = insert->flags.writable;
 	chunk->flags.ctl = true;
@@ -136,11 +419,44 @@ struct vbuffer_chunk *vbuffer_chunk_insert_ctl(struct vbuffer_chunk *insert, str
 	vbuffer_chunk_addref(chunk);
 
 	list2_elem_init(&chunk->list);
-	list2_insert(&insert->list, &chunk->list);
+	vbuffer_chunk_link(insert, chunk);
 
 	return chunk;
 }
 
+struct vbuffer_chunk *vbuffer_chunk_insert_end(struct vbuffer *buf, struct vbuffer_data *data)
+{
+	struct vbuffer_chunk *chunk, *end;
+
+	assert(vbuffer_isvalid(buf));
+
+	chunk = vbuffer_chunk_create(data, 0, 0);
+	if (!chunk) return NULL;
+
+	end = buf->chunks;
+	list2_insert(list2_next(&end->list), &chunk->list);
+
+	chunk->flags = end->flags;
+	chunk->flags.ctl = true;
+
+	end->flags.end = false;
+	end->flags.eof = false;
+
+#ifdef HAKA_DEBUG
+	assert(end->list.is_end);
+	end->list.is_end = false;
+	chunk->list.is_end = true;
+#endif
+
+	/* The previous end becomes the last chunk of the buffer */
+	chunk->head = end->head;
+	end->head = NULL;
+	vbuffer_chunk_attach(end, chunk->head, true);
+
+	buf->chunks = chunk;
+	return chunk;
+}
+
 INLINE bool vbuffer_chunk_check_writeable(struct vbuffer_chunk *chunk)
 {
 	if (!chunk->flags.writable) {
@@ -245,8 +561,12 @@ static bool vbuffer_create_from_data(struct vbuffer *buffer, struct vbuffer_data
 		return false;
 	}
 
-	_vbuffer_init(buffer, true);
-	list2_insert(&vbuffer_chunk_end(buffer)->list, &chunk->list);
+	if (!_vbuffer_init(buffer, true)) {
+		vbuffer_chunk_clear(chunk);
+		return false;
+	}
+
+	vbuffer_chunk_link(vbuffer_chunk_end(buffer), chunk);
 	return true;
 }
 
@@ -280,6 +600,27 @@ bool vbuffer_create_from(struct vbuffer *buffer, const char *str, size_t len)
 	return true;
 }
 
+bool vbuffer_create_external(struct vbuffer *buffer, const uint8 *ptr, size_t len,
+		void (*release)(void *owner, const uint8 *ptr), void *owner, struct vbuffer_data **handle)
+{
+	struct vbuffer_data_external *data = vbuffer_data_external(ptr, len, release, owner);
+	if (!data) {
+		return false;
+	}
+
+	/* Reference kept by the owner until it reclaims the memory */
+	if (handle) data->super.ops->addref(&data->super);
+
+	if (!vbuffer_create_from_data(buffer, &data->super, 0, len)) {
+		if (handle) vbuffer_data_release(&data->super);
+		else data->super.ops->free(&data->super);
+		return false;
+	}
+
+	if (handle) *handle = &data->super;
+	return true;
+}
+
 struct vbuffer_chunk *vbuffer_chunk_next(struct vbuffer_chunk *chunk)
 {
 	assert(chunk);
@@ -304,6 +645,7 @@ struct vbuffer_chunk *vbuffer_chunk_prev(struct vbuffer_chunk *chunk)
 void vbuffer_clear(struct vbuffer *buf)
 {
 	if (vbuffer_isvalid(buf)) {
+		struct vbuffer_head *head;
 		struct vbuffer_chunk *iter = vbuffer_chunk_begin(buf);
 		while (!iter->flags.end) {
 			struct vbuffer_chunk *cur = iter;
@@ -312,8 +654,15 @@ void vbuffer_clear(struct vbuffer *buf)
 			vbuffer_chunk_clear(cur);
 		}
 
+		head = buf->chunks->head;
+		assert(head->count == 0);
+		buf->chunks->head = NULL;
+
 		vbuffer_chunk_clear(buf->chunks);
 		buf->chunks = NULL;
+
+		free(head->index.entries);
+		slab_free(head);
 	}
 }
 
@@ -325,16 +674,8 @@ void vbuffer_release(struct vbuffer *buffer)
 
 size_t vbuffer_size(struct vbuffer *buf)
 {
-	struct vbuffer_chunk *iter;
-	size_t size = 0;
-
 	assert(vbuffer_isvalid(buf));
-
-	VBUFFER_FOR_EACH(buf, iter) {
-		size += iter->size;
-	}
-
-	return size;
+	return buf->chunks->head->size;
 }
 
 void vbuffer_position(const struct vbuffer *buf, struct vbuffer_iterator *position, size_t offset)
@@ -347,6 +688,21 @@ void vbuffer_position(const struct vbuffer *buf, struct vbuffer_iterator *positi
 		position->registered = false;
 	}
 	else {
+		struct vbuffer_head *head = buf->chunks->head;
+
+		if (offset > 0 && offset <= head->size &&
+		    head->count >= VBUFFER_INDEX_MIN_CHUNKS) {
+			size_t chunk_offset = offset;
+			struct vbuffer_chunk *chunk = vbuffer_index_find(head, buf->chunks, &chunk_offset);
+			if (chunk) {
+				position->chunk = chunk;
+				position->offset = chunk_offset;
+				position->registered = false;
+				position->meter += offset;
+				return;
+			}
+		}
+
 		position->chunk = vbuffer_chunk_begin(buf);
 		position->offset = 0;
 		position->registered = false;
@@ -427,7 +783,7 @@ bool vbuffer_append(struct vbuffer *buf, struct vbuffer *buffer)
 
 	vbuffer_chunk_mark_modified(vbuffer_chunk_end(buf));
 
-	list2_insert_list(&vbuffer_chunk_end(buf)->list, list2_begin(list), list2_end(list));
+	vbuffer_chunk_move(vbuffer_chunk_end(buf), vbuffer_chunk_begin(buffer), vbuffer_chunk_end(buffer));
 	assert(list2_empty(list));
 
 	return true;
@@ -702,9 +1058,9 @@ static struct vbuffer_chunk *_vbuffer_iterator_split(struct vbuffer_iterator *po
 			iter->offset + offset,
 			iter->size - offset);
 
-	iter->size = offset;
+	vbuffer_chunk_resize(iter, offset);
 	newchunk->flags = iter->flags;
-	list2_insert(list2_next(&iter->list), &newchunk->list);
+	vbuffer_chunk_link(list2_get(list2_next(&iter->list), struct vbuffer_chunk, list), newchunk);
 
 	return newchunk;
 }
@@ -735,7 +1091,7 @@ bool vbuffer_iterator_insert(struct vbuffer_iterator *position, struct vbuffer *
 		vbuffer_begin(buffer, &begin);
 	}
 
-	list2_insert_list(&insert->list, list2_begin(list), list2_end(list));
+	vbuffer_chunk_move(insert, vbuffer_chunk_begin(buffer), vbuffer_chunk_end(buffer));
 
 	vbuffer_iterator_update(position, insert, 0);
 
@@ -1381,6 +1737,7 @@ static struct vbuffer_chunk *_vbuffer_extract(struct vbuffer_sub *data, struct v
 				else {
 					list2_iter eraseiter = list2_erase(&iter->list);
 					ctl_insert_iter = list2_insert(list2_next(ctl_insert_iter), &iter->list);
+					vbuffer_index_reset(iter->head);
 					iter = list2_get(eraseiter, struct vbuffer_chunk, list);
 				}
 			}
@@ -1392,9 +1749,7 @@ static struct vbuffer_chunk *_vbuffer_extract(struct vbuffer_sub *data, struct v
 		if (!end) end = iter;
 	}
 
-	if (begin != end) {
-		list2_insert_list(&vbuffer_chunk_end(buffer)->list, &begin->list, &end->list);
-	}
+	vbuffer_chunk_move(vbuffer_chunk_end(buffer), begin, end);
 
 	if (insert_ctl) {
 		struct vbuffer_chunk *mark;
@@ -1467,7 +1822,7 @@ bool vbuffer_restore(struct vbuffer_iterator *position, struct vbuffer *data, bo
 			data = &clone_buf;
 		}
 
-		list2_insert_list(&position->chunk->list, &vbuffer_chunk_begin(data)->list, &vbuffer_chunk_end(data)->list);
+		vbuffer_chunk_move(position->chunk, vbuffer_chunk_begin(data), vbuffer_chunk_end(data));
 		vbuffer_clear(data);
 	}
 
@@ -1501,7 +1856,7 @@ bool vbuffer_replace(struct vbuffer_sub *data, struct vbuffer *buffer)
 
 	iter->flags.modified = true;
 
-	list2_insert_list(&iter->list, &vbuffer_chunk_begin(buffer)->list, &vbuffer_chunk_end(buffer)->list);
+	vbuffer_chunk_move(iter, vbuffer_chunk_begin(buffer), vbuffer_chunk_end(buffer));
 	vbuffer_clear(buffer);
 
 	/* Update buffer range */
@@ -1557,7 +1912,7 @@ static bool _vbuffer_compact(struct vbuffer_sub *data, bool *has_ctl, size_t *rs
 						vbuffer_iterator_update(&data->end, prev, prev->size + data->end.offset);
 					}
 
-					prev->size += chunk->size;
+					vbuffer_chunk_resize(prev, prev->size + chunk->size);
 					prev->flags.modified |= chunk->flags.modified;
 					prev->flags.writable &= chunk->flags.writable;
 
@@ -1664,7 +2019,7 @@ bool vbuffer_sub_clone(struct vbuffer_sub *data, struct vbuffer *buffer, clone_m
 	while ((chunk = _vbuffer_sub_iterate(data, &offset, &len, &iter))) {
 		if (!chunk->flags.ctl) {
 			struct vbuffer_chunk *clone = vbuffer_chunk_clone(chunk, mode == CLONE_COPY);
-			list2_insert(&end->list, &clone->list);
+			vbuffer_chunk_link(end, clone);
 
 			switch (mode) {
 			case CLONE_COPY:
@@ -16,11 +16,40 @@ struct vbuffer_chunk_flags {
 	bool   ctl:1;
 };
 
+struct vbuffer_index_entry {
+	size_t                      start;
+	struct vbuffer_chunk       *chunk;
+};
+
+/*
+ * Offset index of the chunks. The entries are sorted by start offset,
+ * the offset of an entry in the buffer is `start - base`.
+ */
+struct vbuffer_index {
+	bool                        valid;
+	size_t                      first;
+	size_t                      last;
+	size_t                      capacity;
+	size_t                      base;
+	struct vbuffer_index_entry *entries;
+};
+
+/*
+ * Shared state of the chunks of a buffer. It is kept outside of the end
+ * chunk as the stream can replace the end of its buffer.
+ */
+struct vbuffer_head {
+	size_t                      size;
+	size_t                      count;
+	struct vbuffer_index        index;
+};
+
 struct vbuffer_chunk {
 	struct list2_elem           list;
 	atomic_t                    ref;
 	struct vbuffer_chunk_flags  flags;
 	struct vbuffer_data        *data;
+	struct vbuffer_head        *head;   /* owning buffer, NULL if the chunk is not linked */
 	vbsize_t                    offset;
 	vbsize_t                    size;
 };
@@ -30,6 +59,14 @@ struct vbuffer_chunk *vbuffer_chunk_create(struct vbuffer_data *data, size_t off
 struct vbuffer_chunk *vbuffer_chunk_insert_ctl(struct vbuffer_chunk *ctl, struct vbuffer_data *data);
 struct vbuffer_chunk *vbuffer_chunk_clone(struct vbuffer_chunk *chunk, bool copy);
 
+/* Copy the data chunks from first to last (excluded) in a single new memory
+ * block held by first. The other data chunks are removed, the ctl chunks stay
+ * in place and end up after the merged data. */
+bool                  vbuffer_chunk_merge(struct vbuffer_chunk *first, struct vbuffer_chunk *last);
+struct vbuffer_chunk *vbuffer_chunk_insert_end(struct vbuffer *buf, struct vbuffer_data *data);
+void                  vbuffer_chunk_link(struct vbuffer_chunk *insert, struct vbuffer_chunk *chunk);
+void                  vbuffer_chunk_move(struct vbuffer_chunk *insert, struct vbuffer_chunk *begin, struct vbuffer_chunk *end);
+
 struct list2         *vbuffer_chunk_list(const struct vbuffer *buf);
 struct vbuffer_chunk *vbuffer_chunk_begin(const struct vbuffer *buf);
 struct vbuffer_chunk *vbuffer_chunk_end(const struct vbuffer *buf);
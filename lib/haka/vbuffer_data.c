@@ -8,6 +8,8 @@
 
 #include <haka/vbuffer.h>
 #include <haka/error.h>
+#include <haka/slab.h>
+#include <haka/metrics.h>
 
 #include "vbuffer_data.h"
 
@@ -79,17 +81,149 @@ struct vbuffer_data_basic *vbuffer_data_basic(size_t size, bool zero)
 }
 
 
+/*
+ * External data
+ */
+
+static struct metric vbuffer_data_external_copies = METRIC_COUNTER("vbuffer_external_copies_total",
+	"Number of external memory blocks copied on write or when retained by their owner");
+
+#define VBUFFER_DATA_EXTERNAL  \
+	struct vbuffer_data_external *buf = (struct vbuffer_data_external *)_buf; \
+	assert(buf->super.ops == &vbuffer_data_external_ops)
+
+static bool vbuffer_data_external_copy(struct vbuffer_data_external *buf)
+{
+	assert(!buf->copy);
+
+	buf->copy = malloc(buf->size ? buf->size : 1);
+	if (!buf->copy) {
+		error("memory error");
+		return false;
+	}
+
+	memcpy(buf->copy, buf->external, buf->size);
+	metric_inc(&vbuffer_data_external_copies);
+	return true;
+}
+
+static void vbuffer_data_external_giveback(struct vbuffer_data_external *buf)
+{
+	if (buf->external) {
+		const uint8 *external = buf->external;
+		buf->external = NULL;
+
+		if (buf->release) {
+			buf->release(buf->owner, external);
+		}
+	}
+}
+
+static void vbuffer_data_external_free(struct vbuffer_data *_buf)
+{
+	VBUFFER_DATA_EXTERNAL;
+	vbuffer_data_external_giveback(buf);
+	free(buf->copy);
+	free(buf);
+}
+
+static void vbuffer_data_external_addref(struct vbuffer_data *_buf)
+{
+	VBUFFER_DATA_EXTERNAL;
+	atomic_inc(&buf->ref);
+}
+
+static bool vbuffer_data_external_release(struct vbuffer_data *_buf)
+{
+	VBUFFER_DATA_EXTERNAL;
+	return atomic_dec(&buf->ref) == 0;
+}
+
+static uint8 *vbuffer_data_external_get(struct vbuffer_data *_buf, bool write)
+{
+	VBUFFER_DATA_EXTERNAL;
+
+	if (!buf->copy) {
+		if (!write) return (uint8 *)buf->external;
+
+		/* The external memory is kept until it is given back as pointers
+		 * on it could still be in use */
+		if (!vbuffer_data_external_copy(buf)) return NULL;
+	}
+
+	return buf->copy;
+}
+
+struct vbuffer_data_ops vbuffer_data_external_ops = {
+	free:    vbuffer_data_external_free,
+	addref:  vbuffer_data_external_addref,
+	release: vbuffer_data_external_release,
+	get:     vbuffer_data_external_get
+};
+
+struct vbuffer_data_external *vbuffer_data_external(const uint8 *ptr, size_t size,
+	void (*release)(void *owner, const uint8 *ptr), void *owner)
+{
+	struct vbuffer_data_external *buf = malloc(sizeof(struct vbuffer_data_external));
+	if (!buf) {
+		error("memory error");
+		return NULL;
+	}
+
+	buf->super.ops = &vbuffer_data_external_ops;
+	atomic_set(&buf->ref, 0);
+	buf->size = size;
+	buf->external = ptr;
+	buf->copy = NULL;
+	buf->release = release;
+	buf->owner = owner;
+	return buf;
+}
+
+bool vbuffer_external_reclaim(struct vbuffer_data *data)
+{
+	struct vbuffer_data_external *buf = vbuffer_data_cast(data, vbuffer_data_external);
+	assert(buf);
+
+	/* Some buffers still use the data, they get their own copy */
+	if (atomic_get(&buf->ref) > 1 && !buf->copy) {
+		if (!vbuffer_data_external_copy(buf)) return false;
+	}
+
+	vbuffer_data_external_giveback(buf);
+	vbuffer_data_release(data);
+	return true;
+}
+
 /*
  *  Buffer ctl data
  */
 
+union vbuffer_data_ctl_any {
+	struct vbuffer_data_ctl_select  select;
+	struct vbuffer_data_ctl_push    push;
+	struct vbuffer_data_ctl_mark    mark;
+};
+
+static struct slab_cache vbuffer_data_ctl_cache = SLAB_CACHE("vbuffer_ctl", union vbuffer_data_ctl_any);
+
+INIT static void vbuffer_data_init_cache()
+{
+	slab_cache_init(&vbuffer_data_ctl_cache);
+}
+
+SLAB_FINI static void vbuffer_data_fini_cache()
+{
+	slab_cache_destroy(&vbuffer_data_ctl_cache);
+}
+
 #define VBUFFER_DATA_CTL  \
 	UNUSED struct vbuffer_data_ctl *buf = (struct vbuffer_data_ctl *)_buf;
 
 static void vbuffer_data_ctl_free(struct vbuffer_data *_buf)
 {
 	VBUFFER_DATA_CTL;
-	free(buf);
+	slab_free(buf);
 }
 
 static void vbuffer_data_ctl_addref(struct vbuffer_data *_buf)
@@ -113,7 +247,7 @@ static uint8 *vbuffer_data_ctl_get(struct vbuffer_data *_buf, bool write)
 static void vbuffer_data_ctl_select_free(struct vbuffer_data *_buf)
 {
 	struct vbuffer_data_ctl_select *select = (struct vbuffer_data_ctl_select *)_buf;
-	free(select);
+	slab_free(select);
 }
 
 struct vbuffer_data_ops vbuffer_data_ctl_select_ops = {
@@ -125,9 +259,8 @@ struct vbuffer_data_ops vbuffer_data_ctl_select_ops = {
 
 struct vbuffer_data_ctl_select *vbuffer_data_ctl_select()
 {
-	struct vbuffer_data_ctl_select *buf = malloc(sizeof(struct vbuffer_data_ctl_select));
+	struct vbuffer_data_ctl_select *buf = slab_alloc(&vbuffer_data_ctl_cache);
 	if (!buf) {
-		error("memory error");
 		return NULL;
 	}
 
@@ -146,9 +279,8 @@ struct vbuffer_data_ops vbuffer_data_ctl_push_ops = {
 struct vbuffer_data_ctl_push *vbuffer_data_ctl_push(struct vbuffer_stream *stream,
 	struct vbuffer_stream_chunk *chunk)
 {
-	struct vbuffer_data_ctl_push *buf = malloc(sizeof(struct vbuffer_data_ctl_push));
+	struct vbuffer_data_ctl_push *buf = slab_alloc(&vbuffer_data_ctl_cache);
 	if (!buf) {
-		error("memory error");
 		return NULL;
 	}
 
@@ -168,9 +300,8 @@ struct vbuffer_data_ops vbuffer_data_ctl_mark_ops = {
 
 struct vbuffer_data_ctl_mark *vbuffer_data_ctl_mark(bool readonly)
 {
-	struct vbuffer_data_ctl_mark *buf = malloc(sizeof(struct vbuffer_data_ctl_mark));
+	struct vbuffer_data_ctl_mark *buf = slab_alloc(&vbuffer_data_ctl_cache);
 	if (!buf) {
-		error("memory error");
 		return NULL;
 	}
 
@@ -22,6 +22,21 @@ struct vbuffer_data_basic *vbuffer_data_basic(size_t size, bool zero);
 bool                       vbuffer_data_is_basic(struct vbuffer_data *data);
 
 
+extern struct vbuffer_data_ops vbuffer_data_external_ops;
+
+struct vbuffer_data_external {
+	struct vbuffer_data  super;
+	atomic_t             ref;
+	size_t               size;
+	const uint8         *external;  /* NULL once given back to its owner */
+	uint8               *copy;      /* Private copy made on write or on reclaim */
+	void               (*release)(void *owner, const uint8 *ptr);
+	void                *owner;
+};
+
+struct vbuffer_data_external *vbuffer_data_external(const uint8 *ptr, size_t size,
+	void (*release)(void *owner, const uint8 *ptr), void *owner);
+
 struct vbuffer_data_ctl {
 	struct vbuffer_data  super;
 	atomic_t             ref;
@@ -0,0 +1,332 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <haka/vbuffer.h>
+#include <haka/compiler.h>
+#include <haka/error.h>
+#include <haka/thread.h>
+
+#include "vbuffer.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VBUFFER_FIND_SIMD
+#include <immintrin.h>
+#endif
+
+
+/*
+ * Byte set
+ *
+ * The set is stored as a bitmap for the scalar version. The SIMD versions
+ * use two tables indexed by the low nibble of the byte, the high nibble
+ * gives the bit to check in the first table (0-7) or in the second one
+ * (8-15).
+ */
+
+struct byte_set {
+	uint8   bitmap[32];
+	uint8   low[16];
+	uint8   high[16];
+};
+
+static void byte_set_init(struct byte_set *set, const uint8 *bytes, size_t len)
+{
+	size_t i;
+
+	memset(set, 0, sizeof(struct byte_set));
+
+	for (i=0; i<len; ++i) {
+		const uint8 byte = bytes[i];
+		const uint8 hi = byte >> 4;
+
+		set->bitmap[byte >> 3] |= 1 << (byte & 7);
+
+		if (hi < 8) set->low[byte & 0xf] |= 1 << hi;
+		else set->high[byte & 0xf] |= 1 << (hi - 8);
+	}
+}
+
+static size_t find_set_scalar(const uint8 *ptr, size_t len, const struct byte_set *set)
+{
+	size_t i;
+	for (i=0; i<len; ++i) {
+		if (set->bitmap[ptr[i] >> 3] & (1 << (ptr[i] & 7))) break;
+	}
+	return i;
+}
+
+#ifdef VBUFFER_FIND_SIMD
+
+static const uint8 byte_set_bits[16] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80
+};
+
+__attribute__((target("sse4.2")))
+static size_t find_set_sse42(const uint8 *ptr, size_t len, const struct byte_set *set)
+{
+	const __m128i low = _mm_loadu_si128((const __m128i *)set->low);
+	const __m128i high = _mm_loadu_si128((const __m128i *)set->high);
+	const __m128i bits = _mm_loadu_si128((const __m128i *)byte_set_bits);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		const __m128i data = _mm_loadu_si128((const __m128i *)(ptr + i));
+		const __m128i lo = _mm_and_si128(data, nibble);
+		const __m128i hi = _mm_and_si128(_mm_srli_epi16(data, 4), nibble);
+
+		/* The high bit of each byte selects the table */
+		const __m128i row = _mm_blendv_epi8(_mm_shuffle_epi8(low, lo),
+				_mm_shuffle_epi8(high, lo), data);
+		const __m128i hit = _mm_and_si128(row, _mm_shuffle_epi8(bits, hi));
+
+		const int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(hit, zero)) & 0xffff;
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i + find_set_scalar(ptr + i, len - i, set);
+}
+
+__attribute__((target("avx2")))
+static size_t find_set_avx2(const uint8 *ptr, size_t len, const struct byte_set *set)
+{
+	const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->low));
+	const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->high));
+	const __m256i bits = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte_set_bits));
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		const __m256i data = _mm256_loadu_si256((const __m256i *)(ptr + i));
+		const __m256i lo = _mm256_and_si256(data, nibble);
+		const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(data, 4), nibble);
+
+		const __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(low, lo),
+				_mm256_shuffle_epi8(high, lo), data);
+		const __m256i hit = _mm256_and_si256(row, _mm256_shuffle_epi8(bits, hi));
+
+		const uint32 mask = ~(uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, zero));
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i + find_set_scalar(ptr + i, len - i, set);
+}
+
+#endif /* VBUFFER_FIND_SIMD */
+
+typedef size_t (*find_set_func)(const uint8 *ptr, size_t len, const struct byte_set *set);
+
+struct find_set_kernel {
+	const char     *name;
+	find_set_func   func;
+};
+
+/* Ordered from the fastest to the slowest */
+static const struct find_set_kernel find_set_kernels[] = {
+#ifdef VBUFFER_FIND_SIMD
+	{ "avx2", find_set_avx2 },
+	{ "sse4.2", find_set_sse42 },
+#endif
+	{ "scalar", find_set_scalar },
+	{ NULL, NULL }
+};
+
+static const struct find_set_kernel *find_set_kernel = &find_set_kernels[
+		sizeof(find_set_kernels)/sizeof(find_set_kernels[0]) - 2];
+
+static bool find_set_kernel_supported(const struct find_set_kernel *kernel)
+{
+#ifdef VBUFFER_FIND_SIMD
+	if (kernel->func == find_set_avx2) return __builtin_cpu_supports("avx2") != 0;
+	if (kernel->func == find_set_sse42) return __builtin_cpu_supports("sse4.2") != 0;
+#endif
+	return true;
+}
+
+INIT static void vbuffer_find_init()
+{
+	const struct find_set_kernel *kernel;
+
+#ifdef VBUFFER_FIND_SIMD
+	__builtin_cpu_init();
+#endif
+
+	for (kernel = find_set_kernels; kernel->name; ++kernel) {
+		if (find_set_kernel_supported(kernel)) {
+			find_set_kernel = kernel;
+			break;
+		}
+	}
+}
+
+bool vbuffer_find_set_kernel(const char *name)
+{
+	const struct find_set_kernel *kernel;
+
+	for (kernel = find_set_kernels; kernel->name; ++kernel) {
+		if (strcmp(kernel->name, name) == 0) {
+			if (!find_set_kernel_supported(kernel)) {
+				error("find kernel not supported by the cpu: %s", name);
+				return false;
+			}
+
+			find_set_kernel = kernel;
+			return true;
+		}
+	}
+
+	error("unknown find kernel: %s", name);
+	return false;
+}
+
+const char *vbuffer_find_get_kernel()
+{
+	return find_set_kernel->name;
+}
+
+
+/*
+ * Search
+ */
+
+static void vbuffer_find_position(struct vbuffer_iterator *iter, const struct vbuffer_iterator *chunk,
+		size_t offset)
+{
+	if (iter) {
+		vbuffer_iterator_build(iter, chunk->chunk, chunk->offset + offset, chunk->meter + offset);
+	}
+}
+
+size_t vbuffer_sub_find_byte(struct vbuffer_sub *data, uint8 byte, struct vbuffer_iterator *iter)
+{
+	struct vbuffer_sub_mmap mmapiter = vbuffer_mmap_init;
+	struct vbuffer_iterator chunk;
+	const uint8 *ptr;
+	size_t len, offset = 0;
+
+	if (!vbuffer_sub_check_size(data, 0, NULL)) return (size_t)-1;
+
+	/* memchr is already vectorized by the libc */
+	while ((ptr = vbuffer_mmap(data, &len, false, &mmapiter, &chunk))) {
+		const uint8 *found = memchr(ptr, byte, len);
+		if (found) {
+			vbuffer_find_position(iter, &chunk, found - ptr);
+			return offset + (found - ptr);
+		}
+
+		offset += len;
+	}
+
+	return (size_t)-1;
+}
+
+size_t vbuffer_sub_find_set(struct vbuffer_sub *data, const uint8 *set, size_t setlen,
+		struct vbuffer_iterator *iter)
+{
+	struct vbuffer_sub_mmap mmapiter = vbuffer_mmap_init;
+	struct vbuffer_iterator chunk;
+	struct byte_set byteset;
+	const uint8 *ptr;
+	size_t len, offset = 0;
+
+	if (setlen == 1) return vbuffer_sub_find_byte(data, set[0], iter);
+
+	if (!vbuffer_sub_check_size(data, 0, NULL)) return (size_t)-1;
+
+	byte_set_init(&byteset, set, setlen);
+
+	while ((ptr = vbuffer_mmap(data, &len, false, &mmapiter, &chunk))) {
+		const size_t index = find_set_kernel->func(ptr, len, &byteset);
+		if (index < len) {
+			vbuffer_find_position(iter, &chunk, index);
+			return offset + index;
+		}
+
+		offset += len;
+	}
+
+	return (size_t)-1;
+}
+
+/* Check that the following memory blocks start with the given data */
+static bool vbuffer_find_match_next(struct vbuffer_sub *data, const struct vbuffer_sub_mmap *mmapiter,
+		const uint8 *literal, size_t len)
+{
+	struct vbuffer_sub_mmap next = *mmapiter;
+	const uint8 *ptr;
+	size_t chunklen;
+
+	while (len > 0) {
+		ptr = vbuffer_mmap(data, &chunklen, false, &next, NULL);
+		if (!ptr) return false;
+
+		if (chunklen > len) chunklen = len;
+		if (memcmp(ptr, literal, chunklen) != 0) return false;
+
+		literal += chunklen;
+		len -= chunklen;
+	}
+
+	return true;
+}
+
+size_t vbuffer_sub_find_literal(struct vbuffer_sub *data, const uint8 *literal, size_t litlen,
+		struct vbuffer_iterator *iter)
+{
+	struct vbuffer_sub_mmap mmapiter = vbuffer_mmap_init;
+	struct vbuffer_iterator chunk;
+	const uint8 *ptr;
+	size_t len, offset = 0;
+
+	if (litlen <= 1) {
+		if (litlen == 1) return vbuffer_sub_find_byte(data, literal[0], iter);
+
+		if (!vbuffer_sub_check_size(data, 0, NULL)) return (size_t)-1;
+		if (iter) vbuffer_sub_begin(data, iter);
+		return 0;
+	}
+
+	if (!vbuffer_sub_check_size(data, 0, NULL)) return (size_t)-1;
+
+	while ((ptr = vbuffer_mmap(data, &len, false, &mmapiter, &chunk))) {
+		size_t index;
+		const uint8 *found = memmem(ptr, len, literal, litlen);
+		if (found) {
+			index = found - ptr;
+			vbuffer_find_position(iter, &chunk, index);
+			return offset + index;
+		}
+
+		/* Check the matches that straddle the end of the block */
+		index = len >= litlen ? len - litlen + 1 : 0;
+		while (index < len) {
+			found = memchr(ptr + index, literal[0], len - index);
+			if (!found) break;
+
+			index = found - ptr;
+			if (memcmp(found, literal, len - index) == 0 &&
+			    vbuffer_find_match_next(data, &mmapiter, literal + (len - index), litlen - (len - index))) {
+				vbuffer_find_position(iter, &chunk, index);
+				return offset + index;
+			}
+
+			++index;
+		}
+
+		offset += len;
+	}
+
+	return (size_t)-1;
+}
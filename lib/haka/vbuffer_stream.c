@@ -10,11 +10,34 @@
 #include <haka/error.h>
 #include <haka/log.h>
 #include <haka/thread.h>
+#include <haka/metrics.h>
 
 #include "vbuffer.h"
 #include "vbuffer_data.h"
 
 
+/* Read only chunks smaller than this are merged together up to
+ * VBUFFER_STREAM_COMPACT_MAX bytes */
+#define VBUFFER_STREAM_COMPACT_SIZE   256
+#define VBUFFER_STREAM_COMPACT_MAX    4096
+
+static struct metric vbuffer_stream_bytes_metric = METRIC_GAUGE("vbuffer_stream_bytes", "Number of data bytes held by the streams");
+static struct metric vbuffer_stream_overflows_metric = METRIC_COUNTER("vbuffer_stream_overflows_total", "Number of pushes refused because of a stream memory limit");
+static struct metric vbuffer_stream_compacted_metric = METRIC_COUNTER("vbuffer_stream_compacted_chunks_total", "Number of read only stream chunks merged into larger blocks");
+
+static atomic64_t vbuffer_stream_total;
+static size_t vbuffer_stream_global_limit = 0;
+
+INIT static void vbuffer_stream_init_memory()
+{
+	atomic64_init(&vbuffer_stream_total, 0);
+}
+
+FINI static void vbuffer_stream_fini_memory()
+{
+	atomic64_destroy(&vbuffer_stream_total);
+}
+
 struct vbuffer_stream_chunk {
 	struct list2_elem              list;
 	struct vbuffer_data_ctl_push  *ctl_data;
@@ -43,6 +66,96 @@ static void _vbuffer_stream_free_chunks(struct vbuffer_stream *stream, struct li
 	}
 }
 
+static void _vbuffer_stream_account(struct vbuffer_stream *stream, size_t memory)
+{
+	if (memory != stream->memory) {
+		const int64 delta = (int64)memory - (int64)stream->memory;
+
+		atomic64_add(&vbuffer_stream_total, delta);
+		metric_add(&vbuffer_stream_bytes_metric, delta);
+		stream->memory = memory;
+	}
+}
+
+static bool _vbuffer_stream_check_limit(struct vbuffer_stream *stream, size_t size)
+{
+	if (stream->max_size && stream->memory + size > stream->max_size) {
+		error("stream memory limit exceeded");
+	}
+	else if (vbuffer_stream_global_limit &&
+	         atomic64_get(&vbuffer_stream_total) + size > vbuffer_stream_global_limit) {
+		error("global stream memory limit exceeded");
+	}
+	else {
+		return true;
+	}
+
+	metric_inc(&vbuffer_stream_overflows_metric);
+	stream->overflow = true;
+	return false;
+}
+
+static bool _vbuffer_stream_compactable(struct vbuffer_stream *stream, struct vbuffer_chunk *chunk, bool first)
+{
+	if (chunk->flags.ctl) {
+		/* The data can be moved before the push nodes of the stream as long as
+		 * no iterator uses them */
+		struct vbuffer_data_ctl_push *push = vbuffer_data_cast(chunk->data, vbuffer_data_ctl_push);
+		return !first && push && push->stream == stream && push->chunk &&
+			atomic_get(&chunk->ref) == 1;
+	}
+
+	if (chunk->flags.writable) return false;
+
+	/* Only the first chunk of a block can be used by some iterators */
+	if (first) return chunk->size < VBUFFER_STREAM_COMPACT_MAX;
+	else return chunk->size < VBUFFER_STREAM_COMPACT_SIZE && atomic_get(&chunk->ref) == 1;
+}
+
+/* Merge the small read only chunks kept for the readers, the last block
+ * of the previous pop is extended if possible. */
+static void _vbuffer_stream_compact(struct vbuffer_stream *stream, struct vbuffer_chunk *begin,
+		struct vbuffer_chunk *end)
+{
+	struct vbuffer_chunk *iter = begin, *prev;
+
+	while ((prev = vbuffer_chunk_prev(iter))) {
+		if (_vbuffer_stream_compactable(stream, prev, true)) {
+			iter = prev;
+			break;
+		}
+		else if (!_vbuffer_stream_compactable(stream, prev, false)) {
+			break;
+		}
+		iter = prev;
+	}
+
+	while (iter != end) {
+		struct vbuffer_chunk *first = iter;
+		size_t size = 0, count = 0;
+
+		while (iter != end && _vbuffer_stream_compactable(stream, iter, iter == first) &&
+		       size + iter->size <= VBUFFER_STREAM_COMPACT_MAX) {
+			size += iter->size;
+			if (!iter->flags.ctl) ++count;
+			iter = vbuffer_chunk_next(iter);
+		}
+
+		if (count < 2) {
+			if (iter == first) iter = vbuffer_chunk_next(iter);
+			continue;
+		}
+
+		if (!vbuffer_chunk_merge(first, iter)) {
+			/* The chunks are kept as they are */
+			clear_error();
+			return;
+		}
+
+		metric_add(&vbuffer_stream_compacted_metric, count);
+	}
+}
+
 static void _vbuffer_stream_cleanup(struct vbuffer_stream *stream)
 {
 	list2_iter iter = list2_begin(vbuffer_chunk_list(&stream->data));
@@ -64,7 +177,7 @@ static void _vbuffer_stream_cleanup(struct vbuffer_stream *stream)
 			_vbuffer_stream_free_chunk(stream, read_chunk);
 		}
 
-		iter = list2_erase(iter);
+		iter = list2_next(iter);
 		vbuffer_chunk_clear(chunk);
 	}
 }
@@ -78,6 +191,9 @@ bool vbuffer_stream_init(struct vbuffer_stream *stream, void (*userdata_cleanup)
 	list2_init(&stream->read_chunks);
 	lua_ref_init(&stream->comanager);
 	stream->userdata_cleanup = userdata_cleanup;
+	stream->max_size = 0;
+	stream->memory = 0;
+	stream->overflow = false;
 	return true;
 }
 
@@ -86,6 +202,7 @@ void vbuffer_stream_clear(struct vbuffer_stream *stream)
 	_vbuffer_stream_free_chunks(stream, &stream->chunks);
 	_vbuffer_stream_free_chunks(stream, &stream->read_chunks);
 
+	_vbuffer_stream_account(stream, 0);
 	vbuffer_release(&stream->data);
 	lua_ref_clear(&stream->comanager);
 	lua_object_release(stream, &stream->lua_object);
@@ -101,6 +218,12 @@ bool vbuffer_stream_push(struct vbuffer_stream *stream, struct vbuffer *buffer,
 		return false;
 	}
 
+	if (!_vbuffer_stream_check_limit(stream, vbuffer_size(buffer))) {
+		return false;
+	}
+
+	stream->overflow = false;
+
 	chunk = malloc(sizeof(struct vbuffer_stream_chunk));
 	if (!chunk) {
 		error("memory error");
@@ -129,29 +252,14 @@ bool vbuffer_stream_push(struct vbuffer_stream *stream, struct vbuffer *buffer,
 		end_data->super.super.ops->addref(&end_data->super.super);
 	}
 
-	ctl = vbuffer_chunk_create(&chunk->ctl_data->super.super, 0, 0);
+	ctl = vbuffer_chunk_insert_end(&stream->data, &chunk->ctl_data->super.super);
 	if (!ctl) {
 		free(chunk);
 		return false;
 	}
 
-	list2_insert(list2_next(&end->list), &ctl->list);
-
-	ctl->flags = end->flags;
-	ctl->flags.ctl = true;
 	ctl->flags.writable = vbuffer_iswritable(buffer);
 
-	end->flags.end = false;
-	end->flags.eof = false;
-
-#ifdef HAKA_DEBUG
-	assert(end->list.is_end);
-	end->list.is_end = false;
-	ctl->list.is_end = true;
-#endif
-
-	stream->data.chunks = ctl;
-
 	if (current) {
 		if (vbuffer_isempty(buffer)) {
 			*current = vbuffer_iterator_init;
@@ -161,7 +269,7 @@ bool vbuffer_stream_push(struct vbuffer_stream *stream, struct vbuffer *buffer,
 		}
 	}
 
-	list2_insert_list(&ctl->list, &vbuffer_chunk_begin(buffer)->list, &vbuffer_chunk_end(buffer)->list);
+	vbuffer_chunk_move(ctl, vbuffer_chunk_begin(buffer), vbuffer_chunk_end(buffer));
 
 	list2_insert(list2_end(&stream->chunks), &chunk->list);
 
@@ -172,6 +280,7 @@ bool vbuffer_stream_push(struct vbuffer_stream *stream, struct vbuffer *buffer,
 
 	chunk->userdata = userdata;
 
+	_vbuffer_stream_account(stream, vbuffer_size(&stream->data));
 	return true;
 }
 
@@ -200,6 +309,7 @@ bool vbuffer_stream_pop(struct vbuffer_stream *stream, struct vbuffer *buffer, v
 	}
 
 	_vbuffer_stream_cleanup(stream);
+	_vbuffer_stream_account(stream, vbuffer_size(&stream->data));
 
 	read_last = list2_last(&stream->read_chunks, struct vbuffer_stream_chunk, list);
 
@@ -275,7 +385,7 @@ bool vbuffer_stream_pop(struct vbuffer_stream *stream, struct vbuffer *buffer, v
 	/* Set output buffer */
 	if (keep_for_read) {
 		/* Extract chunks from begin to start_of_keep */
-		list2_insert_list(&end->list, &begin->list, &start_of_keep->list);
+		vbuffer_chunk_move(end, begin, start_of_keep);
 
 		/* Clone from start_of_keep until push_ctl without marks */
 		struct vbuffer_chunk *chunk;
@@ -286,14 +396,16 @@ bool vbuffer_stream_pop(struct vbuffer_stream *stream, struct vbuffer *buffer, v
 			}
 
 			struct vbuffer_chunk *clone = vbuffer_chunk_clone(chunk, false);
-			list2_insert(&end->list, &clone->list);
+			vbuffer_chunk_link(end, clone);
 
 			chunk->flags.writable = false;
 		}
+
+		_vbuffer_stream_compact(stream, start_of_keep, current->ctl_iter.chunk);
 	}
 	else {
 		/* Extract buffer data */
-		list2_insert_list(&end->list, &begin->list, &iter->list);
+		vbuffer_chunk_move(end, begin, iter);
 
 		/* Remove push ctl node */
 		if (!iter->flags.end) {
@@ -318,6 +430,7 @@ bool vbuffer_stream_pop(struct vbuffer_stream *stream, struct vbuffer *buffer, v
 		_vbuffer_stream_free_chunk(stream, current);
 	}
 
+	_vbuffer_stream_account(stream, vbuffer_size(&stream->data));
 	return true;
 }
 
@@ -325,3 +438,18 @@ struct vbuffer *vbuffer_stream_data(struct vbuffer_stream *stream)
 {
 	return &stream->data;
 }
+
+size_t vbuffer_stream_memory(struct vbuffer_stream *stream)
+{
+	return stream->memory;
+}
+
+void vbuffer_stream_set_global_limit(size_t size)
+{
+	vbuffer_stream_global_limit = size;
+}
+
+size_t vbuffer_stream_global_memory()
+{
+	return atomic64_get(&vbuffer_stream_total);
+}
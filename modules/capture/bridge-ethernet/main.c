@@ -253,6 +253,8 @@ static int packet_do_receive(struct capture_module_state *state, struct packet *
 	int ret;
 	fd_set read_set;
 	int max_fd = -1;
+	int timer_fd;
+	struct timeval timeout;
 
 	// Read packet
 	FD_ZERO(&read_set);
@@ -266,7 +268,13 @@ static int packet_do_receive(struct capture_module_state *state, struct packet *
 	FD_SET(engine_thread_interrupt_fd(), &read_set);
 	if (engine_thread_interrupt_fd() > max_fd) max_fd = engine_thread_interrupt_fd();
 
-	ret = select(max_fd+1, &read_set, NULL, NULL, NULL);
+	timer_fd = packet_timer_fd();
+	if (timer_fd >= 0) {
+		FD_SET(timer_fd, &read_set);
+		if (timer_fd > max_fd) max_fd = timer_fd;
+	}
+
+	ret = select(max_fd+1, &read_set, NULL, NULL, engine_thread_idle_timeout(&timeout));
 	if (ret < 0) {
 		if (errno == EINTR) {
 			return 0;
@@ -275,10 +283,15 @@ static int packet_do_receive(struct capture_module_state *state, struct packet *
 			return 1;
 		}
 	}
+	else if (ret == 0) {
+		return 0;
+	}
 
-	// Check for interrupt
+	// Check for interrupt or expired timers
 	if (FD_ISSET(engine_thread_interrupt_fd(), &read_set))
 		return 0;
+	if (timer_fd >= 0 && FD_ISSET(timer_fd, &read_set))
+		return 0;
 
 	// Check bypass first
 	if (state->bypass) {
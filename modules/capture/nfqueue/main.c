@@ -57,6 +57,7 @@ struct capture_module_state {
 
 	struct nfqueue_packet      *current_packet; /* Packet allocated by nfq callback */
 	int                         error;
+	struct vbuffer_data        *receive_ref; /* Packet data still pointing to receive_buffer */
 	char                        receive_buffer[PACKET_RECV_SIZE];
 };
 
@@ -67,10 +68,12 @@ struct nfqueue_packet {
 	struct capture_module_state *state;
 	int                          id; /* nfq identifier */
 	struct time                  timestamp;
+	enum packet_checksum         checksum;
 };
 
 bool use_multithreading = true;
 size_t nfqueue_len = 1024;
+static bool kernel_checksum = true;
 
 /* Iptables rules to add (iptables-restore format) */
 static const char iptables_config_template_begin[] =
@@ -250,8 +253,10 @@ static int packet_callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
 
 	memset(state->current_packet, 0, sizeof(struct nfqueue_packet));
 
-	if (!vbuffer_create_from(&state->current_packet->core_packet.payload,
-	    (char *)packet_data, packet_len)) {
+	/* The payload references the receive buffer, it will be copied if it is
+	 * modified or still in use when the next packet is received */
+	if (!vbuffer_create_external(&state->current_packet->core_packet.payload,
+	    (const uint8 *)packet_data, packet_len, NULL, NULL, &state->receive_ref)) {
 		free(state->current_packet);
 		state->error = ENOMEM;
 		return 0;
@@ -260,9 +265,37 @@ static int packet_callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
 	time_gettimestamp(&state->current_packet->timestamp);
 	state->current_packet->id = ntohl(packet_hdr->packet_id);
 
+#ifdef NFQ_HAS_SKBINFO
+	/* The ip header checksum is always checked by the kernel before the
+	 * packet is queued, the flags tell about the transport checksum */
+	if (kernel_checksum) {
+		const uint32 skbinfo = nfq_get_skbinfo(nfad);
+		if (skbinfo & NFQA_SKB_CSUMNOTREADY) {
+			state->current_packet->checksum = CHECKSUM_PARTIAL;
+		}
+		else if (!(skbinfo & NFQA_SKB_CSUM_NOTVERIFIED)) {
+			state->current_packet->checksum = CHECKSUM_VERIFIED;
+		}
+	}
+#endif
+
 	return 0;
 }
 
+static bool reclaim_receive_buffer(struct capture_module_state *state)
+{
+	if (state->receive_ref) {
+		if (!vbuffer_external_reclaim(state->receive_ref)) {
+			LOG_ERROR(capture, "unable to release receive buffer: %s", clear_error());
+			return false;
+		}
+
+		state->receive_ref = NULL;
+	}
+
+	return true;
+}
+
 static void cleanup_state(struct capture_module_state *state)
 {
 	if (state->queue)
@@ -276,7 +309,10 @@ static void cleanup_state(struct capture_module_state *state)
 	if (state->send_fd >= 0) close(state->send_fd);
 	if (state->send_mark_fd >= 0) close(state->send_mark_fd);
 
-	free(state);
+	/* Keep the state allocated if some packets still use the receive buffer */
+	if (reclaim_receive_buffer(state)) {
+		free(state);
+	}
 }
 
 static int open_send_socket(bool mark)
@@ -338,6 +374,8 @@ static struct capture_module_state *init_state(int thread_id)
 	state->queue = NULL;
 	state->send_fd = -1;
 	state->send_mark_fd = -1;
+	state->current_packet = NULL;
+	state->receive_ref = NULL;
 
 	/* Setup nfqueue connection */
 	state->handle = nfq_open();
@@ -574,6 +612,13 @@ static int init(struct parameters *args)
 
 	free(new_iptables_config);
 
+	kernel_checksum = parameters_get_boolean(args, "kernel_checksum", true);
+#ifndef NFQ_HAS_SKBINFO
+	if (kernel_checksum) {
+		LOG_INFO(capture, "kernel checksum status is not supported by the netfilter queue library");
+	}
+#endif
+
 	/* Setup pcap dump */
 	dump = parameters_get_boolean(args, "dump", false);
 	if (dump) {
@@ -637,7 +682,9 @@ static int packet_do_receive(struct capture_module_state *state, struct packet *
 	int rv;
 	fd_set read_set;
 	int max_fd = -1;
+	struct timeval timeout;
 	const int interrupt_fd = engine_thread_interrupt_fd();
+	const int timer_fd = packet_timer_fd();
 
 	FD_ZERO(&read_set);
 
@@ -647,7 +694,12 @@ static int packet_do_receive(struct capture_module_state *state, struct packet *
 	FD_SET(interrupt_fd, &read_set);
 	if (interrupt_fd > max_fd) max_fd = interrupt_fd;
 
-	rv = select(max_fd+1, &read_set, NULL, NULL, NULL);
+	if (timer_fd >= 0) {
+		FD_SET(timer_fd, &read_set);
+		if (timer_fd > max_fd) max_fd = timer_fd;
+	}
+
+	rv = select(max_fd+1, &read_set, NULL, NULL, engine_thread_idle_timeout(&timeout));
 	if (rv <= 0) {
 		if (rv == -1 && errno != EINTR) {
 			LOG_ERROR(capture, "packet reception failed, %s", errno_error(errno));
@@ -656,6 +708,10 @@ static int packet_do_receive(struct capture_module_state *state, struct packet *
 	}
 
 	if (FD_ISSET(state->fd, &read_set)) {
+		if (!reclaim_receive_buffer(state)) {
+			return ENOMEM;
+		}
+
 		rv = recv(state->fd, state->receive_buffer, sizeof(state->receive_buffer), 0);
 		if (rv < 0) {
 			if (errno != EINTR) {
@@ -847,6 +903,12 @@ static const struct time *get_timestamp(struct packet *orig_pkt)
 	return &pkt->timestamp;
 }
 
+static enum packet_checksum get_checksum(struct packet *orig_pkt)
+{
+	struct nfqueue_packet *pkt = (struct nfqueue_packet*)orig_pkt;
+	return pkt->checksum;
+}
+
 static bool is_realtime()
 {
 	return true;
@@ -876,5 +938,6 @@ struct capture_module HAKA_MODULE = {
 	new_packet:      new_packet,
 	send_packet:     send_packet,
 	get_mtu:         get_mtu,
-	get_timestamp:   get_timestamp
+	get_timestamp:   get_timestamp,
+	get_checksum:    get_checksum
 };
@@ -16,6 +16,7 @@ struct pcap_capture {
 	FILE         *file;
 	size_t        file_size;
 	struct time   last_progress;
+	struct vbuffer_data *data;    /* Last packet data still pointing to the pcap memory */
 };
 
 /*
@@ -168,6 +168,20 @@ static bool pass_through()
 	return passthrough;
 }
 
+static bool reclaim_pcap_data(struct pcap_capture *pd)
+{
+	if (pd->data) {
+		if (!vbuffer_external_reclaim(pd->data)) {
+			LOG_ERROR(capture, "unable to release packet data: %s", clear_error());
+			return false;
+		}
+
+		pd->data = NULL;
+	}
+
+	return true;
+}
+
 static void cleanup_state(struct capture_module_state *state)
 {
 	int i;
@@ -183,7 +197,8 @@ static void cleanup_state(struct capture_module_state *state)
 	}
 
 	for (i=0; i<state->pd_count; ++i) {
-		if (state->pd[i].pd) {
+		/* The pcap handle is kept open if some packets still use its memory */
+		if (state->pd[i].pd && reclaim_pcap_data(&state->pd[i])) {
 			pcap_close(state->pd[i].pd);
 			state->pd[i].pd = NULL;
 		}
@@ -346,6 +361,8 @@ static int packet_do_receive(struct capture_module_state *state, struct packet *
 		int ret;
 		fd_set read_set;
 		int max_fd = -1;
+		int timer_fd;
+		struct timeval timeout;
 
 		/* read packet */
 		FD_ZERO(&read_set);
@@ -365,7 +382,13 @@ static int packet_do_receive(struct capture_module_state *state, struct packet *
 		FD_SET(engine_thread_interrupt_fd(), &read_set);
 		if (engine_thread_interrupt_fd() > max_fd) max_fd = engine_thread_interrupt_fd();
 
-		ret = select(max_fd+1, &read_set, NULL, NULL, NULL);
+		timer_fd = packet_timer_fd();
+		if (timer_fd >= 0) {
+			FD_SET(timer_fd, &read_set);
+			if (timer_fd > max_fd) max_fd = timer_fd;
+		}
+
+		ret = select(max_fd+1, &read_set, NULL, NULL, engine_thread_idle_timeout(&timeout));
 		if (ret < 0) {
 			if (errno == EINTR) {
 				return 0;
@@ -396,6 +419,11 @@ static int packet_do_receive(struct capture_module_state *state, struct packet *
 				return 0;
 			}
 
+			/* The data of the previous packet will be overwritten */
+			if (!reclaim_pcap_data(pd)) {
+				return ENOMEM;
+			}
+
 			ret = pcap_next_ex(pd->pd, &header, &p);
 			if (ret == -1) {
 				LOG_ERROR(capture, "%s", pcap_geterr(pd->pd));
@@ -428,7 +456,7 @@ static int packet_do_receive(struct capture_module_state *state, struct packet *
 
 				list_init(packet);
 
-				if (!vbuffer_create_from(&packet->data, (char *)p, header->caplen)) {
+				if (!vbuffer_create_external(&packet->data, p, header->caplen, NULL, NULL, &pd->data)) {
 					free(packet);
 					return ENOMEM;
 				}
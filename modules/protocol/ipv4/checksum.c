@@ -0,0 +1,291 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "haka/ipv4.h"
+
+#include <string.h>
+
+#include <haka/compiler.h>
+#include <haka/error.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_SIMD
+#include <immintrin.h>
+#endif
+
+
+/* compute inet checksum RFC #1071 */
+
+struct checksum_partial checksum_partial_init = { false, 0, 0 };
+
+typedef union {
+	uint8   c[2];
+	uint16  s;
+} swap_util_t;
+
+/*
+ * The kernels sum the 16 bits words of a block of even size in the host
+ * byte order. The ones' complement sum does not depend on the width of the
+ * accumulator as long as the carries are added back, so wider accumulators
+ * are used and the sum is only folded at the end.
+ */
+
+static uint32 checksum_fold(uint64 sum)
+{
+	sum = (sum & 0xffffffffULL) + (sum >> 32);
+	sum = (sum & 0xffffffffULL) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+static uint64 checksum_block_scalar(const uint8 *ptr, size_t len)
+{
+	uint64 sum = 0, sum2 = 0;
+	uint32 w[4];
+
+	/* The 32 bits words are equal to the sum of their 16 bits halves
+	 * modulo 0xffff */
+	for (; len >= 16; len -= 16, ptr += 16) {
+		memcpy(w, ptr, 16);
+		sum += w[0]; sum2 += w[1]; sum += w[2]; sum2 += w[3];
+	}
+
+	for (; len >= 4; len -= 4, ptr += 4) {
+		memcpy(w, ptr, 4);
+		sum += w[0];
+	}
+
+	if (len >= 2) {
+		uint16 last;
+		memcpy(&last, ptr, 2);
+		sum += last;
+	}
+
+	return sum + sum2;
+}
+
+#ifdef CHECKSUM_SIMD
+
+/*
+ * The 16 bits words are widened to 32 bits lanes. Each lane gets one word
+ * per iteration, the lanes are flushed to the 64 bits sum before they can
+ * overflow. Several accumulators are used to avoid a dependency chain.
+ */
+#define CHECKSUM_SIMD_BLOCK   32768
+
+__attribute__((target("sse2")))
+static uint64 checksum_block_sse2(const uint8 *ptr, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint64 sum = 0;
+
+	while (len >= 32) {
+		size_t count = len / 32;
+		__m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+		uint64 total;
+
+		if (count > CHECKSUM_SIMD_BLOCK) count = CHECKSUM_SIMD_BLOCK;
+		len -= count * 32;
+
+		for (; count > 0; --count, ptr += 32) {
+			const __m128i data0 = _mm_loadu_si128((const __m128i *)ptr);
+			const __m128i data1 = _mm_loadu_si128((const __m128i *)(ptr + 16));
+			acc0 = _mm_add_epi32(acc0, _mm_unpacklo_epi16(data0, zero));
+			acc1 = _mm_add_epi32(acc1, _mm_unpackhi_epi16(data0, zero));
+			acc2 = _mm_add_epi32(acc2, _mm_unpacklo_epi16(data1, zero));
+			acc3 = _mm_add_epi32(acc3, _mm_unpackhi_epi16(data1, zero));
+		}
+
+		/* Widen the lanes to 64 bits before summing them */
+		acc0 = _mm_add_epi64(_mm_add_epi64(_mm_unpacklo_epi32(acc0, zero), _mm_unpackhi_epi32(acc0, zero)),
+				_mm_add_epi64(_mm_unpacklo_epi32(acc1, zero), _mm_unpackhi_epi32(acc1, zero)));
+		acc2 = _mm_add_epi64(_mm_add_epi64(_mm_unpacklo_epi32(acc2, zero), _mm_unpackhi_epi32(acc2, zero)),
+				_mm_add_epi64(_mm_unpacklo_epi32(acc3, zero), _mm_unpackhi_epi32(acc3, zero)));
+		acc0 = _mm_add_epi64(acc0, acc2);
+		acc0 = _mm_add_epi64(acc0, _mm_unpackhi_epi64(acc0, acc0));
+		_mm_storel_epi64((__m128i *)&total, acc0);
+		sum += total;
+	}
+
+	return sum + checksum_block_scalar(ptr, len);
+}
+
+__attribute__((target("avx2")))
+static uint64 checksum_block_avx2(const uint8 *ptr, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	uint64 sum = 0;
+
+	while (len >= 64) {
+		size_t count = len / 64;
+		__m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+		__m128i total;
+		uint64 value;
+
+		if (count > CHECKSUM_SIMD_BLOCK) count = CHECKSUM_SIMD_BLOCK;
+		len -= count * 64;
+
+		for (; count > 0; --count, ptr += 64) {
+			const __m256i data0 = _mm256_loadu_si256((const __m256i *)ptr);
+			const __m256i data1 = _mm256_loadu_si256((const __m256i *)(ptr + 32));
+			acc0 = _mm256_add_epi32(acc0, _mm256_unpacklo_epi16(data0, zero));
+			acc1 = _mm256_add_epi32(acc1, _mm256_unpackhi_epi16(data0, zero));
+			acc2 = _mm256_add_epi32(acc2, _mm256_unpacklo_epi16(data1, zero));
+			acc3 = _mm256_add_epi32(acc3, _mm256_unpackhi_epi16(data1, zero));
+		}
+
+		acc0 = _mm256_add_epi64(_mm256_add_epi64(_mm256_unpacklo_epi32(acc0, zero), _mm256_unpackhi_epi32(acc0, zero)),
+				_mm256_add_epi64(_mm256_unpacklo_epi32(acc1, zero), _mm256_unpackhi_epi32(acc1, zero)));
+		acc2 = _mm256_add_epi64(_mm256_add_epi64(_mm256_unpacklo_epi32(acc2, zero), _mm256_unpackhi_epi32(acc2, zero)),
+				_mm256_add_epi64(_mm256_unpacklo_epi32(acc3, zero), _mm256_unpackhi_epi32(acc3, zero)));
+		acc0 = _mm256_add_epi64(acc0, acc2);
+
+		total = _mm_add_epi64(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1));
+		total = _mm_add_epi64(total, _mm_unpackhi_epi64(total, total));
+		_mm_storel_epi64((__m128i *)&value, total);
+		sum += value;
+	}
+
+	/* Avoid the transition penalty in the following SSE code */
+	_mm256_zeroupper();
+
+	return sum + checksum_block_sse2(ptr, len);
+}
+
+#endif /* CHECKSUM_SIMD */
+
+typedef uint64 (*checksum_block_func)(const uint8 *ptr, size_t len);
+
+static checksum_block_func checksum_block = checksum_block_scalar;
+
+static checksum_block_func checksum_impl(enum inet_checksum_impl impl)
+{
+	switch (impl) {
+	case INET_CHECKSUM_SCALAR:
+		return checksum_block_scalar;
+
+#ifdef CHECKSUM_SIMD
+	case INET_CHECKSUM_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2") ? checksum_block_sse2 : NULL;
+
+	case INET_CHECKSUM_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") ? checksum_block_avx2 : NULL;
+#endif
+
+	default:
+		return NULL;
+	}
+}
+
+bool inet_checksum_select(enum inet_checksum_impl impl)
+{
+	checksum_block_func func = checksum_impl(impl);
+	if (!func) {
+		error("unsupported checksum implementation");
+		return false;
+	}
+
+	checksum_block = func;
+	return true;
+}
+
+INIT static void inet_checksum_init()
+{
+	checksum_block_func func = checksum_impl(INET_CHECKSUM_AVX2);
+	if (!func) func = checksum_impl(INET_CHECKSUM_SSE2);
+	if (func) checksum_block = func;
+}
+
+void inet_checksum_partial(struct checksum_partial *csum, const uint8 *ptr, size_t size)
+{
+	uint64 sum = (uint32)csum->csum;
+	swap_util_t swap_util;
+
+	if (size == 0) return;
+
+	if (csum->odd) {
+		/* The last partial checksum len was not even. We need to take
+		 * the leftover char into account.
+		 */
+		swap_util.c[0] = csum->leftover;
+		swap_util.c[1] = *ptr++;
+		sum += swap_util.s;
+		size--;
+	}
+
+	sum += checksum_block(ptr, size & ~(size_t)1);
+
+	/* Update csum context */
+	csum->odd = (size & 1) != 0;
+	if (csum->odd) {
+		csum->leftover = ptr[size-1];
+	}
+
+	csum->csum = checksum_fold(sum);
+}
+
+int16 inet_checksum_reduce(struct checksum_partial *csum)
+{
+	uint64 sum = (uint32)csum->csum;
+
+	if (csum->odd) {
+		swap_util_t swap_util;
+		swap_util.c[0] = csum->leftover;
+		swap_util.c[1] = 0;
+		sum += swap_util.s;
+	}
+
+	return (~checksum_fold(sum) & 0xffff);
+}
+
+/* Update a checksum for the modification of some data, using the eqn. 3
+ * of RFC 1624: HC' = ~(~HC + ~m + m') */
+uint16 inet_checksum_update(uint16 checksum, const uint8 *old, const uint8 *new, size_t size)
+{
+	uint64 sum = (uint16)~checksum;
+	uint16 m, mnew;
+	size_t i;
+
+	for (i=0; i+1<size; i+=2) {
+		memcpy(&m, old+i, 2);
+		memcpy(&mnew, new+i, 2);
+
+		if (m != mnew) {
+			sum += (uint16)~m;
+			sum += mnew;
+		}
+	}
+
+	return (~checksum_fold(sum) & 0xffff);
+}
+
+int16 inet_checksum(const uint8 *ptr, size_t size)
+{
+	struct checksum_partial csum = checksum_partial_init;
+	inet_checksum_partial(&csum, ptr, size);
+	return inet_checksum_reduce(&csum);
+}
+
+void inet_checksum_vbuffer_partial(struct checksum_partial *csum, struct vbuffer_sub *buf)
+{
+	struct vbuffer_sub_mmap iter = vbuffer_mmap_init;
+	uint8 *data;
+	size_t len;
+
+	while ((data = vbuffer_mmap(buf, &len, false, &iter, NULL))) {
+		if (len > 0) {
+			inet_checksum_partial(csum, data, len);
+		}
+	}
+}
+
+int16 inet_checksum_vbuffer(struct vbuffer_sub *buf)
+{
+	struct checksum_partial csum = checksum_partial_init;
+	inet_checksum_vbuffer_partial(&csum, buf);
+	return inet_checksum_reduce(&csum);
+}
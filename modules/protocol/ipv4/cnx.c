@@ -11,14 +11,31 @@
 #include <haka/thread.h>
 #include <haka/log.h>
 #include <haka/error.h>
+#include <haka/metrics.h>
+#include <haka/packet.h>
+#include <haka/timer.h>
 #include <haka/container/hash.h>
+#include <haka/container/list2.h>
 
 static REGISTER_LOG_SECTION(conn);
 
+static struct metric cnx_count_metric = METRIC_GAUGE("connections", "Number of tracked connections");
+static struct metric cnx_total_metric = METRIC_COUNTER("connections_total", "Number of created connections");
+static struct metric cnx_expired_metric = METRIC_COUNTER("connections_expired_total", "Number of idle connections expired");
+
+/*
+ * Idle connections are aged in a ring of buckets. Each bucket holds the
+ * connections whose last activity happened in the same period of
+ * bucket_width seconds, and the whole buckets older than the idle timeout
+ * are swept at once.
+ */
+#define CNX_AGING_BUCKETS 16
+
 #define CNX_ELEM(var) ((struct cnx_table_elem *)((uint8 *)var - offsetof(struct cnx_table_elem, cnx)))
 
 struct cnx_table_elem {
 	hash_head_t       hh;
+	struct list2_elem aging;
 	struct cnx_table *table;
 	struct cnx        cnx;
 };
@@ -28,6 +45,13 @@ struct cnx_table {
 	struct cnx_table_elem  *head;
 	void                  (*cnx_release)(struct cnx *, bool);
 	atomic_t                id;
+	uint32                  idle_timeout;
+	uint32                  bucket_width;
+	uint64                  swept;          /* First bucket not swept yet */
+	struct list2            buckets[CNX_AGING_BUCKETS];
+	struct timer           *aging_timer;
+	void                  (*expire)(struct cnx *, struct lua_ref *hook);
+	struct lua_ref          expire_hook;
 };
 
 static const size_t hash_keysize = sizeof(struct cnx_key);
@@ -39,6 +63,7 @@ static void cnx_release(struct cnx_table *table, struct cnx_table_elem *elem, bo
 
 struct cnx_table *cnx_table_new(void (*cnx_release)(struct cnx *, bool))
 {
+	int i;
 	struct cnx_table *table = malloc(sizeof(struct cnx_table));
 	if (!table) {
 		error("memory error");
@@ -55,6 +80,16 @@ struct cnx_table *cnx_table_new(void (*cnx_release)(struct cnx *, bool))
 	table->cnx_release = cnx_release;
 	atomic_set(&table->id, 0);
 
+	table->idle_timeout = 0;
+	table->bucket_width = 1;
+	table->swept = 0;
+	for (i=0; i<CNX_AGING_BUCKETS; ++i) {
+		list2_init(&table->buckets[i]);
+	}
+	table->aging_timer = NULL;
+	table->expire = NULL;
+	lua_ref_init(&table->expire_hook);
+
 	return table;
 }
 
@@ -76,12 +111,18 @@ void cnx_table_release(struct cnx_table *table)
 
 	HASH_ITER(hh, table->head, elem, tmp) {
 		HASH_DEL(table->head, elem);
+		metric_dec(&cnx_count_metric);
 
 		cnx_log(elem, "release");
 
 		cnx_release(table, elem, true);
 	}
 
+	if (table->aging_timer) {
+		timer_destroy(table->aging_timer);
+	}
+	lua_ref_clear(&table->expire_hook);
+
 	mutex_destroy(&table->mutex);
 	free(table);
 }
@@ -93,6 +134,9 @@ static void cnx_insert(struct cnx_table *table, struct cnx_table_elem *elem)
 	HASH_ADD(hh, table->head, cnx.key, hash_keysize, elem);
 
 	mutex_unlock(&table->mutex);
+
+	metric_inc(&cnx_count_metric);
+	metric_inc(&cnx_total_metric);
 }
 
 #define EXCHANGE(a, b) { const typeof(a) tmp = a; a = b; b = tmp; }
@@ -139,6 +183,12 @@ static void cnx_remove(struct cnx_table *table, struct cnx_table_elem *elem)
 	mutex_lock(&table->mutex);
 	HASH_DEL(table->head, elem);
 	mutex_unlock(&table->mutex);
+
+	if (list2_elem_check(&elem->aging)) {
+		list2_erase(&elem->aging);
+	}
+
+	metric_dec(&cnx_count_metric);
 }
 
 static void cnx_release(struct cnx_table *table, struct cnx_table_elem *elem, bool freemem)
@@ -154,6 +204,164 @@ static void cnx_release(struct cnx_table *table, struct cnx_table_elem *elem, bo
 	}
 }
 
+static uint64 cnx_bucket(struct cnx_table *table, const struct time *now)
+{
+	return now->secs / table->bucket_width;
+}
+
+static void cnx_touch(struct cnx_table *table, struct cnx_table_elem *elem, const struct time *now)
+{
+	const uint64 bucket = cnx_bucket(table, now);
+
+	if (bucket != elem->cnx.bucket || !list2_elem_check(&elem->aging)) {
+		if (list2_elem_check(&elem->aging)) {
+			list2_erase(&elem->aging);
+		}
+
+		list2_insert(list2_end(&table->buckets[bucket % CNX_AGING_BUCKETS]), &elem->aging);
+		elem->cnx.bucket = bucket;
+	}
+}
+
+static void cnx_table_aging(int count, void *data)
+{
+	struct cnx_table *table = (struct cnx_table *)data;
+	cnx_table_expire(table, time_realm_current_time(&network_time));
+}
+
+static bool cnx_table_start_aging(struct cnx_table *table)
+{
+	struct time width;
+
+	if (!table->aging_timer) {
+		table->aging_timer = time_realm_timer(&network_time, cnx_table_aging, table);
+		if (!table->aging_timer) {
+			return false;
+		}
+	}
+
+	width.secs = table->bucket_width;
+	width.nsecs = 0;
+	return timer_repeat(table->aging_timer, &width);
+}
+
+bool cnx_table_set_idle_timeout(struct cnx_table *table, uint32 timeout,
+		void (*expire)(struct cnx *, struct lua_ref *hook), struct lua_ref *hook)
+{
+	uint32 width;
+
+	if (timeout == 0) {
+		error("invalid idle timeout");
+		return false;
+	}
+
+	/* Keep two spare buckets for the current period and the one being
+	 * swept */
+	width = (timeout + CNX_AGING_BUCKETS - 3) / (CNX_AGING_BUCKETS - 2);
+
+	if (table->idle_timeout && width != table->bucket_width) {
+		/* The bucket numbers of the aged connections are not valid
+		 * anymore, restart their idle time from now */
+		struct cnx_table_elem *elem, *tmp;
+		const struct time *now = time_realm_current_time(&network_time);
+
+		table->bucket_width = width;
+		table->swept = 0;
+
+		mutex_lock(&table->mutex);
+		HASH_ITER(hh, table->head, elem, tmp) {
+			if (list2_elem_check(&elem->aging)) {
+				cnx_touch(table, elem, now);
+			}
+		}
+		mutex_unlock(&table->mutex);
+	}
+
+	table->idle_timeout = timeout;
+	table->bucket_width = width;
+
+	table->expire = expire;
+	lua_ref_clear(&table->expire_hook);
+	if (hook) {
+		table->expire_hook = *hook;
+	}
+
+	/* The timer is started with the first connection if the network time
+	 * is not ready yet */
+	if (table->aging_timer) {
+		return cnx_table_start_aging(table);
+	}
+
+	return true;
+}
+
+int cnx_table_expire(struct cnx_table *table, const struct time *now)
+{
+	struct list2 expired;
+	uint64 cutoff, bucket;
+	int count = 0;
+
+	if (!table->idle_timeout || now->secs < table->idle_timeout) {
+		return 0;
+	}
+
+	/* The connections of the buckets before the cutoff have been idle
+	 * for at least the timeout */
+	cutoff = (now->secs - table->idle_timeout) / table->bucket_width;
+	if (cutoff <= table->swept) {
+		return 0;
+	}
+
+	list2_init(&expired);
+
+	bucket = table->swept;
+	if (cutoff - bucket > CNX_AGING_BUCKETS) {
+		bucket = cutoff - CNX_AGING_BUCKETS;
+	}
+
+	for (; bucket < cutoff; ++bucket) {
+		struct list2 *list = &table->buckets[bucket % CNX_AGING_BUCKETS];
+		list2_iter iter = list2_begin(list);
+		const list2_iter end = list2_end(list);
+
+		while (iter != end) {
+			struct cnx_table_elem *elem = list2_get(iter, struct cnx_table_elem, aging);
+			iter = list2_next(iter);
+
+			/* After a long time jump a bucket can also hold recent
+			 * connections */
+			if (elem->cnx.bucket < cutoff) {
+				list2_erase(&elem->aging);
+				list2_insert(list2_end(&expired), &elem->aging);
+			}
+		}
+	}
+
+	table->swept = cutoff;
+
+	while (!list2_empty(&expired)) {
+		struct cnx_table_elem *elem = list2_first(&expired, struct cnx_table_elem, aging);
+		++count;
+
+		if (elem->cnx.expire_hook && table->expire) {
+			/* The hook is expected to close the connection, otherwise
+			 * it will stay for another timeout */
+			cnx_touch(table, elem, now);
+			table->expire(&elem->cnx, &table->expire_hook);
+		}
+		else {
+			cnx_log(elem, "expiring");
+
+			cnx_remove(table, elem);
+			cnx_release(table, elem, true);
+		}
+
+		metric_inc(&cnx_expired_metric);
+	}
+
+	return count;
+}
+
 struct cnx *cnx_new(struct cnx_table *table, struct cnx_key *key)
 {
 	struct cnx_table_elem *elem;
@@ -182,6 +390,9 @@ struct cnx *cnx_new(struct cnx_table *table, struct cnx_key *key)
 	elem->cnx.key = *key;
 	elem->cnx.id = atomic_inc(&table->id);
 	elem->cnx.dropped = false;
+	elem->cnx.expire_hook = false;
+	elem->cnx.bucket = 0;
+	list2_elem_init(&elem->aging);
 
 	for (i=0; i<CNX_DIR_CNT; ++i) {
 		elem->cnx.stats[i].packets = 0;
@@ -193,6 +404,14 @@ struct cnx *cnx_new(struct cnx_table *table, struct cnx_key *key)
 
 	cnx_insert(table, elem);
 
+	if (table->idle_timeout) {
+		if (!table->aging_timer && !cnx_table_start_aging(table)) {
+			LOG_ERROR(conn, "%s", clear_error());
+		}
+
+		cnx_touch(table, elem, time_realm_current_time(&network_time));
+	}
+
 	cnx_log(elem, "opening");
 
 	return &elem->cnx;
@@ -257,6 +476,60 @@ bool cnx_foreach(struct cnx_table *table, bool include_dropped, bool (*callback)
 	return true;
 }
 
+bool cnx_oldest(struct cnx_table *table, double ratio, bool (*callback)(void *data, struct cnx *, int index), void *data)
+{
+	struct cnx_table_elem *ptr, *tmp;
+	int index = 0, count;
+	double limit;
+
+	mutex_lock(&table->mutex);
+
+	limit = HASH_COUNT(table->head) * ratio;
+	count = limit;
+	if (count < limit || (count == 0 && table->head)) {
+		++count;
+	}
+
+	if (table->idle_timeout) {
+		/* Walk the aging ring from the bucket following the current one,
+		 * which is the oldest period still tracked */
+		const uint64 current = cnx_bucket(table, time_realm_current_time(&network_time));
+		int i;
+
+		for (i=1; i<=CNX_AGING_BUCKETS && index < count; ++i) {
+			struct list2 *list = &table->buckets[(current + i) % CNX_AGING_BUCKETS];
+			list2_iter iter = list2_begin(list);
+			const list2_iter end = list2_end(list);
+
+			for (; iter != end && index < count; iter = list2_next(iter)) {
+				ptr = list2_get(iter, struct cnx_table_elem, aging);
+				if (!ptr->cnx.dropped) {
+					if (!callback(data, &ptr->cnx, index++)) {
+						mutex_unlock(&table->mutex);
+						return false;
+					}
+				}
+			}
+		}
+	}
+	else {
+		/* Without aging, the hash keeps the creation order */
+		HASH_ITER(hh, table->head, ptr, tmp) {
+			if (index >= count) break;
+
+			if (!ptr->cnx.dropped) {
+				if (!callback(data, &ptr->cnx, index++)) {
+					mutex_unlock(&table->mutex);
+					return false;
+				}
+			}
+		}
+	}
+
+	mutex_unlock(&table->mutex);
+	return true;
+}
+
 void cnx_close(struct cnx* cnx)
 {
 	struct cnx_table_elem *elem = CNX_ELEM(cnx);
@@ -281,6 +554,12 @@ void cnx_drop(struct cnx *cnx)
 
 void cnx_update_stat(struct cnx *cnx, int direction, size_t size)
 {
+	struct cnx_table_elem *elem = CNX_ELEM(cnx);
+
 	++cnx->stats[direction].packets;
 	cnx->stats[direction].bytes += size;
+
+	if (elem->table->idle_timeout) {
+		cnx_touch(elem->table, elem, time_realm_current_time(&network_time));
+	}
 }
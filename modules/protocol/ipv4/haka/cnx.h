@@ -6,6 +6,7 @@
 #define HAKA_PROTO_IPV4_CNX_H
 
 #include <haka/types.h>
+#include <haka/time.h>
 #include <haka/ipv4.h>
 #include <haka/lua/ref.h>
 #include <haka/lua/object.h>
@@ -35,12 +36,18 @@ struct cnx {
 	bool                 dropped;
 	struct lua_ref       lua_priv;
 	uint32               id;
+	uint64               bucket;       /* Last activity bucket */
+	bool                 expire_hook;  /* Call the table expire hook when idle instead of closing */
 	void                *priv;
 };
 
 struct cnx_table *cnx_table_new(void (*cnx_release)(struct cnx *, bool));
 void              cnx_table_release(struct cnx_table *table);
+bool              cnx_table_set_idle_timeout(struct cnx_table *table, uint32 timeout,
+		void (*expire)(struct cnx *, struct lua_ref *hook), struct lua_ref *hook);
+int               cnx_table_expire(struct cnx_table *table, const struct time *now);
 bool              cnx_foreach(struct cnx_table *table, bool include_dropped, bool (*callback)(void *data, struct cnx *, int index), void *data);
+bool              cnx_oldest(struct cnx_table *table, double ratio, bool (*callback)(void *data, struct cnx *, int index), void *data);
 
 struct cnx *cnx_new(struct cnx_table *table, struct cnx_key *key);
 struct cnx *cnx_get(struct cnx_table *table, struct cnx_key *key, int *direction, bool *dropped);
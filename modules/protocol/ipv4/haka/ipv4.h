@@ -72,6 +72,8 @@ struct ipv4 {
 	struct vbuffer          packet_payload;
 	struct vbuffer_stream   reassembled_payload;
 	size_t                  reassembled_offset;
+	ipv4addr                captured_src; /* addresses of the captured header, network byte order */
+	ipv4addr                captured_dst;
 	bool                    invalid_checksum:1;
 	bool                    dont_reassemble:1;
 	bool                    reassembled:1;
@@ -81,9 +83,15 @@ struct ipv4 {
 /** \cond */
 struct ipv4 *ipv4_dissect(struct packet *packet);
 struct ipv4 *ipv4_reassemble(struct ipv4 *ip);
+void ipv4_frag_set_timeout(double secs);
+void ipv4_frag_set_limits(size_t datagram, size_t global);
+size_t ipv4_frag_memory();
+void ipv4_frag_cleanup();
 struct ipv4 *ipv4_create(struct packet *packet);
 struct packet *ipv4_forge(struct ipv4 *ip);
 struct ipv4_header *ipv4_header(struct ipv4 *ip, bool write);
+struct ipv4_header *ipv4_header_update_begin(struct ipv4 *ip, struct ipv4_header *old);
+void ipv4_header_update_end(struct ipv4 *ip, struct ipv4_header *header, const struct ipv4_header *old);
 void ipv4_release(struct ipv4 *ip);
 bool ipv4_verify_checksum(struct ipv4 *ip);
 void ipv4_compute_checksum(struct ipv4 *ip);
@@ -105,12 +113,24 @@ int16 inet_checksum_vbuffer(struct vbuffer_sub *buf);
 void  inet_checksum_partial(struct checksum_partial *csum, const uint8 *ptr, size_t size);
 void  inet_checksum_vbuffer_partial(struct checksum_partial *csum, struct vbuffer_sub *buf);
 int16 inet_checksum_reduce(struct checksum_partial *csum);
+uint16 inet_checksum_update(uint16 checksum, const uint8 *old, const uint8 *new, size_t size);
+
+enum inet_checksum_impl {
+	INET_CHECKSUM_SCALAR,
+	INET_CHECKSUM_SSE2,
+	INET_CHECKSUM_AVX2,
+};
+
+/* The best implementation supported by the cpu is selected at load time */
+bool  inet_checksum_select(enum inet_checksum_impl impl);
 
 
+/* The setters update the header checksum incrementally (RFC 1624) */
 #define IPV4_GETSET_FIELD(type, field) \
 		INLINE type ipv4_get_##field(struct ipv4 *ip) { IPV4_CHECK(ip, 0); return SWAP_FROM_IPV4(type, ipv4_header(ip, false)->field); } \
-		INLINE void ipv4_set_##field(struct ipv4 *ip, type v) { IPV4_CHECK(ip); \
-			struct ipv4_header *header = ipv4_header(ip, true); if (header) { header->field = SWAP_TO_IPV4(type, v); } }
+		INLINE void ipv4_set_##field(struct ipv4 *ip, type v) { IPV4_CHECK(ip); struct ipv4_header old; \
+			struct ipv4_header *header = ipv4_header_update_begin(ip, &old); \
+			if (header) { header->field = SWAP_TO_IPV4(type, v); ipv4_header_update_end(ip, header, &old); } }
 
 IPV4_GETSET_FIELD(uint8, version);
 IPV4_GETSET_FIELD(uint8, tos);
@@ -131,9 +151,12 @@ INLINE uint8 ipv4_get_hdr_len(struct ipv4 *ip)
 INLINE void ipv4_set_hdr_len(struct ipv4 *ip, uint8 v)
 {
 	IPV4_CHECK(ip);
-	struct ipv4_header *header = ipv4_header(ip, true);
-	if (header)
-		ipv4_header(ip, true)->hdr_len = v >> IPV4_HDR_LEN_OFFSET;
+	struct ipv4_header old;
+	struct ipv4_header *header = ipv4_header_update_begin(ip, &old);
+	if (header) {
+		header->hdr_len = v >> IPV4_HDR_LEN_OFFSET;
+		ipv4_header_update_end(ip, header, &old);
+	}
 }
 
 INLINE uint16 ipv4_get_frag_offset(struct ipv4 *ip)
@@ -147,9 +170,12 @@ INLINE uint16 ipv4_get_frag_offset(struct ipv4 *ip)
 INLINE void ipv4_set_frag_offset(struct ipv4 *ip, uint16 v)
 {
 	IPV4_CHECK(ip);
-	struct ipv4_header *header = ipv4_header(ip, true);
-	if (header)
+	struct ipv4_header old;
+	struct ipv4_header *header = ipv4_header_update_begin(ip, &old);
+	if (header) {
 		header->fragment = IPV4_SET_BITS(uint16, header->fragment, IPV4_FRAGMENTOFFSET_BITS, v >> IPV4_FRAGMENTOFFSET_OFFSET);
+		ipv4_header_update_end(ip, header, &old);
+	}
 }
 
 INLINE uint16 ipv4_get_flags(struct ipv4 *ip)
@@ -163,9 +189,12 @@ INLINE uint16 ipv4_get_flags(struct ipv4 *ip)
 INLINE void ipv4_set_flags(struct ipv4 *ip, uint16 v)
 {
 	IPV4_CHECK(ip);
-	struct ipv4_header *header = ipv4_header(ip, true);
-	if (header)
+	struct ipv4_header old;
+	struct ipv4_header *header = ipv4_header_update_begin(ip, &old);
+	if (header) {
 		header->fragment = IPV4_SET_BITS(uint16, header->fragment, IPV4_FLAG_BITS, v);
+		ipv4_header_update_end(ip, header, &old);
+	}
 }
 
 #define IPV4_GETSET_FLAG(name, flag) \
@@ -177,9 +206,11 @@ INLINE void ipv4_set_flags(struct ipv4 *ip, uint16 v)
 		} \
 		INLINE void ipv4_set_flags_##name(struct ipv4 *ip, bool v) { \
 			IPV4_CHECK(ip); \
-			struct ipv4_header *header = ipv4_header(ip, true); \
+			struct ipv4_header old; \
+			struct ipv4_header *header = ipv4_header_update_begin(ip, &old); \
 			if (header) { \
 				header->fragment = IPV4_SET_BIT(uint16, header->fragment, flag, v); \
+				ipv4_header_update_end(ip, header, &old); \
 			} \
 		}
 
@@ -13,6 +13,8 @@
 #include <haka/alert.h>
 #include <haka/error.h>
 #include <haka/string.h>
+#include <haka/metrics.h>
+#include <haka/timer.h>
 #include <haka/container/hash.h>
 
 
@@ -26,37 +28,42 @@ struct ipv4_frag_key {
 struct ipv4_frag_elem {
 	hash_head_t       hh;
 	struct list2      list;
+	struct time       expires;
+	size_t            size; /* bytes held by the fragments */
 };
 
+/*
+ * Each packet thread owns a fragment table. The captures dispatch the
+ * packets to the threads using a hash of the addresses, so all the fragments
+ * of a datagram are handled by the same thread. The datagrams are kept in
+ * arrival order in the table, the oldest ones expire first.
+ */
 struct ipv4_frag_table {
-	mutex_t                 mutex;
+	struct list2_elem       list;
 	struct ipv4_frag_elem  *head;
+	struct timer           *timer;
+	struct time             timeout; /* Timeout of the datagrams of the table */
 };
 
+#define IPV4_FRAG_TIMEOUT          30
+#define IPV4_FRAG_DATAGRAM_LIMIT   (128*1024)
+#define IPV4_FRAG_GLOBAL_LIMIT     (4*1024*1024)
+
 static const size_t hash_keysize = sizeof(struct ipv4_frag_key);
 
-static struct ipv4_frag_table *ipv4_frag_global;
+static struct metric ipv4_frag_metric = METRIC_COUNTER("ipv4_fragments_total", "Number of received ipv4 fragments");
+static struct metric ipv4_reassembled_metric = METRIC_COUNTER("ipv4_reassembled_total", "Number of reassembled ipv4 packets");
+static struct metric ipv4_frag_evicted_metric = METRIC_COUNTER("ipv4_fragments_evicted_total", "Number of ipv4 fragments dropped on timeout or memory limit");
+static struct metric ipv4_frag_overlap_metric = METRIC_COUNTER("ipv4_fragments_overlapping_total", "Number of ipv4 fragments overlapping another fragment");
+static struct metric ipv4_frag_bytes_metric = METRIC_GAUGE("ipv4_fragments_bytes", "Number of bytes held by the ipv4 fragment tables");
 
-static struct ipv4_frag_table *ipv4_frag_table_new()
-{
-	struct ipv4_frag_table *table = malloc(sizeof(struct ipv4_frag_table));
-	if (!table) {
-		error("memory error");
-		return NULL;
-	}
-
-	/* Init a recursive mutex to avoid dead-lock on signal handling when
-	 * running in single thread mode.
-	 */
-	UNUSED bool ret = mutex_init(&table->mutex, true);
-	if (!ret) {
-		assert(check_error());
-		return NULL;
-	}
-
-	table->head = NULL;
-	return table;
-}
+static local_storage_t ipv4_frag_local;
+static mutex_t ipv4_frag_tables_mutex;
+static struct list2 ipv4_frag_tables;
+static atomic64_t ipv4_frag_total;
+static struct time ipv4_frag_timeout = { IPV4_FRAG_TIMEOUT, 0 };
+static size_t ipv4_frag_datagram_limit = IPV4_FRAG_DATAGRAM_LIMIT;
+static size_t ipv4_frag_global_limit = IPV4_FRAG_GLOBAL_LIMIT;
 
 static void raise_alert(struct ipv4 *ip, char *message)
 {
@@ -84,6 +91,130 @@ static void raise_alert(struct ipv4 *ip, char *message)
 	}
 }
 
+static size_t ipv4_frag_len(struct ipv4 *pkt)
+{
+	const ssize_t len = ipv4_get_len(pkt) - ipv4_get_hdr_len(pkt);
+	assert(len >= 0);
+	return len;
+}
+
+static size_t ipv4_frag_size(struct ipv4 *pkt)
+{
+	return ipv4_get_hdr_len(pkt) + vbuffer_size(&pkt->packet_payload);
+}
+
+static void ipv4_frag_account(struct ipv4_frag_elem *elem, int64 delta)
+{
+	elem->size += delta;
+	atomic64_add(&ipv4_frag_total, delta);
+	metric_add(&ipv4_frag_bytes_metric, delta);
+}
+
+/* Drop a fragment that was removed from its datagram list */
+static void ipv4_frag_drop(struct ipv4_frag_elem *elem, struct ipv4 *pkt)
+{
+	ipv4_frag_account(elem, -(int64)ipv4_frag_size(pkt));
+	ipv4_action_drop(pkt);
+	ipv4_release(pkt);
+}
+
+static void ipv4_frag_evict(struct ipv4_frag_table *table, struct ipv4_frag_elem *elem)
+{
+	list2_iter iter = list2_begin(&elem->list);
+	const list2_iter end = list2_end(&elem->list);
+
+	while (iter != end) {
+		struct ipv4 *cur = list2_get(iter, struct ipv4, frag_list);
+		iter = list2_erase(iter);
+
+		metric_inc(&ipv4_frag_evicted_metric);
+		ipv4_frag_drop(elem, cur);
+	}
+
+	HASH_DEL(table->head, elem);
+	free(elem);
+}
+
+static void ipv4_frag_table_expire(struct ipv4_frag_table *table)
+{
+	const struct time *now = time_realm_current_time(&network_time);
+	struct ipv4_frag_elem *elem, *tmp;
+	struct time delay;
+
+	HASH_ITER(hh, table->head, elem, tmp) {
+		if (time_cmp(&elem->expires, now) > 0) break;
+		ipv4_frag_evict(table, elem);
+	}
+
+	/* Wait for the next datagram to expire */
+	if (table->head) {
+		time_diff(&delay, &table->head->expires, now);
+		if (!timer_once(table->timer, &delay)) {
+			assert(check_error());
+			clear_error();
+		}
+	}
+}
+
+/* Apply a new reassembly timeout to the datagrams already held. They are
+ * all moved by the same delay, so they stay sorted by expiration time.
+ * The caller must expire the table if the timeout changed. */
+static bool ipv4_frag_table_update_timeout(struct ipv4_frag_table *table)
+{
+	const struct time timeout = ipv4_frag_timeout;
+	struct ipv4_frag_elem *elem, *tmp;
+	struct time arrival;
+
+	if (time_cmp(&table->timeout, &timeout) == 0) return false;
+
+	HASH_ITER(hh, table->head, elem, tmp) {
+		time_diff(&arrival, &elem->expires, &table->timeout);
+		time_add(&elem->expires, &arrival, &timeout);
+	}
+
+	table->timeout = timeout;
+	return true;
+}
+
+static void ipv4_frag_timeout_callback(int count, void *data)
+{
+	struct ipv4_frag_table *table = (struct ipv4_frag_table *)data;
+
+	ipv4_frag_table_update_timeout(table);
+	ipv4_frag_table_expire(table);
+}
+
+static struct ipv4_frag_table *ipv4_frag_table_get()
+{
+	struct ipv4_frag_table *table = local_storage_get(&ipv4_frag_local);
+	if (!table) {
+		table = malloc(sizeof(struct ipv4_frag_table));
+		if (!table) {
+			error("memory error");
+			return NULL;
+		}
+
+		table->timer = time_realm_timer(&network_time, ipv4_frag_timeout_callback, table);
+		if (!table->timer) {
+			assert(check_error());
+			free(table);
+			return NULL;
+		}
+
+		table->head = NULL;
+		table->timeout = ipv4_frag_timeout;
+		list2_elem_init(&table->list);
+
+		mutex_lock(&ipv4_frag_tables_mutex);
+		list2_insert(list2_end(&ipv4_frag_tables), &table->list);
+		mutex_unlock(&ipv4_frag_tables_mutex);
+
+		local_storage_set(&ipv4_frag_local, table);
+	}
+
+	return table;
+}
+
 static void ipv4_frag_table_release(struct ipv4_frag_table *table)
 {
 	struct ipv4_frag_elem *elem, *tmp;
@@ -101,7 +232,7 @@ static void ipv4_frag_table_release(struct ipv4_frag_table *table)
 		free(elem);
 	}
 
-	mutex_destroy(&table->mutex);
+	timer_destroy(table->timer);
 	free(table);
 }
 
@@ -109,29 +240,25 @@ static bool ipv4_frag_check_missing_fragments(struct ipv4_frag_elem *elem)
 {
 	list2_iter iter;
 	const list2_iter end = list2_end(&elem->list);
-	struct ipv4 *last;
+	struct ipv4 *last = list2_last(&elem->list, struct ipv4, frag_list);
 	size_t last_offset = 0;
 
+	/* The last fragment is needed first */
+	if (!last || ipv4_get_flags_mf(last)) return false;
+
 	for (iter = list2_begin(&elem->list); iter != end; iter = list2_next(iter)) {
 		struct ipv4 *cur = list2_get(iter, struct ipv4, frag_list);
-
-		size_t curoffset = ipv4_get_frag_offset(cur);
-		const ssize_t curlen = ipv4_get_len(cur) - ipv4_get_hdr_len(cur);
-		assert(curlen >= 0);
+		const size_t curoffset = ipv4_get_frag_offset(cur);
 
 		if (curoffset > last_offset) {
 			return false;
 		}
 
-		last_offset = curoffset + curlen;
+		last_offset = curoffset + ipv4_frag_len(cur);
 
 		if (!ipv4_get_flags_mf(cur)) return true;
 	}
 
-	/* check for last mf flag */
-	last = list2_get(list2_prev(end), struct ipv4, frag_list);
-	if (ipv4_get_flags_mf(last)) return false;
-
 	return true;
 }
 
@@ -139,58 +266,91 @@ static bool ipv4_frag_insert(struct ipv4_frag_elem *elem, struct ipv4 *pkt)
 {
 	list2_iter iter;
 	const list2_iter end = list2_end(&elem->list);
-	bool added = false;
+	const size_t offset = ipv4_get_frag_offset(pkt);
+	struct ipv4 *last = list2_last(&elem->list, struct ipv4, frag_list);
 
-	if (list2_empty(&elem->list)) {
+	if (!last) {
 		list2_insert(end, &pkt->frag_list);
+		ipv4_frag_account(elem, ipv4_frag_size(pkt));
 		return false;
 	}
 
-	/* Insert our new packet in the list */
-	for (iter = list2_begin(&elem->list); iter != end; iter = list2_next(iter)) {
-		struct ipv4 *cur = list2_get(iter, struct ipv4, frag_list);
+	if (ipv4_get_frag_offset(last) < offset) {
+		/* The fragments usually arrive in order, insert the packet at the
+		 * end, but check first that the last packet does have the mf flag
+		 * set. */
+		if (!ipv4_get_flags_mf(last)) {
+			raise_alert(pkt, "invalid ipv4 fragment");
+			ipv4_action_drop(pkt);
+			ipv4_release(pkt);
+			return false;
+		}
+
+		if (ipv4_get_frag_offset(last) + ipv4_frag_len(last) > offset) {
+			metric_inc(&ipv4_frag_overlap_metric);
+		}
 
-		size_t curoffset = ipv4_get_frag_offset(cur);
+		list2_insert(end, &pkt->frag_list);
+	}
+	else {
+		struct ipv4 *cur = NULL;
 
-		assert(ipv4_get_src(cur) == ipv4_get_src(pkt));
-		assert(ipv4_get_dst(cur) == ipv4_get_dst(pkt));
-		assert(ipv4_get_id(cur) == ipv4_get_id(pkt));
+		/* Insert our new packet in the list */
+		for (iter = list2_begin(&elem->list); iter != end; iter = list2_next(iter)) {
+			cur = list2_get(iter, struct ipv4, frag_list);
 
-		if (curoffset >= ipv4_get_frag_offset(pkt)) {
-			list2_insert(iter, &pkt->frag_list);
-			added = true;
+			assert(ipv4_get_src(cur) == ipv4_get_src(pkt));
+			assert(ipv4_get_dst(cur) == ipv4_get_dst(pkt));
+			assert(ipv4_get_id(cur) == ipv4_get_id(pkt));
 
-			if (!ipv4_get_flags_mf(pkt)) {
-				/* All packets after this one are incorrect */
-				while (iter != end) {
-					cur = list2_get(iter, struct ipv4, frag_list);
-					iter = list2_erase(iter);
+			if (ipv4_get_frag_offset(cur) >= offset) break;
+		}
 
-					raise_alert(cur, "invalid ipv4 fragment");
-					ipv4_action_drop(cur);
-					ipv4_release(cur);
-				}
+		assert(iter != end);
+
+		if (ipv4_get_frag_offset(cur) < offset + ipv4_frag_len(pkt)) {
+			metric_inc(&ipv4_frag_overlap_metric);
+		}
+		else if (iter != list2_begin(&elem->list)) {
+			struct ipv4 *prev = list2_get(list2_prev(iter), struct ipv4, frag_list);
+			if (ipv4_get_frag_offset(prev) + ipv4_frag_len(prev) > offset) {
+				metric_inc(&ipv4_frag_overlap_metric);
 			}
+		}
 
-			break;
+		list2_insert(iter, &pkt->frag_list);
+
+		if (!ipv4_get_flags_mf(pkt)) {
+			/* All packets after this one are incorrect */
+			while (iter != end) {
+				cur = list2_get(iter, struct ipv4, frag_list);
+				iter = list2_erase(iter);
+
+				raise_alert(cur, "invalid ipv4 fragment");
+				ipv4_frag_drop(elem, cur);
+			}
 		}
 	}
 
-	if (!added) {
-		/* Insert the packet at the end, but check first that the last
-		 * packet does have the mf flag set. */
-		struct ipv4 *last = list2_get(list2_prev(end), struct ipv4, frag_list);
-		if (!ipv4_get_flags_mf(last)) {
-			raise_alert(pkt, "invalid ipv4 fragment");
-			ipv4_action_drop(pkt);
-			ipv4_release(pkt);
-			return false;
-		}
+	ipv4_frag_account(elem, ipv4_frag_size(pkt));
+	return ipv4_frag_check_missing_fragments(elem);
+}
 
-		list2_insert(end, &pkt->frag_list);
+/* Make room for size bytes in the fragment tables by dropping the oldest
+ * datagrams of the thread */
+static bool ipv4_frag_table_reserve(struct ipv4_frag_table *table, struct ipv4_frag_elem *keep, size_t size)
+{
+	struct ipv4_frag_elem *elem, *tmp;
+
+	if (!ipv4_frag_global_limit) return true;
+
+	HASH_ITER(hh, table->head, elem, tmp) {
+		if (atomic64_get(&ipv4_frag_total) + size <= ipv4_frag_global_limit) break;
+		if (elem != keep) ipv4_frag_evict(table, elem);
 	}
 
-	return ipv4_frag_check_missing_fragments(elem);
+	/* The remaining memory can be held by the other threads */
+	return atomic64_get(&ipv4_frag_total) + size <= ipv4_frag_global_limit;
 }
 
 static struct ipv4_frag_elem *ipv4_frag_table_insert(struct ipv4_frag_table *table, struct ipv4 *pkt)
@@ -198,6 +358,7 @@ static struct ipv4_frag_elem *ipv4_frag_table_insert(struct ipv4_frag_table *tab
 	struct ipv4_frag_key key;
 	struct ipv4_header *header = ipv4_header(pkt, false);
 	struct ipv4_frag_elem *ptr;
+	const size_t size = ipv4_frag_size(pkt);
 	bool ret = false;
 
 	assert(ipv4_get_flags_mf(pkt) || ipv4_get_frag_offset(pkt) > 0);
@@ -208,9 +369,30 @@ static struct ipv4_frag_elem *ipv4_frag_table_insert(struct ipv4_frag_table *tab
 	key.id = header->id;
 	key.proto = header->proto;
 
-	mutex_lock(&table->mutex);
+	/* A shorter timeout can expire some datagrams now */
+	if (ipv4_frag_table_update_timeout(table)) {
+		ipv4_frag_table_expire(table);
+	}
 
 	HASH_FIND(hh, table->head, &key, hash_keysize, ptr);
+
+	if ((ptr ? ptr->size : 0) + size > ipv4_frag_datagram_limit) {
+		raise_alert(pkt, "ipv4 fragmented packet too large");
+		if (ptr) ipv4_frag_evict(table, ptr);
+
+		metric_inc(&ipv4_frag_evicted_metric);
+		ipv4_action_drop(pkt);
+		ipv4_release(pkt);
+		return NULL;
+	}
+
+	if (!ipv4_frag_table_reserve(table, ptr, size)) {
+		metric_inc(&ipv4_frag_evicted_metric);
+		ipv4_action_drop(pkt);
+		ipv4_release(pkt);
+		return NULL;
+	}
+
 	if (ptr) {
 		ret = ipv4_frag_insert(ptr, pkt);
 	}
@@ -218,33 +400,97 @@ static struct ipv4_frag_elem *ipv4_frag_table_insert(struct ipv4_frag_table *tab
 		ptr = malloc(sizeof(struct ipv4_frag_elem));
 		if (!ptr) {
 			error("memory error");
-			mutex_unlock(&table->mutex);
-			return false;
+			ipv4_action_drop(pkt);
+			ipv4_release(pkt);
+			return NULL;
 		}
 
 		list2_init(&ptr->list);
-		list2_insert(list2_end(&ptr->list), &pkt->frag_list);
+		ptr->size = 0;
+		time_add(&ptr->expires, time_realm_current_time(&network_time), &table->timeout);
+		ipv4_frag_insert(ptr, pkt);
+
+		if (!table->head) {
+			if (!timer_once(table->timer, &table->timeout)) {
+				assert(check_error());
+				clear_error();
+			}
+		}
 
 		HASH_ADD_KEYPTR(hh, table->head, &key, hash_keysize, ptr);
 	}
 
 	if (!ret) ptr = NULL;
 
-	mutex_unlock(&table->mutex);
-
 	return ptr;
 }
 
+void ipv4_frag_set_timeout(double secs)
+{
+	struct ipv4_frag_table *table;
+
+	time_build(&ipv4_frag_timeout, secs);
+
+	/* The tables of the other threads are updated when they receive their
+	 * next fragment or when their timer fires */
+	table = local_storage_get(&ipv4_frag_local);
+	if (table && ipv4_frag_table_update_timeout(table)) {
+		ipv4_frag_table_expire(table);
+	}
+}
+
+void ipv4_frag_set_limits(size_t datagram, size_t global)
+{
+	ipv4_frag_datagram_limit = datagram ? datagram : (size_t)-1;
+	ipv4_frag_global_limit = global;
+}
+
+size_t ipv4_frag_memory()
+{
+	return atomic64_get(&ipv4_frag_total);
+}
+
 INIT void ipv4_init()
 {
-	ipv4_frag_global = ipv4_frag_table_new();
-	assert(ipv4_frag_global);
+	UNUSED bool ret;
+
+	ret = local_storage_init(&ipv4_frag_local, NULL);
+	assert(ret);
+
+	ret = mutex_init(&ipv4_frag_tables_mutex, false);
+	assert(ret);
+
+	list2_init(&ipv4_frag_tables);
+	atomic64_init(&ipv4_frag_total, 0);
+}
+
+void ipv4_frag_cleanup()
+{
+	list2_iter iter, end;
+
+	/* The tables hold some timers of the network time, they are released
+	 * on exit while it still exists. The packet threads are stopped, their
+	 * local storage is not used anymore. */
+	mutex_lock(&ipv4_frag_tables_mutex);
+
+	iter = list2_begin(&ipv4_frag_tables);
+	end = list2_end(&ipv4_frag_tables);
+	while (iter != end) {
+		struct ipv4_frag_table *table = list2_get(iter, struct ipv4_frag_table, list);
+		iter = list2_erase(iter);
+		ipv4_frag_table_release(table);
+	}
+
+	mutex_unlock(&ipv4_frag_tables_mutex);
+
+	local_storage_set(&ipv4_frag_local, NULL);
 }
 
 FINI void ipv4_final()
 {
-	ipv4_frag_table_release(ipv4_frag_global);
-	ipv4_frag_global = NULL;
+	atomic64_destroy(&ipv4_frag_total);
+	mutex_destroy(&ipv4_frag_tables_mutex);
+	local_storage_destroy(&ipv4_frag_local);
 }
 
 static bool ipv4_flatten_header(struct vbuffer *payload, size_t hdrlen)
@@ -361,6 +607,12 @@ struct ipv4 *ipv4_dissect(struct packet *packet)
 		return NULL;
 	}
 
+	{
+		const struct ipv4_header *header = ipv4_header(ip, false);
+		ip->captured_src = header->src;
+		ip->captured_dst = header->dst;
+	}
+
 	ip->lua_object = lua_object_init;
 	lua_ref_init(&ip->next_dissector);
 
@@ -378,14 +630,26 @@ struct ipv4 *ipv4_reassemble(struct ipv4 *ip)
 	}
 
 	/* Fragmented case */
-	struct ipv4_frag_elem *elem = ipv4_frag_table_insert(ipv4_frag_global, ip);
+	struct ipv4_frag_table *table = ipv4_frag_table_get();
+	struct ipv4_frag_elem *elem;
 	struct ipv4 *first;
 	list2_iter iter, end;
 	size_t offset = 0;
 
+	metric_inc(&ipv4_frag_metric);
+
+	if (!table) {
+		ipv4_action_drop(ip);
+		ipv4_release(ip);
+		return NULL;
+	}
+
 	/* More packet are needed */
+	elem = ipv4_frag_table_insert(table, ip);
 	if (!elem) return NULL;
 
+	metric_inc(&ipv4_reassembled_metric);
+
 	first = list2_first(&elem->list, struct ipv4, frag_list);
 	assert(first);
 	assert(!first->reassembled);
@@ -433,7 +697,8 @@ struct ipv4 *ipv4_reassemble(struct ipv4 *ip)
 
 	first->payload = vbuffer_stream_data(&first->reassembled_payload);
 
-	HASH_DEL(ipv4_frag_global->head, elem);
+	ipv4_frag_account(elem, -(int64)elem->size);
+	HASH_DEL(table->head, elem);
 	free(elem);
 
 	return first;
@@ -453,6 +718,8 @@ struct ipv4 *ipv4_create(struct packet *packet)
 	}
 
 	ip->packet = packet;
+	ip->captured_src = 0;
+	ip->captured_dst = 0;
 	ip->invalid_checksum = true;
 	ip->dont_reassemble = false;
 	ip->reassembled = false;
@@ -580,6 +847,30 @@ struct ipv4_header *ipv4_header(struct ipv4 *ip, bool write)
 	return header;
 }
 
+struct ipv4_header *ipv4_header_update_begin(struct ipv4 *ip, struct ipv4_header *old)
+{
+	const bool invalid_checksum = ip->invalid_checksum;
+	struct ipv4_header *header = ipv4_header(ip, true);
+	ip->invalid_checksum = invalid_checksum;
+
+	if (header) *old = *header;
+	return header;
+}
+
+void ipv4_header_update_end(struct ipv4 *ip, struct ipv4_header *header, const struct ipv4_header *old)
+{
+	/* The checksum will be computed again anyway */
+	if (ip->invalid_checksum) return;
+
+	if (header->checksum != old->checksum) {
+		ip->invalid_checksum = true;
+		return;
+	}
+
+	header->checksum = inet_checksum_update(header->checksum, (const uint8 *)old,
+			(const uint8 *)header, sizeof(struct ipv4_header));
+}
+
 static void ipv4_flush(struct ipv4 *ip)
 {
 	if (ip->packet) {
@@ -607,144 +898,16 @@ void ipv4_release(struct ipv4 *ip)
 	free(ip);
 }
 
-/* compute inet checksum RFC #1071 */
-
-struct checksum_partial checksum_partial_init = { false, 0, 0 };
-
-#define REDUCE_DECL \
-	union { \
-		uint16  s[2]; \
-		uint32  l; \
-	} reduce_util;
-
-typedef union {
-	uint8   c[2];
-	uint16  s;
-} swap_util_t;
-
-#define ADD_CARRY(x) (x > 0xffffUL ? x -= 0xffffUL : x)
-#define REDUCE       { reduce_util.l = sum; sum = reduce_util.s[0] + reduce_util.s[1]; ADD_CARRY(sum); }
-
-void inet_checksum_partial(struct checksum_partial *csum, const uint8 *ptr, size_t size)
-{
-	register int sum = csum->csum;
-	register int len = size;
-	register uint16 *w;
-	int byte_swapped = 0;
-	REDUCE_DECL;
-	swap_util_t swap_util;
-
-	if (csum->odd) {
-		/* The last partial checksum len was not even. We need to take
-		 * the leftover char into account.
-		 */
-		swap_util.c[0] = csum->leftover;
-		swap_util.c[1] = *ptr++;
-		sum += swap_util.s;
-		len--;
-	}
-
-	/* Make sure that the pointer is aligned on 16 bit boundary */
-	if ((1 & (ptrdiff_t)ptr) && (len > 0)) {
-		REDUCE;
-		sum <<= 8;
-		swap_util.c[0] = *ptr++;
-		len--;
-		byte_swapped = 1;
-	}
-
-	w = (uint16 *)ptr;
-
-	/* Unrolled loop */
-	while ((len -= 32) >= 0) {
-		sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-		sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
-		sum += w[8]; sum += w[9]; sum += w[10]; sum += w[11];
-		sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
-		w += 16;
-	}
-	len += 32;
-
-	while ((len -= 8) >= 0) {
-		sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-		w += 4;
-	}
-	len += 8;
-
-	if (len != 0 || byte_swapped) {
-		REDUCE;
-		while ((len -= 2) >= 0) {
-			sum += *w++;
-		}
-
-		if (byte_swapped) {
-			REDUCE;
-			sum <<= 8;
-
-			if (len == -1) {
-				swap_util.c[1] = *(uint8 *)w;
-				sum += swap_util.s;
-				len = 0;
-			} else {
-				csum->leftover = swap_util.c[0];
-				len = -1;
-			}
-		} else if (len == -1) {
-			csum->leftover = *(uint8 *)w;
-		}
-	}
-
-	/* Update csum context */
-	csum->odd = (len == -1);
-	csum->csum = sum;
-}
-
-int16 inet_checksum_reduce(struct checksum_partial *csum)
-{
-	register int32 sum = csum->csum;
-	REDUCE_DECL;
-
-	if (csum->odd) {
-		swap_util_t swap_util;
-		swap_util.c[0] = csum->leftover;
-		swap_util.c[1] = 0;
-		sum += swap_util.s;
-	}
-
-	REDUCE;
-	return (~sum & 0xffff);
-}
-
-int16 inet_checksum(const uint8 *ptr, size_t size)
-{
-	struct checksum_partial csum = checksum_partial_init;
-	inet_checksum_partial(&csum, ptr, size);
-	return inet_checksum_reduce(&csum);
-}
-
-void inet_checksum_vbuffer_partial(struct checksum_partial *csum, struct vbuffer_sub *buf)
+bool ipv4_verify_checksum(struct ipv4 *ip)
 {
-	struct vbuffer_sub_mmap iter = vbuffer_mmap_init;
-	uint8 *data;
-	size_t len;
+	IPV4_CHECK(ip, false);
 
-	while ((data = vbuffer_mmap(buf, &len, false, &iter, NULL))) {
-		if (len > 0) {
-			inet_checksum_partial(csum, data, len);
-		}
+	/* The header is still the one verified by the capture */
+	if (packet_checksum_status(ip->packet) != CHECKSUM_UNKNOWN &&
+	    !ip->invalid_checksum && !vbuffer_ismodified(&ip->packet->payload)) {
+		return true;
 	}
-}
-
-int16 inet_checksum_vbuffer(struct vbuffer_sub *buf)
-{
-	struct checksum_partial csum = checksum_partial_init;
-	inet_checksum_vbuffer_partial(&csum, buf);
-	return inet_checksum_reduce(&csum);
-}
 
-bool ipv4_verify_checksum(struct ipv4 *ip)
-{
-	IPV4_CHECK(ip, false);
 	return inet_checksum((uint8 *)ipv4_header(ip, false), ipv4_get_hdr_len(ip)) == 0;
 }
 
@@ -331,6 +331,18 @@ struct ipv4 *ipv4_create(struct packet *DISOWN_SUCCESS_ONLY);
 %newobject ipv4_forge;
 struct packet *ipv4_forge(struct ipv4 *pkt);
 
+%rename(set_fragment_timeout) ipv4_frag_set_timeout;
+void ipv4_frag_set_timeout(double secs);
+
+%rename(set_fragment_limits) ipv4_frag_set_limits;
+void ipv4_frag_set_limits(size_t datagram, size_t global);
+
+%rename(fragment_memory) ipv4_frag_memory;
+size_t ipv4_frag_memory();
+
+%rename(_fragment_cleanup) ipv4_frag_cleanup;
+void ipv4_frag_cleanup();
+
 %rename(inet_checksum_compute) lua_inet_checksum_sub;
 int lua_inet_checksum_sub(struct vbuffer_sub *sub);
 
@@ -482,6 +494,13 @@ int lua_inet_checksum(struct vbuffer *buf);
 		action = haka.dissectors.ipv4.install
 	}
 
+	haka.rule {
+		on = haka.events.exiting,
+		eval = function ()
+			this._fragment_cleanup()
+		end
+	}
+
 	local InNetworkCriterion = class.class('ipv4_in_network', haka.policy.Criterion)
 
 	function InNetworkCriterion.method:init(net)
@@ -0,0 +1,147 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Micro benchmark of the internet checksum. Each implementation is run on
+ * buffers of several packet sizes split in several chunks, and compared
+ * with the previous 16 bits loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <haka/ipv4.h>
+#include <haka/vbuffer.h>
+
+#include "checksum_legacy.h"
+
+
+#define BENCH_BYTES   (256 << 20)
+
+static const size_t sizes[] = { 20, 40, 64, 576, 1500, 9000, 65535 };
+static const int chunks[] = { 1, 2, 3, 8 };
+
+static const struct {
+	const char                *name;
+	enum inet_checksum_impl    impl;
+} impls[] = {
+	{ "scalar64", INET_CHECKSUM_SCALAR },
+	{ "sse2", INET_CHECKSUM_SSE2 },
+	{ "avx2", INET_CHECKSUM_AVX2 },
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void legacy_checksum_vbuffer_partial(struct checksum_partial *csum, struct vbuffer_sub *buf)
+{
+	struct vbuffer_sub_mmap iter = vbuffer_mmap_init;
+	uint8 *data;
+	size_t len;
+
+	while ((data = vbuffer_mmap(buf, &len, false, &iter, NULL))) {
+		if (len > 0) {
+			legacy_checksum_partial(csum, data, len);
+		}
+	}
+}
+
+/* Build a buffer of the given size made of count chunks of unequal sizes */
+static bool build_buffer(struct vbuffer *buffer, const uint8 *data, size_t size, int count)
+{
+	size_t offset = 0;
+	int i;
+
+	if (!vbuffer_create_empty(buffer)) return false;
+
+	for (i=0; i<count; ++i) {
+		struct vbuffer chunk;
+		size_t len = (i == count-1) ? size - offset : (size / count) | 1;
+		if (len > size - offset) len = size - offset;
+
+		if (!vbuffer_create_from(&chunk, (const char *)data + offset, len) ||
+		    !vbuffer_append(buffer, &chunk)) {
+			vbuffer_release(buffer);
+			return false;
+		}
+
+		vbuffer_release(&chunk);
+		offset += len;
+	}
+
+	return true;
+}
+
+static void run(const char *name, struct vbuffer *buffer, size_t size, int count, int impl, int16 ref)
+{
+	struct vbuffer_sub sub;
+	const long loops = BENCH_BYTES / size;
+	volatile int16 result = 0;
+	double start, elapsed;
+	long i;
+
+	vbuffer_sub_create(&sub, buffer, 0, ALL);
+
+	start = now();
+	for (i=0; i<loops; ++i) {
+		if (impl < 0) {
+			struct checksum_partial csum = checksum_partial_init;
+			legacy_checksum_vbuffer_partial(&csum, &sub);
+			result = legacy_checksum_reduce(&csum);
+		}
+		else {
+			result = inet_checksum_vbuffer(&sub);
+		}
+	}
+	elapsed = now() - start;
+
+	printf("%-10s %6zu %6d %10.1f %8.2f%s\n", name, size, count,
+		elapsed * 1e9 / loops, (double)loops * size / elapsed / 1e9,
+		result == ref ? "" : "  MISMATCH");
+}
+
+int main(int argc, char *argv[])
+{
+	uint8 *data;
+	size_t s, i;
+
+	data = malloc(65535);
+	if (!data) return 1;
+
+	srand(42);
+	for (i=0; i<65535; ++i) data[i] = rand();
+
+	printf("%-10s %6s %6s %10s %8s\n", "impl", "size", "chunks", "ns/op", "GB/s");
+
+	for (s=0; s<sizeof(sizes)/sizeof(sizes[0]); ++s) {
+		for (i=0; i<sizeof(chunks)/sizeof(chunks[0]); ++i) {
+			struct vbuffer buffer;
+			const int16 ref = legacy_checksum(data, sizes[s]);
+			size_t j;
+
+			if (chunks[i] > sizes[s]) continue;
+			if (!build_buffer(&buffer, data, sizes[s], chunks[i])) return 1;
+
+			run("legacy", &buffer, sizes[s], chunks[i], -1, ref);
+
+			for (j=0; j<sizeof(impls)/sizeof(impls[0]); ++j) {
+				if (!inet_checksum_select(impls[j].impl)) {
+					clear_error();
+					continue;
+				}
+
+				run(impls[j].name, &buffer, sizes[s], chunks[i], j, ref);
+			}
+
+			vbuffer_release(&buffer);
+		}
+	}
+
+	free(data);
+	return 0;
+}
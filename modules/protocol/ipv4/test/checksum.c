@@ -0,0 +1,202 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include <haka/ipv4.h>
+#include <haka/vbuffer.h>
+
+#include "checksum_legacy.h"
+
+
+#define DATA_SIZE   (1 << 20)
+
+static uint8 data[DATA_SIZE + 4];
+
+static const enum inet_checksum_impl impls[] = {
+	INET_CHECKSUM_SCALAR, INET_CHECKSUM_SSE2, INET_CHECKSUM_AVX2
+};
+
+#define IMPL_COUNT  (sizeof(impls)/sizeof(impls[0]))
+
+static void fill(uint8 value)
+{
+	size_t i;
+	srand(42);
+	for (i=0; i<sizeof(data); ++i) {
+		data[i] = value ? value : rand();
+	}
+}
+
+static bool select_impl(int i)
+{
+	if (!inet_checksum_select(impls[i])) {
+		clear_error();
+		return false;
+	}
+	return true;
+}
+
+static void check_sizes()
+{
+	int i;
+	size_t size, offset;
+
+	for (i=0; i<IMPL_COUNT; ++i) {
+		if (!select_impl(i)) continue;
+
+		for (offset=0; offset<4; ++offset) {
+			for (size=0; size<2100; size += size < 300 ? 1 : 37) {
+				ck_assert_int_eq(inet_checksum(data+offset, size),
+						legacy_checksum(data+offset, size));
+			}
+
+			ck_assert_int_eq(inet_checksum(data+offset, 65535),
+					legacy_checksum(data+offset, 65535));
+		}
+	}
+
+	inet_checksum_select(INET_CHECKSUM_SCALAR);
+}
+
+START_TEST(checksum_random_check)
+{
+	fill(0);
+	check_sizes();
+}
+END_TEST
+
+START_TEST(checksum_ones_check)
+{
+	fill(0xff);
+	check_sizes();
+}
+END_TEST
+
+START_TEST(checksum_large_check)
+{
+	int i;
+	int16 ref;
+
+	/* Larger than the flush period of the vector accumulators */
+	fill(0xff);
+	inet_checksum_select(INET_CHECKSUM_SCALAR);
+	ref = inet_checksum(data+1, DATA_SIZE-1);
+
+	for (i=0; i<IMPL_COUNT; ++i) {
+		if (!select_impl(i)) continue;
+		ck_assert_int_eq(inet_checksum(data+1, DATA_SIZE-1), ref);
+	}
+
+	inet_checksum_select(INET_CHECKSUM_SCALAR);
+}
+END_TEST
+
+START_TEST(checksum_partial_check)
+{
+	int i, loop;
+
+	fill(0);
+	srand(7);
+
+	for (i=0; i<IMPL_COUNT; ++i) {
+		if (!select_impl(i)) continue;
+
+		for (loop=0; loop<500; ++loop) {
+			struct checksum_partial csum = checksum_partial_init;
+			const size_t size = rand() % 3000;
+			size_t offset = 0;
+
+			while (offset < size) {
+				size_t len = rand() % 80;
+				if (len > size - offset) len = size - offset;
+				inet_checksum_partial(&csum, data+offset, len);
+				offset += len;
+			}
+
+			ck_assert_int_eq(inet_checksum_reduce(&csum), legacy_checksum(data, size));
+		}
+	}
+
+	inet_checksum_select(INET_CHECKSUM_SCALAR);
+}
+END_TEST
+
+START_TEST(checksum_vbuffer_check)
+{
+	static const size_t splits[] = { 1, 7, 20, 33, 500, 1, 938 };
+	struct vbuffer buffer, chunk;
+	struct vbuffer_sub sub;
+	size_t i, offset = 0;
+
+	fill(0);
+
+	ck_assert(vbuffer_create_empty(&buffer));
+	for (i=0; i<sizeof(splits)/sizeof(splits[0]); ++i) {
+		ck_assert(vbuffer_create_from(&chunk, (const char *)data+offset, splits[i]));
+		ck_assert(vbuffer_append(&buffer, &chunk));
+		vbuffer_release(&chunk);
+		offset += splits[i];
+	}
+
+	vbuffer_sub_create(&sub, &buffer, 0, ALL);
+	ck_assert_int_eq(inet_checksum_vbuffer(&sub), legacy_checksum(data, offset));
+
+	vbuffer_release(&buffer);
+}
+END_TEST
+
+START_TEST(checksum_update_check)
+{
+	uint8 header[60], old[60];
+	int loop, i;
+	uint16 csum;
+
+	srand(11);
+
+	for (loop=0; loop<10000; ++loop) {
+		const size_t size = 20 + 4*(rand() % 11);
+
+		for (i=0; i<size; ++i) header[i] = loop & 1 ? rand() : 0xff;
+		header[10] = header[11] = 0;
+		csum = inet_checksum(header, size);
+		memcpy(header+10, &csum, 2);
+		memcpy(old, header, size);
+
+		for (i=rand() % 4; i>0; --i) {
+			const size_t pos = 12 + rand() % (size-12);
+			header[pos] = loop & 2 ? rand() : 0;
+		}
+
+		csum = inet_checksum_update(csum, old, header, size);
+		header[10] = header[11] = 0;
+		ck_assert_int_eq(csum, (uint16)inet_checksum(header, size));
+	}
+}
+END_TEST
+
+int main(int argc, char *argv[])
+{
+	int number_failed;
+
+	Suite *suite = suite_create("checksum_suite");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, checksum_random_check);
+	tcase_add_test(tcase, checksum_ones_check);
+	tcase_add_test(tcase, checksum_large_check);
+	tcase_add_test(tcase, checksum_partial_check);
+	tcase_add_test(tcase, checksum_vbuffer_check);
+	tcase_add_test(tcase, checksum_update_check);
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+#ifdef HAKA_DEBUG
+	srunner_set_fork_status(runner, CK_NOFORK);
+#endif
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+	return number_failed;
+}
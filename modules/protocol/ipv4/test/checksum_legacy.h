@@ -0,0 +1,125 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/* Previous 16 bits checksum loop, used as a reference by the tests and
+ * the benchmark. The int accumulator limits it to 64KB of data. */
+
+#ifndef CHECKSUM_LEGACY_H
+#define CHECKSUM_LEGACY_H
+
+#include <stddef.h>
+#include <haka/ipv4.h>
+
+#define REDUCE_DECL \
+	union { \
+		uint16  s[2]; \
+		uint32  l; \
+	} reduce_util;
+
+typedef union {
+	uint8   c[2];
+	uint16  s;
+} swap_util_t;
+
+#define ADD_CARRY(x) (x > 0xffffUL ? x -= 0xffffUL : x)
+#define REDUCE       { reduce_util.l = sum; sum = reduce_util.s[0] + reduce_util.s[1]; ADD_CARRY(sum); }
+
+static void legacy_checksum_partial(struct checksum_partial *csum, const uint8 *ptr, size_t size)
+{
+	register int sum = csum->csum;
+	register int len = size;
+	register uint16 *w;
+	int byte_swapped = 0;
+	REDUCE_DECL;
+	swap_util_t swap_util;
+
+	if (csum->odd) {
+		/* The last partial checksum len was not even. We need to take
+		 * the leftover char into account.
+		 */
+		swap_util.c[0] = csum->leftover;
+		swap_util.c[1] = *ptr++;
+		sum += swap_util.s;
+		len--;
+	}
+
+	/* Make sure that the pointer is aligned on 16 bit boundary */
+	if ((1 & (ptrdiff_t)ptr) && (len > 0)) {
+		REDUCE;
+		sum <<= 8;
+		swap_util.c[0] = *ptr++;
+		len--;
+		byte_swapped = 1;
+	}
+
+	w = (uint16 *)ptr;
+
+	/* Unrolled loop */
+	while ((len -= 32) >= 0) {
+		sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
+		sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
+		sum += w[8]; sum += w[9]; sum += w[10]; sum += w[11];
+		sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
+		w += 16;
+	}
+	len += 32;
+
+	while ((len -= 8) >= 0) {
+		sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
+		w += 4;
+	}
+	len += 8;
+
+	if (len != 0 || byte_swapped) {
+		REDUCE;
+		while ((len -= 2) >= 0) {
+			sum += *w++;
+		}
+
+		if (byte_swapped) {
+			REDUCE;
+			sum <<= 8;
+
+			if (len == -1) {
+				swap_util.c[1] = *(uint8 *)w;
+				sum += swap_util.s;
+				len = 0;
+			} else {
+				csum->leftover = swap_util.c[0];
+				len = -1;
+			}
+		} else if (len == -1) {
+			csum->leftover = *(uint8 *)w;
+		}
+	}
+
+	/* Update csum context */
+	csum->odd = (len == -1);
+	csum->csum = sum;
+}
+
+static int16 legacy_checksum_reduce(struct checksum_partial *csum)
+{
+	register int32 sum = csum->csum;
+	REDUCE_DECL;
+
+	if (csum->odd) {
+		swap_util_t swap_util;
+		swap_util.c[0] = csum->leftover;
+		swap_util.c[1] = 0;
+		sum += swap_util.s;
+	}
+
+	REDUCE;
+	return (~sum & 0xffff);
+}
+
+static int16 legacy_checksum(const uint8 *ptr, size_t size)
+{
+	struct checksum_partial csum = checksum_partial_init;
+	legacy_checksum_partial(&csum, ptr, size);
+	return legacy_checksum_reduce(&csum);
+}
+
+#endif /* CHECKSUM_LEGACY_H */
@@ -0,0 +1,238 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <check.h>
+#include <haka/capture_module.h>
+#include <haka/packet.h>
+#include <haka/timer.h>
+#include <haka/cnx.h>
+
+
+extern int set_capture_module(struct module *module);
+
+/*
+ * Capture module giving a static network time
+ */
+
+static bool is_realtime() { return false; }
+
+static struct capture_module test_capture = {
+	module: {
+		type:        MODULE_CAPTURE,
+		name:        "test",
+		api_version: HAKA_API_VERSION,
+	},
+	is_realtime:     is_realtime
+};
+
+/* The tests share the network time, each one starts at a later base */
+static double base = 0.;
+
+static void set_time(double secs)
+{
+	struct time time;
+	time_build(&time, base + secs);
+	time_realm_update_and_check(&network_time, &time);
+}
+
+static void start_time()
+{
+	base += 1000.;
+	set_time(0.);
+}
+
+static int released;
+
+static void count_release(struct cnx *cnx, bool freemem)
+{
+	if (freemem) ++released;
+}
+
+static struct cnx_key make_key(uint16 port)
+{
+	struct cnx_key key;
+	key.srcip = ipv4_addr_from_bytes(192, 168, 0, 1);
+	key.dstip = ipv4_addr_from_bytes(192, 168, 0, 2);
+	key.srcport = port;
+	key.dstport = 53;
+	return key;
+}
+
+static bool exists(struct cnx_table *table, uint16 port)
+{
+	struct cnx_key key = make_key(port);
+	return cnx_get(table, &key, NULL, NULL) != NULL;
+}
+
+static struct cnx *create(struct cnx_table *table, uint16 port)
+{
+	struct cnx_key key = make_key(port);
+	struct cnx *cnx = cnx_new(table, &key);
+	ck_assert(cnx != NULL);
+	return cnx;
+}
+
+START_TEST(cnx_idle_cutoff)
+{
+	struct cnx_table *table = cnx_table_new(count_release);
+	struct cnx *active;
+
+	start_time();
+	released = 0;
+
+	/* 60 s in buckets of 5 s */
+	ck_assert(cnx_table_set_idle_timeout(table, 60, NULL, NULL));
+
+	create(table, 1000);
+	active = create(table, 1001);
+
+	set_time(30.);
+	cnx_update_stat(active, CNX_DIR_IN, 100);
+
+	/* The bucket of the idle connection is only swept once all of it
+	 * has been idle for the timeout */
+	set_time(64.9);
+	ck_assert(exists(table, 1000));
+
+	set_time(65.);
+	ck_assert(!exists(table, 1000));
+	ck_assert(exists(table, 1001));
+	ck_assert_int_eq(released, 1);
+
+	set_time(94.9);
+	ck_assert(exists(table, 1001));
+	set_time(95.);
+	ck_assert(!exists(table, 1001));
+	ck_assert_int_eq(released, 2);
+
+	cnx_table_release(table);
+}
+END_TEST
+
+START_TEST(cnx_idle_expire)
+{
+	struct cnx_table *table = cnx_table_new(count_release);
+	struct time now;
+
+	start_time();
+	released = 0;
+	ck_assert(cnx_table_set_idle_timeout(table, 60, NULL, NULL));
+
+	create(table, 1000);
+	create(table, 1001);
+
+	/* A time jump sweeps the whole ring at once */
+	time_build(&now, base + 10000.);
+	ck_assert_int_eq(cnx_table_expire(table, &now), 2);
+	ck_assert_int_eq(cnx_table_expire(table, &now), 0);
+	ck_assert_int_eq(released, 2);
+
+	cnx_table_release(table);
+}
+END_TEST
+
+static int hook_calls;
+
+static void expire_hook(struct cnx *cnx, struct lua_ref *hook)
+{
+	/* Keep the connection the first time */
+	if (++hook_calls > 1) {
+		cnx_close(cnx);
+	}
+}
+
+START_TEST(cnx_idle_hook)
+{
+	struct cnx_table *table = cnx_table_new(count_release);
+	struct cnx *cnx;
+
+	start_time();
+	released = 0;
+	hook_calls = 0;
+	ck_assert(cnx_table_set_idle_timeout(table, 60, expire_hook, NULL));
+
+	cnx = create(table, 1000);
+	cnx->expire_hook = true;
+	create(table, 1001);
+
+	/* Only the flagged connection goes through the hook */
+	set_time(65.);
+	ck_assert_int_eq(hook_calls, 1);
+	ck_assert_int_eq(released, 1);
+	ck_assert(exists(table, 1000));
+
+	/* It is kept idle for another timeout */
+	set_time(125.);
+	ck_assert(exists(table, 1000));
+	set_time(130.);
+	ck_assert_int_eq(hook_calls, 2);
+	ck_assert(!exists(table, 1000));
+	ck_assert_int_eq(released, 2);
+
+	cnx_table_release(table);
+}
+END_TEST
+
+START_TEST(cnx_idle_width_change)
+{
+	struct cnx_table *table = cnx_table_new(count_release);
+
+	start_time();
+	released = 0;
+	ck_assert(cnx_table_set_idle_timeout(table, 60, NULL, NULL));
+
+	create(table, 1000);
+
+	/* 140 s in buckets of 10 s, the idle time restarts from now */
+	set_time(10.);
+	ck_assert(cnx_table_set_idle_timeout(table, 140, NULL, NULL));
+
+	set_time(65.);
+	ck_assert(exists(table, 1000));
+	set_time(159.9);
+	ck_assert(exists(table, 1000));
+	set_time(160.);
+	ck_assert(!exists(table, 1000));
+	ck_assert_int_eq(released, 1);
+
+	/* Same width, the connections keep their bucket */
+	create(table, 1001);
+	set_time(170.);
+	ck_assert(cnx_table_set_idle_timeout(table, 135, NULL, NULL));
+	set_time(310.);
+	ck_assert(!exists(table, 1001));
+	ck_assert_int_eq(released, 2);
+
+	ck_assert(!cnx_table_set_idle_timeout(table, 0, NULL, NULL));
+	ck_assert(check_error());
+	clear_error();
+
+	cnx_table_release(table);
+}
+END_TEST
+
+int main(int argc, char *argv[])
+{
+	int number_failed;
+
+	set_capture_module(&test_capture.module);
+
+	Suite *suite = suite_create("cnx");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, cnx_idle_cutoff);
+	tcase_add_test(tcase, cnx_idle_expire);
+	tcase_add_test(tcase, cnx_idle_hook);
+	tcase_add_test(tcase, cnx_idle_width_change);
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+#ifdef HAKA_DEBUG
+	srunner_set_fork_status(runner, CK_NOFORK);
+#endif
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return number_failed;
+}
@@ -0,0 +1,24 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+-- Test ipv4 reassembly memory limits
+--   D is larger than the datagram limit
+--   F is the oldest packet when the global limit is reached
+
+local ipv4 = require("protocol/ipv4")
+local icmp = require("protocol/icmp")
+
+ipv4.set_fragment_limits(80, 0)
+
+haka.rule {
+	on = haka.dissectors.icmp.events.receive_packet,
+	eval = function (pkt)
+		local label = pkt.payload:sub(4, 1):asstring()
+		haka.log("received icmp packet %s data=%d", label, #pkt.payload)
+
+		if label == 'S' then
+			ipv4.set_fragment_limits(0, 80)
+		end
+	end
+}
@@ -0,0 +1,24 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+-- Test ipv4 reassembly timeout
+--   A, B and C are fragmented, S is a single packet
+--   A and B expire once the timeout is shortened, C is received in time
+
+local ipv4 = require("protocol/ipv4")
+local icmp = require("protocol/icmp")
+
+ipv4.set_fragment_timeout(10)
+
+haka.rule {
+	on = haka.dissectors.icmp.events.receive_packet,
+	eval = function (pkt)
+		local label = pkt.payload:sub(4, 1):asstring()
+		haka.log("received icmp packet %s data=%d", label, #pkt.payload)
+
+		if label == 'S' then
+			ipv4.set_fragment_timeout(2)
+		end
+	end
+}
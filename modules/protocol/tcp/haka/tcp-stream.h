@@ -24,6 +24,7 @@ struct tcp_stream {
 	struct list2              queued;
 	struct list2              sent;
 	struct vbuffer_stream     stream;
+	uint32                    refused;
 };
 
 /**
@@ -69,4 +70,10 @@ void        tcp_stream_seq(struct tcp_stream *stream, struct tcp *tcp);
  */
 uint32      tcp_stream_lastseq(struct tcp_stream *stream);
 
+/**
+ * Get the number of queued packets that were dropped because the stream
+ * was full, and reset it.
+ */
+uint32      tcp_stream_take_refused(struct tcp_stream *stream);
+
 #endif /* HAKA_PROTO_TCP_STREAM_H */
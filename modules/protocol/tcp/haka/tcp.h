@@ -57,6 +57,14 @@ struct tcp_header {
 	uint16    checksum;
 	uint16    urgent_pointer;
 };
+
+struct tcp_pseudo_header {
+	ipv4addr       src;
+	ipv4addr       dst;
+	uint8          reserved;
+	uint8          proto;
+	uint16         len;
+};
 /** \endcond */
 
 /**
@@ -69,6 +77,9 @@ struct tcp {
 	struct vbuffer_iterator select;
 	bool                    modified:1;
 	bool                    invalid_checksum:1;
+	bool                    verified_checksum:1; /* checksum verified by the capture */
+	bool                    partial_checksum:1; /* offloaded checksum, not computed yet */
+	struct tcp_pseudo_header pseudo; /* pseudo header the checksum was computed with */
 	struct lua_ref          next_dissector;
 };
 
@@ -77,6 +88,8 @@ struct tcp *tcp_dissect(struct ipv4 *packet);
 struct tcp *tcp_create(struct ipv4 *packet);
 struct ipv4 *tcp_forge(struct tcp *packet);
 struct tcp_header *tcp_header(struct tcp *packet, bool write);
+struct tcp_header *tcp_header_update_begin(struct tcp *packet, struct tcp_header *old);
+void tcp_header_update_end(struct tcp *packet, struct tcp_header *header, const struct tcp_header *old);
 void tcp_release(struct tcp *packet);
 void tcp_compute_checksum(struct tcp *packet);
 bool tcp_verify_checksum(struct tcp *packet);
@@ -84,10 +97,12 @@ size_t tcp_get_payload_length(struct tcp *packet);
 void tcp_action_drop(struct tcp *packet);
 
 
+/* The setters update the checksum incrementally (RFC 1624) */
 #define TCP_GETSET_FIELD(type, field) \
 	INLINE type tcp_get_##field(struct tcp *tcp) { TCP_CHECK(tcp, 0); return SWAP_FROM_TCP(type, tcp_header(tcp, false)->field); } \
-	INLINE void tcp_set_##field(struct tcp *tcp, type v) { TCP_CHECK(tcp); \
-		struct tcp_header *header = tcp_header(tcp, true); if (header) { header->field = SWAP_TO_TCP(type, v); } }
+	INLINE void tcp_set_##field(struct tcp *tcp, type v) { TCP_CHECK(tcp); struct tcp_header old; \
+		struct tcp_header *header = tcp_header_update_begin(tcp, &old); \
+		if (header) { header->field = SWAP_TO_TCP(type, v); tcp_header_update_end(tcp, header, &old); } }
 
 TCP_GETSET_FIELD(uint16, srcport);
 TCP_GETSET_FIELD(uint16, dstport);
@@ -107,9 +122,12 @@ INLINE uint8 tcp_get_hdr_len(struct tcp *tcp)
 INLINE void tcp_set_hdr_len(struct tcp *tcp, uint8 v)
 {
 	TCP_CHECK(tcp);
-	struct tcp_header *header = tcp_header(tcp, true);
-	if (header)
+	struct tcp_header old;
+	struct tcp_header *header = tcp_header_update_begin(tcp, &old);
+	if (header) {
 		header->hdr_len = v >> TCP_HDR_LEN;
+		tcp_header_update_end(tcp, header, &old);
+	}
 }
 
 INLINE uint16 tcp_get_flags(struct tcp *tcp)
@@ -122,16 +140,20 @@ INLINE uint16 tcp_get_flags(struct tcp *tcp)
 INLINE void tcp_set_flags(struct tcp *tcp, uint8 v)
 {
 	TCP_CHECK(tcp);
-	struct tcp_header *header = tcp_header(tcp, true);
-	if (header)
+	struct tcp_header old;
+	struct tcp_header *header = tcp_header_update_begin(tcp, &old);
+	if (header) {
 		*(((uint8 *)header) + TCP_FLAGS_START) = TCP_SET_BITS(uint8, *(((uint8 *)header) + TCP_FLAGS_START), TCP_FLAGS_BITS, v);
+		tcp_header_update_end(tcp, header, &old);
+	}
 }
 
 
 #define TCP_GETSET_FLAG(name) \
 	INLINE bool tcp_get_flags_##name(struct tcp *tcp) { TCP_CHECK(tcp, 0); return tcp_header(tcp, false)->name; } \
-	INLINE void tcp_set_flags_##name(struct tcp *tcp, bool v) { TCP_CHECK(tcp); \
-		struct tcp_header *header = tcp_header(tcp, true); if (header) { tcp_header(tcp, true)->name = v; } }
+	INLINE void tcp_set_flags_##name(struct tcp *tcp, bool v) { TCP_CHECK(tcp); struct tcp_header old; \
+		struct tcp_header *header = tcp_header_update_begin(tcp, &old); \
+		if (header) { header->name = v; tcp_header_update_end(tcp, header, &old); } }
 
 TCP_GETSET_FLAG(fin);
 TCP_GETSET_FLAG(syn);
@@ -6,6 +6,7 @@
 #include <haka/tcp.h>
 #include <haka/log.h>
 #include <haka/error.h>
+#include <haka/metrics.h>
 #include <haka/container/list.h>
 #include <haka/container/vector.h>
 
@@ -17,6 +18,9 @@
 
 static REGISTER_LOG_SECTION(tcp);
 
+static struct metric tcp_queued_metric = METRIC_COUNTER("tcp_out_of_order_total", "Number of tcp segments queued for reassembly");
+static struct metric tcp_retransmit_metric = METRIC_COUNTER("tcp_retransmits_total", "Number of ignored tcp retransmissions");
+
 enum tcp_modif_type {
 	TCP_MODIF_INSERT,
 	TCP_MODIF_ERASE
@@ -139,8 +143,14 @@ bool tcp_stream_push(struct tcp_stream *stream, struct tcp *tcp, struct vbuffer_
 	}
 
 	if (stream->last_seq == chunk->start_seq) {
+		if (!vbuffer_stream_push(&stream->stream, &tcp->payload, NULL, current)) {
+			/* The packet is still owned by the caller */
+			chunk->tcp = NULL;
+			tcp_stream_chunk_free(chunk);
+			return false;
+		}
+
 		list2_insert(list2_end(&stream->current), &chunk->list);
-		vbuffer_stream_push(&stream->stream, &tcp->payload, NULL, current);
 		stream->last_seq = chunk->end_seq;
 
 		/* Check for queued packets */
@@ -157,8 +167,17 @@ bool tcp_stream_push(struct tcp_stream *stream, struct tcp *tcp, struct vbuffer_
 
 				iter = list2_erase(iter);
 
+				/* The stream is full, the segment is lost and will be
+				 * sent again by the peer. The caller reports it through
+				 * tcp_stream_take_refused(). */
+				if (!vbuffer_stream_push(&stream->stream, &qchunk->tcp->payload, NULL, NULL)) {
+					clear_error();
+					tcp_stream_chunk_free(qchunk);
+					++stream->refused;
+					break;
+				}
+
 				list2_insert(list2_end(&stream->current), &qchunk->list);
-				vbuffer_stream_push(&stream->stream, &qchunk->tcp->payload, NULL, NULL);
 				stream->last_seq = qchunk->end_seq;
 			}
 		}
@@ -177,14 +196,17 @@ bool tcp_stream_push(struct tcp_stream *stream, struct tcp *tcp, struct vbuffer_
 
 		if (iter != end && chunk->end_seq > qchunk->start_seq) {
 			LOG_WARNING(tcp, "retransmit packet (ignored)");
+			metric_inc(&tcp_retransmit_metric);
 			tcp_stream_chunk_free(chunk);
 			return false;
 		}
 
 		list2_insert(iter, &chunk->list);
+		metric_inc(&tcp_queued_metric);
 	}
 	else {
 		LOG_WARNING(tcp, "retransmit packet (ignored)");
+		metric_inc(&tcp_retransmit_metric);
 		tcp_stream_chunk_free(chunk);
 		return false;
 	}
@@ -350,3 +372,10 @@ uint32 tcp_stream_lastseq(struct tcp_stream *stream)
 {
 	return stream->start_seq + stream->last_sent_seq + stream->first_offset_seq;
 }
+
+uint32 tcp_stream_take_refused(struct tcp_stream *stream)
+{
+	const uint32 refused = stream->refused;
+	stream->refused = 0;
+	return refused;
+}
@@ -15,14 +15,6 @@
 #include <haka/string.h>
 
 
-struct tcp_pseudo_header {
-	ipv4addr       src;
-	ipv4addr       dst;
-	uint8          reserved;
-	uint8          proto;
-	uint16         len;
-};
-
 static void alert_invalid_packet(struct ipv4 *packet, char *desc)
 {
 	TOSTR(srcip, ipv4addr, ipv4_get_src(packet));
@@ -38,6 +30,16 @@ static void alert_invalid_packet(struct ipv4 *packet, char *desc)
 	alert(&invalid_packet);
 }
 
+static void tcp_pseudo_header(struct tcp *tcp, struct tcp_pseudo_header *pseudo)
+{
+	struct ipv4_header *ipheader = ipv4_header(tcp->packet, false);
+	pseudo->src = ipheader->src;
+	pseudo->dst = ipheader->dst;
+	pseudo->reserved = 0;
+	pseudo->proto = ipheader->proto;
+	pseudo->len = SWAP_TO_IPV4(uint16, ipv4_get_payload_length(tcp->packet) + tcp_get_payload_length(tcp));
+}
+
 static bool tcp_flatten_header(struct vbuffer *payload, size_t hdrlen)
 {
 	struct vbuffer_sub header_part;
@@ -108,6 +110,16 @@ struct tcp *tcp_dissect(struct ipv4 *packet)
 	tcp->packet = packet;
 	tcp->modified = false;
 	tcp->invalid_checksum = false;
+	tcp->verified_checksum = false;
+	tcp->partial_checksum = false;
+
+	if (!packet->reassembled) {
+		switch (packet_checksum_status(packet->packet)) {
+		case CHECKSUM_VERIFIED: tcp->verified_checksum = true; break;
+		case CHECKSUM_PARTIAL:  tcp->partial_checksum = true; break;
+		default:                break;
+		}
+	}
 
 	/* extract header len (at offset 12, see struct tcp_header) */
 	vbuffer_position(packet->payload, &hdrleniter, 12);
@@ -133,6 +145,12 @@ struct tcp *tcp_dissect(struct ipv4 *packet)
 		return NULL;
 	}
 
+	/* The captured checksum covers the captured addresses, the ipv4 hooks
+	 * could already have changed them */
+	tcp_pseudo_header(tcp, &tcp->pseudo);
+	tcp->pseudo.src = packet->captured_src;
+	tcp->pseudo.dst = packet->captured_dst;
+
 	tcp->lua_object = lua_object_init;
 	lua_ref_init(&tcp->next_dissector);
 	return tcp;
@@ -178,6 +196,9 @@ struct tcp *tcp_create(struct ipv4 *packet)
 	tcp->packet = packet;
 	tcp->modified = true;
 	tcp->invalid_checksum = true;
+	tcp->verified_checksum = false;
+	tcp->partial_checksum = false;
+	memset(&tcp->pseudo, 0, sizeof(struct tcp_pseudo_header));
 
 	if (!tcp_extract_payload(tcp, hdrlen, ALL)) {
 		assert(check_error());
@@ -195,12 +216,43 @@ struct tcp *tcp_create(struct ipv4 *packet)
 	return tcp;
 }
 
+/* Check if any part of the packet differs from the captured one */
+static bool tcp_packet_modified(struct tcp *tcp)
+{
+	return tcp->invalid_checksum || vbuffer_ismodified(&tcp->payload) ||
+		vbuffer_ismodified(tcp->packet->payload) ||
+		vbuffer_ismodified(&tcp->packet->packet->payload);
+}
+
 static void tcp_recompute_checksum(struct tcp *tcp)
 {
 	if (tcp->invalid_checksum || tcp->packet->invalid_checksum ||
 		vbuffer_ismodified(&tcp->payload)) {
 		tcp_compute_checksum(tcp);
 	}
+	else if (tcp->partial_checksum) {
+		/* The kernel will not complete the checksum of a modified
+		 * packet */
+		if (tcp_packet_modified(tcp)) {
+			tcp_compute_checksum(tcp);
+		}
+	}
+	else {
+		/* Only the ip fields covered by the pseudo header can have
+		 * changed, update the checksum for them */
+		struct tcp_pseudo_header pseudo;
+		tcp_pseudo_header(tcp, &pseudo);
+
+		if (memcmp(&pseudo, &tcp->pseudo, sizeof(struct tcp_pseudo_header)) != 0) {
+			struct tcp_header old;
+			struct tcp_header *header = tcp_header_update_begin(tcp, &old);
+			if (header) {
+				header->checksum = inet_checksum_update(header->checksum, (const uint8 *)&tcp->pseudo,
+						(const uint8 *)&pseudo, sizeof(struct tcp_pseudo_header));
+				tcp->pseudo = pseudo;
+			}
+		}
+	}
 }
 
 struct ipv4 *_tcp_forge(struct tcp *tcp, bool split)
@@ -331,6 +383,30 @@ struct tcp_header *tcp_header(struct tcp *tcp, bool write)
 	return header;
 }
 
+struct tcp_header *tcp_header_update_begin(struct tcp *tcp, struct tcp_header *old)
+{
+	const bool invalid_checksum = tcp->invalid_checksum;
+	struct tcp_header *header = tcp_header(tcp, true);
+	tcp->invalid_checksum = invalid_checksum;
+
+	if (header) *old = *header;
+	return header;
+}
+
+void tcp_header_update_end(struct tcp *tcp, struct tcp_header *header, const struct tcp_header *old)
+{
+	/* The checksum will be computed again anyway */
+	if (tcp->invalid_checksum) return;
+
+	if (tcp->partial_checksum || header->checksum != old->checksum) {
+		tcp->invalid_checksum = true;
+		return;
+	}
+
+	header->checksum = inet_checksum_update(header->checksum, (const uint8 *)old,
+			(const uint8 *)header, sizeof(struct tcp_header));
+}
+
 static void tcp_flush(struct tcp *tcp)
 {
 	if (tcp->packet) {
@@ -356,13 +432,7 @@ int16 tcp_checksum(struct tcp *tcp)
 	struct vbuffer_sub sub;
 	struct checksum_partial csum = checksum_partial_init;
 
-	/* fill tcp pseudo header */
-	struct ipv4_header *ipheader = ipv4_header(tcp->packet, false);
-	tcp_pseudo_h.src = ipheader->src;
-	tcp_pseudo_h.dst = ipheader->dst;
-	tcp_pseudo_h.reserved = 0;
-	tcp_pseudo_h.proto = ipheader->proto;
-	tcp_pseudo_h.len = SWAP_TO_IPV4(uint16, ipv4_get_payload_length(tcp->packet) + tcp_get_payload_length(tcp));
+	tcp_pseudo_header(tcp, &tcp_pseudo_h);
 
 	/* compute checksum */
 	inet_checksum_partial(&csum, (uint8 *)&tcp_pseudo_h, sizeof(struct tcp_pseudo_header));
@@ -379,6 +449,12 @@ int16 tcp_checksum(struct tcp *tcp)
 bool tcp_verify_checksum(struct tcp *tcp)
 {
 	TCP_CHECK(tcp, false);
+
+	/* An offloaded checksum will be filled when the packet is sent */
+	if ((tcp->verified_checksum || tcp->partial_checksum) && !tcp_packet_modified(tcp)) {
+		return true;
+	}
+
 	return tcp_checksum(tcp) == 0;
 }
 
@@ -389,7 +465,9 @@ void tcp_compute_checksum(struct tcp *tcp)
 	if (header) {
 		header->checksum = 0;
 		header->checksum = tcp_checksum(tcp);
+		tcp_pseudo_header(tcp, &tcp->pseudo);
 		tcp->invalid_checksum = false;
+		tcp->partial_checksum = false;
 	}
 }
 
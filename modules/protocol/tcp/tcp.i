@@ -95,6 +95,9 @@ struct tcp_stream
 
 			if (!tcp_stream_push($self, DISOWN_SUCCESS_ONLY, iter)) {
 				free(iter);
+
+				/* Reported by the overflow attribute of the stream */
+				if ($self->stream.overflow) clear_error();
 				return NULL;
 			}
 
@@ -110,6 +113,12 @@ struct tcp_stream
 			return tcp_stream_pop($self);
 		}
 
+		%rename(take_refused) _take_refused;
+		unsigned int _take_refused()
+		{
+			return tcp_stream_take_refused($self);
+		}
+
 		%rename(seq) _seq;
 		void _seq(struct tcp *tcp)
 		{
@@ -10,6 +10,17 @@ local tcp = require("protocol/tcp")
 
 local module = {}
 local log = haka.log_section("tcp")
+local trace_push, trace_pop = haka._trace_push, haka._trace_pop
+
+-- Ratio of the least recently active connections dropped on memory pressure
+module.eviction_ratio = 0.1
+
+-- Maximum number of bytes held by each direction of a connection, 0 for no limit
+module.stream_max_size = 0
+
+-- Number of segments refused in a row on a full stream before the connection
+-- is dropped, 0 to never drop it
+module.stream_overflow_max_refused = 64
 
 local tcp_connection_dissector = haka.dissector.new{
 	type = haka.helper.PacketDissector,
@@ -27,6 +38,7 @@ tcp_connection_dissector.policies.no_connection_found = haka.policy.new("no conn
 tcp_connection_dissector.policies.unexpected_packet = haka.policy.new("unexpected tcp packet")
 tcp_connection_dissector.policies.invalid_handshake = haka.policy.new("invalid tcp handshake")
 tcp_connection_dissector.policies.new_connection = haka.policy.new("new connection")
+tcp_connection_dissector.policies.stream_overflow = haka.policy.new("tcp stream memory limit exceeded")
 
 haka.policy {
 	on = tcp_connection_dissector.policies.no_connection_found,
@@ -37,6 +49,14 @@ haka.policy {
 	}
 }
 
+-- The refused segment is always dropped, adding haka.policy.drop here would
+-- drop the whole connection
+haka.policy {
+	on = tcp_connection_dissector.policies.stream_overflow,
+	name = "default action",
+	action = haka.policy.alert{ severity = 'medium' }
+}
+
 local function tcp_get_key(pkt)
 	return pkt.src, pkt.dst, pkt.srcport, pkt.dstport
 end
@@ -532,6 +552,7 @@ tcp_connection_dissector.auto_state_machine = false
 function tcp_connection_dissector.method:__init(connection, pkt)
 	class.super(tcp_connection_dissector).__init(self, connection)
 	self._stream = {}
+	self._refused = {}
 	self._restart = false
 
 	self.srcip = pkt.src
@@ -541,6 +562,8 @@ function tcp_connection_dissector.method:__init(connection, pkt)
 
 	self._stream['up'] = tcp.tcp_stream()
 	self._stream['down'] = tcp.tcp_stream()
+	self._stream.up.stream.max_size = module.stream_max_size
+	self._stream.down.stream.max_size = module.stream_max_size
 	self._state = tcp_connection_dissector.state_machine:instanciate(self)
 end
 
@@ -577,16 +600,83 @@ function tcp_connection_dissector.method:_trigger_receive(direction, stream, cur
 
 	local next_dissector = self._next_dissector
 	if next_dissector then
-		return next_dissector:receive(stream.stream, current, direction)
+		local trace = trace_push(next_dissector.name)
+		if trace == 0 then
+			return next_dissector:receive(stream.stream, current, direction)
+		end
+
+		local success, ret = pcall(next_dissector.receive, next_dissector, stream.stream, current, direction)
+		trace_pop(trace)
+		if not success then error(ret, 0) end
+		return ret
 	else
 		return self:send(direction)
 	end
 end
 
+-- Report the segments refused by a full stream, returns true if the
+-- connection has been dropped
+function tcp_connection_dissector.method:_stream_overflow(direction, stream, count)
+	local refused = (self._refused[direction] or 0) + count
+	self._refused[direction] = refused
+
+	tcp_connection_dissector.policies.stream_overflow:apply{
+		ctx = self,
+		values = {
+			direction = direction,
+			memory = stream.stream.memory,
+			refused = refused
+		},
+		desc = {
+			sources = {
+				haka.alert.address(self.srcip),
+				haka.alert.service(string.format("tcp/%d", self.srcport))
+			},
+			targets = {
+				haka.alert.address(self.dstip),
+				haka.alert.service(string.format("tcp/%d", self.dstport))
+			}
+		}
+	}
+
+	if not self._state then
+		-- Dropped by the policy
+		return true
+	end
+
+	local max = module.stream_overflow_max_refused
+	if max > 0 and refused >= max then
+		log.warning("%d segments refused in a row on a full stream, dropping connection", refused)
+		self:drop()
+		return true
+	end
+
+	return false
+end
+
 function tcp_connection_dissector.method:push(pkt, direction, finish)
 	local stream = self._stream[direction]
 
 	local current = stream:push(pkt)
+	local refused = stream:take_refused()
+
+	if not current and stream.stream.overflow then
+		-- The segment is lost, the peer will send it again once the
+		-- stream data has been consumed
+		pkt:drop()
+		self:_stream_overflow(direction, stream, refused + 1)
+		return
+	end
+
+	if refused > 0 then
+		-- Queued segments could not follow this one, they are lost as well
+		if self:_stream_overflow(direction, stream, refused) then
+			return
+		end
+	elseif current then
+		self._refused[direction] = 0
+	end
+
 	if finish then stream.stream:finish() end
 
 	self:_trigger_receive(direction, stream, current)
@@ -599,6 +689,14 @@ function tcp_connection_dissector.method:finish(direction)
 	self:_trigger_receive(direction, stream, nil)
 end
 
+function tcp_connection_dissector.method:stream_memory()
+	if self._stream then
+		return self._stream.up.stream.memory + self._stream.down.stream.memory
+	else
+		return 0
+	end
+end
+
 function tcp_connection_dissector.method:can_continue()
 	return self._stream ~= nil
 end
@@ -738,6 +836,25 @@ haka.rule {
 	end
 }
 
+haka.rule {
+	on = haka.events.memory_pressure,
+	eval = function ()
+		local count = 0
+
+		for _, cnx in ipairs(tcp_connection_dissector.cnx_table:oldest(module.eviction_ratio)) do
+			if cnx.data then
+				local tcp_data = cnx.data:namespace('tcp_connection')
+				if tcp_data._state then
+					tcp_data:drop()
+					count = count+1
+				end
+			end
+		end
+
+		log.warning("memory pressure, %d connection(s) evicted", count)
+	end
+}
+
 --
 -- Helpers
 --
@@ -814,7 +931,8 @@ function module.console.list_connections(show_dropped)
 				in_pkts = tcp_data.in_pkts,
 				in_bytes = tcp_data.in_bytes,
 				out_pkts = tcp_data.out_pkts,
-				out_bytes = tcp_data.out_bytes
+				out_bytes = tcp_data.out_bytes,
+				stream_bytes = tcp_data:stream_memory()
 			})
 		end
 	end
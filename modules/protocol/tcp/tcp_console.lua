@@ -10,7 +10,7 @@ local TcpConnInfo = list.new('tcp_cnx_info')
 
 TcpConnInfo.field = {
 	'id', 'srcip', 'srcport', 'dstip', 'dstport', 'state',
-	'in_pkts', 'in_bytes', 'out_pkts', 'out_bytes'
+	'in_pkts', 'in_bytes', 'out_pkts', 'out_bytes', 'stream_bytes'
 }
 
 TcpConnInfo.key = 'id'
@@ -19,7 +19,8 @@ TcpConnInfo.field_format = {
 	['in_pkt']    = list.formatter.unit,
 	['in_bytes']  = list.formatter.unit,
 	['out_pkt']   = list.formatter.unit,
-	['out_bytes'] = list.formatter.unit
+	['out_bytes'] = list.formatter.unit,
+	['stream_bytes'] = list.formatter.unit
 }
 
 function TcpConnInfo.method:drop()
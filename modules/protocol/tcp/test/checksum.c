@@ -0,0 +1,233 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include <haka/capture_module.h>
+#include <haka/packet.h>
+#include <haka/ipv4.h>
+#include <haka/tcp.h>
+#include <haka/vbuffer.h>
+
+
+extern int set_capture_module(struct module *module);
+
+/* 192.168.0.1:1234 -> 192.168.0.2:80, 4 bytes of payload */
+static const uint8 packet_data[] = {
+	0x45, 0x00, 0x00, 0x2c, 0x00, 0x01, 0x00, 0x00, 0x40, 0x06, 0xf9, 0x77,
+	0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0x02,
+	0x04, 0xd2, 0x00, 0x50, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+	0x50, 0x18, 0xff, 0xff, 0x41, 0x78, 0x00, 0x00,
+	0x74, 0x65, 0x73, 0x74
+};
+
+#define IPV4_CHECKSUM_OFFSET   10
+#define TCP_CHECKSUM_OFFSET    36
+
+/*
+ * Capture module reporting a fixed checksum status
+ */
+
+struct test_packet {
+	struct packet          core_packet;
+	enum packet_checksum   checksum;
+};
+
+static bool multi_threaded() { return false; }
+static bool pass_through() { return false; }
+static bool is_realtime() { return false; }
+static void verdict(struct packet *pkt, filter_result result) { }
+static uint64 get_id(struct packet *pkt) { return 0; }
+static const char *get_dissector(struct packet *pkt) { return "ipv4"; }
+static enum packet_status packet_getstate(struct packet *pkt) { return STATUS_NORMAL; }
+static size_t get_mtu(struct packet *pkt) { return 1500; }
+
+static void release_packet(struct packet *pkt)
+{
+	vbuffer_release(&pkt->payload);
+	free(pkt);
+}
+
+static enum packet_checksum get_checksum(struct packet *pkt)
+{
+	return ((struct test_packet *)pkt)->checksum;
+}
+
+static struct capture_module test_capture = {
+	module: {
+		type:        MODULE_CAPTURE,
+		name:        "test",
+		api_version: HAKA_API_VERSION,
+	},
+	multi_threaded:  multi_threaded,
+	pass_through:    pass_through,
+	is_realtime:     is_realtime,
+	verdict:         verdict,
+	get_id:          get_id,
+	get_dissector:   get_dissector,
+	release_packet:  release_packet,
+	packet_getstate: packet_getstate,
+	get_mtu:         get_mtu,
+	get_checksum:    get_checksum
+};
+
+static struct ipv4 *create_ipv4(enum packet_checksum checksum, bool bad_ipv4, bool bad_tcp)
+{
+	struct test_packet *pkt;
+	struct ipv4 *ip;
+	uint8 data[sizeof(packet_data)];
+
+	memcpy(data, packet_data, sizeof(data));
+	if (bad_ipv4) data[IPV4_CHECKSUM_OFFSET] ^= 0xff;
+	if (bad_tcp) data[TCP_CHECKSUM_OFFSET] ^= 0xff;
+
+	pkt = malloc(sizeof(struct test_packet));
+	ck_assert(pkt != NULL);
+	memset(pkt, 0, sizeof(struct test_packet));
+
+	pkt->checksum = checksum;
+	pkt->core_packet.lua_object = lua_object_init;
+	lua_ref_init(&pkt->core_packet.userdata);
+	lua_ref_init(&pkt->core_packet.next_dissector);
+	atomic_set(&pkt->core_packet.ref, 1);
+	ck_assert(vbuffer_create_from(&pkt->core_packet.payload, (const char *)data, sizeof(data)));
+
+	ip = ipv4_dissect(&pkt->core_packet);
+	ck_assert(ip != NULL);
+	return ip;
+}
+
+static struct tcp *create_tcp(enum packet_checksum checksum, bool bad_ipv4, bool bad_tcp)
+{
+	struct tcp *tcp = tcp_dissect(create_ipv4(checksum, bad_ipv4, bad_tcp));
+	ck_assert(tcp != NULL);
+	return tcp;
+}
+
+/* Forge the packet and dissect it again to check the sent checksum */
+static bool forged_checksum_valid(struct tcp *tcp)
+{
+	struct ipv4 *ip = tcp_forge(tcp);
+	bool ret;
+
+	ck_assert(ip != NULL);
+	tcp_release(tcp);
+
+	tcp = tcp_dissect(ip);
+	ck_assert(tcp != NULL);
+	ret = tcp_verify_checksum(tcp);
+	tcp_release(tcp);
+	return ret;
+}
+
+static void modify_payload(struct tcp *tcp)
+{
+	struct vbuffer_sub sub;
+	vbuffer_sub_create(&sub, &tcp->payload, 0, ALL);
+	ck_assert(vbuffer_setbyte(&sub, 0, 'T'));
+	vbuffer_sub_clear(&sub);
+}
+
+START_TEST(checksum_unknown)
+{
+	struct tcp *tcp = create_tcp(CHECKSUM_UNKNOWN, false, false);
+	ck_assert(ipv4_verify_checksum(tcp->packet));
+	ck_assert(tcp_verify_checksum(tcp));
+	tcp_release(tcp);
+
+	/* Without any status from the capture, the checksums are verified */
+	tcp = create_tcp(CHECKSUM_UNKNOWN, true, true);
+	ck_assert(!ipv4_verify_checksum(tcp->packet));
+	ck_assert(!tcp_verify_checksum(tcp));
+	tcp_release(tcp);
+
+	ck_assert(!check_error());
+}
+END_TEST
+
+START_TEST(checksum_verified)
+{
+	/* Wrong checksums are trusted, they are not recomputed */
+	struct tcp *tcp = create_tcp(CHECKSUM_VERIFIED, true, true);
+	ck_assert_int_eq(packet_checksum_status(tcp->packet->packet), CHECKSUM_VERIFIED);
+	ck_assert(ipv4_verify_checksum(tcp->packet));
+	ck_assert(tcp_verify_checksum(tcp));
+
+	/* Once modified, the packets are verified again */
+	ipv4_set_ttl(tcp->packet, 32);
+	ck_assert(!ipv4_verify_checksum(tcp->packet));
+
+	modify_payload(tcp);
+	ck_assert(!tcp_verify_checksum(tcp));
+	tcp_release(tcp);
+
+	ck_assert(!check_error());
+}
+END_TEST
+
+START_TEST(checksum_partial)
+{
+	/* The offloaded tcp checksum is not computed yet */
+	struct tcp *tcp = create_tcp(CHECKSUM_PARTIAL, false, true);
+	ck_assert(ipv4_verify_checksum(tcp->packet));
+	ck_assert(tcp_verify_checksum(tcp));
+	ck_assert(!tcp->invalid_checksum);
+	tcp_release(tcp);
+
+	ck_assert(!check_error());
+}
+END_TEST
+
+START_TEST(checksum_address)
+{
+	struct ipv4 *ip;
+	struct tcp *tcp;
+
+	/* Address changed once tcp is dissected */
+	tcp = create_tcp(CHECKSUM_UNKNOWN, false, false);
+	ipv4_set_dst(tcp->packet, ipv4_addr_from_bytes(10, 0, 0, 2));
+	ck_assert(forged_checksum_valid(tcp));
+
+	/* Address changed by an ipv4 hook, before tcp is dissected */
+	ip = create_ipv4(CHECKSUM_UNKNOWN, false, false);
+	ipv4_set_src(ip, ipv4_addr_from_bytes(10, 0, 0, 1));
+	tcp = tcp_dissect(ip);
+	ck_assert(tcp != NULL);
+	ck_assert(forged_checksum_valid(tcp));
+
+	/* A wrong checksum stays wrong */
+	ip = create_ipv4(CHECKSUM_UNKNOWN, false, true);
+	ipv4_set_src(ip, ipv4_addr_from_bytes(10, 0, 0, 1));
+	tcp = tcp_dissect(ip);
+	ck_assert(tcp != NULL);
+	ck_assert(!forged_checksum_valid(tcp));
+
+	ck_assert(!check_error());
+}
+END_TEST
+
+int main(int argc, char *argv[])
+{
+	int number_failed;
+
+	set_capture_module(&test_capture.module);
+
+	Suite *suite = suite_create("tcp_checksum_suite");
+	TCase *tcase = tcase_create("case");
+	tcase_add_test(tcase, checksum_unknown);
+	tcase_add_test(tcase, checksum_verified);
+	tcase_add_test(tcase, checksum_partial);
+	tcase_add_test(tcase, checksum_address);
+	suite_add_tcase(suite, tcase);
+
+	SRunner *runner = srunner_create(suite);
+#ifdef HAKA_DEBUG
+	srunner_set_fork_status(runner, CK_NOFORK);
+#endif
+	srunner_run_all(runner, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(runner);
+	srunner_free(runner);
+	return number_failed;
+}
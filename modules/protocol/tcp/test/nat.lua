@@ -0,0 +1,20 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+-- Change the ip addresses before tcp is dissected, the tcp checksum
+-- must follow the new addresses
+
+local ipv4 = require('protocol/ipv4')
+require('protocol/tcp')
+
+haka.rule {
+	on = haka.dissectors.ipv4.events.receive_packet,
+	eval = function (pkt)
+		if pkt.dst == ipv4.addr("192.168.10.1") then
+			pkt.dst = ipv4.addr("192.168.110.1")
+		elseif pkt.src == ipv4.addr("192.168.10.1") then
+			pkt.src = ipv4.addr("192.168.110.1")
+		end
+	end
+}
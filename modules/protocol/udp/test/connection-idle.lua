@@ -0,0 +1,26 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+-- Check that the idle udp connections are closed, a new packet on
+-- the same flow opens a new connection
+
+require("protocol/ipv4")
+require("protocol/udp")
+local udp_connection = require("protocol/udp_connection")
+
+udp_connection.idle_timeout = 60
+
+haka.rule{
+	on = haka.dissectors.udp_connection.events.new_connection,
+	eval = function (flow, pkt)
+		print(string.format("New UDP connection: %s:%d -> %s:%d", flow.srcip, flow.srcport, flow.dstip, flow.dstport))
+	end
+}
+
+haka.rule{
+	on = haka.dissectors.udp_connection.events.end_connection,
+	eval = function (flow)
+		print(string.format("End UDP connection: %s:%d -> %s:%d", flow.srcip, flow.srcport, flow.dstip, flow.dstport))
+	end
+}
@@ -11,6 +11,12 @@ local udp = require("protocol/udp")
 local module = {}
 local log = haka.log_section("udp")
 
+-- Ratio of the least recently active connections dropped on memory pressure
+module.eviction_ratio = 0.1
+
+-- Idle time in seconds after which a connection is closed
+module.idle_timeout = 60
+
 local udp_connection_dissector = haka.dissector.new{
 	type = haka.helper.PacketDissector,
 	name = 'udp_connection'
@@ -18,6 +24,28 @@ local udp_connection_dissector = haka.dissector.new{
 
 udp_connection_dissector.cnx_table = ipv4.cnx_table()
 
+-- The idle connections are closed from C, this hook is only called for the
+-- connections that have something to notify
+local function expire_hook(cnx)
+	local dissector = cnx.data and cnx.data:namespace('udp_connection')
+	if dissector then
+		dissector:expire()
+	else
+		cnx:close()
+	end
+end
+
+-- The timeout is read when a connection is created to follow the changes
+-- done after the module is loaded
+local idle_timeout
+
+local function update_idle_timeout()
+	if idle_timeout ~= module.idle_timeout then
+		udp_connection_dissector.cnx_table:set_idle_timeout(module.idle_timeout, expire_hook)
+		idle_timeout = module.idle_timeout
+	end
+end
+
 udp_connection_dissector:register_event('new_connection')
 udp_connection_dissector:register_event('receive_packet')
 udp_connection_dissector:register_event('receive_data')
@@ -44,8 +72,11 @@ function udp_connection_dissector:receive(pkt)
 
 		pkt:continue()
 
+		update_idle_timeout()
+
 		connection = udp_connection_dissector.cnx_table:create(udp_get_cnx_key(pkt))
 		connection.data = data
+		connection.expire_hook = self:need_expire_hook(data)
 		self:init(connection)
 		data:createnamespace('udp_connection', self)
 	end
@@ -70,6 +101,38 @@ function udp_connection_dissector.method:install_criterion()
 	return { port = self.dstport }
 end
 
+-- Only the connections with a next dissector or with some listeners on their end
+-- need to go through Lua when they expire. The listeners are either global or
+-- registered by the dissectors of the connection scope.
+function udp_connection_dissector.method:need_expire_hook(scope)
+	local event = udp_connection_dissector.events.end_connection
+
+	if self._next_dissector ~= nil or haka.context.connections:_get(event) then
+		return true
+	end
+
+	for _, connections in ipairs(scope._connections) do
+		if connections:_get(event) then
+			return true
+		end
+	end
+
+	return false
+end
+
+function udp_connection_dissector.method:expire()
+	local ret, err = xpcall(function ()
+		haka.context:exec(self._parent.data, function ()
+			self._state:finish()
+		end)
+	end, debug.format_error)
+
+	if not ret then
+		log.error("%s", err)
+		self._parent:close()
+	end
+end
+
 udp_connection_dissector.state_machine = haka.state_machine.new("udp", function ()
 	state_type{
 		events = { 'receive', 'drop' },
@@ -104,15 +167,11 @@ udp_connection_dissector.state_machine = haka.state_machine.new("udp", function
 		execute = function (self)
 			self:trigger('end_connection')
 			self._dropped = true
+			self._parent.expire_hook = false
 			self._parent:drop()
 		end,
 	}
 
-	drop:on{
-		event = events.timeout(60),
-		jump = finish,
-	}
-
 	drop:on{
 		event = events.receive,
 		execute = function (self, pkt, direction)
@@ -144,11 +203,6 @@ udp_connection_dissector.state_machine = haka.state_machine.new("udp", function
 		jump = established,
 	}
 
-	established:on{
-		event = events.timeout(60),
-		jump = fail,
-	}
-
 	initial(established)
 end)
 
@@ -199,6 +253,25 @@ haka.policy {
 	action = haka.dissectors.udp_connection.install
 }
 
+haka.rule {
+	on = haka.events.memory_pressure,
+	eval = function ()
+		local count = 0
+
+		for _, cnx in ipairs(udp_connection_dissector.cnx_table:oldest(module.eviction_ratio)) do
+			if cnx.data then
+				local udp_data = cnx.data:namespace('udp_connection')
+				if not udp_data._dropped then
+					udp_data:drop()
+					count = count+1
+				end
+			end
+		end
+
+		log.warning("memory pressure, %d connection(s) evicted", count)
+	end
+}
+
 --
 -- Helpers
 --
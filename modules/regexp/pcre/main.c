@@ -10,9 +10,13 @@
 #include <haka/log.h>
 #include <haka/regexp_module.h>
 #include <haka/thread.h>
+#include <haka/metrics.h>
 
 static REGISTER_LOG_SECTION(pcre);
 
+static struct metric pcre_exec_metric = METRIC_COUNTER("regexp_exec_total", "Number of regular expression executions");
+static struct metric pcre_bytes_metric = METRIC_COUNTER("regexp_bytes_total", "Number of bytes matched against regular expressions");
+
 /* We enforce multiline on all API */
 #define DEFAULT_COMPILE_OPTIONS PCRE_MULTILINE
 
@@ -373,6 +377,9 @@ static int _exec(struct regexp *_re, const char *buf, int len, struct regexp_res
 		*result = regexp_result_init;
 	}
 
+	metric_inc(&pcre_exec_metric);
+	metric_add(&pcre_bytes_metric, len);
+
 	ret = pcre_exec(re->pcre, NULL, buf, len, 0, 0, ovector, OVECTOR_SIZE);
 
 	/* Got some match (ret = 0) if we get more than OVECTOR_SIZE */
@@ -431,6 +438,9 @@ try_again:
 
 	if (!sink->started) sink->started = true;
 
+	metric_inc(&pcre_exec_metric);
+	metric_add(&pcre_bytes_metric, len);
+
 	do {
 		/* We run out of space so grow workspace */
 		if (ret == PCRE_ERROR_DFA_WSSIZE) {
@@ -5,9 +5,16 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 
 #include <haka/error.h>
@@ -16,7 +23,9 @@
 #include <haka/alert.h>
 #include <haka/engine.h>
 #include <haka/system.h>
+#include <haka/time.h>
 #include <haka/container/list2.h>
+#include <haka/lua/state.h>
 #include <haka/luadebug/user.h>
 #include <haka/luadebug/debugger.h>
 #include <haka/luadebug/interactive.h>
@@ -26,11 +35,16 @@
 #include "thread.h"
 #include "config.h"
 #include "ctl_comm.h"
+#include "openmetrics.h"
 
 
 #define MODULE             remote
 #define MAX_CLIENT_QUEUE   10
 #define MAX_COMMAND_LEN    1024
+#define MAX_HTTP_REQUEST   4096
+#define HTTP_TIMEOUT       1
+#define PROFILE_PERIOD     0.001
+#define PROFILE_MAX_TIME   3600
 
 struct ctl_server_state;
 
@@ -54,6 +68,11 @@ struct ctl_server_state {
 	volatile bool            exiting;
 	mutex_t                  lock;
 	struct list2             clients;
+	char                    *metrics_listen;
+	int                      metrics_fd;
+	char                    *metrics_file;
+	int                      metrics_interval;
+	struct time              metrics_next;
 };
 
 struct ctl_server_state ctl_server = {0};
@@ -116,7 +135,7 @@ static void *ctl_client_process_thread(void *param)
 	return NULL;
 }
 
-UNUSED static bool ctl_start_client_thread(struct ctl_client_state *state, void (*func)(void*), void *data)
+static bool ctl_start_client_thread(struct ctl_client_state *state, void (*func)(void*), void *data)
 {
 	state->callback = func;
 	state->data = data;
@@ -195,6 +214,11 @@ static void ctl_server_cleanup(struct ctl_server_state *state, bool cancel_threa
 			state->fd = -1;
 		}
 
+		if (state->metrics_fd >= 0) {
+			close(state->metrics_fd);
+			state->metrics_fd = -1;
+		}
+
 		if (state->binded) {
 			if (remove(state->socket_file)) {
 				LOG_ERROR(MODULE, "cannot remove socket file: %s", errno_error(errno));
@@ -209,12 +233,317 @@ static void ctl_server_cleanup(struct ctl_server_state *state, bool cancel_threa
 	}
 }
 
+/*
+ * Metrics export
+ */
+
+static bool ctl_metrics_init(struct ctl_server_state *state)
+{
+	struct addrinfo hints, *res, *iter;
+	char *host, *port;
+	const int on = 1;
+	int err;
+
+	/* The listen address is host:port, the host can be omitted */
+	host = strdup(state->metrics_listen);
+	if (!host) {
+		LOG_FATAL(MODULE, "memory error");
+		return false;
+	}
+
+	port = strrchr(host, ':');
+	if (!port) {
+		LOG_FATAL(MODULE, "invalid metrics listen address '%s'", state->metrics_listen);
+		free(host);
+		return false;
+	}
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	err = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+	if (err) {
+		LOG_FATAL(MODULE, "invalid metrics listen address '%s': %s", state->metrics_listen,
+				gai_strerror(err));
+		free(host);
+		return false;
+	}
+
+	for (iter = res; iter; iter = iter->ai_next) {
+		state->metrics_fd = socket(iter->ai_family, iter->ai_socktype, iter->ai_protocol);
+		if (state->metrics_fd < 0) continue;
+
+		setsockopt(state->metrics_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if (bind(state->metrics_fd, iter->ai_addr, iter->ai_addrlen) == 0) break;
+
+		close(state->metrics_fd);
+		state->metrics_fd = -1;
+	}
+
+	freeaddrinfo(res);
+	free(host);
+
+	if (state->metrics_fd < 0) {
+		LOG_FATAL(MODULE, "cannot bind metrics socket on '%s': %s", state->metrics_listen,
+				errno_error(errno));
+		return false;
+	}
+
+	return true;
+}
+
+/* Wait for the socket to be ready until the deadline of the request */
+static bool ctl_metrics_wait(int fd, short events, const struct timespec *deadline)
+{
+	struct pollfd pfd = { fd, events, 0 };
+	struct timespec now;
+	int timeout, ret;
+
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = (deadline->tv_sec - now.tv_sec) * 1000 +
+				(deadline->tv_nsec - now.tv_nsec) / 1000000;
+		if (timeout <= 0) {
+			errno = ETIMEDOUT;
+			return false;
+		}
+
+		ret = poll(&pfd, 1, timeout);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret == 0) {
+		errno = ETIMEDOUT;
+		return false;
+	}
+
+	return ret > 0;
+}
+
+static bool ctl_metrics_send(int fd, const char *data, size_t len, const struct timespec *deadline)
+{
+	while (len > 0) {
+		const ssize_t ret = send(fd, data, len, MSG_NOSIGNAL);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR) continue;
+			if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+			    ctl_metrics_wait(fd, POLLOUT, deadline)) continue;
+			return false;
+		}
+
+		data += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static void ctl_metrics_reply(int fd, const char *status, const char *type,
+		const char *body, size_t len, const struct timespec *deadline)
+{
+	char header[256];
+	const int size = snprintf(header, sizeof(header),
+			"HTTP/1.0 %s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", status, type, len);
+
+	if (!ctl_metrics_send(fd, header, size, deadline) ||
+	    !ctl_metrics_send(fd, body, len, deadline)) {
+		LOG_DEBUG(MODULE, "cannot send metrics: %s", errno_error(errno));
+	}
+}
+
+static void ctl_metrics_process(int fd, const struct timespec *deadline)
+{
+	char request[MAX_HTTP_REQUEST+1];
+	size_t len = 0;
+	char *body = NULL;
+	size_t size = 0;
+	FILE *out;
+
+	/* Only the request line is needed, wait for the end of the headers
+	 * to avoid resetting the connection of the client. The socket is non
+	 * blocking and the whole request must be received before the deadline
+	 * so that a slow client cannot hold the ctl thread. */
+	while (len < MAX_HTTP_REQUEST) {
+		const ssize_t ret = recv(fd, request + len, MAX_HTTP_REQUEST - len, 0);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR) continue;
+			if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+			    ctl_metrics_wait(fd, POLLIN, deadline)) continue;
+			break;
+		}
+
+		len += ret;
+		request[len] = '\0';
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+	}
+	request[len] = '\0';
+
+	if (strncmp(request, "GET ", 4) != 0) {
+		static const char msg[] = "method not allowed\n";
+		ctl_metrics_reply(fd, "405 Method Not Allowed", "text/plain", msg, sizeof(msg)-1, deadline);
+		return;
+	}
+
+	if (strncmp(request + 4, "/ ", 2) != 0 && strncmp(request + 4, "/metrics ", 9) != 0) {
+		static const char msg[] = "not found\n";
+		ctl_metrics_reply(fd, "404 Not Found", "text/plain", msg, sizeof(msg)-1, deadline);
+		return;
+	}
+
+	out = open_memstream(&body, &size);
+	if (!out) {
+		LOG_ERROR(MODULE, "memory error");
+		return;
+	}
+
+	if (!openmetrics_write(out)) {
+		fclose(out);
+		free(body);
+
+		LOG_ERROR(MODULE, "cannot collect metrics");
+		return;
+	}
+
+	fclose(out);
+
+	ctl_metrics_reply(fd, "200 OK", OPENMETRICS_CONTENT_TYPE, body, size, deadline);
+	free(body);
+}
+
+static void ctl_metrics_accept(struct ctl_server_state *state)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	struct timespec deadline;
+	int fd;
+
+	thread_testcancel();
+
+	fd = accept(state->metrics_fd, (struct sockaddr *)&addr, &len);
+	if (fd < 0) {
+		LOG_DEBUG(MODULE, "failed to accept metrics connection: %s", errno_error(errno));
+		return;
+	}
+
+	thread_setcancelstate(false);
+
+	/* The request is handled by the ctl thread, a slow client must not
+	 * keep it busy for more than HTTP_TIMEOUT in total */
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		LOG_DEBUG(MODULE, "cannot setup metrics connection: %s", errno_error(errno));
+		close(fd);
+		thread_setcancelstate(true);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += HTTP_TIMEOUT;
+
+	ctl_metrics_process(fd, &deadline);
+	close(fd);
+
+	thread_setcancelstate(true);
+}
+
+static void ctl_metrics_write_file(struct ctl_server_state *state)
+{
+	const size_t len = strlen(state->metrics_file);
+	char *tmp;
+	FILE *out;
+	bool ret;
+
+	tmp = malloc(len + 5);
+	if (!tmp) {
+		LOG_ERROR(MODULE, "memory error");
+		return;
+	}
+
+	/* Write to a temporary file and rename it to never expose a partial file */
+	snprintf(tmp, len + 5, "%s.tmp", state->metrics_file);
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		LOG_ERROR(MODULE, "cannot open metrics file '%s': %s", tmp, errno_error(errno));
+		free(tmp);
+		return;
+	}
+
+	ret = openmetrics_write(out);
+	if (fclose(out)) ret = false;
+
+	if (!ret) {
+		LOG_ERROR(MODULE, "cannot write metrics file '%s'", tmp);
+		remove(tmp);
+	}
+	else if (rename(tmp, state->metrics_file)) {
+		LOG_ERROR(MODULE, "cannot rename metrics file '%s': %s", tmp, errno_error(errno));
+		remove(tmp);
+	}
+
+	free(tmp);
+}
+
+static struct timeval *ctl_metrics_timeout(struct ctl_server_state *state, struct timeval *timeout)
+{
+	struct time now, diff;
+
+	if (!state->metrics_file) return NULL;
+
+	if (!time_gettimestamp(&now)) {
+		clear_error();
+		return NULL;
+	}
+
+	if (time_cmp(&now, &state->metrics_next) >= 0) {
+		ctl_metrics_write_file(state);
+
+		time_build(&diff, state->metrics_interval);
+		time_add(&state->metrics_next, &now, &diff);
+	}
+
+	time_diff(&diff, &state->metrics_next, &now);
+	timeout->tv_sec = diff.secs;
+	timeout->tv_usec = diff.nsecs / 1000;
+	return timeout;
+}
+
+bool ctl_server_set_metrics_listen(const char *address)
+{
+	free(ctl_server.metrics_listen);
+	ctl_server.metrics_listen = strdup(address);
+	if (!ctl_server.metrics_listen) {
+		error("memory error");
+		return false;
+	}
+	return true;
+}
+
+bool ctl_server_set_metrics_file(const char *file, int interval)
+{
+	free(ctl_server.metrics_file);
+	ctl_server.metrics_file = strdup(file);
+	if (!ctl_server.metrics_file) {
+		error("memory error");
+		return false;
+	}
+	ctl_server.metrics_interval = interval;
+	return true;
+}
+
 static bool ctl_server_init(struct ctl_server_state *state, const char *socket_file)
 {
 	struct sockaddr_un addr;
 	socklen_t len;
 	int err;
 
+	state->metrics_fd = -1;
+
 	state->socket_file = strdup(socket_file);
 	if (!state->socket_file) {
 		LOG_FATAL(MODULE, "memory error");
@@ -257,6 +586,11 @@ static bool ctl_server_init(struct ctl_server_state *state, const char *socket_f
 	state->binded = true;
 	state->created = true;
 
+	if (state->metrics_listen && !ctl_metrics_init(state)) {
+		ctl_server_cleanup(&ctl_server, true);
+		return false;
+	}
+
 	return true;
 }
 
@@ -337,6 +671,7 @@ static void *ctl_server_coreloop(void *param)
 	struct ctl_server_state *state = (struct ctl_server_state *)param;
 	sigset_t set;
 	fd_set listfds, readfds;
+	struct timeval timeout;
 	int maxfd, rc;
 
 	/* Block all signal to let the main thread handle them */
@@ -352,9 +687,14 @@ static void *ctl_server_coreloop(void *param)
 	FD_SET(state->fd, &listfds);
 	maxfd = state->fd;
 
+	if (state->metrics_fd >= 0) {
+		FD_SET(state->metrics_fd, &listfds);
+		if (state->metrics_fd > maxfd) maxfd = state->metrics_fd;
+	}
+
 	while (!state->exiting) {
 		readfds = listfds;
-		rc = select(maxfd+1, &readfds, NULL, NULL, NULL);
+		rc = select(maxfd+1, &readfds, NULL, NULL, ctl_metrics_timeout(state, &timeout));
 
 		if (rc < 0) {
 			LOG_FATAL(MODULE, "failed to handle ctl connection (closing ctl socket): %s", errno_error(errno));
@@ -366,6 +706,11 @@ static void *ctl_server_coreloop(void *param)
 				rc--;
 			}
 
+			if (state->metrics_fd >= 0 && FD_ISSET(state->metrics_fd, &readfds)) {
+				ctl_metrics_accept(state);
+				rc--;
+			}
+
 			if (rc > 0) {
 				ctl_server_handle_commands(state, &readfds, &listfds);
 			}
@@ -390,6 +735,12 @@ bool start_ctl_server()
 		return false;
 	}
 
+	if (ctl_server.metrics_fd >= 0 && listen(ctl_server.metrics_fd, MAX_CLIENT_QUEUE)) {
+		LOG_FATAL(MODULE, "failed to listen on metrics socket: %s", errno_error(errno));
+		ctl_server_cleanup(&ctl_server, true);
+		return false;
+	}
+
 	/* Start the processing thread */
 	if (!thread_create(&ctl_server.thread, ctl_server_coreloop, &ctl_server)) {
 		LOG_FATAL(MODULE, "%s", clear_error());
@@ -527,6 +878,114 @@ struct redirect_alerter *redirect_alerter_create(void)
 	return alerter;
 }
 
+struct ctl_profile {
+	struct ctl_client_state *client;
+	int                      duration;
+};
+
+struct ctl_profile_result {
+	char                    *data;
+	size_t                   size;
+};
+
+static void ctl_profile_start(void *data)
+{
+	struct engine_thread *engine = engine_thread_current();
+
+	/* The error is given back to the ctl thread by the remote launch */
+	if (!lua_state_profile_start(lua_state_get(engine_thread_lua_state(engine)), PROFILE_PERIOD) &&
+	    !check_error()) {
+		error("cannot start profiler");
+	}
+}
+
+static void ctl_profile_stop(void *data)
+{
+	struct ctl_profile_result *result = (struct ctl_profile_result *)data;
+	struct engine_thread *engine = engine_thread_current();
+	result->data = lua_state_profile_stop(lua_state_get(engine_thread_lua_state(engine)), &result->size);
+}
+
+static bool ctl_profile_collect(int thread, struct ctl_profile_result *result, FILE *out)
+{
+	char *line, *next;
+
+	if (!engine_thread_remote_launch(engine_thread_byid(thread), ctl_profile_stop, result)) {
+		return false;
+	}
+
+	if (!result->data) {
+		return true;
+	}
+
+	/* Each thread is a different root in the folded stacks */
+	for (line = result->data; *line; line = next) {
+		next = strchr(line, '\n');
+		if (next) *next++ = '\0';
+		else next = line + strlen(line);
+
+		fprintf(out, "thread-%d;%s\n", thread, line);
+	}
+
+	free(result->data);
+	result->data = NULL;
+	return true;
+}
+
+static void ctl_profile_run(void *data)
+{
+	struct ctl_profile *profile = (struct ctl_profile *)data;
+	const int fd = profile->client->fd;
+	const int duration = profile->duration;
+	struct ctl_profile_result result = { NULL, 0 };
+	int i, started;
+	char *output = NULL;
+	size_t size = 0;
+	FILE *out;
+
+	free(profile);
+
+	for (started=0; engine_thread_byid(started); ++started) {
+		if (!engine_thread_remote_launch(engine_thread_byid(started), ctl_profile_start, NULL)) {
+			char msg[MAX_COMMAND_LEN];
+			snprintf(msg, sizeof(msg), "thread %d: %s", started, clear_error());
+
+			LOG_ERROR(MODULE, "cannot start profiling on %s", msg);
+			ctl_send_status(fd, -1, msg);
+
+			for (i=0; i<started; ++i) {
+				engine_thread_remote_launch(engine_thread_byid(i), ctl_profile_stop, &result);
+				free(result.data);
+				result.data = NULL;
+			}
+			return;
+		}
+	}
+
+	ctl_send_status(fd, 0, NULL);
+
+	LOG_INFO(MODULE, "profiling for %d second(s)", duration);
+	sleep(duration);
+
+	out = open_memstream(&output, &size);
+	if (!out) {
+		ctl_send_status(fd, -1, "memory error");
+		return;
+	}
+
+	for (i=0; i<started; ++i) {
+		if (!ctl_profile_collect(i, &result, out)) {
+			LOG_ERROR(MODULE, "cannot collect profile of thread %d: %s", i, clear_error());
+		}
+	}
+
+	fclose(out);
+
+	ctl_send_status(fd, 0, NULL);
+	ctl_send_chars(fd, output, size);
+	free(output);
+}
+
 static enum clt_client_rc ctl_client_process_command(struct ctl_client_state *state, const char *command)
 {
 	if (strcmp(command, "STATUS") == 0) {
@@ -608,6 +1067,37 @@ static enum clt_client_rc ctl_client_process_command(struct ctl_client_state *st
 		luadebug_user_release(&remote_user);
 		return CTL_CLIENT_DUP;
 	}
+	else if (strcmp(command, "PROFILE") == 0) {
+		struct ctl_profile *profile;
+		const int duration = ctl_recv_int(state->fd);
+		if (check_error()) {
+			return CTL_CLIENT_DONE;
+		}
+
+		if (duration <= 0 || duration > PROFILE_MAX_TIME) {
+			ctl_send_status(state->fd, -1, "invalid profiling duration");
+			return CTL_CLIENT_OK;
+		}
+
+		profile = malloc(sizeof(struct ctl_profile));
+		if (!profile) {
+			ctl_send_status(state->fd, -1, "memory error");
+			return CTL_CLIENT_OK;
+		}
+
+		profile->client = state;
+		profile->duration = duration;
+
+		/* The profiling runs in its own thread to keep the ctl server
+		 * responsive */
+		if (!ctl_start_client_thread(state, ctl_profile_run, profile)) {
+			free(profile);
+			ctl_send_status(state->fd, -1, "cannot start profiling thread");
+			return CTL_CLIENT_OK;
+		}
+
+		return CTL_CLIENT_THREAD;
+	}
 	else if (strcmp(command, "EXECUTE") == 0) {
 		int thread = ctl_recv_int(state->fd);
 		if (check_error()) {
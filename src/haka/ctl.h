@@ -10,4 +10,7 @@ bool prepare_ctl_server(const char *ctl_socket_file);
 bool start_ctl_server(void);
 void stop_ctl_server(void);
 
+bool ctl_server_set_metrics_listen(const char *address);
+bool ctl_server_set_metrics_file(const char *file, int interval);
+
 #endif /* CTL_H */
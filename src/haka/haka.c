@@ -22,6 +22,7 @@
 #include <haka/luadebug/debugger.h>
 #include <haka/luadebug/interactive.h>
 #include <haka/luadebug/user.h>
+#include <haka/packet_trace.h>
 #include <haka/container/vector.h>
 
 #include "app.h"
@@ -282,6 +283,90 @@ int read_configuration(const char *file)
 		}
 	}
 
+	/* Lua memory limit (in megabytes per thread) */
+	{
+		const int memory_limit = parameters_get_integer(config, "general:lua_memory_limit", 0);
+		if (memory_limit > 0) {
+			lua_state_set_memory_limit((size_t)memory_limit * 1024 * 1024);
+		}
+	}
+
+	/* Per-packet cpu budget (in milliseconds) */
+	{
+		const int budget = parameters_get_integer(config, "general:packet_budget", 0);
+		if (budget > 0) {
+			const char *verdict = parameters_get_string(config, "general:packet_budget_verdict", "drop");
+			if (strcmp(verdict, "drop") == 0) {
+				thread_pool_set_packet_budget(budget / 1000., FILTER_DROP);
+			}
+			else if (strcmp(verdict, "accept") == 0) {
+				thread_pool_set_packet_budget(budget / 1000., FILTER_ACCEPT);
+			}
+			else {
+				LOG_FATAL(core, "invalid packet budget verdict '%s'", verdict);
+				clean_exit();
+				exit(1);
+			}
+		}
+	}
+
+	/* Rule profiling */
+	{
+		const char *profiling = parameters_get_string(config, "general:rule_profiling", "no");
+		if (strcmp(profiling, "wall") == 0) {
+			lua_state_set_rule_profiling(LUA_PROFILING_WALL);
+		}
+		else if (strcmp(profiling, "cpu") == 0) {
+			lua_state_set_rule_profiling(LUA_PROFILING_CPU);
+		}
+		else if (strcmp(profiling, "no") != 0) {
+			LOG_FATAL(core, "invalid rule profiling mode '%s'", profiling);
+			clean_exit();
+			exit(1);
+		}
+	}
+
+	/* LuaJIT trace abort diagnostics */
+	{
+		const bool jit_diagnostics = parameters_get_boolean(config, "general:jit_diagnostics", false);
+		lua_state_set_jit_diagnostics(jit_diagnostics);
+	}
+
+	/* Per-stage latency tracing */
+	{
+		const int sampling = parameters_get_integer(config, "general:latency_sampling", 0);
+		if (sampling > 0) {
+			packet_trace_set_sampling(sampling);
+		}
+	}
+
+	/* Metrics export */
+	{
+		const char *listen = parameters_get_string(config, "general:metrics_listen", NULL);
+		const char *file = parameters_get_string(config, "general:metrics_file", NULL);
+
+		if (listen && !ctl_server_set_metrics_listen(listen)) {
+			LOG_FATAL(core, "%s", clear_error());
+			clean_exit();
+			exit(1);
+		}
+
+		if (file) {
+			const int interval = parameters_get_integer(config, "general:metrics_interval", 10);
+			if (interval <= 0) {
+				LOG_FATAL(core, "invalid metrics interval %d", interval);
+				clean_exit();
+				exit(1);
+			}
+
+			if (!ctl_server_set_metrics_file(file, interval)) {
+				LOG_FATAL(core, "%s", clear_error());
+				clean_exit();
+				exit(1);
+			}
+		}
+	}
+
 	/* Log level */
 	{
 		const char *_level = parameters_get_string(config, "log:level", "info");
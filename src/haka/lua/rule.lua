@@ -10,6 +10,68 @@ local log = haka.log_section("core")
 
 module.rules = {}
 
+-- Map rule eval functions to their location, used to report
+-- the rule that exceeds the packet budget
+haka._rule_location = setmetatable({}, { __mode = 'k' })
+
+-- Rule profiling, enabled by the configuration
+local profiling = haka._rule_profiling()
+local clock = haka._profile_clock
+
+if profiling and jit then
+	-- Read the clocks through the FFI, a call to the C function would
+	-- abort the LuaJIT trace of every profiled rule
+	local ffi = require('ffi')
+	ffi.cdef[[
+		struct rule_timespec { long tv_sec; long tv_nsec; };
+		int clock_gettime(int clk_id, struct rule_timespec *tp);
+	]]
+
+	local CLOCK_MONOTONIC = 1
+	local CLOCK_THREAD_CPUTIME_ID = 3
+	local C = ffi.C
+	local ts = ffi.new('struct rule_timespec')
+	local cpu = profiling == 'cpu'
+
+	clock = function ()
+		C.clock_gettime(CLOCK_MONOTONIC, ts)
+		local wall = tonumber(ts.tv_sec)*1e9 + tonumber(ts.tv_nsec)
+		if cpu then
+			C.clock_gettime(CLOCK_THREAD_CPUTIME_ID, ts)
+			return wall, tonumber(ts.tv_sec)*1e9 + tonumber(ts.tv_nsec)
+		end
+		return wall
+	end
+end
+
+-- The wrappers take a fixed number of parameters, enough for every
+-- event, as LuaJIT 2.0 does not compile vararg forwarding
+local function profile_rule(r)
+	local eval = r.eval
+	local profile = { hits = 0, wall = 0, cpu = 0 }
+	r.profile = profile
+
+	if r.options and r.options.streamed then
+		-- Streamed rules run in a coroutine that can be suspended
+		-- while waiting for data, only count their hits
+		return function (a, b, c, d, e)
+			profile.hits = profile.hits + 1
+			eval(a, b, c, d, e)
+		end
+	else
+		return function (a, b, c, d, e)
+			profile.hits = profile.hits + 1
+			local wall, cpu = clock()
+			eval(a, b, c, d, e)
+			local endwall, endcpu = clock()
+			profile.wall = profile.wall + (endwall - wall)
+			if cpu then
+				profile.cpu = profile.cpu + (endcpu - cpu)
+			end
+		end
+	end
+end
+
 function haka.rule_summary()
 	local total = 0
 
@@ -43,18 +105,29 @@ function haka.rule(r)
 	r.type = 'simple'
 
 	table.insert(module.rules, r)
+	haka._rule_location[r.eval] = r.location
+
+	local eval = r.eval
+	if profiling then
+		eval = profile_rule(r)
+		haka._rule_location[eval] = r.location
+	end
 
-	haka.context.connections:register(r.on, r.eval, r.options or {})
+	haka.context.connections:register(r.on, eval, r.options or {})
 end
 
 function haka.console.rules()
 	local ret = {}
-	for _, rule in pairs(module.rules) do
+	for _, rule in ipairs(module.rules) do
+		local profile = rule.profile
 		table.insert(ret, {
 			name=rule.name,
 			event=rule.on.name,
 			location=rule.location,
-			type=rule.type
+			type=rule.type,
+			hits=profile and profile.hits,
+			wall=profile and profile.wall / 1e9,
+			cpu=profile and profiling == 'cpu' and profile.cpu / 1e9 or nil
 		})
 	end
 	return ret
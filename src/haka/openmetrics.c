@@ -0,0 +1,230 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <haka/engine.h>
+#include <haka/error.h>
+#include <haka/metrics.h>
+#include <haka/lua/state.h>
+
+#include "openmetrics.h"
+
+
+#define METRIC_PREFIX      "haka_"
+#define MAX_THREADS        256
+
+struct openmetrics_state {
+	FILE          *out;
+	int            threads[MAX_THREADS];
+	int            thread_count;
+};
+
+static void openmetrics_family(FILE *out, const char *name, size_t len,
+		const char *type, const char *help)
+{
+	fprintf(out, "# TYPE " METRIC_PREFIX "%.*s %s\n", (int)len, name, type);
+	if (help) {
+		fprintf(out, "# HELP " METRIC_PREFIX "%.*s %s\n", (int)len, name, help);
+	}
+}
+
+static void openmetrics_thread_label(FILE *out, int thread)
+{
+	if (thread == METRICS_OTHER_THREADS) fprintf(out, "thread=\"other\"");
+	else fprintf(out, "thread=\"%d\"", thread);
+}
+
+/*
+ * Engine statistics
+ */
+
+#define PACKET_STATS_COUNT   5
+
+static const struct {
+	const char  *name;
+	const char  *help;
+	size_t       offset;
+} packet_stats_fields[PACKET_STATS_COUNT] = {
+	{ "received_packets", "Packets received", offsetof(struct packet_stats, recv_packets) },
+	{ "received_bytes", "Bytes received", offsetof(struct packet_stats, recv_bytes) },
+	{ "transmitted_packets", "Packets transmitted", offsetof(struct packet_stats, trans_packets) },
+	{ "transmitted_bytes", "Bytes transmitted", offsetof(struct packet_stats, trans_bytes) },
+	{ "dropped_packets", "Packets dropped", offsetof(struct packet_stats, drop_packets) },
+};
+
+static void openmetrics_write_engine(FILE *out)
+{
+	int i, id;
+	struct engine_thread *thread;
+
+	for (i=0; i<PACKET_STATS_COUNT; ++i) {
+		openmetrics_family(out, packet_stats_fields[i].name, strlen(packet_stats_fields[i].name),
+				"counter", packet_stats_fields[i].help);
+
+		for (id=0; (thread = engine_thread_byid(id)); ++id) {
+			volatile struct packet_stats *stats = engine_thread_statistics(thread);
+			const size_t value = *(volatile size_t *)((volatile char *)stats + packet_stats_fields[i].offset);
+
+			fprintf(out, METRIC_PREFIX "%s_total{thread=\"%d\"} %zu\n",
+					packet_stats_fields[i].name, id, value);
+		}
+	}
+}
+
+/*
+ * Lua memory
+ */
+
+static void openmetrics_write_lua(FILE *out)
+{
+	int id;
+	struct engine_thread *thread;
+	struct lua_state_memory_stats stats[MAX_THREADS];
+	bool valid[MAX_THREADS];
+	int count;
+
+	for (count=0; count < MAX_THREADS && (thread = engine_thread_byid(count)); ++count) {
+		struct lua_State *L = engine_thread_lua_state(thread);
+		valid[count] = L && lua_state_memory_stats(L, &stats[count]);
+		if (!valid[count]) clear_error();
+	}
+
+#define LUA_MEMORY_FAMILY(name, type, help, format, value) \
+	openmetrics_family(out, name, strlen(name), type, help); \
+	for (id=0; id<count; ++id) { \
+		if (valid[id]) { \
+			fprintf(out, METRIC_PREFIX "%s{thread=\"%d\"} " format "\n", \
+					strcmp(type, "counter") == 0 ? name "_total" : name, id, value); \
+		} \
+	}
+
+	LUA_MEMORY_FAMILY("lua_memory_bytes", "gauge", "Memory allocated by the Lua state",
+			"%zu", stats[id].allocated);
+	LUA_MEMORY_FAMILY("lua_memory_peak_bytes", "gauge", "Peak memory allocated by the Lua state",
+			"%zu", stats[id].peak);
+	LUA_MEMORY_FAMILY("slab_memory_bytes", "gauge", "Memory of the slab pages owned by the thread",
+			"%zu", stats[id].slab);
+	LUA_MEMORY_FAMILY("lua_memory_limit_bytes", "gauge", "Memory limit of the Lua state (0 if unlimited)",
+			"%zu", stats[id].limit);
+	LUA_MEMORY_FAMILY("lua_allocated_bytes", "counter", "Cumulative bytes allocated by the Lua state",
+			"%llu", (unsigned long long)stats[id].total);
+	LUA_MEMORY_FAMILY("lua_allocation_failures", "counter", "Allocations refused due to the memory limit",
+			"%llu", (unsigned long long)stats[id].failures);
+	LUA_MEMORY_FAMILY("lua_gc_seconds", "counter", "Time spent in idle garbage collection",
+			"%.9f", stats[id].gc_time / 1e9);
+	LUA_MEMORY_FAMILY("lua_gc_cycles", "counter", "Garbage collection cycles finished while idle",
+			"%llu", (unsigned long long)stats[id].gc_cycles);
+
+#undef LUA_MEMORY_FAMILY
+}
+
+/*
+ * Metrics registry
+ */
+
+static void openmetrics_collect_thread(int thread, void *data)
+{
+	struct openmetrics_state *state = (struct openmetrics_state *)data;
+	int i;
+
+	/* Several slots can share the same thread value */
+	for (i=0; i<state->thread_count; ++i) {
+		if (state->threads[i] == thread) return;
+	}
+
+	if (state->thread_count < MAX_THREADS) {
+		state->threads[state->thread_count++] = thread;
+	}
+}
+
+static void openmetrics_write_histogram(FILE *out, struct metric *metric, size_t len,
+		int thread, const uint64 *values)
+{
+	int i;
+	uint64 cumul = 0;
+
+	for (i=0; i<=metric->bucket_count; ++i) {
+		cumul += values[i];
+
+		fprintf(out, METRIC_PREFIX "%.*s_bucket{", (int)len, metric->name);
+		openmetrics_thread_label(out, thread);
+		if (i < metric->bucket_count) {
+			fprintf(out, ",le=\"%llu\"} %llu\n", (unsigned long long)metric->bounds[i],
+					(unsigned long long)cumul);
+		}
+		else {
+			fprintf(out, ",le=\"+Inf\"} %llu\n", (unsigned long long)cumul);
+		}
+	}
+
+	fprintf(out, METRIC_PREFIX "%.*s_sum{", (int)len, metric->name);
+	openmetrics_thread_label(out, thread);
+	fprintf(out, "} %llu\n", (unsigned long long)values[metric->bucket_count+1]);
+
+	fprintf(out, METRIC_PREFIX "%.*s_count{", (int)len, metric->name);
+	openmetrics_thread_label(out, thread);
+	fprintf(out, "} %llu\n", (unsigned long long)values[metric->bucket_count+2]);
+}
+
+static void openmetrics_write_metric(struct metric *metric, void *data)
+{
+	struct openmetrics_state *state = (struct openmetrics_state *)data;
+	uint64 values[METRICS_MAX_VALUES];
+	size_t len = strlen(metric->name);
+	int i;
+
+	switch (metric->type) {
+	case METRIC_TYPE_COUNTER:
+		/* The family name of a counter does not have the _total suffix */
+		if (len > 6 && strcmp(metric->name + len - 6, "_total") == 0) len -= 6;
+
+		openmetrics_family(state->out, metric->name, len, "counter", metric->help);
+		for (i=0; i<state->thread_count; ++i) {
+			metric_read(metric, state->threads[i], values);
+
+			fprintf(state->out, METRIC_PREFIX "%.*s_total{", (int)len, metric->name);
+			openmetrics_thread_label(state->out, state->threads[i]);
+			fprintf(state->out, "} %llu\n", (unsigned long long)values[0]);
+		}
+		break;
+
+	case METRIC_TYPE_GAUGE:
+		/* A gauge can be incremented and decremented by different threads,
+		 * only the sum is meaningful */
+		openmetrics_family(state->out, metric->name, len, "gauge", metric->help);
+		metric_read(metric, METRICS_ALL_THREADS, values);
+		fprintf(state->out, METRIC_PREFIX "%s %lld\n", metric->name, (long long)(int64)values[0]);
+		break;
+
+	case METRIC_TYPE_HISTOGRAM:
+		openmetrics_family(state->out, metric->name, len, "histogram", metric->help);
+		for (i=0; i<state->thread_count; ++i) {
+			metric_read(metric, state->threads[i], values);
+			openmetrics_write_histogram(state->out, metric, len, state->threads[i], values);
+		}
+		break;
+	}
+}
+
+bool openmetrics_write(FILE *out)
+{
+	struct openmetrics_state state;
+
+	state.out = out;
+	state.thread_count = 0;
+
+	openmetrics_write_engine(out);
+	openmetrics_write_lua(out);
+
+	metrics_foreach_thread(openmetrics_collect_thread, &state);
+	metrics_foreach(openmetrics_write_metric, &state);
+
+	fprintf(out, "# EOF\n");
+
+	return !ferror(out);
+}
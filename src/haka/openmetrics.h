@@ -0,0 +1,19 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef OPENMETRICS_H
+#define OPENMETRICS_H
+
+#include <stdio.h>
+
+
+#define OPENMETRICS_CONTENT_TYPE   "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/*
+ * Write a snapshot of the haka metrics in the OpenMetrics text format.
+ * The values are read without taking any lock used by the packet threads.
+ */
+bool openmetrics_write(FILE *out);
+
+#endif /* OPENMETRICS_H */
@@ -18,7 +18,7 @@
 #include <haka/thread.h>
 #include <haka/engine.h>
 #include <haka/system.h>
-#include <haka/timer.h>
+#include <haka/packet_trace.h>
 #include <haka/lua/state.h>
 #include <haka/lua/luautils.h>
 #include <haka/luadebug/debugger.h>
@@ -62,9 +62,17 @@ struct thread_pool {
 
 extern bool lua_pushppacket(lua_State *L, struct packet *pkt);
 
+static filter_result budget_verdict = FILTER_DROP;
+
+void thread_pool_set_packet_budget(double budget, filter_result verdict)
+{
+	lua_state_set_packet_budget(budget);
+	budget_verdict = verdict;
+}
+
 static void filter_wrapper(struct thread_state *state, struct packet *pkt)
 {
-	int h;
+	int h, err;
 	LUA_STACK_MARK(state->lua->L);
 
 	packet_addref(pkt);
@@ -80,7 +88,20 @@ static void filter_wrapper(struct thread_state *state, struct packet *pkt)
 	assert(!lua_isnil(state->lua->L, -1));
 	lua_pushvalue(state->lua->L, -2);
 
-	if (lua_pcall(state->lua->L, 1, 0, h)) {
+	lua_state_budget_begin(state->lua);
+	err = lua_pcall(state->lua->L, 1, 0, h);
+
+	if (lua_state_budget_end(state->lua)) {
+		/* The rules took too long, apply the configured verdict. The
+		 * budget error is raised again by the hook until the processing
+		 * is unwound, the traced stages could not be left. */
+		if (err) lua_pop(state->lua->L, 1);
+		packet_trace_unwind();
+
+		if (budget_verdict == FILTER_ACCEPT) packet_accept(pkt);
+		else packet_drop(pkt);
+	}
+	else if (err) {
 		lua_state_print_error(state->lua->L, "receive");
 		packet_drop(pkt);
 	}
@@ -88,6 +109,8 @@ static void filter_wrapper(struct thread_state *state, struct packet *pkt)
 	lua_pop(state->lua->L, 2);
 	LUA_STACK_CHECK(state->lua->L, 0);
 
+	packet_trace_end();
+
 	packet_release(pkt);
 }
 
@@ -246,13 +269,6 @@ static void *thread_main_loop(void *_state)
 			return NULL;
 		}
 
-		if (!timer_init_thread()) {
-			LOG_FATAL(core, "%s", clear_error());
-			barrier_wait(&state->pool->thread_start_sync);
-			state->state = STATE_ERROR;
-			return NULL;
-		}
-
 		/* To make sure we can still cancel even if some thread are locked in
 		 * infinite loops */
 		if (!thread_setcanceltype(THREAD_CANCEL_ASYNCHRONOUS)) {
@@ -272,6 +288,10 @@ static void *thread_main_loop(void *_state)
 	state->engine = engine_thread_init(state->lua->L, state->thread_id);
 	engine_thread_update_status(state->engine, THREAD_RUNNING);
 
+	if (!lua_state_budget_init_thread(state->lua)) {
+		LOG_ERROR(core, "cannot enable packet budget: %s", clear_error());
+	}
+
 	packet_init(state->capture);
 
 	if (!state->pool->single) {
@@ -297,6 +317,12 @@ static void *thread_main_loop(void *_state)
 	engine_thread_update_status(state->engine, THREAD_WAITING);
 
 	while (packet_receive(state->engine, &pkt) == 0) {
+		/* No packet is pending, use this idle time to run a bounded
+		 * collection step instead of doing it during packet processing */
+		if (!pkt && engine_thread_has_idle_work(state->engine)) {
+			lua_state_gc_step(state->lua);
+		}
+
 		engine_thread_update_status(state->engine, THREAD_RUNNING);
 
 		/* The packet can be NULL in case of failure in packet receive */
@@ -306,6 +332,7 @@ static void *thread_main_loop(void *_state)
 		}
 
 		lua_state_runinterrupt(state->lua);
+		lua_state_memory_check(state->lua);
 		engine_thread_check_remote_launch(state->engine);
 
 		if (state->pool->attach_debugger > state->attach_debugger) {
@@ -313,6 +340,7 @@ static void *thread_main_loop(void *_state)
 			state->attach_debugger = state->pool->attach_debugger;
 		}
 
+		engine_thread_set_idle_work(state->engine, lua_state_gc_update(state->lua));
 		engine_thread_update_status(state->engine, THREAD_WAITING);
 
 #ifdef HAKA_MEMCHECK
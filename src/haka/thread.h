@@ -21,6 +21,7 @@ bool thread_pool_stop(struct thread_pool *pool, int force);
 void thread_pool_attachdebugger(struct thread_pool *pool);
 bool thread_pool_issingle(struct thread_pool *pool);
 struct engine_thread *thread_pool_thread(struct thread_pool *pool, int index);
+void thread_pool_set_packet_budget(double budget, filter_result verdict);
 
 #endif /* THREAD_H */
 
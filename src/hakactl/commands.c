@@ -232,3 +232,56 @@ struct command command_interactive = {
 	0,
 	run_interactive
 };
+
+
+/*
+ * profile
+ */
+
+static int run_profile(int fd, int argc, char *argv[])
+{
+	char *end, *output;
+	size_t size;
+	const long duration = strtol(argv[0], &end, 10);
+
+	/* The folded stacks are written on the standard output, the
+	 * progress is reported on the error output */
+	if (*end != '\0' || duration <= 0) {
+		fprintf(stderr, "invalid profiling duration '%s'\n", argv[0]);
+		return COMMAND_FAILED;
+	}
+
+	fprintf(stderr, "[....] profiling for %ld second(s)", duration);
+	fflush(stderr);
+
+	if (!ctl_send_chars(fd, "PROFILE", -1) || !ctl_send_int(fd, duration) ||
+	    ctl_recv_status(fd) == -1 || ctl_recv_status(fd) == -1) {
+		const char *err = clear_error();
+		if (!err) err = "failed!";
+
+		fprintf(stderr, ": %s%s%s", c(RED, use_colors), err, c(CLEAR, use_colors));
+		fprintf(stderr, "\r[%sFAIL%s]\n", c(RED, use_colors), c(CLEAR, use_colors));
+		return COMMAND_FAILED;
+	}
+
+	output = ctl_recv_chars(fd, &size);
+	if (!output) {
+		fprintf(stderr, ": %s%s%s", c(RED, use_colors), clear_error(), c(CLEAR, use_colors));
+		fprintf(stderr, "\r[%sFAIL%s]\n", c(RED, use_colors), c(CLEAR, use_colors));
+		return COMMAND_FAILED;
+	}
+
+	fprintf(stderr, "\r[ %sok%s ]\n", c(GREEN, use_colors), c(CLEAR, use_colors));
+
+	fwrite(output, 1, size, stdout);
+	free(output);
+
+	return COMMAND_SUCCESS;
+}
+
+struct command command_profile = {
+	"profile",
+	"profile <seconds>:  Sample the rules and output folded stacks",
+	1,
+	run_profile
+};
@@ -114,6 +114,8 @@ int ctl_recv_status(int fd)
 char *ctl_recv_chars(int fd, size_t *_len)
 {
 	char *str;
+	int32 received;
+	ssize_t ret;
 	const int32 len = ctl_recv_int(fd);
 	if (check_error()) {
 		return NULL;
@@ -125,8 +127,14 @@ char *ctl_recv_chars(int fd, size_t *_len)
 		return NULL;
 	}
 
-	if (!ctl_check_error(read(fd, str, len), len, true)) {
-		return NULL;
+	/* Large strings can be received in several parts */
+	for (received = 0; received < len; received += ret) {
+		ret = read(fd, str + received, len - received);
+		if (ret <= 0) {
+			ctl_check_error(ret, len - received, true);
+			free(str);
+			return NULL;
+		}
 	}
 
 	if (_len) *_len = len;
@@ -39,6 +39,7 @@ static struct command* commands[] = {
 	&command_loglevel,
 	&command_debug,
 	&command_interactive,
+	&command_profile,
 	&command_console,
 	NULL
 };
@@ -0,0 +1,30 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+local list = require('list')
+
+local BudgetInfo = list.new('budget_info')
+
+BudgetInfo.field = {
+	'thread', 'rule', 'location', 'count'
+}
+
+BudgetInfo.field_format = {
+	['count'] = list.formatter.unit
+}
+
+BudgetInfo.field_aggregate = {
+	['thread'] = list.aggregator.replace('total'),
+	['count']  = list.aggregator.add
+}
+
+function console.budget()
+	local data = hakactl.remote('all', function ()
+		return haka.console.budget()
+	end)
+
+	local info = BudgetInfo:new()
+	info:addall(data)
+	return info
+end
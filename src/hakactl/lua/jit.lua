@@ -0,0 +1,52 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+local list = require('list')
+
+local JitAbortInfo = list.new('jit_abort_info')
+
+JitAbortInfo.field = {
+	'location', 'reason', 'rule', 'start', 'count'
+}
+
+JitAbortInfo.key = 'location'
+
+JitAbortInfo.field_format = {
+	['rule']  = list.formatter.optional("<none>"),
+	['start'] = list.formatter.optional("<unknown>"),
+	['count'] = list.formatter.unit
+}
+
+function console.jit_aborts()
+	local data = hakactl.remote('all', function ()
+		return haka.console.jit_aborts()
+	end)
+
+	-- Merge the aborts of all threads by location and reason
+	local aborts = {}
+	local index = {}
+	for _, thread in ipairs(data) do
+		for _, abort in ipairs(thread) do
+			local key = abort.location .. '\0' .. abort.reason
+			local current = index[key]
+			if not current then
+				index[key] = abort
+				table.insert(aborts, abort)
+			else
+				current.count = current.count + abort.count
+			end
+		end
+	end
+
+	local info = JitAbortInfo:new()
+	info:add(aborts)
+	info:sort(function (a, b) return a.count > b.count end)
+	return info
+end
+
+function console.jit_diagnostics(enable)
+	hakactl.remote('all', function ()
+		haka.console.jit_diagnostics(enable)
+	end)
+end
@@ -0,0 +1,32 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+local list = require('list')
+
+local LatencyInfo = list.new('latency_info')
+
+LatencyInfo.field = {
+	'stage', 'count', 'mean', 'p50', 'p90', 'p99'
+}
+
+LatencyInfo.key = 'stage'
+
+LatencyInfo.field_format = {
+	['count'] = list.formatter.unit,
+	['mean']  = list.formatter.duration,
+	['p50']   = list.formatter.duration,
+	['p90']   = list.formatter.duration,
+	['p99']   = list.formatter.duration
+}
+
+function console.latency()
+	-- The histograms are already summed over all threads
+	local data = hakactl.remote('any', function ()
+		return haka.console.latency()
+	end)
+
+	local info = LatencyInfo:new()
+	info:add(data[1])
+	return info
+end
@@ -0,0 +1,48 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+local list = require('list')
+
+local MemoryInfo = list.new('memory_info')
+
+MemoryInfo.field = {
+	'id', 'allocated', 'peak', 'limit', 'rate', 'failures', 'evictions',
+	'gc_time', 'gc_cycles', 'gc_pause', 'gc_stepmul'
+}
+
+MemoryInfo.key = 'id'
+
+MemoryInfo.field_format = {
+	['allocated']  = list.formatter.unit,
+	['peak']       = list.formatter.unit,
+	['limit']      = list.formatter.optional("-"),
+	['rate']       = list.formatter.unit,
+	['failures']   = list.formatter.unit,
+	['evictions']  = list.formatter.unit,
+	['gc_time']    = list.formatter.duration,
+	['gc_cycles']  = list.formatter.unit,
+	['gc_pause']   = list.formatter.optional("-"),
+	['gc_stepmul'] = list.formatter.optional("-")
+}
+
+MemoryInfo.field_aggregate = {
+	['id']         = list.aggregator.replace('total'),
+	['allocated']  = list.aggregator.add,
+	['peak']       = list.aggregator.add,
+	['rate']       = list.aggregator.add,
+	['failures']   = list.aggregator.add,
+	['evictions']  = list.aggregator.add,
+	['gc_time']    = list.aggregator.add,
+	['gc_cycles']  = list.aggregator.add
+}
+
+function console.memory()
+	local data = hakactl.remote('any', function ()
+		return haka.console.memory()
+	end)
+
+	local info = MemoryInfo:new()
+	info:add(data[1])
+	return info
+end
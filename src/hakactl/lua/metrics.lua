@@ -0,0 +1,28 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+local list = require('list')
+
+local MetricInfo = list.new('metric_info')
+
+MetricInfo.field = {
+	'name', 'type', 'value', 'sum'
+}
+
+MetricInfo.key = 'name'
+
+MetricInfo.field_format = {
+	['value'] = list.formatter.unit,
+	['sum']   = list.formatter.optional("-")
+}
+
+function console.metrics()
+	local data = hakactl.remote('any', function ()
+		return haka.console.metrics()
+	end)
+
+	local info = MetricInfo:new()
+	info:add(data[1])
+	return info
+end
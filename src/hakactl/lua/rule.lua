@@ -7,19 +7,45 @@ local list = require('list')
 local RuleInfo = list.new('rule_info')
 
 RuleInfo.field = {
-	'name', 'location', 'event', 'type'
+	'name', 'location', 'event', 'type', 'hits', 'wall', 'cpu'
 }
 
+RuleInfo.key = 'location'
+
 RuleInfo.field_format = {
-	['name'] = list.formatter.optional("<no name>")
+	['name'] = list.formatter.optional("<no name>"),
+	['hits'] = list.formatter.unit,
+	['wall'] = list.formatter.duration,
+	['cpu']  = list.formatter.duration
 }
 
+local function rule_cost(rule)
+	return rule.cpu or rule.wall or 0
+end
+
 function console.rules()
-	local data = hakactl.remote('any', function ()
+	local data = hakactl.remote('all', function ()
 		return haka.console.rules()
 	end)
 
+	-- Every thread loads the same rules in the same order, sum
+	-- their profiling data
+	local rules = {}
+	for _, thread in ipairs(data) do
+		for i, rule in ipairs(thread) do
+			local current = rules[i]
+			if not current then
+				rules[i] = rule
+			elseif rule.hits then
+				current.hits = current.hits + rule.hits
+				current.wall = current.wall + rule.wall
+				if rule.cpu then current.cpu = current.cpu + rule.cpu end
+			end
+		end
+	end
+
 	local info = RuleInfo:new()
-	info:add(data[1])
+	info:add(rules)
+	info:sort(function (a, b) return rule_cost(a) > rule_cost(b) end)
 	return info
 end